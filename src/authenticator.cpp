@@ -179,6 +179,7 @@ Authenticator::Authenticate (const gloox::JID& jid, std::string& account) const
     return false;
 
   VLOG (1) << "JID for account " << account << ": " << jid.full ();
+  std::lock_guard<std::mutex> lock(mut);
   knownJids[account] = jid;
   return true;
 }
@@ -186,6 +187,7 @@ Authenticator::Authenticate (const gloox::JID& jid, std::string& account) const
 bool
 Authenticator::LookupJid (const std::string& account, gloox::JID& jid) const
 {
+  std::lock_guard<std::mutex> lock(mut);
   const auto mit = knownJids.find (account);
   if (mit == knownJids.end ())
     return false;
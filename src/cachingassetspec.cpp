@@ -0,0 +1,182 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "cachingassetspec.hpp"
+
+#include <glog/logging.h>
+
+namespace democrit
+{
+
+CachingAssetSpec::CachingAssetSpec (const AssetSpec& b, const size_t m)
+  : base(b), maxEntries(m)
+{
+  CHECK_GT (maxEntries, 0);
+}
+
+template <typename K, typename V>
+  void
+  CachingAssetSpec::AddToCache (std::map<K, V>& cache, const uint64_t gen,
+                                const K& key, const V& value) const
+{
+  if (gen != generation)
+    return;
+
+  if (cache.size () >= maxEntries)
+    {
+      VLOG (1) << "Asset cache is full, clearing it";
+      cache.clear ();
+    }
+
+  cache.emplace (key, value);
+}
+
+void
+CachingAssetSpec::SetTip (const std::string& hash)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (hash == tip)
+    return;
+
+  VLOG (1) << "New tip " << hash << ", clearing cached balances";
+  tip = hash;
+  ++generation;
+  canSell.clear ();
+  canBuy.clear ();
+}
+
+CachingAssetSpec::Stats
+CachingAssetSpec::GetStats () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return stats;
+}
+
+std::string
+CachingAssetSpec::GetGameId () const
+{
+  return base.GetGameId ();
+}
+
+bool
+CachingAssetSpec::IsAsset (const Asset& asset) const
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const auto mit = isAsset.find (asset);
+    if (mit != isAsset.end ())
+      {
+        ++stats.hits;
+        return mit->second;
+      }
+    ++stats.misses;
+  }
+
+  const bool res = base.IsAsset (asset);
+
+  /* Whether or not something is an asset does not depend on the tip,
+     so we can always add it to the cache.  */
+  std::lock_guard<std::mutex> lock(mut);
+  AddToCache (isAsset, generation, asset, res);
+
+  return res;
+}
+
+bool
+CachingAssetSpec::CanSell (const std::string& name, const Asset& asset,
+                           const Amount n, xaya::uint256& hash) const
+{
+  const BalanceKey key(name, asset, n);
+
+  uint64_t gen;
+  std::string curTip;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const auto mit = canSell.find (key);
+    if (mit != canSell.end ())
+      {
+        ++stats.hits;
+        if (mit->second.ok)
+          hash = mit->second.hash;
+        return mit->second.ok;
+      }
+    ++stats.misses;
+    gen = generation;
+    curTip = tip;
+  }
+
+  SellResult res;
+  res.ok = base.CanSell (name, asset, n, res.hash);
+  if (res.ok)
+    hash = res.hash;
+
+  /* The GSP may lag behind the Xaya tip.  A positive answer refers to the
+     block it was computed at, which is later checked for being an ancestor
+     of the trade's block.  If we cached an answer for a lagging block, we
+     would keep returning that (increasingly stale) hash until the tip
+     changes again.  Thus only cache it if it is for the current tip.  */
+  if (res.ok && res.hash.ToHex () != curTip)
+    {
+      VLOG (1)
+          << "Not caching CanSell result at block " << res.hash.ToHex ()
+          << ", which is not the current tip " << curTip;
+      return res.ok;
+    }
+
+  std::lock_guard<std::mutex> lock(mut);
+  AddToCache (canSell, gen, key, res);
+
+  return res.ok;
+}
+
+bool
+CachingAssetSpec::CanBuy (const std::string& name, const Asset& asset,
+                          const Amount n) const
+{
+  const BalanceKey key(name, asset, n);
+
+  uint64_t gen;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const auto mit = canBuy.find (key);
+    if (mit != canBuy.end ())
+      {
+        ++stats.hits;
+        return mit->second;
+      }
+    ++stats.misses;
+    gen = generation;
+  }
+
+  const bool res = base.CanBuy (name, asset, n);
+
+  std::lock_guard<std::mutex> lock(mut);
+  AddToCache (canBuy, gen, key, res);
+
+  return res;
+}
+
+Json::Value
+CachingAssetSpec::GetTransferMove (const std::string& sender,
+                                   const std::string& receiver,
+                                   const Asset& asset, const Amount n) const
+{
+  return base.GetTransferMove (sender, receiver, asset, n);
+}
+
+} // namespace democrit
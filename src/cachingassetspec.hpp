@@ -0,0 +1,175 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_CACHINGASSETSPEC_HPP
+#define DEMOCRIT_CACHINGASSETSPEC_HPP
+
+#include "assetspec.hpp"
+
+#include <xayautil/uint256.hpp>
+
+#include <json/json.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+namespace democrit
+{
+
+/**
+ * AssetSpec that wraps another one and caches its answers.  Whether or not
+ * a string is an asset is cached indefinitely.  The results of CanSell and
+ * CanBuy (for a given name, asset and amount) are cached until the chain
+ * tip changes, which has to be signalled by calling SetTip.  Positive
+ * results of CanSell are only cached if the block hash they were computed
+ * at matches the tip, so that a lagging GSP does not pin a stale hash.
+ *
+ * Negative results of CanSell and all results of CanBuy do not tell us
+ * the block they refer to, so they are cached for the current tip even if
+ * the GSP was still lagging behind it.  For instance, if an account
+ * receives an asset in the new tip block and its orders are re-validated
+ * before the GSP has caught up, they will be rejected until the next block.
+ * This is accepted as a trade-off for caching those answers at all, since
+ * the effect is limited to a single block.
+ *
+ * Like any AssetSpec, this class is thread-safe.  The lock is not held
+ * while calling the underlying AssetSpec.
+ */
+class CachingAssetSpec : public AssetSpec
+{
+
+public:
+
+  /**
+   * Statistics about how the cache has been used.
+   */
+  struct Stats
+  {
+
+    /** Number of lookups answered from the cache.  */
+    uint64_t hits = 0;
+
+    /** Number of lookups that had to query the underlying spec.  */
+    uint64_t misses = 0;
+
+  };
+
+private:
+
+  /** Key for the cached results of CanSell and CanBuy.  */
+  using BalanceKey = std::tuple<std::string, Asset, Amount>;
+
+  /**
+   * A cached result of CanSell.
+   */
+  struct SellResult
+  {
+
+    /** Whether or not the sale is possible.  */
+    bool ok;
+
+    /** The block hash returned (if ok is true).  */
+    xaya::uint256 hash;
+
+  };
+
+  /** The underlying AssetSpec.  */
+  const AssetSpec& base;
+
+  /**
+   * Maximum number of entries in each cache.  If it is exceeded, the cache
+   * is simply cleared, which is cheap and good enough to prevent unbounded
+   * growth (e.g. from queries for lots of bogus assets).
+   */
+  const size_t maxEntries;
+
+  /** Mutex protecting the cache data.  */
+  mutable std::mutex mut;
+
+  /** The current tip's block hash as last set.  */
+  std::string tip;
+
+  /**
+   * Generation of the balance caches.  This is increased whenever they are
+   * cleared, so that results of queries that were started before will not
+   * be added to the cache anymore.
+   */
+  uint64_t generation = 0;
+
+  /** Cached results of IsAsset.  */
+  mutable std::map<Asset, bool> isAsset;
+
+  /** Cached results of CanSell at the current tip.  */
+  mutable std::map<BalanceKey, SellResult> canSell;
+
+  /** Cached results of CanBuy at the current tip.  */
+  mutable std::map<BalanceKey, bool> canBuy;
+
+  /** The usage statistics.  */
+  mutable Stats stats;
+
+  /**
+   * Adds a result to one of the caches, unless the generation changed
+   * since the query was started.  Must be called with the lock held.
+   */
+  template <typename K, typename V>
+    void AddToCache (std::map<K, V>& cache, uint64_t gen,
+                     const K& key, const V& value) const;
+
+public:
+
+  /**
+   * Constructs the cache wrapping the given AssetSpec, which must remain
+   * valid while this instance is used.
+   */
+  explicit CachingAssetSpec (const AssetSpec& b, size_t maxEntries = 100'000);
+
+  CachingAssetSpec () = delete;
+  CachingAssetSpec (const CachingAssetSpec&) = delete;
+  void operator= (const CachingAssetSpec&) = delete;
+
+  /**
+   * Informs the cache about the current tip.  If it differs from the
+   * previous one, cached results of CanSell and CanBuy are discarded.
+   */
+  void SetTip (const std::string& hash);
+
+  /**
+   * Returns the statistics about cache usage so far.
+   */
+  Stats GetStats () const;
+
+  std::string GetGameId () const override;
+  bool IsAsset (const Asset& asset) const override;
+  bool CanSell (const std::string& name, const Asset& asset, Amount n,
+                xaya::uint256& hash) const override;
+  bool CanBuy (const std::string& name, const Asset& asset,
+               Amount n) const override;
+  Json::Value GetTransferMove (const std::string& sender,
+                               const std::string& receiver,
+                               const Asset& asset, Amount n) const override;
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_CACHINGASSETSPEC_HPP
@@ -0,0 +1,232 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "cachingassetspec.hpp"
+
+#include "testutils.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace democrit
+{
+namespace
+{
+
+/**
+ * TestAssets that counts how often it has been queried.
+ */
+class CountingAssets : public TestAssets
+{
+
+public:
+
+  mutable unsigned calls = 0;
+
+  bool
+  IsAsset (const Asset& asset) const override
+  {
+    ++calls;
+    return TestAssets::IsAsset (asset);
+  }
+
+  bool
+  CanSell (const std::string& name, const Asset& asset, const Amount n,
+           xaya::uint256& hash) const override
+  {
+    ++calls;
+    return TestAssets::CanSell (name, asset, n, hash);
+  }
+
+  bool
+  CanBuy (const std::string& name, const Asset& asset,
+          const Amount n) const override
+  {
+    ++calls;
+    return TestAssets::CanBuy (name, asset, n);
+  }
+
+};
+
+class CachingAssetSpecTests : public testing::Test
+{
+
+protected:
+
+  CountingAssets base;
+  CachingAssetSpec spec;
+
+  CachingAssetSpecTests ()
+    : spec(base)
+  {
+    spec.SetTip ("tip 1");
+  }
+
+  /**
+   * Expects the given number of hits and misses in the stats.
+   */
+  void
+  ExpectStats (const uint64_t hits, const uint64_t misses)
+  {
+    const auto stats = spec.GetStats ();
+    EXPECT_EQ (stats.hits, hits);
+    EXPECT_EQ (stats.misses, misses);
+  }
+
+};
+
+TEST_F (CachingAssetSpecTests, PassesThrough)
+{
+  base.SetBalance ("domob", "gold", 10);
+
+  EXPECT_EQ (spec.GetGameId (), TestAssets::GAME_ID);
+  EXPECT_EQ (spec.GetTransferMove ("domob", "andy", "gold", 5),
+             base.GetTransferMove ("domob", "andy", "gold", 5));
+}
+
+TEST_F (CachingAssetSpecTests, IsAsset)
+{
+  EXPECT_TRUE (spec.IsAsset ("gold"));
+  EXPECT_FALSE (spec.IsAsset ("invalid"));
+  EXPECT_EQ (base.calls, 2);
+
+  spec.SetTip ("tip 2");
+  EXPECT_TRUE (spec.IsAsset ("gold"));
+  EXPECT_FALSE (spec.IsAsset ("invalid"));
+  EXPECT_EQ (base.calls, 2);
+
+  ExpectStats (2, 2);
+}
+
+TEST_F (CachingAssetSpecTests, CanSell)
+{
+  xaya::uint256 hash1, hash2;
+  ASSERT_TRUE (hash1.FromHex ("ab" + std::string (62, '0')));
+  ASSERT_TRUE (hash2.FromHex ("cd" + std::string (62, '0')));
+
+  spec.SetTip (hash1.ToHex ());
+  base.SetBlock (hash1);
+  base.SetBalance ("domob", "gold", 10);
+
+  xaya::uint256 hash;
+  EXPECT_TRUE (spec.CanSell ("domob", "gold", 10, hash));
+  EXPECT_EQ (hash, hash1);
+  EXPECT_FALSE (spec.CanSell ("domob", "gold", 11, hash));
+  EXPECT_EQ (base.calls, 2);
+
+  /* Changes in the underlying state are not seen until the tip changes.  */
+  base.SetBlock (hash2);
+  base.SetBalance ("domob", "gold", 5);
+  hash.SetNull ();
+  EXPECT_TRUE (spec.CanSell ("domob", "gold", 10, hash));
+  EXPECT_EQ (hash, hash1);
+  EXPECT_FALSE (spec.CanSell ("domob", "gold", 11, hash));
+  EXPECT_EQ (base.calls, 2);
+
+  spec.SetTip (hash1.ToHex ());
+  EXPECT_TRUE (spec.CanSell ("domob", "gold", 10, hash));
+  EXPECT_EQ (base.calls, 2);
+
+  spec.SetTip (hash2.ToHex ());
+  EXPECT_FALSE (spec.CanSell ("domob", "gold", 10, hash));
+  EXPECT_TRUE (spec.CanSell ("domob", "gold", 5, hash));
+  EXPECT_EQ (hash, hash2);
+  EXPECT_EQ (base.calls, 4);
+
+  ExpectStats (3, 4);
+}
+
+TEST_F (CachingAssetSpecTests, LaggingGsp)
+{
+  xaya::uint256 hash1, hash2;
+  ASSERT_TRUE (hash1.FromHex ("ab" + std::string (62, '0')));
+  ASSERT_TRUE (hash2.FromHex ("cd" + std::string (62, '0')));
+
+  /* The GSP is still at hash1, while the Xaya tip is already hash2.  */
+  spec.SetTip (hash2.ToHex ());
+  base.SetBlock (hash1);
+  base.SetBalance ("domob", "gold", 10);
+
+  xaya::uint256 hash;
+  for (unsigned i = 0; i < 2; ++i)
+    {
+      EXPECT_TRUE (spec.CanSell ("domob", "gold", 10, hash));
+      EXPECT_EQ (hash, hash1);
+      EXPECT_FALSE (spec.CanSell ("domob", "gold", 11, hash));
+      EXPECT_FALSE (spec.CanBuy ("andy", "gold", 1));
+    }
+  EXPECT_EQ (base.calls, 4);
+
+  /* Once the GSP catches up, the new answer is returned and cached.
+     Negative answers and CanBuy results from the lagging GSP remain cached
+     until the tip changes, even if the GSP would now answer differently
+     (this is a known trade-off).  */
+  base.SetBlock (hash2);
+  base.SetBalance ("domob", "gold", 20);
+  base.InitialiseAccount ("andy");
+  for (unsigned i = 0; i < 2; ++i)
+    {
+      EXPECT_TRUE (spec.CanSell ("domob", "gold", 10, hash));
+      EXPECT_EQ (hash, hash2);
+      EXPECT_FALSE (spec.CanSell ("domob", "gold", 11, hash));
+      EXPECT_FALSE (spec.CanBuy ("andy", "gold", 1));
+    }
+  EXPECT_EQ (base.calls, 5);
+
+  spec.SetTip ("tip 3");
+  EXPECT_TRUE (spec.CanSell ("domob", "gold", 11, hash));
+  EXPECT_TRUE (spec.CanBuy ("andy", "gold", 1));
+  EXPECT_EQ (base.calls, 7);
+
+  ExpectStats (7, 7);
+}
+
+TEST_F (CachingAssetSpecTests, CanBuy)
+{
+  EXPECT_FALSE (spec.CanBuy ("domob", "gold", 1));
+  EXPECT_EQ (base.calls, 1);
+
+  base.InitialiseAccount ("domob");
+  EXPECT_FALSE (spec.CanBuy ("domob", "gold", 1));
+  EXPECT_TRUE (spec.CanBuy ("domob", "gold", 2));
+  EXPECT_EQ (base.calls, 2);
+
+  spec.SetTip ("tip 2");
+  EXPECT_TRUE (spec.CanBuy ("domob", "gold", 1));
+  EXPECT_EQ (base.calls, 3);
+
+  ExpectStats (1, 3);
+}
+
+TEST_F (CachingAssetSpecTests, MaxEntries)
+{
+  CachingAssetSpec small(base, 2);
+  EXPECT_TRUE (small.IsAsset ("gold"));
+  EXPECT_TRUE (small.IsAsset ("silver"));
+  EXPECT_TRUE (small.IsAsset ("gold"));
+  EXPECT_EQ (base.calls, 2);
+
+  /* This clears the cache, so that gold has to be looked up again.  */
+  EXPECT_TRUE (small.IsAsset ("bronze"));
+  EXPECT_TRUE (small.IsAsset ("gold"));
+  EXPECT_EQ (base.calls, 4);
+}
+
+} // anonymous namespace
+} // namespace democrit
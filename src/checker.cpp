@@ -18,6 +18,8 @@
 
 #include "private/checker.hpp"
 
+#include "private/psbt.hpp"
+
 #include <xayautil/jsonutils.hpp>
 #include <xayautil/uint256.hpp>
 
@@ -72,6 +74,65 @@ GetNameOutPoint (RpcClient<XayaRpcClient>& rpc, const std::string& account)
   return OutPointFromJson (rpc->name_show (GetXayaName (account)));
 }
 
+std::vector<Json::Value>
+GetTxOuts (RpcClient<XayaRpcClient>& rpc,
+           const std::vector<proto::OutPoint>& outs)
+{
+  /* gettxout returns a JSON object when the UTXO is found, or JSON null
+     if it does not exist.  We call the methods directly rather than through
+     libjson-rpc-cpp's generated code anyway, so that is fine here.  */
+  std::vector<BatchedCall> calls;
+  for (const auto& out : outs)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append (out.hash ());
+      params.append (out.n ());
+      calls.emplace_back ("gettxout", params);
+    }
+
+  return rpc.CallBatch (calls);
+}
+
+std::vector<Json::Value>
+DecodePsbts (RpcClient<XayaRpcClient>& rpc,
+             const std::vector<std::string>& psbts)
+{
+  /* If one of the PSBTs cannot be decoded natively, we decode all of them
+     with Xaya Core instead.  This makes sure that results can be compared
+     (e.g. the "inputs" before and after signing).  */
+  std::vector<Json::Value> res(psbts.size ());
+  bool native = true;
+  for (unsigned i = 0; i < psbts.size (); ++i)
+    if (!DecodePsbtNatively (psbts[i], res[i]))
+      {
+        native = false;
+        break;
+      }
+  if (native)
+    return res;
+
+  VLOG (1) << "Decoding PSBTs with Xaya Core";
+  std::vector<BatchedCall> calls;
+  for (const auto& psbt : psbts)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append (psbt);
+      calls.emplace_back ("decodepsbt", params);
+    }
+
+  res = rpc.CallBatch (calls);
+  for (const auto& decoded : res)
+    CHECK (decoded.isObject ()) << "Invalid decodepsbt result: " << decoded;
+
+  return res;
+}
+
+Json::Value
+DecodePsbt (RpcClient<XayaRpcClient>& rpc, const std::string& psbt)
+{
+  return DecodePsbts (rpc, {psbt})[0];
+}
+
 std::string
 TradeChecker::GetNameUpdateValue () const
 {
@@ -106,46 +167,6 @@ TradeChecker::GetTotalSat (Amount& total) const
   return true;
 }
 
-namespace
-{
-
-/**
- * Checks if the given ancestor block hash is indeed an ancestor of the
- * given child block, according to the Xaya RPC interface.  We check at most
- * n blocks back.
- */
-bool
-IsBlockAncestor (RpcClient<XayaRpcClient>& rpc,
-                 const xaya::uint256& ancestor,
-                 const xaya::uint256& child,
-                 const int n)
-{
-  if (ancestor == child)
-    return true;
-
-  if (n == 0)
-    return false;
-  CHECK_GT (n, 0);
-
-  const auto childData = rpc->getblockheader (child.ToHex ());
-  CHECK (childData.isObject ());
-  const auto prevVal = childData["previousblockhash"];
-  if (prevVal.isNull ())
-    {
-      /* This is the case for the genesis block.  */
-      return false;
-    }
-  CHECK (prevVal.isString ());
-  xaya::uint256 parent;
-  CHECK (parent.FromHex (prevVal.asString ()))
-      << "getblockheader prev block hash is not valid uint256: "
-      << childData;
-
-  return IsBlockAncestor (rpc, ancestor, parent, n - 1);
-}
-
-} // anonymous namespace
-
 bool
 TradeChecker::CheckForBuyerTrade (proto::OutPoint& nameInput) const
 {
@@ -218,7 +239,7 @@ TradeChecker::CheckForBuyerTrade (proto::OutPoint& nameInput) const
       return false;
     }
 
-  if (!IsBlockAncestor (xaya, utxoBlock, gspBlock, MAX_BLOCK_ANCESTORS_CHECKED))
+  if (!headers.IsAncestor (utxoBlock, gspBlock, MAX_BLOCK_ANCESTORS_CHECKED))
     {
       LOG (WARNING)
           << "UTXO block is not ancestor of GSP block; still syncing?\n"
@@ -233,8 +254,9 @@ bool
 TradeChecker::CheckForBuyerSignature (const std::string& beforeStr,
                                       const std::string& afterStr) const
 {
-  const auto before = xaya->decodepsbt (beforeStr);
-  const auto after = xaya->decodepsbt (afterStr);
+  const auto decoded = DecodePsbts (xaya, {beforeStr, afterStr});
+  const auto& before = decoded[0];
+  const auto& after = decoded[1];
 
   /* The "tx" field inside the PSBT is always unsigned, so should never
      change at all by signing (no matter what).  */
@@ -276,7 +298,9 @@ namespace
 
 /**
  * Returns true if the given "scriptPubKey" JSON value (as per Xaya Core's
- * transaction-decoding RPC interface) matches the given address.
+ * transaction-decoding RPC interface) matches the given address.  If the
+ * value has been decoded natively, it contains only the script's hex
+ * and not the address.
  */
 bool
 MatchesAddress (const Json::Value& scriptPubKey, const std::string& addr)
@@ -293,6 +317,11 @@ MatchesAddress (const Json::Value& scriptPubKey, const std::string& addr)
   if (address.isString () && address.asString () == addr)
     return true;
 
+  const auto& hex = scriptPubKey["hex"];
+  if (!scriptPubKey.isMember ("address") && !scriptPubKey.isMember ("addresses")
+        && hex.isString () && ScriptPaysToAddress (hex.asString (), addr))
+    return true;
+
   return false;
 }
 
@@ -304,7 +333,7 @@ TradeChecker::CheckForSellerOutputs (const std::string& psbt,
 {
   CHECK (sd.has_chi_address () && sd.has_name_address ());
 
-  const auto decoded = xaya->decodepsbt (psbt);
+  const auto decoded = DecodePsbt (xaya, psbt);
   CHECK (decoded.isObject ());
   const auto& tx = decoded["tx"];
   CHECK (tx.isObject ());
@@ -402,8 +431,9 @@ TradeChecker::CheckForSellerSignature (const std::string& beforeStr,
   const auto& nmOut = sd.name_output ();
   CHECK (nmOut.has_hash () && nmOut.has_n ());
 
-  const auto before = xaya->decodepsbt (beforeStr);
-  const auto after = xaya->decodepsbt (afterStr);
+  const auto decoded = DecodePsbts (xaya, {beforeStr, afterStr});
+  const auto& before = decoded[0];
+  const auto& after = decoded[1];
 
   /* The "tx" field inside the PSBT is always unsigned, so should never
      change at all by signing (no matter what).  */
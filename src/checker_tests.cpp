@@ -26,6 +26,7 @@
 #include <gtest/gtest.h>
 
 #include <limits>
+#include <vector>
 
 namespace democrit
 {
@@ -43,11 +44,14 @@ protected:
 
   TestEnvironment<MockXayaRpcServer> env;
   TestAssets spec;
+  BlockHeaderCache headers;
 
   TradeChecker checker;
 
   TradeCheckerTests ()
-    : checker(spec, env.GetXayaRpc (), "buyer", "seller", "gold", 10, 3)
+    : headers(env.GetXayaRpc ()),
+      checker(spec, env.GetXayaRpc (), headers,
+              "buyer", "seller", "gold", 10, 3)
   {
     /* By default, the setting is such that the game allows the trade.  Tests
        for this will overwrite the data as needed.  */
@@ -99,8 +103,8 @@ TEST_F (TradeCheckerTests, GetTotalSat)
 
   for (const auto& t : tests)
     {
-      const TradeChecker c(spec, env.GetXayaRpc (), "buyer", "seller", "gold",
-                           t.price, t.units);
+      const TradeChecker c(spec, env.GetXayaRpc (), headers,
+                           "buyer", "seller", "gold", t.price, t.units);
       Amount res;
       ASSERT_EQ (c.GetTotalSat (res), t.expectedSuccess);
       if (t.expectedSuccess)
@@ -110,6 +114,40 @@ TEST_F (TradeCheckerTests, GetTotalSat)
     }
 }
 
+TEST_F (TradeCheckerTests, GetTxOuts)
+{
+  env.GetXayaServer ().AddUtxo ("foo", 1);
+  env.GetXayaServer ().AddUtxo ("bar", 2);
+
+  std::vector<proto::OutPoint> outs(3);
+  outs[0].set_hash ("foo");
+  outs[0].set_n (1);
+  outs[1].set_hash ("foo");
+  outs[1].set_n (2);
+  outs[2].set_hash ("bar");
+  outs[2].set_n (2);
+
+  const auto res = GetTxOuts (env.GetXayaRpc (), outs);
+  ASSERT_EQ (res.size (), 3);
+  EXPECT_TRUE (res[0].isObject ());
+  EXPECT_TRUE (res[1].isNull ());
+  EXPECT_TRUE (res[2].isObject ());
+}
+
+TEST_F (TradeCheckerTests, DecodePsbts)
+{
+  env.GetXayaServer ().SetPsbt ("first", ParseJson (R"({"value": 1})"));
+  env.GetXayaServer ().SetPsbt ("second", ParseJson (R"({"value": 2})"));
+
+  const auto res = DecodePsbts (env.GetXayaRpc (), {"second", "first"});
+  ASSERT_EQ (res.size (), 2);
+  EXPECT_EQ (res[0], ParseJson (R"({"value": 2})"));
+  EXPECT_EQ (res[1], ParseJson (R"({"value": 1})"));
+
+  EXPECT_THROW (DecodePsbts (env.GetXayaRpc (), {"first", "invalid"}),
+                jsonrpc::JsonRpcException);
+}
+
 /* ************************************************************************** */
 
 class TradeCheckerForBuyerTests : public TradeCheckerTests
@@ -144,13 +182,15 @@ protected:
 
 TEST_F (TradeCheckerForBuyerTests, InvalidAsset)
 {
-  TradeChecker c(spec, env.GetXayaRpc (), "buyer", "seller", "invalid", 1, 1);
+  TradeChecker c(spec, env.GetXayaRpc (), headers,
+                 "buyer", "seller", "invalid", 1, 1);
   ExpectInvalid (c);
 }
 
 TEST_F (TradeCheckerForBuyerTests, BuyerCannotReceive)
 {
-  TradeChecker c(spec, env.GetXayaRpc (), "uninit", "seller", "gold", 1, 1);
+  TradeChecker c(spec, env.GetXayaRpc (), headers,
+                 "uninit", "seller", "gold", 1, 1);
   ExpectInvalid (c);
 }
 
@@ -424,7 +464,8 @@ TEST_F (TradeCheckerForSellerOutputsTests, ExtraOutputOk)
 
 TEST_F (TradeCheckerForSellerOutputsTests, ZeroTotalNeedsNoChiOutput)
 {
-  TradeChecker c(spec, env.GetXayaRpc (), "buyer", "seller", "gold", 0, 1);
+  TradeChecker c(spec, env.GetXayaRpc (), headers,
+                 "buyer", "seller", "gold", 0, 1);
 
   const auto baseVouts = GetValidVout (c);
   Json::Value vouts(Json::arrayValue);
@@ -450,7 +491,8 @@ TEST_F (TradeCheckerForSellerOutputsTests, ChiAndNameSameAddress)
 TEST_F (TradeCheckerForSellerOutputsTests, TotalOverflow)
 {
   const auto max = std::numeric_limits<Amount>::max ();
-  TradeChecker c(spec, env.GetXayaRpc (), "buyer", "seller", "gold", max, 2);
+  TradeChecker c(spec, env.GetXayaRpc (), headers,
+                 "buyer", "seller", "gold", max, 2);
 
   Json::Value vouts = GetValidVout (checker);
   vouts[0]["value"] = 10.0 * max;
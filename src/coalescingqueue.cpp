@@ -0,0 +1,136 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/coalescingqueue.hpp"
+
+#include <glog/logging.h>
+
+namespace democrit
+{
+
+CoalescingQueue::CoalescingQueue (const unsigned numThreads,
+                                  const size_t mp)
+  : maxPending(mp), pool(numThreads)
+{
+  CHECK_GT (maxPending, 0);
+}
+
+bool
+CoalescingQueue::Enqueue (const std::string& key, std::function<void ()> job,
+                          const bool replace)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (stopped)
+    {
+      VLOG (1) << "Queue is stopped, dropping job for " << key;
+      return false;
+    }
+
+  auto& q = queues[key];
+
+  if (replace)
+    {
+      if (!q.pending.empty ())
+        {
+          VLOG (2)
+              << "Replacing " << q.pending.size ()
+              << " pending jobs for " << key;
+          q.pending.clear ();
+        }
+    }
+  else if (q.pending.size () >= maxPending)
+    {
+      /* The queue can only be full if a worker is already on it,
+         so we do not leave behind an entry that is never drained.  */
+      CHECK (q.running);
+      return false;
+    }
+
+  q.pending.push_back (std::move (job));
+
+  if (!q.running)
+    {
+      q.running = true;
+      pool.Submit ([this, key] ()
+        {
+          Drain (key);
+        });
+    }
+
+  return true;
+}
+
+void
+CoalescingQueue::Drain (const std::string& key)
+{
+  while (true)
+    {
+      std::function<void ()> job;
+
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        auto mit = queues.find (key);
+        CHECK (mit != queues.end ());
+        CHECK (mit->second.running);
+
+        if (mit->second.pending.empty ())
+          {
+            queues.erase (mit);
+            if (queues.empty ())
+              cvIdle.notify_all ();
+            return;
+          }
+
+        job = std::move (mit->second.pending.front ());
+        mit->second.pending.pop_front ();
+      }
+
+      job ();
+    }
+}
+
+bool
+CoalescingQueue::Push (const std::string& key, std::function<void ()> job)
+{
+  return Enqueue (key, std::move (job), false);
+}
+
+void
+CoalescingQueue::Replace (const std::string& key, std::function<void ()> job)
+{
+  Enqueue (key, std::move (job), true);
+}
+
+void
+CoalescingQueue::Stop ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  stopped = true;
+}
+
+void
+CoalescingQueue::WaitIdle ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  cvIdle.wait (lock, [this] ()
+    {
+      return queues.empty ();
+    });
+}
+
+} // namespace democrit
@@ -0,0 +1,223 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/coalescingqueue.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace democrit
+{
+namespace
+{
+
+using testing::ElementsAre;
+
+/**
+ * Test fixture that provides a "gate" that jobs can block on, so that we
+ * can control when they finish and queue up other jobs meanwhile.
+ */
+class CoalescingQueueTests : public testing::Test
+{
+
+private:
+
+  std::mutex mut;
+  std::condition_variable cv;
+  bool open = false;
+  bool blocked = false;
+
+protected:
+
+  /** Log of all jobs run (by name), protected by mutLog.  */
+  std::vector<std::string> log;
+  std::mutex mutLog;
+
+  /**
+   * Returns a job that blocks until the gate is opened.
+   */
+  std::function<void ()>
+  BlockingJob ()
+  {
+    return [this] ()
+      {
+        std::unique_lock<std::mutex> lock(mut);
+        blocked = true;
+        cv.notify_all ();
+        cv.wait (lock, [this] () { return open; });
+      };
+  }
+
+  /**
+   * Waits until a blocking job has started running.
+   */
+  void
+  WaitForBlocked ()
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait (lock, [this] () { return blocked; });
+  }
+
+  /**
+   * Returns a job that just logs the given name.
+   */
+  std::function<void ()>
+  LoggingJob (const std::string& name)
+  {
+    return [this, name] ()
+      {
+        std::lock_guard<std::mutex> lock(mutLog);
+        log.push_back (name);
+      };
+  }
+
+  void
+  OpenGate ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    open = true;
+    cv.notify_all ();
+  }
+
+};
+
+TEST_F (CoalescingQueueTests, RunsInOrderPerKey)
+{
+  CoalescingQueue q(4, 100);
+  for (unsigned i = 0; i < 50; ++i)
+    ASSERT_TRUE (q.Push ("foo", LoggingJob (std::to_string (i))));
+  q.WaitIdle ();
+
+  ASSERT_EQ (log.size (), 50);
+  for (unsigned i = 0; i < 50; ++i)
+    EXPECT_EQ (log[i], std::to_string (i));
+}
+
+TEST_F (CoalescingQueueTests, LatestWins)
+{
+  CoalescingQueue q(1, 100);
+  q.Push ("foo", BlockingJob ());
+  WaitForBlocked ();
+  q.Push ("foo", LoggingJob ("delta 1"));
+  q.Replace ("foo", LoggingJob ("full 1"));
+  q.Push ("foo", LoggingJob ("delta 2"));
+  q.Replace ("foo", LoggingJob ("full 2"));
+  q.Push ("foo", LoggingJob ("delta 3"));
+
+  OpenGate ();
+  q.WaitIdle ();
+  EXPECT_THAT (log, ElementsAre ("full 2", "delta 3"));
+}
+
+TEST_F (CoalescingQueueTests, Bounded)
+{
+  CoalescingQueue q(2, 2);
+  ASSERT_TRUE (q.Push ("foo", BlockingJob ()));
+  WaitForBlocked ();
+  ASSERT_TRUE (q.Push ("foo", LoggingJob ("foo 1")));
+  ASSERT_TRUE (q.Push ("foo", LoggingJob ("foo 2")));
+  EXPECT_FALSE (q.Push ("foo", LoggingJob ("foo 3")));
+
+  /* Other keys are not affected, and are also not blocked.  */
+  ASSERT_TRUE (q.Push ("bar", LoggingJob ("bar")));
+  while (true)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutLog);
+        if (!log.empty ())
+          break;
+      }
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    }
+  EXPECT_THAT (log, ElementsAre ("bar"));
+
+  OpenGate ();
+  q.WaitIdle ();
+  EXPECT_THAT (log, ElementsAre ("bar", "foo 1", "foo 2"));
+
+  /* After draining, the queue accepts jobs again.  */
+  ASSERT_TRUE (q.Push ("foo", LoggingJob ("foo 4")));
+  q.WaitIdle ();
+  EXPECT_THAT (log, ElementsAre ("bar", "foo 1", "foo 2", "foo 4"));
+}
+
+TEST_F (CoalescingQueueTests, KeysRunInParallel)
+{
+  constexpr auto DELAY = std::chrono::milliseconds (50);
+  constexpr unsigned KEYS = 4;
+
+  CoalescingQueue q(KEYS, 10);
+  std::atomic<unsigned> running(0);
+  std::atomic<unsigned> maxRunning(0);
+
+  const auto before = std::chrono::steady_clock::now ();
+  for (unsigned i = 0; i < KEYS; ++i)
+    q.Push (std::to_string (i), [&] ()
+      {
+        const unsigned cur = ++running;
+        unsigned prev = maxRunning;
+        while (cur > prev && !maxRunning.compare_exchange_weak (prev, cur))
+          ;
+        std::this_thread::sleep_for (DELAY);
+        --running;
+      });
+  q.WaitIdle ();
+  const auto after = std::chrono::steady_clock::now ();
+
+  EXPECT_GT (maxRunning, 1);
+  EXPECT_LT (after - before, KEYS * DELAY);
+}
+
+TEST_F (CoalescingQueueTests, Stop)
+{
+  CoalescingQueue q(1, 10);
+  ASSERT_TRUE (q.Push ("foo", BlockingJob ()));
+  WaitForBlocked ();
+  ASSERT_TRUE (q.Push ("foo", LoggingJob ("before")));
+
+  q.Stop ();
+  EXPECT_FALSE (q.Push ("foo", LoggingJob ("push")));
+  EXPECT_FALSE (q.Push ("bar", LoggingJob ("other key")));
+  q.Replace ("foo", LoggingJob ("replace"));
+
+  OpenGate ();
+  q.WaitIdle ();
+  EXPECT_THAT (log, ElementsAre ("before"));
+}
+
+TEST_F (CoalescingQueueTests, FinishesOnDestruction)
+{
+  {
+    CoalescingQueue q(2, 10);
+    for (unsigned i = 0; i < 5; ++i)
+      q.Push ("foo", LoggingJob ("job"));
+  }
+
+  EXPECT_EQ (log.size (), 5);
+}
+
+} // anonymous namespace
+} // namespace democrit
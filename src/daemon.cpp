@@ -19,6 +19,7 @@
 #include "daemon.hpp"
 
 #include "private/authenticator.hpp"
+#include "private/coalescingqueue.hpp"
 #include "private/intervaljob.hpp"
 #include "private/mucclient.hpp"
 #include "private/myorders.hpp"
@@ -26,7 +27,11 @@
 #include "private/rpcclient.hpp"
 #include "private/stanzas.hpp"
 #include "private/state.hpp"
+#include "private/statestore.hpp"
+#include "private/tipnotifier.hpp"
 #include "private/trades.hpp"
+#include "private/wakeupjob.hpp"
+#include "private/workerpool.hpp"
 #include "proto/processing.pb.h"
 #include "rpc-stubs/demgsprpcclient.h"
 #include "rpc-stubs/xayarpcclient.h"
@@ -34,15 +39,54 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <google/protobuf/repeated_field.h>
+
+#include <algorithm>
 #include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace democrit
 {
 
+using google::protobuf::RepeatedPtrField;
+
 DEFINE_int64 (democrit_order_timeout_ms, 10 * 60 * 1'000,
               "Timeout (in milliseconds) of orders when not refreshed");
 DEFINE_int64 (democrit_reconnect_ms, 10 * 1'000,
               "Interval (in milliseconds) for trying to reconnect to XMPP");
+DEFINE_int32 (democrit_take_threads, 4,
+              "Number of threads used to take multiple orders in parallel");
+DEFINE_int32 (democrit_inbound_threads, 4,
+              "Number of threads used to validate and apply order updates"
+              " received from other participants");
+DEFINE_int32 (democrit_inbound_queue_per_account, 16,
+              "Maximum number of order updates queued per account");
+DEFINE_int32 (democrit_processing_threads, 4,
+              "Number of threads used to handle trade messages received"
+              " from counterparties");
+DEFINE_int64 (democrit_tip_poll_ms, 1'000,
+              "Interval (in milliseconds) for polling Xaya Core for new blocks"
+              " to trigger trade updates");
+DEFINE_int32 (democrit_max_orders_per_account, 1'000,
+              "Maximum number of orders stored for any other account"
+              " (zero for no limit)");
+DEFINE_int32 (democrit_max_assets_per_account, 100,
+              "Maximum number of assets any other account can have orders"
+              " for (zero for no limit)");
+DEFINE_int64 (democrit_max_book_bytes, 256 << 20,
+              "Budget for the estimated memory used by the orderbook"
+              " (zero for no limit)");
+DEFINE_string (democrit_book_eviction, "oldest",
+               "What to evict if the orderbook exceeds its memory budget,"
+               " \"oldest\" (accounts updated least recently) or \"furthest\""
+               " (orders furthest from the top of the book)");
+DEFINE_string (democrit_datadir, "",
+               "If set, directory in which the state (own orders and trades)"
+               " is persisted across restarts");
 
 /**
  * Whether or not we should use the "legacy" V1 protocol for the Xaya
@@ -51,6 +95,46 @@ DEFINE_int64 (democrit_reconnect_ms, 10 * 1'000,
  */
 bool useLegacyXayaRpcInDaemon = true;
 
+namespace
+{
+
+/**
+ * Maximum number of received processing messages that can be pending for
+ * a single trade.  Each step of a trade requires just one message, so more
+ * than a few at a time indicate a misbehaving counterparty.
+ */
+constexpr size_t MAX_PENDING_PROCESSING = 16;
+
+/**
+ * Maximum number of received processing messages that can be pending for
+ * a single counterparty across all its trades.  The trade identifier is
+ * chosen by the sender, so without this limit one counterparty could
+ * queue an unbounded amount of work by using many different identifiers.
+ */
+constexpr size_t MAX_PENDING_PROCESSING_PER_ACCOUNT = 64;
+
+/**
+ * Coalescing group for broadcasts of our own orders.  A full update of
+ * them supersedes all previous ones as well as deltas.
+ */
+const std::string ORDERS_GROUP = "orders";
+
+/**
+ * Opens the store for persisting our state based on the configured
+ * data directory, or returns null if there is none.
+ */
+std::unique_ptr<StateStore>
+OpenStateStore ()
+{
+  if (FLAGS_democrit_datadir.empty ())
+    return nullptr;
+
+  LOG (INFO) << "Persisting state in " << FLAGS_democrit_datadir;
+  return std::make_unique<StateStore> (FLAGS_democrit_datadir);
+}
+
+} // anonymous namespace
+
 /* ************************************************************************** */
 
 /**
@@ -68,7 +152,8 @@ protected:
 
   bool ValidateOrder (const std::string& account,
                       const proto::Order& o) const override;
-  void UpdateOrders (const proto::OrdersOfAccount& ownOrders) override;
+  bool UpdateOrders (const proto::OrdersOfAccount& ownOrders) override;
+  bool UpdateOrderDeltas (const proto::OrderDeltas& deltas) override;
 
 public:
 
@@ -85,8 +170,11 @@ class Daemon::Impl : private MucClient
 
 private:
 
-  /** Asset spec used to validate orders.  */
-  const AssetSpec& spec;
+  /**
+   * Asset spec used to validate orders.  This wraps the spec passed in
+   * with a cache, which is invalidated whenever a new block arrives.
+   */
+  CachingAssetSpec spec;
 
   /** The internal "global" state with thread-safe access.  */
   State state;
@@ -106,24 +194,86 @@ private:
   /** RPC connection to the g/dem GSP.  */
   RpcClient<DemGspRpcClient> demGsp;
 
+  /** Notifier for new blocks, used to trigger trade updates.  */
+  RpcTipNotifier tipNotifier;
+
   /** Handler for active trades.  */
   TradeManager trades;
 
+  /** Worker threads for taking multiple orders in parallel.  */
+  WorkerPool takers;
+
+  /**
+   * Queue for processing received order updates, keyed by account.
+   * Receiving a message just queues it here, and the validation as well
+   * as updating of the orderbook is done on the queue's workers.
+   */
+  CoalescingQueue inbound;
+
+  /** Lock for pendingProcessing.  */
+  std::mutex mutPending;
+
+  /**
+   * Number of processing messages queued or running for each counterparty
+   * account.  Accounts without any are removed from the map.
+   */
+  std::map<std::string, size_t> pendingProcessing;
+
+  /**
+   * Queue for handling received processing messages.  They are keyed by
+   * counterparty and trade, so that messages for one trade are handled in
+   * order while independent trades can progress in parallel.
+   */
+  CoalescingQueue processors;
+
   /** Interval job for checking the connection and perhaps reconnecting.  */
   std::unique_ptr<IntervalJob> reconnecter;
 
+  /** Job for re-validating the orderbook when a new block arrives.  */
+  std::unique_ptr<WakeupJob> revalidator;
+
+  /** Our listener ID with the tip notifier.  */
+  unsigned tipListener;
+
   /**
    * Returns true if the given order seems valid for the given account,
    * according to the asset spec.
    */
   bool ValidateOrder (const std::string& account, const proto::Order& o) const;
 
+  /**
+   * Validates all orders in the orderbook again, and removes the ones that
+   * are no longer valid (e.g. because balances changed with a new block).
+   * Incoming orders are only validated if they are new or changed, so this
+   * makes sure the others are still checked against the current state.
+   */
+  void RevalidateOrders ();
+
+  /**
+   * Validates and applies a full update of orders received from
+   * the given account.
+   */
+  void ProcessOrders (const std::string& account,
+                      const proto::OrdersOfAccount& data);
+
+  /**
+   * Validates and applies order deltas received from the given account.
+   */
+  void ProcessDeltas (const std::string& account,
+                      const proto::OrderDeltas& data);
+
   /**
    * Sends a ProcessingMessage via XMPP to the counterparty specified in
    * the message.
    */
   void SendProcessingMessage (proto::ProcessingMessage&& msg);
 
+  /**
+   * Marks one pending processing message of the given counterparty
+   * as done, decrementing its count in pendingProcessing.
+   */
+  void ProcessingDone (const std::string& account);
+
   friend class Daemon;
   friend class MyOrdersImpl;
 
@@ -133,6 +283,7 @@ protected:
                       const gloox::Stanza& msg) override;
   void HandlePrivate (const gloox::JID& sender,
                       const gloox::Stanza& msg) override;
+  void HandleJoin (const gloox::JID& joined) override;
   void HandleDisconnect (const gloox::JID& disconnected) override;
 
 public:
@@ -142,6 +293,8 @@ public:
                  const std::string& jid, const std::string& password,
                  const std::string& mucRoom);
 
+  ~Impl ();
+
   Impl () = delete;
   Impl (const Impl&) = delete;
   void operator= (const Impl&) = delete;
@@ -163,7 +316,7 @@ Daemon::MyOrdersImpl::ValidateOrder (const std::string& account,
   return impl.ValidateOrder (account, o);
 }
 
-void
+bool
 Daemon::MyOrdersImpl::UpdateOrders (const proto::OrdersOfAccount& ownOrders)
 {
   impl.state.ReadState ([&] (const proto::State& s)
@@ -174,12 +327,35 @@ Daemon::MyOrdersImpl::UpdateOrders (const proto::OrdersOfAccount& ownOrders)
   if (!impl.IsConnected ())
     {
       VLOG (1) << "Ignoring order refresh while not connected";
-      return;
+      return false;
     }
 
   MucClient::ExtensionData ext;
   ext.push_back (std::make_unique<AccountOrdersStanza> (ownOrders));
-  impl.PublishMessage (std::move (ext));
+  impl.PublishMessage (std::move (ext), ORDERS_GROUP, true);
+
+  return true;
+}
+
+bool
+Daemon::MyOrdersImpl::UpdateOrderDeltas (const proto::OrderDeltas& deltas)
+{
+  impl.state.ReadState ([&] (const proto::State& s)
+    {
+      CHECK_EQ (deltas.account (), s.account ());
+    });
+
+  if (!impl.IsConnected ())
+    {
+      VLOG (1) << "Ignoring order deltas while not connected";
+      return false;
+    }
+
+  MucClient::ExtensionData ext;
+  ext.push_back (std::make_unique<OrderDeltasStanza> (deltas));
+  impl.PublishMessage (std::move (ext), ORDERS_GROUP, false);
+
+  return true;
 }
 
 Daemon::Impl::Impl (const AssetSpec& s, const std::string& account,
@@ -187,11 +363,18 @@ Daemon::Impl::Impl (const AssetSpec& s, const std::string& account,
                     const std::string& jid, const std::string& password,
                     const std::string& mucRoom)
   : MucClient (gloox::JID (jid), password, gloox::JID (mucRoom)),
-    spec(s), state(account),
+    spec(s), state(account, OpenStateStore ()),
     myOrders(*this),
     allOrders(std::chrono::milliseconds (FLAGS_democrit_order_timeout_ms)),
     xayaRpc(xr, useLegacyXayaRpcInDaemon), demGsp(dg),
-    trades(state, myOrders, spec, xayaRpc, demGsp, true)
+    tipNotifier(xayaRpc,
+                std::chrono::milliseconds (FLAGS_democrit_tip_poll_ms)),
+    trades(state, myOrders, spec, xayaRpc, demGsp, true),
+    takers(std::max (FLAGS_democrit_take_threads, 1)),
+    inbound(std::max (FLAGS_democrit_inbound_threads, 1),
+            std::max (FLAGS_democrit_inbound_queue_per_account, 1)),
+    processors(std::max (FLAGS_democrit_processing_threads, 1),
+               MAX_PENDING_PROCESSING)
 {
   std::string jidAccount;
   CHECK (auth.Authenticate (gloox::JID (jid), jidAccount))
@@ -200,7 +383,61 @@ Daemon::Impl::Impl (const AssetSpec& s, const std::string& account,
       << "Our JID " << jid << " does not match claimed account " << account;
 
   RegisterExtension (std::make_unique<AccountOrdersStanza> ());
+  RegisterExtension (std::make_unique<OrderDeltasStanza> ());
   RegisterExtension (std::make_unique<ProcessingMessageStanza> ());
+
+  OrderBook::Limits limits;
+  limits.maxOrdersPerAccount
+      = std::max (FLAGS_democrit_max_orders_per_account, 0);
+  limits.maxAssetsPerAccount
+      = std::max (FLAGS_democrit_max_assets_per_account, 0);
+  limits.maxBytes = std::max<int64_t> (FLAGS_democrit_max_book_bytes, 0);
+  if (FLAGS_democrit_book_eviction == "oldest")
+    limits.eviction = OrderBook::EvictionPolicy::OLDEST_UPDATE;
+  else if (FLAGS_democrit_book_eviction == "furthest")
+    limits.eviction = OrderBook::EvictionPolicy::FURTHEST_FROM_TOP;
+  else
+    LOG (FATAL)
+        << "Invalid eviction policy: " << FLAGS_democrit_book_eviction;
+  allOrders.SetLimits (limits);
+
+  revalidator = std::make_unique<WakeupJob> ([this] ()
+    {
+      RevalidateOrders ();
+    });
+  /* This listener is added before the one of the trade manager, so that
+     the asset cache is invalidated before trades are updated.  */
+  tipListener = tipNotifier.AddListener ([this] (const std::string& hash)
+    {
+      spec.SetTip (hash);
+      VLOG (1) << "New tip " << hash << ", scheduling order re-validation";
+      revalidator->Trigger ();
+    });
+
+  trades.EnableTipUpdates (tipNotifier);
+}
+
+Daemon::Impl::~Impl ()
+{
+  /* Stop reconnecting to the server while we are shutting down.  */
+  reconnecter.reset ();
+
+  /* We keep receiving stanzas until we disconnect below.  Stop the queues
+     from accepting more work, so that none of it runs after the disconnect
+     (e.g. in the queues' destructors).  Messages received from now on are
+     dropped.  */
+  inbound.Stop ();
+  processors.Stop ();
+
+  /* Let the jobs that are already queued finish while we are still
+     connected, so that their replies can be sent.  */
+  processors.WaitIdle ();
+  inbound.WaitIdle ();
+
+  Disconnect ();
+
+  tipNotifier.RemoveListener (tipListener);
+  revalidator.reset ();
 }
 
 bool
@@ -238,6 +475,45 @@ Daemon::Impl::ValidateOrder (const std::string& account,
     }
 }
 
+void
+Daemon::Impl::RevalidateOrders ()
+{
+  const auto book = allOrders.GetByAsset ();
+
+  unsigned checked = 0;
+  unsigned removed = 0;
+  const auto checkSide = [&] (const Asset& asset,
+                              const proto::Order::Type type,
+                              const RepeatedPtrField<proto::Order>& side)
+    {
+      for (const auto& entry : side)
+        {
+          proto::Order o = entry;
+          o.set_asset (asset);
+          o.set_type (type);
+
+          ++checked;
+          if (!ValidateOrder (o.account (), o)
+                && allOrders.RemoveOrder (o.account (), o.id (), o))
+            {
+              LOG (WARNING)
+                  << "Removing no-longer valid order from " << o.account ()
+                  << ":\n" << o.DebugString ();
+              ++removed;
+            }
+        }
+    };
+
+  for (const auto& entry : book.assets ())
+    {
+      checkSide (entry.first, proto::Order::BID, entry.second.bids ());
+      checkSide (entry.first, proto::Order::ASK, entry.second.asks ());
+    }
+
+  VLOG (1)
+      << "Re-validated " << checked << " orders, removed " << removed;
+}
+
 void
 Daemon::Impl::SendProcessingMessage (proto::ProcessingMessage&& msg)
 {
@@ -258,6 +534,59 @@ Daemon::Impl::SendProcessingMessage (proto::ProcessingMessage&& msg)
   SendMessage (receiver, std::move (ext));
 }
 
+void
+Daemon::Impl::ProcessOrders (const std::string& account,
+                             const proto::OrdersOfAccount& data)
+{
+  proto::OrdersOfAccount orders;
+  orders.set_account (account);
+
+  /* Orders that we already have unchanged have been validated before
+     (and are re-validated with each new block), so that periodic
+     refreshes only need to validate new or changed orders.  */
+  const auto unchanged = allOrders.FindUnchanged (account, data.orders ());
+
+  for (const auto& o : data.orders ())
+    if (unchanged.count (o.first) > 0 || ValidateOrder (account, o.second))
+      orders.mutable_orders ()->insert (o);
+    else
+      LOG (WARNING)
+          << "Ignoring invalid order from " << account << "\n:"
+          << o.second.DebugString ();
+
+  if (data.has_seq ())
+    orders.set_seq (data.seq ());
+
+  allOrders.UpdateOrders (std::move (orders));
+}
+
+void
+Daemon::Impl::ProcessDeltas (const std::string& account,
+                             const proto::OrderDeltas& data)
+{
+  proto::OrderDeltas deltas;
+  deltas.set_account (account);
+  deltas.set_seq (data.seq ());
+  *deltas.mutable_removed () = data.removed ();
+  *deltas.mutable_locked () = data.locked ();
+
+  /* Invalid orders are not added, but they still replace (i.e. remove)
+     any previous order with the same ID.  */
+  const auto unchanged = allOrders.FindUnchanged (account, data.added ());
+  for (const auto& o : data.added ())
+    if (unchanged.count (o.first) > 0 || ValidateOrder (account, o.second))
+      deltas.mutable_added ()->insert (o);
+    else
+      {
+        LOG (WARNING)
+            << "Ignoring invalid order from " << account << "\n:"
+            << o.second.DebugString ();
+        deltas.add_removed (o.first);
+      }
+
+  allOrders.ApplyDeltas (std::move (deltas));
+}
+
 void
 Daemon::Impl::HandleMessage (const gloox::JID& sender, const gloox::Stanza& msg)
 {
@@ -268,25 +597,52 @@ Daemon::Impl::HandleMessage (const gloox::JID& sender, const gloox::Stanza& msg)
       return;
     }
 
+  /* This is called on the XMPP thread, so we just copy out the data and
+     queue it for processing (which may involve RPC calls for validation).  */
+
   const auto* ordersExt
       = msg.findExtension<AccountOrdersStanza> (AccountOrdersStanza::EXT_TYPE);
   if (ordersExt != nullptr && ordersExt->IsValid ())
     {
-      proto::OrdersOfAccount orders;
-      orders.set_account (account);
-
-      for (const auto& o : ordersExt->GetData ().orders ())
-        if (ValidateOrder (account, o.second))
-          orders.mutable_orders ()->insert (o);
-        else
-          LOG (WARNING)
-              << "Ignoring invalid order from " << account << "\n:"
-              << o.second.DebugString ();
+      /* A full update supersedes whatever is still pending for the account,
+         so only the latest one needs to be processed.  */
+      inbound.Replace (account,
+          [this, account, data = ordersExt->GetData ()] ()
+            {
+              ProcessOrders (account, data);
+            });
+    }
 
-      allOrders.UpdateOrders (std::move (orders));
+  const auto* deltasExt
+      = msg.findExtension<OrderDeltasStanza> (OrderDeltasStanza::EXT_TYPE);
+  if (deltasExt != nullptr && deltasExt->IsValid ()
+        && deltasExt->GetData ().has_seq ())
+    {
+      /* If deltas are dropped, the orderbook will notice the gap in sequence
+         numbers and wait for the next full update.  */
+      const bool queued = inbound.Push (account,
+          [this, account, data = deltasExt->GetData ()] ()
+            {
+              ProcessDeltas (account, data);
+            });
+      if (!queued)
+        LOG (WARNING)
+            << "Could not queue order deltas from " << account
+            << " (too many pending or shutting down), dropping them";
     }
 }
 
+void
+Daemon::Impl::ProcessingDone (const std::string& account)
+{
+  std::lock_guard<std::mutex> lock(mutPending);
+  auto mit = pendingProcessing.find (account);
+  CHECK (mit != pendingProcessing.end () && mit->second > 0);
+  --mit->second;
+  if (mit->second == 0)
+    pendingProcessing.erase (mit);
+}
+
 void
 Daemon::Impl::HandlePrivate (const gloox::JID& sender, const gloox::Stanza& msg)
 {
@@ -305,12 +661,48 @@ Daemon::Impl::HandlePrivate (const gloox::JID& sender, const gloox::Stanza& msg)
       proto::ProcessingMessage msg = pmExt->GetData ();
       msg.set_counterparty (account);
 
-      proto::ProcessingMessage reply;
-      if (trades.ProcessMessage (msg, reply))
-        SendProcessingMessage (std::move (reply));
+      {
+        std::lock_guard<std::mutex> lock(mutPending);
+        auto& cnt = pendingProcessing[account];
+        if (cnt >= MAX_PENDING_PROCESSING_PER_ACCOUNT)
+          {
+            LOG (WARNING)
+                << "Too many pending messages from " << account
+                << " in total, dropping:\n" << msg.DebugString ();
+            return;
+          }
+        ++cnt;
+      }
+
+      /* Processing may involve blocking RPC calls, so it is done on the
+         worker threads rather than the XMPP thread.  */
+      const std::string key = account + "\n" + msg.identifier ();
+      const bool queued = processors.Push (key, [this, account, msg] ()
+        {
+          proto::ProcessingMessage reply;
+          if (trades.ProcessMessage (msg, reply))
+            SendProcessingMessage (std::move (reply));
+          ProcessingDone (account);
+        });
+      if (!queued)
+        {
+          LOG (WARNING)
+              << "Could not queue message from " << account
+              << " (too many pending or shutting down), dropping:\n"
+              << msg.DebugString ();
+          ProcessingDone (account);
+        }
     }
 }
 
+void
+Daemon::Impl::HandleJoin (const gloox::JID& joined)
+{
+  /* The new participant does not know our orders yet, so it can't apply
+     deltas to them.  Make sure the next update is a full snapshot.  */
+  myOrders.RequestSnapshot ();
+}
+
 void
 Daemon::Impl::HandleDisconnect (const gloox::JID& disconnected)
 {
@@ -321,10 +713,15 @@ Daemon::Impl::HandleDisconnect (const gloox::JID& disconnected)
       return;
     }
 
-  proto::OrdersOfAccount o;
-  o.set_account (account);
-  /* We leave the orders empty.  */
-  allOrders.UpdateOrders (std::move (o));
+  /* This goes through the inbound queue as well, so that it is ordered
+     correctly with respect to pending updates from the account.  */
+  inbound.Replace (account, [this, account] ()
+    {
+      proto::OrdersOfAccount o;
+      o.set_account (account);
+      /* We leave the orders empty.  */
+      allOrders.UpdateOrders (std::move (o));
+    });
 }
 
 /* ************************************************************************** */
@@ -379,6 +776,31 @@ Daemon::GetOrdersByAsset () const
   return impl->allOrders.GetByAsset ();
 }
 
+proto::DepthForAsset
+Daemon::GetDepth (const Asset& asset, const unsigned levels) const
+{
+  return impl->allOrders.GetDepth (asset, levels);
+}
+
+proto::OrderbookUsage
+Daemon::GetOrderbookUsage () const
+{
+  return impl->allOrders.GetUsage ();
+}
+
+CachingAssetSpec::Stats
+Daemon::GetAssetCacheStats () const
+{
+  return impl->spec.GetStats ();
+}
+
+proto::BookChange
+Daemon::WaitForBookChange (const uint64_t known, const std::set<Asset>& assets,
+                           const std::chrono::milliseconds timeout) const
+{
+  return impl->allOrders.WaitForChange (known, assets, timeout);
+}
+
 bool
 Daemon::AddOrder (proto::Order&& o)
 {
@@ -403,6 +825,12 @@ Daemon::GetTrades () const
   return impl->trades.GetTrades ();
 }
 
+proto::TradeQueryResult
+Daemon::QueryTrades (const proto::TradeQuery& q) const
+{
+  return impl->trades.QueryTrades (q);
+}
+
 bool
 Daemon::TakeOrder (const proto::Order& o, const Amount units)
 {
@@ -414,6 +842,52 @@ Daemon::TakeOrder (const proto::Order& o, const Amount units)
   return true;
 }
 
+proto::TakeBestResult
+Daemon::TakeBest (const Asset& asset, const proto::Order::Type type,
+                  const Amount units, const uint64_t limitPrice)
+{
+  const auto selected
+      = impl->allOrders.SelectBest (asset, type, units, limitPrice);
+
+  /* The individual orders are taken in parallel, since that may involve
+     RPC calls to the wallet.  The resulting messages are sent afterwards
+     from this thread.  */
+  std::vector<proto::ProcessingMessage> msgs(selected.size ());
+  std::vector<char> ok(selected.size (), false);
+  std::vector<std::function<void ()>> jobs;
+  for (size_t i = 0; i < selected.size (); ++i)
+    jobs.push_back ([this, &selected, &msgs, &ok, i] ()
+      {
+        ok[i] = impl->trades.TakeOrder (selected[i].first, selected[i].second,
+                                        msgs[i]);
+      });
+  impl->takers.RunAll (std::move (jobs));
+
+  proto::TakeBestResult res;
+  res.set_units (0);
+  res.set_total_sat (0);
+  for (size_t i = 0; i < selected.size (); ++i)
+    {
+      if (!ok[i])
+        continue;
+
+      impl->SendProcessingMessage (std::move (msgs[i]));
+
+      const auto& o = selected[i].first;
+      const Amount cur = selected[i].second;
+      auto& started = *res.add_started ();
+      *started.mutable_order () = o;
+      started.set_units (cur);
+      res.set_units (res.units () + cur);
+      res.set_total_sat (res.total_sat () + cur * o.price_sat ());
+    }
+
+  LOG (INFO)
+      << "Started " << res.started_size () << " trades for " << res.units ()
+      << " units of " << asset;
+  return res;
+}
+
 std::string
 Daemon::GetAccount () const
 {
@@ -20,10 +20,13 @@
 #define DEMOCRIT_DAEMON_HPP
 
 #include "assetspec.hpp"
+#include "cachingassetspec.hpp"
 #include "proto/orders.pb.h"
 #include "proto/trades.pb.h"
 
+#include <chrono>
 #include <memory>
+#include <set>
 #include <string>
 
 namespace democrit
@@ -97,6 +100,32 @@ public:
    */
   proto::OrderbookByAsset GetOrdersByAsset () const;
 
+  /**
+   * Returns the aggregated price levels of the known orderbook for
+   * a given asset, limited to the given number of best levels on
+   * each side (or all levels if zero).
+   */
+  proto::DepthForAsset GetDepth (const Asset& asset, unsigned levels) const;
+
+  /**
+   * Returns statistics about the memory used by the known orderbook.
+   */
+  proto::OrderbookUsage GetOrderbookUsage () const;
+
+  /**
+   * Returns statistics about the cache of AssetSpec results.
+   */
+  CachingAssetSpec::Stats GetAssetCacheStats () const;
+
+  /**
+   * Waits until the known orderbook changes compared to the given known
+   * version, or until the timeout expires.  If the set of assets is not
+   * empty, only changes to those assets are considered.
+   */
+  proto::BookChange WaitForBookChange (uint64_t known,
+                                       const std::set<Asset>& assets,
+                                       std::chrono::milliseconds timeout) const;
+
   /**
    * Adds a new order to the list of own orders.  Returns false if the
    * given order seems invalid for our account.
@@ -118,6 +147,11 @@ public:
    */
   std::vector<proto::Trade> GetTrades () const;
 
+  /**
+   * Returns one page of known trades that match the given filters.
+   */
+  proto::TradeQueryResult QueryTrades (const proto::TradeQuery& q) const;
+
   /**
    * Requests to take another's order for the given number of units.
    * Returns true on success (if the process could at least be started)
@@ -125,6 +159,18 @@ public:
    */
   bool TakeOrder (const proto::Order& o, Amount units);
 
+  /**
+   * Takes the best available orders of the given type (i.e. asks if we want
+   * to buy and bids if we want to sell) for the given asset, up to the given
+   * number of units and respecting the limit price.  Since a seller can
+   * only be in one trade at a time, at most one order per seller is
+   * selected (i.e. only a single one if we are selling).  The selected
+   * orders are taken in parallel, and the result contains those for which
+   * a trade has been started successfully.  Those trades may still fail.
+   */
+  proto::TakeBestResult TakeBest (const Asset& asset, proto::Order::Type type,
+                                  Amount units, uint64_t limitPrice);
+
   /**
    * Returns the account name this is running for.
    */
@@ -375,6 +375,109 @@ TEST_F (DaemonTests, OrderValidation)
   )"));
 }
 
+TEST_F (DaemonTests, TakeBestAsks)
+{
+  TestDaemon d1(assets, env, 0), d2(assets, env, 1), d3(assets, env, 2);
+
+  assets.SetBalance ("xmpptest1", "gold", 100);
+  assets.SetBalance ("xmpptest3", "gold", 100);
+  assets.InitialiseAccount ("xmpptest2");
+
+  d1.AddFromText (R"(
+    asset: "gold"
+    type: ASK
+    price_sat: 1
+    max_units: 10
+  )");
+  d1.AddFromText (R"(
+    asset: "gold"
+    type: ASK
+    price_sat: 2
+    max_units: 10
+  )");
+  d3.AddFromText (R"(
+    asset: "gold"
+    type: ASK
+    price_sat: 2
+    max_units: 10
+  )");
+  d3.AddFromText (R"(
+    asset: "gold"
+    type: ASK
+    price_sat: 3
+    max_units: 10
+  )");
+
+  /* Only one order per seller can be taken, since each trade needs
+     the seller's name output.  */
+  SleepSome ();
+  const auto res = d2.TakeBest ("gold", proto::Order::ASK, 15, 2);
+  ASSERT_EQ (res.started_size (), 2);
+  EXPECT_EQ (res.started (0).order ().account (), "xmpptest1");
+  EXPECT_EQ (res.started (0).order ().id (), 0);
+  EXPECT_EQ (res.started (0).units (), 10);
+  EXPECT_EQ (res.started (1).order ().account (), "xmpptest3");
+  EXPECT_EQ (res.started (1).order ().id (), 0);
+  EXPECT_EQ (res.started (1).units (), 5);
+  EXPECT_EQ (res.units (), 15);
+  EXPECT_EQ (res.total_sat (), 20);
+
+  SleepSome ();
+  for (auto* d : {&d1, &d3})
+    d->GetStateForTesting ().ReadState ([] (const proto::State& s)
+      {
+        EXPECT_EQ (s.trades_size (), 1);
+      });
+}
+
+TEST_F (DaemonTests, TakeBestBids)
+{
+  TestDaemon d1(assets, env, 0), d2(assets, env, 1), d3(assets, env, 2);
+
+  assets.SetBalance ("xmpptest1", "gold", 100);
+  assets.InitialiseAccount ("xmpptest2");
+  assets.InitialiseAccount ("xmpptest3");
+
+  d2.AddFromText (R"(
+    asset: "gold"
+    type: BID
+    price_sat: 3
+    max_units: 5
+  )");
+  d3.AddFromText (R"(
+    asset: "gold"
+    type: BID
+    price_sat: 2
+    max_units: 5
+  )");
+  d2.AddFromText (R"(
+    asset: "gold"
+    type: BID
+    price_sat: 1
+    max_units: 5
+  )");
+
+  /* When selling, we can only take a single bid at a time.  */
+  SleepSome ();
+  const auto res = d1.TakeBest ("gold", proto::Order::BID, 15, 1);
+  ASSERT_EQ (res.started_size (), 1);
+  EXPECT_EQ (res.started (0).order ().account (), "xmpptest2");
+  EXPECT_EQ (res.started (0).order ().id (), 0);
+  EXPECT_EQ (res.started (0).units (), 5);
+  EXPECT_EQ (res.units (), 5);
+  EXPECT_EQ (res.total_sat (), 15);
+
+  SleepSome ();
+  d1.GetStateForTesting ().ReadState ([] (const proto::State& s)
+    {
+      EXPECT_EQ (s.trades_size (), 1);
+    });
+  d3.GetStateForTesting ().ReadState ([] (const proto::State& s)
+    {
+      EXPECT_EQ (s.trades_size (), 0);
+    });
+}
+
 TEST_F (DaemonTests, TradeMessages)
 {
   /* In this test, we ensure that the integration for exchanging trade
@@ -422,7 +525,8 @@ TEST_F (DaemonTests, TradeMessages)
 
   /* The start_time will be filled in with real time, which we cannot predict
      for the test.  Thus manually fake it.  */
-  d1.GetStateForTesting ().AccessState ([&order] (proto::State& s)
+  d1.GetStateForTesting ().AccessState ([&order] (proto::State& s,
+                                                  StateChanges&)
     {
       ASSERT_EQ (s.trades_size (), 1);
       auto& t = *s.mutable_trades (0);
@@ -441,7 +545,8 @@ TEST_F (DaemonTests, TradeMessages)
           }
       )"));
     });
-  d2.GetStateForTesting ().AccessState ([&order] (proto::State& s)
+  d2.GetStateForTesting ().AccessState ([&order] (proto::State& s,
+                                                  StateChanges&)
     {
       ASSERT_EQ (s.trades_size (), 1);
       auto& t = *s.mutable_trades (0);
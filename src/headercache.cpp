@@ -0,0 +1,249 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/headercache.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace democrit
+{
+
+BlockHeaderCache::BlockHeaderCache (RpcClient<XayaRpcClient>& r,
+                                    const unsigned n)
+  : rpc(r), maxBlocks(n), maxHeight(0)
+{
+  CHECK_GT (maxBlocks, 0);
+}
+
+BlockHeaderCache::Header
+BlockHeaderCache::HeaderFromJson (const xaya::uint256& hash,
+                                  const Json::Value& val)
+{
+  CHECK (val.isObject ()) << "Invalid getblockheader result: " << val;
+
+  const auto& hashVal = val["hash"];
+  CHECK (hashVal.isString () && hashVal.asString () == hash.ToHex ())
+      << "getblockheader returned wrong block for " << hash.ToHex ()
+      << ":\n" << val;
+
+  const auto& heightVal = val["height"];
+  CHECK (heightVal.isUInt ()) << "Invalid getblockheader result: " << val;
+
+  Header res;
+  res.height = heightVal.asUInt ();
+
+  const auto& prevVal = val["previousblockhash"];
+  if (prevVal.isNull ())
+    {
+      /* This is the case for the genesis block.  */
+      res.hasParent = false;
+      return res;
+    }
+
+  CHECK (prevVal.isString ());
+  CHECK (res.parent.FromHex (prevVal.asString ()))
+      << "getblockheader prev block hash is not valid uint256: " << val;
+  res.hasParent = true;
+
+  return res;
+}
+
+void
+BlockHeaderCache::AddHeader (const xaya::uint256& hash, const Header& h)
+{
+  headers.emplace (hash, h);
+  maxHeight = std::max (maxHeight, h.height);
+
+  if (headers.size () <= 2 * maxBlocks)
+    return;
+
+  VLOG (1) << "Pruning block header cache with " << headers.size ()
+           << " entries";
+  for (auto it = headers.begin (); it != headers.end (); )
+    if (it->second.height + maxBlocks <= maxHeight)
+      it = headers.erase (it);
+    else
+      ++it;
+}
+
+BlockHeaderCache::Header
+BlockHeaderCache::GetHeader (const xaya::uint256& hash)
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const auto mit = headers.find (hash);
+    if (mit != headers.end ())
+      return mit->second;
+  }
+
+  VLOG (2) << "Block header for " << hash.ToHex () << " is not cached";
+  const Header res = HeaderFromJson (hash, rpc->getblockheader (hash.ToHex ()));
+
+  std::lock_guard<std::mutex> lock(mut);
+  AddHeader (hash, res);
+
+  return res;
+}
+
+void
+BlockHeaderCache::FetchRange (const unsigned from, const unsigned to)
+{
+  CHECK_LE (from, to);
+
+  std::vector<BatchedCall> calls;
+  for (unsigned h = from; h <= to; ++h)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append (static_cast<Json::Int> (h));
+      calls.emplace_back ("getblockhash", params);
+    }
+
+  const auto hashVals = rpc.CallBatch (calls);
+
+  std::vector<xaya::uint256> hashes;
+  calls.clear ();
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    for (const auto& val : hashVals)
+      {
+        CHECK (val.isString ()) << "Invalid getblockhash result: " << val;
+        xaya::uint256 hash;
+        CHECK (hash.FromHex (val.asString ()))
+            << "getblockhash result is not valid uint256: " << val;
+
+        if (headers.count (hash) > 0)
+          continue;
+
+        Json::Value params(Json::arrayValue);
+        params.append (hash.ToHex ());
+        calls.emplace_back ("getblockheader", params);
+        hashes.push_back (hash);
+      }
+  }
+
+  if (calls.empty ())
+    return;
+
+  const auto headerVals = rpc.CallBatch (calls);
+  CHECK_EQ (headerVals.size (), hashes.size ());
+
+  std::lock_guard<std::mutex> lock(mut);
+  for (unsigned i = 0; i < hashes.size (); ++i)
+    AddHeader (hashes[i], HeaderFromJson (hashes[i], headerVals[i]));
+}
+
+void
+BlockHeaderCache::Warm (const xaya::uint256& tip)
+{
+  std::lock_guard<std::mutex> lockWarm(mutWarm);
+
+  const Header tipHeader = GetHeader (tip);
+  unsigned minHeight = 0;
+  if (tipHeader.height >= maxBlocks)
+    minHeight = tipHeader.height - maxBlocks + 1;
+
+  /* Find the most recent block in range on the tip's chain that is not
+     yet cached.  It and all blocks before it are then fetched in bulk.
+     Typically this will only be the case initially or when we missed
+     some blocks; with a single new block, its parent is cached already.  */
+  bool missing = false;
+  unsigned missingHeight = 0;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    Header cur = tipHeader;
+    while (cur.hasParent && cur.height > minHeight)
+      {
+        const auto mit = headers.find (cur.parent);
+        if (mit == headers.end ())
+          {
+            missing = true;
+            missingHeight = cur.height - 1;
+            break;
+          }
+        cur = mit->second;
+      }
+  }
+
+  if (missing)
+    {
+      VLOG (1)
+          << "Fetching block headers from height " << minHeight
+          << " to " << missingHeight;
+      FetchRange (minHeight, missingHeight);
+    }
+
+  /* Keep only the tip's chain (as far as we have it) in the cache, which
+     removes both old blocks and those that have been reorged away.  */
+  std::map<xaya::uint256, Header> chain;
+  std::lock_guard<std::mutex> lock(mut);
+  xaya::uint256 hash = tip;
+  Header cur = tipHeader;
+  while (true)
+    {
+      chain.emplace (hash, cur);
+      if (!cur.hasParent || cur.height <= minHeight)
+        break;
+
+      const auto mit = headers.find (cur.parent);
+      if (mit == headers.end ())
+        break;
+
+      hash = mit->first;
+      cur = mit->second;
+    }
+
+  VLOG (1)
+      << "Block header cache has " << chain.size ()
+      << " entries (previously " << headers.size () << ") for tip "
+      << tip.ToHex ();
+  headers.swap (chain);
+  maxHeight = tipHeader.height;
+}
+
+bool
+BlockHeaderCache::IsAncestor (const xaya::uint256& ancestor,
+                              const xaya::uint256& child, const int n)
+{
+  CHECK_GE (n, 0);
+
+  xaya::uint256 cur = child;
+  for (int i = 0; ; ++i)
+    {
+      if (cur == ancestor)
+        return true;
+      if (i == n)
+        return false;
+
+      const Header h = GetHeader (cur);
+      if (!h.hasParent)
+        return false;
+      cur = h.parent;
+    }
+}
+
+size_t
+BlockHeaderCache::GetSize () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return headers.size ();
+}
+
+} // namespace democrit
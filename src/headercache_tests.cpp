@@ -0,0 +1,141 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/headercache.hpp"
+
+#include "mockxaya.hpp"
+
+#include <jsonrpccpp/common/exception.h>
+
+#include <gtest/gtest.h>
+
+namespace democrit
+{
+namespace
+{
+
+class BlockHeaderCacheTests : public testing::Test
+{
+
+protected:
+
+  TestEnvironment<MockXayaRpcServer> env;
+  BlockHeaderCache cache;
+
+  BlockHeaderCacheTests ()
+    : cache(env.GetXayaRpc (), 10)
+  {}
+
+  /**
+   * Returns the mock server's block hash at the given height.
+   */
+  static xaya::uint256
+  Block (const unsigned h)
+  {
+    return MockXayaRpcServer::GetBlockHash (h);
+  }
+
+};
+
+TEST_F (BlockHeaderCacheTests, IsAncestor)
+{
+  EXPECT_TRUE (cache.IsAncestor (Block (10), Block (10), 0));
+  EXPECT_TRUE (cache.IsAncestor (Block (10), Block (10), 3));
+  EXPECT_TRUE (cache.IsAncestor (Block (7), Block (10), 3));
+  EXPECT_FALSE (cache.IsAncestor (Block (6), Block (10), 3));
+  EXPECT_FALSE (cache.IsAncestor (Block (11), Block (10), 3));
+  EXPECT_FALSE (cache.IsAncestor (Block (10), Block (1), 5));
+}
+
+TEST_F (BlockHeaderCacheTests, UnknownBlock)
+{
+  EXPECT_THROW (cache.IsAncestor (Block (1), Block (2'000), 3),
+                jsonrpc::JsonRpcException);
+}
+
+TEST_F (BlockHeaderCacheTests, LookupsAreCached)
+{
+  EXPECT_TRUE (cache.IsAncestor (Block (5), Block (10), 5));
+  EXPECT_EQ (cache.GetSize (), 5);
+
+  EXPECT_TRUE (cache.IsAncestor (Block (5), Block (10), 5));
+  EXPECT_TRUE (cache.IsAncestor (Block (7), Block (9), 5));
+  EXPECT_EQ (cache.GetSize (), 5);
+}
+
+TEST_F (BlockHeaderCacheTests, SizeBoundedWithoutWarming)
+{
+  EXPECT_TRUE (cache.IsAncestor (Block (0), Block (100), 100));
+  EXPECT_LE (cache.GetSize (), 20);
+}
+
+TEST_F (BlockHeaderCacheTests, WarmFillsInBulk)
+{
+  cache.Warm (Block (20));
+  EXPECT_EQ (cache.GetSize (), 10);
+
+  EXPECT_TRUE (cache.IsAncestor (Block (11), Block (20), 9));
+  EXPECT_TRUE (cache.IsAncestor (Block (10), Block (20), 10));
+  EXPECT_FALSE (cache.IsAncestor (Block (10), Block (20), 9));
+  EXPECT_EQ (cache.GetSize (), 10);
+}
+
+TEST_F (BlockHeaderCacheTests, WarmShortChain)
+{
+  cache.Warm (Block (3));
+  EXPECT_EQ (cache.GetSize (), 4);
+  EXPECT_FALSE (cache.IsAncestor (Block (5), Block (3), 10));
+  EXPECT_EQ (cache.GetSize (), 4);
+}
+
+TEST_F (BlockHeaderCacheTests, WarmPrunesOldBlocks)
+{
+  cache.Warm (Block (20));
+  cache.Warm (Block (21));
+  EXPECT_EQ (cache.GetSize (), 10);
+  EXPECT_TRUE (cache.IsAncestor (Block (12), Block (21), 9));
+  EXPECT_EQ (cache.GetSize (), 10);
+
+  cache.Warm (Block (50));
+  EXPECT_EQ (cache.GetSize (), 10);
+  EXPECT_TRUE (cache.IsAncestor (Block (41), Block (50), 9));
+  EXPECT_EQ (cache.GetSize (), 10);
+}
+
+TEST_F (BlockHeaderCacheTests, WarmPrunesOtherBranches)
+{
+  /* The mock server has just a single chain, but we can simulate blocks
+     from a branch that is not active by looking up blocks beyond the tip
+     and then warming the cache again.  Similarly, going back to a lower
+     tip corresponds to a reorg.  */
+
+  cache.Warm (Block (20));
+  EXPECT_TRUE (cache.IsAncestor (Block (27), Block (30), 3));
+  EXPECT_EQ (cache.GetSize (), 13);
+
+  cache.Warm (Block (20));
+  EXPECT_EQ (cache.GetSize (), 10);
+
+  cache.Warm (Block (15));
+  EXPECT_EQ (cache.GetSize (), 10);
+  EXPECT_FALSE (cache.IsAncestor (Block (16), Block (15), 9));
+  EXPECT_EQ (cache.GetSize (), 10);
+}
+
+} // anonymous namespace
+} // namespace democrit
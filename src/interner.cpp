@@ -0,0 +1,46 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/interner.hpp"
+
+#include <glog/logging.h>
+
+namespace democrit
+{
+
+StringInterner::Handle
+StringInterner::Intern (const std::string& str)
+{
+  auto res = strings.emplace (str, 0).first;
+  ++res->second;
+  return &res->first;
+}
+
+void
+StringInterner::Release (const Handle h)
+{
+  auto mit = strings.find (*h);
+  CHECK (mit != strings.end ()) << "String is not interned: " << *h;
+  CHECK_EQ (&mit->first, h) << "Handle does not match interned string";
+  CHECK_GT (mit->second, 0);
+
+  if (--mit->second == 0)
+    strings.erase (mit);
+}
+
+} // namespace democrit
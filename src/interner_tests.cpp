@@ -0,0 +1,76 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/interner.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace democrit
+{
+namespace
+{
+
+using StringInternerTests = testing::Test;
+
+TEST_F (StringInternerTests, SharedCopies)
+{
+  StringInterner pool;
+
+  const auto a = pool.Intern ("foo");
+  const auto b = pool.Intern (std::string ("fo") + "o");
+  const auto c = pool.Intern ("bar");
+
+  EXPECT_EQ (a, b);
+  EXPECT_NE (a, c);
+  EXPECT_EQ (*a, "foo");
+  EXPECT_EQ (*c, "bar");
+  EXPECT_EQ (pool.GetSize (), 2);
+}
+
+TEST_F (StringInternerTests, Release)
+{
+  StringInterner pool;
+
+  const auto a = pool.Intern ("foo");
+  pool.Intern ("foo");
+  pool.Intern ("bar");
+
+  pool.Release (a);
+  EXPECT_EQ (pool.GetSize (), 2);
+  EXPECT_EQ (*a, "foo");
+
+  pool.Release (a);
+  EXPECT_EQ (pool.GetSize (), 1);
+}
+
+TEST_F (StringInternerTests, StableHandles)
+{
+  StringInterner pool;
+
+  const auto a = pool.Intern ("foo");
+  for (unsigned i = 0; i < 1'000; ++i)
+    pool.Intern (std::to_string (i));
+
+  EXPECT_EQ (pool.Intern ("foo"), a);
+  EXPECT_EQ (*a, "foo");
+}
+
+} // anonymous namespace
+} // namespace democrit
@@ -229,6 +229,92 @@ template <>
   return res;
 }
 
+namespace
+{
+
+/**
+ * Converts one side of an asset's depth (bid or ask levels) to JSON.
+ */
+Json::Value
+DepthSideToJson (const RepeatedPtrField<proto::PriceLevel>& levels)
+{
+  Json::Value res(Json::arrayValue);
+  for (const auto& l : levels)
+    {
+      Json::Value cur(Json::objectValue);
+      cur["price_sat"] = IntToJson (l.price_sat ());
+      cur["units"] = IntToJson (l.units ());
+      cur["orders"] = IntToJson (l.orders ());
+      res.append (cur);
+    }
+
+  return res;
+}
+
+} // anonymous namespace
+
+template <>
+  Json::Value
+  ProtoToJson<proto::DepthForAsset> (const proto::DepthForAsset& pb)
+{
+  Json::Value res(Json::objectValue);
+  res["asset"] = pb.asset ();
+  res["bids"] = DepthSideToJson (pb.bids ());
+  res["asks"] = DepthSideToJson (pb.asks ());
+
+  return res;
+}
+
+template <>
+  Json::Value
+  ProtoToJson<proto::TakeBestResult> (const proto::TakeBestResult& pb)
+{
+  Json::Value started(Json::arrayValue);
+  for (const auto& t : pb.started ())
+    {
+      Json::Value cur(Json::objectValue);
+      cur["order"] = ProtoToJson (t.order ());
+      cur["units"] = IntToJson (t.units ());
+      started.append (cur);
+    }
+
+  Json::Value res(Json::objectValue);
+  res["started"] = started;
+  res["units"] = IntToJson (pb.units ());
+  res["total_sat"] = IntToJson (pb.total_sat ());
+
+  return res;
+}
+
+template <>
+  Json::Value
+  ProtoToJson<proto::BookChange> (const proto::BookChange& pb)
+{
+  Json::Value changed(Json::arrayValue);
+  for (const auto& a : pb.changed_assets ())
+    changed.append (a);
+
+  Json::Value res(Json::objectValue);
+  res["version"] = IntToJson (pb.version ());
+  res["changed"] = changed;
+  res["removed"] = pb.assets_removed ();
+
+  return res;
+}
+
+template <>
+  Json::Value
+  ProtoToJson<proto::OrderbookUsage> (const proto::OrderbookUsage& pb)
+{
+  Json::Value res(Json::objectValue);
+  res["accounts"] = IntToJson (pb.accounts ());
+  res["orders"] = IntToJson (pb.orders ());
+  res["bytes"] = IntToJson (pb.bytes ());
+  res["assets"] = IntToJson (pb.assets ());
+
+  return res;
+}
+
 template <>
   Json::Value
   ProtoToJson<proto::Trade> (const proto::Trade& pb)
@@ -277,4 +363,87 @@ template <>
   return res;
 }
 
+template <>
+  Json::Value
+  ProtoToJson<proto::TradeQueryResult> (const proto::TradeQueryResult& pb)
+{
+  Json::Value trades(Json::arrayValue);
+  for (const auto& t : pb.trades ())
+    trades.append (ProtoToJson (t));
+
+  Json::Value res(Json::objectValue);
+  res["trades"] = trades;
+  if (pb.has_cursor ())
+    res["cursor"] = IntToJson (pb.cursor ());
+
+  return res;
+}
+
+template <>
+  bool
+  ProtoFromJson<proto::TradeQuery> (const Json::Value& val,
+                                    proto::TradeQuery& pb)
+{
+  pb.Clear ();
+
+  if (!val.isObject ())
+    return false;
+
+  if (val.isMember ("since"))
+    {
+      if (!val["since"].isInt64 ())
+        return false;
+      pb.set_since (val["since"].asInt64 ());
+    }
+
+  if (val.isMember ("asset"))
+    {
+      if (!val["asset"].isString ())
+        return false;
+      pb.set_asset (val["asset"].asString ());
+    }
+
+  if (val.isMember ("counterparty"))
+    {
+      if (!val["counterparty"].isString ())
+        return false;
+      pb.set_counterparty (val["counterparty"].asString ());
+    }
+
+  if (val.isMember ("state"))
+    {
+      if (!val["state"].isString ())
+        return false;
+      const std::string state = val["state"].asString ();
+      if (state == "initiated")
+        pb.set_state (proto::Trade::INITIATED);
+      else if (state == "pending")
+        pb.set_state (proto::Trade::PENDING);
+      else if (state == "success")
+        pb.set_state (proto::Trade::SUCCESS);
+      else if (state == "failed")
+        pb.set_state (proto::Trade::FAILED);
+      else if (state == "abandoned")
+        pb.set_state (proto::Trade::ABANDONED);
+      else
+        return false;
+    }
+
+  if (val.isMember ("limit"))
+    {
+      if (!val["limit"].isUInt ())
+        return false;
+      pb.set_limit (val["limit"].asUInt ());
+    }
+
+  if (val.isMember ("cursor"))
+    {
+      if (!val["cursor"].isUInt64 ())
+        return false;
+      pb.set_cursor (val["cursor"].asUInt64 ());
+    }
+
+  return true;
+}
+
 } // namespace democrit
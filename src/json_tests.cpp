@@ -245,6 +245,100 @@ TEST_F (JsonTests, OrderbookForAssetToJson)
   })");
 }
 
+TEST_F (JsonTests, DepthForAssetToJson)
+{
+  ExpectProtoToJson<proto::DepthForAsset> (R"(
+    asset: "gold"
+    bids: { price_sat: 10 units: 5 orders: 2 }
+    bids: { price_sat: 5 units: 1 orders: 1 }
+  )", R"({
+    "asset": "gold",
+    "bids":
+      [
+        {"price_sat": 10, "units": 5, "orders": 2},
+        {"price_sat": 5, "units": 1, "orders": 1}
+      ],
+    "asks": []
+  })");
+}
+
+TEST_F (JsonTests, TakeBestResultToJson)
+{
+  ExpectProtoToJson<proto::TakeBestResult> (R"(
+    started:
+      {
+        order:
+          {
+            account: "domob"
+            id: 5
+            asset: "gold"
+            type: ASK
+            max_units: 10
+            price_sat: 20
+          }
+        units: 3
+      }
+    units: 3
+    total_sat: 60
+  )", R"({
+    "started":
+      [
+        {
+          "order":
+            {
+              "account": "domob",
+              "id": 5,
+              "asset": "gold",
+              "type": "ask",
+              "min_units": 1,
+              "max_units": 10,
+              "price_sat": 20
+            },
+          "units": 3
+        }
+      ],
+    "units": 3,
+    "total_sat": 60
+  })");
+}
+
+TEST_F (JsonTests, BookChangeToJson)
+{
+  ExpectProtoToJson<proto::BookChange> (R"(
+    version: 5
+  )", R"({
+    "version": 5,
+    "changed": [],
+    "removed": false
+  })");
+
+  ExpectProtoToJson<proto::BookChange> (R"(
+    version: 10
+    changed_assets: "gold"
+    changed_assets: "silver"
+    assets_removed: true
+  )", R"({
+    "version": 10,
+    "changed": ["gold", "silver"],
+    "removed": true
+  })");
+}
+
+TEST_F (JsonTests, OrderbookUsageToJson)
+{
+  ExpectProtoToJson<proto::OrderbookUsage> (R"(
+    accounts: 2
+    orders: 10
+    bytes: 4096
+    assets: 3
+  )", R"({
+    "accounts": 2,
+    "orders": 10,
+    "bytes": 4096,
+    "assets": 3
+  })");
+}
+
 TEST_F (JsonTests, OrderbookByAssetToJson)
 {
   ExpectProtoToJson<proto::OrderbookByAsset> (R"(
@@ -408,5 +502,86 @@ TEST_F (JsonTests, ValidOrderFromJson)
   )");
 }
 
+TEST_F (JsonTests, TradeQueryResultToJson)
+{
+  ExpectProtoToJson<proto::TradeQueryResult> (R"(
+    trades:
+      {
+        state: FAILED
+        start_time: 123
+        counterparty: "domob"
+        type: BID
+        asset: "gold"
+        units: 42
+        price_sat: 10
+        role: MAKER
+      }
+    cursor: 5
+  )", R"({
+    "trades":
+      [
+        {
+          "state": "failed",
+          "start_time": 123,
+          "counterparty": "domob",
+          "type": "bid",
+          "asset": "gold",
+          "units": 42,
+          "price_sat": 10,
+          "role": "maker"
+        }
+      ],
+    "cursor": 5
+  })");
+
+  ExpectProtoToJson<proto::TradeQueryResult> ("", R"({
+    "trades": []
+  })");
+}
+
+TEST_F (JsonTests, InvalidTradeQueryFromJson)
+{
+  const auto invalidQueries = ParseJson (R"([
+    42,
+    [1, 2, 3],
+    "query",
+    null,
+    {"since": "yesterday"},
+    {"asset": 10},
+    {"counterparty": null},
+    {"state": "invalid"},
+    {"state": 3},
+    {"limit": -1},
+    {"cursor": -1}
+  ])");
+
+  for (const auto& q : invalidQueries)
+    {
+      proto::TradeQuery dummy;
+      ASSERT_FALSE (ProtoFromJson (q, dummy));
+    }
+}
+
+TEST_F (JsonTests, ValidTradeQueryFromJson)
+{
+  ExpectProtoFromJson<proto::TradeQuery> ("{}", "");
+
+  ExpectProtoFromJson<proto::TradeQuery> (R"({
+    "since": 100,
+    "asset": "gold",
+    "counterparty": "domob",
+    "state": "abandoned",
+    "limit": 10,
+    "cursor": 42
+  })", R"(
+    since: 100
+    asset: "gold"
+    counterparty: "domob"
+    state: ABANDONED
+    limit: 10
+    cursor: 42
+  )");
+}
+
 } // anonymous namespace
 } // namespace democrit
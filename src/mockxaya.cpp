@@ -105,6 +105,7 @@ MockXayaRpcServer::SetJoinedPsbt (const std::vector<std::string>& psbtsIn,
       ExtendJson (res["inputs"], decodedPart["inputs"]);
       ExtendJson (res["outputs"], decodedPart["outputs"]);
     }
+  res["tx"]["btxid"] = combined + " btxid";
 
   SetPsbt (combined, res);
   EXPECT_CALL (*this, joinpsbts (psbtArr)).WillRepeatedly (Return (combined));
@@ -293,6 +294,21 @@ MockXayaRpcServer::gettxout (const std::string& txid, const int vout)
   return res;
 }
 
+std::string
+MockXayaRpcServer::getbestblockhash ()
+{
+  return bestBlock.ToHex ();
+}
+
+std::string
+MockXayaRpcServer::getblockhash (const int height)
+{
+  if (height < 0 || height >= 1'000)
+    throw jsonrpc::JsonRpcException (-8, "block height out of range");
+
+  return GetBlockHash (height).ToHex ();
+}
+
 Json::Value
 MockXayaRpcServer::getblockheader (const std::string& hashStr)
 {
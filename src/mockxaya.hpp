@@ -120,7 +120,8 @@ public:
    * Sets up the call expectations for joinpsbts, joining the given two PSBTs.
    * This actually assumes they are known (from SetPsbt), and combines the
    * joined PSBT value internally, setting it for the given combined PSBT
-   * identifier string.
+   * identifier string.  The btxid of the joined transaction is set to
+   * the combined identifier with " btxid" appended.
    */
   void
   SetJoinedPsbt (const std::vector<std::string>& psbtsIn,
@@ -184,6 +185,17 @@ public:
    */
   Json::Value gettxout (const std::string& txid, int vout) override;
 
+  /**
+   * Returns the currently set best block hash (as per SetBestBlock).
+   */
+  std::string getbestblockhash () override;
+
+  /**
+   * Returns the block hash at the given height from the static list
+   * of blocks (see GetBlockHash).  Throws for heights beyond that list.
+   */
+  std::string getblockhash (int height) override;
+
   /**
    * The server has a static list of block hashes corresponding to fixed heights
    * (as per GetBlockHash).  This method checks if the given hash is one
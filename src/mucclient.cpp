@@ -20,15 +20,28 @@
 
 #include <xayautil/cryptorand.hpp>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+
 namespace democrit
 {
 
+DEFINE_double (democrit_xmpp_send_rate, 10,
+               "Maximum average number of XMPP messages sent per second"
+               " (zero for no limit)");
+DEFINE_int32 (democrit_xmpp_send_burst, 20,
+              "Maximum number of XMPP messages sent in a burst");
+
 MucClient::MucClient (const gloox::JID& j, const std::string& password,
                       const gloox::JID& rm)
   : XmppClient(j, password), roomName(rm)
 {
+  sendQueue = std::make_unique<SendQueue> (
+      std::max (FLAGS_democrit_xmpp_send_rate, 0.0),
+      std::max (FLAGS_democrit_xmpp_send_burst, 1));
+
   gloox::MessageHandler* handler = this;
   RunWithClient ([&] (gloox::Client& c)
     {
@@ -38,6 +51,10 @@ MucClient::MucClient (const gloox::JID& j, const std::string& password,
 
 MucClient::~MucClient ()
 {
+  /* Stop the sender thread first, so that it does not access the client
+     while we are disconnecting and destroying it.  */
+  sendQueue.reset ();
+
   Disconnect ();
   CHECK (room == nullptr);
 }
@@ -57,6 +74,10 @@ MucClient::Connect ()
     disconnecter.join ();
   disconnecting = false;
 
+  /* Anything queued around a previous disconnect belongs to the old
+     session and is dropped.  */
+  sendQueue->Clear ();
+
   if (!XmppClient::Connect (-1))
     return false;
 
@@ -100,6 +121,11 @@ MucClient::DisconnectAsync ()
   if (disconnecter.joinable ())
     disconnecter.join ();
 
+  /* Messages queued for the old session must not be sent once we are
+     connected again, so drop them right away.  */
+  if (sendQueue != nullptr)
+    sendQueue->Clear ();
+
   std::lock_guard<std::mutex> lock(mut);
   nickToJid.clear ();
 
@@ -161,30 +187,58 @@ MucClient::RegisterExtension (std::unique_ptr<gloox::StanzaExtension> ext)
 }
 
 void
-MucClient::SendMessage (gloox::Message&& msg, ExtensionData&& ext)
+MucClient::QueueMessage (std::shared_ptr<gloox::Message> msg,
+                         ExtensionData&& ext, const SendQueue::Priority prio,
+                         const std::string& group, const bool supersedes)
 {
-  CHECK (IsConnected ());
+  /* Callers like the processing of private messages run on worker threads
+     and may race with a disconnect (or shutdown).  Such messages would be
+     dropped by the sender anyway, so just do it here already.  */
+  if (!IsConnected ())
+    {
+      LOG (WARNING) << "Dropping message as we are not connected";
+      return;
+    }
 
   for (auto& entry : ext)
-    msg.addExtension (entry.release ());
+    msg->addExtension (entry.release ());
 
-  RunWithClient ([&msg] (gloox::Client& c)
+  sendQueue->Push (prio, [this, msg] ()
     {
-      c.send (msg);
-    });
+      /* We may have been disconnected while the message was queued.  */
+      if (!IsConnected ())
+        {
+          VLOG (1) << "Dropping queued message as we are not connected";
+          return;
+        }
+
+      RunWithClient ([&msg] (gloox::Client& c)
+        {
+          c.send (*msg);
+        });
+    }, group, supersedes);
 }
 
 void
 MucClient::PublishMessage (ExtensionData&& ext)
 {
-  SendMessage (gloox::Message (gloox::Message::Groupchat, roomName),
-               std::move (ext));
+  PublishMessage (std::move (ext), "", false);
+}
+
+void
+MucClient::PublishMessage (ExtensionData&& ext, const std::string& group,
+                           const bool supersedes)
+{
+  QueueMessage (
+      std::make_shared<gloox::Message> (gloox::Message::Groupchat, roomName),
+      std::move (ext), SendQueue::Priority::NORMAL, group, supersedes);
 }
 
 void
 MucClient::SendMessage (const gloox::JID& to, ExtensionData&& ext)
 {
-  SendMessage (gloox::Message (gloox::Message::Normal, to), std::move (ext));
+  QueueMessage (std::make_shared<gloox::Message> (gloox::Message::Normal, to),
+                std::move (ext), SendQueue::Priority::HIGH, "", false);
 }
 
 bool
@@ -276,7 +330,12 @@ MucClient::handleMUCParticipantPresence (
   LOG (INFO)
       << "Full jid for " << nick << " in room " << room->name ()
       << ": " << participant.jid->full ();
+  const bool joined = (nickToJid.count (nick) == 0
+                        && !(participant.flags & gloox::UserNickChanged));
   nickToJid[nick] = *participant.jid;
+
+  if (joined)
+    HandleJoin (*participant.jid);
 }
 
 void
@@ -18,14 +18,27 @@
 
 #include "private/myorders.hpp"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <google/protobuf/util/message_differencer.h>
+
+#include <algorithm>
 
 namespace democrit
 {
 
+DEFINE_int32 (democrit_validation_threads, 4,
+              "Number of threads used to validate own orders when refreshing");
+
+using google::protobuf::util::MessageDifferencer;
+
 void
 MyOrders::StartRefresher (const std::chrono::milliseconds intv)
 {
+  if (validators == nullptr)
+    validators = std::make_unique<WorkerPool> (
+        std::max (FLAGS_democrit_validation_threads, 1));
+
   refresher = std::make_unique<IntervalJob> (intv, [this] ()
     {
       RunRefresh ();
@@ -37,71 +50,173 @@ MyOrders::RunRefresh ()
 {
   VLOG (2) << "Refreshing set of own orders...";
 
-  state.AccessState ([this] (proto::State& s)
+  std::string account;
+  std::vector<std::pair<uint64_t, proto::Order>> toValidate;
+  state.ReadState ([&account, &toValidate] (const proto::State& s)
+    {
+      account = s.account ();
+      for (const auto& entry : s.own_orders ().orders ())
+        toValidate.emplace_back (entry.first, entry.second);
+    });
+
+  const auto valid = ValidateAll (account, toValidate);
+  CHECK_EQ (valid.size (), toValidate.size ());
+
+  std::lock_guard<std::mutex> lock(mutBroadcast);
+
+  state.AccessState ([&toValidate, &valid] (proto::State& s,
+                                            StateChanges& changes)
     {
-      proto::OrdersOfAccount updated;
-      for (auto& o : *s.mutable_own_orders ()->mutable_orders ())
+      auto& orders = *s.mutable_own_orders ()->mutable_orders ();
+      for (size_t i = 0; i < toValidate.size (); ++i)
         {
-          if (ValidateOrder (s.account (), o.second))
-            updated.mutable_orders ()->insert ({o.first, std::move (o.second)});
-          else
-            LOG (WARNING)
-                << "Dropping invalid own order:\n" << o.second.DebugString ();
+          if (valid[i])
+            continue;
+
+          const uint64_t id = toValidate[i].first;
+          const auto& o = toValidate[i].second;
+
+          auto mit = orders.find (id);
+          if (mit == orders.end ()
+                || !MessageDifferencer::Equals (mit->second, o))
+            {
+              VLOG (1) << "Own order " << id << " changed during validation";
+              continue;
+            }
+
+          LOG (WARNING) << "Dropping invalid own order:\n" << o.DebugString ();
+          orders.erase (mit);
+          changes.OwnOrderRemoved (id);
         }
-      s.mutable_own_orders ()->Swap (&updated);
     });
 
-  UpdateOrders (InternalGetOrders (false));
+  BroadcastSnapshot ();
+}
+
+std::vector<bool>
+MyOrders::ValidateAll (
+    const std::string& account,
+    const std::vector<std::pair<uint64_t, proto::Order>>& toValidate) const
+{
+  /* We use char here rather than bool, so that the batches can write
+     to their entries concurrently.  */
+  std::vector<char> valid(toValidate.size (), false);
+
+  const size_t numBatches
+      = std::min<size_t> (validators->GetNumThreads (), toValidate.size ());
+  std::vector<std::function<void ()>> batches;
+  for (size_t b = 0; b < numBatches; ++b)
+    batches.push_back ([this, b, numBatches, &account, &toValidate, &valid] ()
+      {
+        for (size_t i = b; i < toValidate.size (); i += numBatches)
+          valid[i] = ValidateOrder (account, toValidate[i].second);
+      });
+  validators->RunAll (std::move (batches));
+
+  return std::vector<bool> (valid.begin (), valid.end ());
+}
+
+void
+MyOrders::BroadcastSnapshot ()
+{
+  /* Clear the flag before building the snapshot, so that a concurrent
+     RequestSnapshot (e.g. for a peer that joins meanwhile) is not lost
+     and leads to another snapshot being sent next time.  */
+  needSnapshot.exchange (false);
+
+  auto orders = InternalGetOrders (false);
+  orders.set_seq (++seq);
+  if (!UpdateOrders (orders))
+    needSnapshot = true;
+}
+
+void
+MyOrders::BroadcastDeltas (proto::OrderDeltas&& deltas)
+{
+  if (!needSnapshot)
+    {
+      state.ReadState ([&deltas] (const proto::State& s)
+        {
+          deltas.set_account (s.account ());
+        });
+      deltas.set_seq (++seq);
+      if (UpdateOrderDeltas (deltas))
+        return;
+    }
+
+  BroadcastSnapshot ();
 }
 
 bool
 MyOrders::Add (proto::Order&& o)
 {
-  bool added = false;
-  state.AccessState ([this, &o, &added] (proto::State& s)
+  std::string account;
+  state.ReadState ([&account] (const proto::State& s)
     {
-      if (!ValidateOrder (s.account (), o))
-        {
-          LOG (WARNING) << "Added order is invalid:\n" << o.DebugString ();
-          return;
-        }
+      account = s.account ();
+    });
 
+  if (!ValidateOrder (account, o))
+    {
+      LOG (WARNING) << "Added order is invalid:\n" << o.DebugString ();
+      return false;
+    }
+
+  std::lock_guard<std::mutex> lock(mutBroadcast);
+
+  proto::OrderDeltas deltas;
+  state.AccessState ([&o, &deltas] (proto::State& s, StateChanges& changes)
+    {
       o.clear_account ();
       o.clear_id ();
 
       const auto id = s.next_free_id ();
       s.set_next_free_id (id + 1);
+      changes.NextFreeId (id + 1);
 
       VLOG (1)
           << "Adding new order with ID " << id << ":\n"
           << o.DebugString ();
-      (*s.mutable_own_orders ()->mutable_orders ())[id].Swap (&o);
-      added = true;
+      (*deltas.mutable_added ())[id] = o;
+      auto& stored = (*s.mutable_own_orders ()->mutable_orders ())[id];
+      stored.Swap (&o);
+      changes.OwnOrderSet (id, stored);
     });
 
-  if (added)
-    RunRefresh ();
-
-  return added;
+  BroadcastDeltas (std::move (deltas));
+  return true;
 }
 
 void
 MyOrders::RemoveById (const uint64_t id)
 {
-  state.AccessState ([this, id] (proto::State& s)
+  std::lock_guard<std::mutex> lock(mutBroadcast);
+
+  bool removed = false;
+  state.AccessState ([id, &removed] (proto::State& s, StateChanges& changes)
     {
       VLOG (1) << "Removing order with ID " << id;
-      s.mutable_own_orders ()->mutable_orders ()->erase (id);
+      removed = (s.mutable_own_orders ()->mutable_orders ()->erase (id) > 0);
+      if (removed)
+        changes.OwnOrderRemoved (id);
     });
 
-  RunRefresh ();
+  if (removed)
+    {
+      proto::OrderDeltas deltas;
+      deltas.add_removed (id);
+      BroadcastDeltas (std::move (deltas));
+    }
 }
 
 bool
 MyOrders::TryLock (const uint64_t id, proto::Order& out)
 {
+  std::lock_guard<std::mutex> lock(mutBroadcast);
+
   bool res = false;
-  state.AccessState ([this, id, &res, &out] (proto::State& s)
+  state.AccessState ([id, &res, &out] (proto::State& s,
+                                       StateChanges& changes)
     {
       auto mit = s.mutable_own_orders ()->mutable_orders ()->find (id);
       if (mit == s.mutable_own_orders ()->mutable_orders ()->end ())
@@ -121,28 +236,39 @@ MyOrders::TryLock (const uint64_t id, proto::Order& out)
       out.set_account (s.account ());
       out.set_id (id);
       mit->second.set_locked (true);
+      changes.OwnOrderSet (id, mit->second);
       res = true;
       return;
     });
 
   if (res)
-    RunRefresh ();
+    {
+      proto::OrderDeltas deltas;
+      deltas.add_locked (id);
+      BroadcastDeltas (std::move (deltas));
+    }
+
   return res;
 }
 
 void
 MyOrders::Unlock (const uint64_t id)
 {
-  state.AccessState ([this, id] (proto::State& s)
+  std::lock_guard<std::mutex> lock(mutBroadcast);
+
+  proto::OrderDeltas deltas;
+  state.AccessState ([id, &deltas] (proto::State& s, StateChanges& changes)
     {
       auto mit = s.mutable_own_orders ()->mutable_orders ()->find (id);
       CHECK (mit != s.mutable_own_orders ()->mutable_orders ()->end ())
           << "Order with ID " << id << " doesn't exist";
       CHECK (mit->second.locked ()) << "Order " << id << " isn't locked";
       mit->second.clear_locked ();
+      changes.OwnOrderSet (id, mit->second);
+      (*deltas.mutable_added ())[id] = mit->second;
     });
 
-  RunRefresh ();
+  BroadcastDeltas (std::move (deltas));
 }
 
 proto::OrdersOfAccount
@@ -19,6 +19,7 @@
 #include "private/myorders.hpp"
 
 #include "private/state.hpp"
+#include "private/statestore.hpp"
 #include "testutils.hpp"
 
 #include <gmock/gmock.h>
@@ -26,6 +27,7 @@
 #include <gtest/gtest.h>
 
 #include <chrono>
+#include <memory>
 
 namespace democrit
 {
@@ -55,12 +57,34 @@ private:
 
   using Clock = std::chrono::steady_clock;
 
-  /** Last ownOrders passed to UpdateOrders.  */
+  /**
+   * The orders as known from the last snapshot passed to UpdateOrders,
+   * with all deltas from UpdateOrderDeltas applied on top.  The
+   * sequence number is cleared from the message.
+   */
   proto::OrdersOfAccount lastOrders;
 
-  /** Last time when UpdateOrders was called.  */
+  /** The last sequence number we received.  */
+  uint64_t lastSeq = 0;
+
+  /** Last time when UpdateOrders or UpdateOrderDeltas was called.  */
   Clock::time_point lastUpdate;
 
+  /** Number of snapshots received.  */
+  unsigned numSnapshots = 0;
+
+  /** Number of deltas received.  */
+  unsigned numDeltas = 0;
+
+  /** If set to false, we simulate failures to broadcast updates.  */
+  bool canBroadcast = true;
+
+  /**
+   * If set to true, the next snapshot sent requests another one while
+   * it is being sent, as if a new peer joined concurrently.
+   */
+  bool requestDuringSnapshot = false;
+
   /**
    * Assets that are considered "invalid" for order-validation purposes.
    * We use that to verify the order validation going on.
@@ -80,11 +104,55 @@ protected:
     return invalidAssets.count (o.asset ()) == 0;
   }
 
-  void
+  bool
   UpdateOrders (const proto::OrdersOfAccount& ownOrders) override
   {
+    if (!canBroadcast)
+      return false;
+
+    EXPECT_TRUE (ownOrders.has_seq ());
+    EXPECT_GT (ownOrders.seq (), lastSeq);
+    lastSeq = ownOrders.seq ();
+
     lastOrders = ownOrders;
+    lastOrders.clear_seq ();
+    lastUpdate = Clock::now ();
+    ++numSnapshots;
+
+    if (requestDuringSnapshot)
+      {
+        requestDuringSnapshot = false;
+        RequestSnapshot ();
+      }
+
+    return true;
+  }
+
+  bool
+  UpdateOrderDeltas (const proto::OrderDeltas& deltas) override
+  {
+    /* The initial snapshot from the refresher thread may have been sent
+       before our instance was fully constructed.  In that case, we reject
+       deltas to get a snapshot instead.  */
+    if (!canBroadcast || numSnapshots == 0)
+      return false;
+
+    EXPECT_EQ (deltas.account (), lastOrders.account ());
+    EXPECT_EQ (deltas.seq (), lastSeq + 1);
+    lastSeq = deltas.seq ();
+
+    auto& orders = *lastOrders.mutable_orders ();
+    for (const auto id : deltas.removed ())
+      orders.erase (id);
+    for (const auto id : deltas.locked ())
+      orders.erase (id);
+    for (const auto& entry : deltas.added ())
+      orders[entry.first] = entry.second;
+
     lastUpdate = Clock::now ();
+    ++numDeltas;
+
+    return true;
   }
 
 public:
@@ -114,9 +182,33 @@ public:
     return lastOrders;
   }
 
+  unsigned
+  GetNumSnapshots () const
+  {
+    return numSnapshots;
+  }
+
+  unsigned
+  GetNumDeltas () const
+  {
+    return numDeltas;
+  }
+
+  void
+  SetCanBroadcast (const bool val)
+  {
+    canBroadcast = val;
+  }
+
+  void
+  RequestDuringNextSnapshot ()
+  {
+    requestDuringSnapshot = true;
+  }
+
   /**
    * Compares the actual orders (per GetOrders) with the ones pushed
-   * last via UpdateOrders and expects them to be equal.
+   * last via UpdateOrders (and deltas) and expects them to be equal.
    */
   void
   ExpectOrdersUpdated ()
@@ -136,6 +228,39 @@ public:
 
 };
 
+/**
+ * MyOrders instance whose validation accesses the state.  This verifies
+ * that validation is not done while holding the state lock.
+ */
+class StateReadingMyOrders : public MyOrders
+{
+
+private:
+
+  State& st;
+
+protected:
+
+  bool
+  ValidateOrder (const std::string& account,
+                 const proto::Order& o) const override
+  {
+    bool res;
+    st.ReadState ([&res] (const proto::State& s)
+      {
+        res = s.has_next_free_id ();
+      });
+    return res;
+  }
+
+public:
+
+  explicit StateReadingMyOrders (State& s, const std::chrono::milliseconds intv)
+    : MyOrders(s, intv), st(s)
+  {}
+
+};
+
 class MyOrdersTests : public testing::Test
 {
 
@@ -146,7 +271,7 @@ protected:
   MyOrdersTests ()
     : state("domob")
   {
-    state.AccessState ([] (proto::State& s)
+    state.AccessState ([] (proto::State& s, StateChanges&)
       {
         s.set_next_free_id (101);
       });
@@ -298,6 +423,27 @@ TEST_F (MyOrdersTests, Validation)
   )"));
 }
 
+TEST_F (MyOrdersTests, ValidationWithoutStateLock)
+{
+  StateReadingMyOrders mo(state, REFRESH_INTV);
+
+  ASSERT_TRUE (AddOrder (mo, R"(
+    asset: "gold"
+    type: BID
+    price_sat: 10
+  )"));
+  std::this_thread::sleep_for (3 * REFRESH_INTV);
+
+  EXPECT_THAT (mo.GetOrders (), EqualsOrdersOfAccount (R"(
+    account: "domob"
+    orders:
+      {
+        key: 101
+        value: { asset: "gold" type: BID price_sat: 10 }
+      }
+  )"));
+}
+
 TEST_F (MyOrdersTests, Locking)
 {
   TestMyOrders mo(state, NO_REFRESH);
@@ -376,6 +522,185 @@ TEST_F (MyOrdersTests, Locking)
   mo.ExpectOrdersUpdated ();
 }
 
+TEST_F (MyOrdersTests, DeltaBroadcasts)
+{
+  TestMyOrders mo(state, NO_REFRESH);
+
+  AddOrder (mo, R"(
+    asset: "gold"
+    type: BID
+    price_sat: 10
+  )");
+  mo.ExpectOrdersUpdated ();
+  const unsigned snapshots = mo.GetNumSnapshots ();
+  const unsigned deltas = mo.GetNumDeltas ();
+
+  AddOrder (mo, R"(
+    asset: "gold"
+    type: ASK
+    price_sat: 20
+  )");
+  proto::Order o;
+  ASSERT_TRUE (mo.TryLock (101, o));
+  mo.Unlock (101);
+  mo.RemoveById (102);
+  mo.RemoveById (42);
+
+  EXPECT_EQ (mo.GetNumSnapshots (), snapshots);
+  EXPECT_EQ (mo.GetNumDeltas (), deltas + 4);
+  mo.ExpectOrdersUpdated ();
+}
+
+TEST_F (MyOrdersTests, SnapshotAfterFailedBroadcast)
+{
+  TestMyOrders mo(state, NO_REFRESH);
+
+  mo.SetCanBroadcast (false);
+  AddOrder (mo, R"(
+    asset: "gold"
+    type: BID
+    price_sat: 10
+  )");
+  const unsigned snapshots = mo.GetNumSnapshots ();
+  const unsigned deltas = mo.GetNumDeltas ();
+
+  mo.SetCanBroadcast (true);
+  AddOrder (mo, R"(
+    asset: "gold"
+    type: ASK
+    price_sat: 20
+  )");
+  EXPECT_EQ (mo.GetNumSnapshots (), snapshots + 1);
+  EXPECT_EQ (mo.GetNumDeltas (), deltas);
+  mo.ExpectOrdersUpdated ();
+
+  mo.RemoveById (101);
+  EXPECT_EQ (mo.GetNumSnapshots (), snapshots + 1);
+  EXPECT_EQ (mo.GetNumDeltas (), deltas + 1);
+  mo.ExpectOrdersUpdated ();
+}
+
+TEST_F (MyOrdersTests, SnapshotRequestedDuringSnapshot)
+{
+  TestMyOrders mo(state, NO_REFRESH);
+
+  mo.RequestSnapshot ();
+  mo.RequestDuringNextSnapshot ();
+  AddOrder (mo, R"(
+    asset: "gold"
+    type: BID
+    price_sat: 10
+  )");
+  const unsigned snapshots = mo.GetNumSnapshots ();
+  const unsigned deltas = mo.GetNumDeltas ();
+
+  /* The request made while the previous snapshot was sent must not
+     be lost, so that this is another snapshot.  */
+  mo.RemoveById (101);
+  EXPECT_EQ (mo.GetNumSnapshots (), snapshots + 1);
+  EXPECT_EQ (mo.GetNumDeltas (), deltas);
+  mo.ExpectOrdersUpdated ();
+}
+
+/* ************************************************************************** */
+
+/**
+ * Tests that the changes MyOrders makes to a persisted state are recorded
+ * correctly, i.e. that reopening the state from disk yields the same data.
+ */
+class MyOrdersPersistenceTests : public testing::Test
+{
+
+protected:
+
+  /** Temporary directory used for the state store.  */
+  TempDir tmpDir;
+
+  /** Path of the temporary directory.  */
+  const std::string dir;
+
+  MyOrdersPersistenceTests ()
+    : tmpDir("democrit-myorders"), dir(tmpDir.GetPath ())
+  {}
+
+  /**
+   * Opens a persisted State instance in our temporary directory.
+   */
+  std::unique_ptr<State>
+  Open () const
+  {
+    return std::make_unique<State> ("domob",
+                                    std::make_unique<StateStore> (dir));
+  }
+
+  /**
+   * Returns a copy of the full data inside a State instance.
+   */
+  static proto::State
+  GetData (const State& s)
+  {
+    proto::State res;
+    s.ReadState ([&res] (const proto::State& data)
+      {
+        res = data;
+      });
+    return res;
+  }
+
+};
+
+TEST_F (MyOrdersPersistenceTests, ChangesAreRestored)
+{
+  proto::State expected;
+  {
+    auto state = Open ();
+    state->AccessState ([] (proto::State& s, StateChanges& changes)
+      {
+        s.set_next_free_id (101);
+        changes.NextFreeId (101);
+      });
+
+    TestMyOrders mo(*state, REFRESH_INTV);
+    for (const std::string asset : {"gold", "silver", "bronze", "invalid"})
+      ASSERT_TRUE (mo.Add (ParseTextProto<proto::Order> (R"(
+        asset: ")" + asset + R"("
+        type: ASK
+        price_sat: 10
+      )")));
+
+    /* Removed by the refresher's validation.  */
+    mo.AddInvalidAsset ("invalid");
+    std::this_thread::sleep_for (3 * REFRESH_INTV);
+
+    mo.RemoveById (102);
+
+    proto::Order o;
+    ASSERT_TRUE (mo.TryLock (101, o));
+    mo.Unlock (101);
+    ASSERT_TRUE (mo.TryLock (103, o));
+
+    EXPECT_THAT (mo.GetOrders (), EqualsOrdersOfAccount (R"(
+      account: "domob"
+      orders:
+        {
+          key: 101
+          value: { asset: "gold" type: ASK price_sat: 10 }
+        }
+      orders:
+        {
+          key: 103
+          value: { asset: "bronze" type: ASK price_sat: 10 locked: true }
+        }
+    )"));
+
+    expected = GetData (*state);
+    EXPECT_EQ (expected.next_free_id (), 105);
+  }
+
+  auto state = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*state), expected));
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
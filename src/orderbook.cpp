@@ -20,11 +20,26 @@
 
 #include <glog/logging.h>
 
+#include <google/protobuf/repeated_field.h>
+
 #include <algorithm>
 
 namespace democrit
 {
 
+using google::protobuf::RepeatedPtrField;
+
+namespace
+{
+
+/**
+ * Estimated overhead (in bytes) of a node in a std::map or std::list,
+ * in addition to the stored value.
+ */
+constexpr size_t NODE_OVERHEAD = 4 * sizeof (void*);
+
+} // anonymous namespace
+
 void
 OrderBook::StartTimeouter ()
 {
@@ -40,25 +55,517 @@ OrderBook::RunTimeout ()
   VLOG (2) << "Running timeout tick...";
 
   std::lock_guard<std::mutex> lock(mut);
-  const auto timeoutBefore = Clock::now () - timeout;
+  const auto now = Clock::now ();
+  const auto timeoutBefore = now - timeout;
+  const uint64_t currentTick = GetTick (now);
+
+  /* If we have not been run for a full revolution of the wheel, all slots
+     need to be looked at once, but not more.  */
+  uint64_t tick = nextTick;
+  if (currentTick >= tick + wheel.size ())
+    tick = currentTick + 1 - wheel.size ();
 
-  while (!updates.empty () && updates.front ().time < timeoutBefore)
+  for (; tick <= currentTick; ++tick)
     {
-      const std::string account = std::move (updates.front ().account);
-      updates.pop ();
+      auto& slot = wheel[tick % wheel.size ()];
+      auto it = slot.begin ();
+      while (it != slot.end ())
+        {
+          auto mit = orders.find (**it);
+          CHECK (mit != orders.end ());
+          ++it;
 
-      auto mit = orders.find (account);
-      if (mit == orders.end ())
-        continue;
+          if (mit->second.lastUpdate < timeoutBefore)
+            {
+              VLOG (1) << "Timing out orders of " << mit->first;
+              EraseAccount (mit);
+            }
+          else
+            ArmTimeout (mit->first, mit->second, true);
+        }
+    }
+
+  /* Accounts in the current tick's slot may not be expired yet, so we have
+     to look at it again the next time.  */
+  nextTick = currentTick;
 
-      if (mit->second.lastUpdate < timeoutBefore)
+  PublishSnapshot ();
+}
+
+uint64_t
+OrderBook::GetTick (const Clock::time_point t) const
+{
+  CHECK (t >= wheelStart);
+  return (t - wheelStart) / timeoutIntv;
+}
+
+void
+OrderBook::ArmTimeout (const std::string& account, AccountOrders& ao,
+                       const bool existing)
+{
+  const size_t slot = GetTick (ao.lastUpdate + timeout) % wheel.size ();
+  auto& target = wheel[slot];
+
+  if (!existing)
+    ao.wheelPos = target.insert (target.end (), &account);
+  else if (slot != ao.slot)
+    target.splice (target.end (), wheel[ao.slot], ao.wheelPos);
+
+  ao.slot = slot;
+}
+
+OrderBook::PackedOrder
+OrderBook::Pack (const uint64_t id, const proto::Order& order)
+{
+  PackedOrder res;
+  res.id = id;
+  res.price = order.price_sat ();
+  res.minUnits = order.min_units ();
+  res.maxUnits = order.max_units ();
+  res.asset = assets.Intern (order.asset ());
+  res.type = order.type ();
+  res.flags = GetFlags (order);
+
+  return res;
+}
+
+uint8_t
+OrderBook::GetFlags (const proto::Order& order)
+{
+  uint8_t res = 0;
+  if (order.has_min_units ())
+    res |= PackedOrder::HAS_MIN_UNITS;
+  if (order.has_max_units ())
+    res |= PackedOrder::HAS_MAX_UNITS;
+  if (order.has_locked ())
+    res |= PackedOrder::HAS_LOCKED;
+  if (order.locked ())
+    res |= PackedOrder::LOCKED;
+
+  return res;
+}
+
+bool
+OrderBook::Matches (const PackedOrder& packed, const proto::Order& order)
+{
+  /* The stored order may have default values (e.g. a price of zero), which
+     an order missing the required fields would "match".  Such an order
+     must not be treated as unchanged, so that it is still validated.  */
+  if (!order.has_asset () || !order.has_type () || !order.has_price_sat ())
+    return false;
+
+  return *packed.asset == order.asset ()
+            && packed.type == order.type ()
+            && packed.price == order.price_sat ()
+            && packed.minUnits == order.min_units ()
+            && packed.maxUnits == order.max_units ()
+            && packed.flags == GetFlags (order);
+}
+
+bool
+OrderBook::SameOrder (const PackedOrder& a, const PackedOrder& b)
+{
+  return a.id == b.id
+            && a.asset == b.asset
+            && a.type == b.type
+            && a.price == b.price
+            && a.minUnits == b.minUnits
+            && a.maxUnits == b.maxUnits
+            && a.flags == b.flags;
+}
+
+void
+OrderBook::Unpack (const AssetSnapshot& snap, const SnapshotOrder& order,
+                   proto::Order& out)
+{
+  out.set_account (snap.accounts[order.account]);
+  out.set_id (order.id);
+  if (order.flags & PackedOrder::HAS_MIN_UNITS)
+    out.set_min_units (order.minUnits);
+  if (order.flags & PackedOrder::HAS_MAX_UNITS)
+    out.set_max_units (order.maxUnits);
+  out.set_price_sat (order.price);
+  if (order.flags & PackedOrder::HAS_LOCKED)
+    out.set_locked (order.flags & PackedOrder::LOCKED);
+}
+
+void
+OrderBook::ReleaseOrders (const std::vector<PackedOrder>& o)
+{
+  for (const auto& order : o)
+    assets.Release (order.asset);
+}
+
+void
+OrderBook::IndexOrder (const std::string& account, const PackedOrder& order)
+{
+  auto& book = byAsset[*order.asset];
+  dirtyAssets.insert (*order.asset);
+
+  const size_t cnt = book.bids.size () + book.asks.size ();
+  if (cnt > 0)
+    {
+      CHECK_EQ (assetsBySize.erase (std::make_pair (cnt, *order.asset)), 1);
+    }
+  assetsBySize.emplace (cnt + 1, *order.asset);
+
+  std::map<OrderKey, PackedOrder>* side = nullptr;
+  std::map<uint64_t, Level>* levels = nullptr;
+  switch (order.type)
+    {
+    case proto::Order::ASK:
+      side = &book.asks;
+      levels = &book.askLevels;
+      break;
+    case proto::Order::BID:
+      side = &book.bids;
+      levels = &book.bidLevels;
+      break;
+    default:
+      LOG (FATAL)
+          << "Unexpected order type: " << static_cast<int> (order.type);
+    }
+
+  const OrderKey key(order.price, account, order.id);
+  CHECK (side->emplace (key, order).second)
+      << "Order " << order.id << " of " << account << " is already indexed";
+
+  Level& lvl = (*levels)[order.price];
+  lvl.units += order.maxUnits;
+  ++lvl.orders;
+}
+
+void
+OrderBook::UnindexOrder (const std::string& account, const PackedOrder& order)
+{
+  auto mit = byAsset.find (*order.asset);
+  CHECK (mit != byAsset.end ())
+      << "Indexed asset not found: " << *order.asset;
+  auto& book = mit->second;
+  dirtyAssets.insert (*order.asset);
+
+  const size_t cnt = book.bids.size () + book.asks.size ();
+  CHECK_EQ (assetsBySize.erase (std::make_pair (cnt, *order.asset)), 1);
+  if (cnt > 1)
+    assetsBySize.emplace (cnt - 1, *order.asset);
+
+  const OrderKey key(order.price, account, order.id);
+  std::map<uint64_t, Level>* levels = nullptr;
+  switch (order.type)
+    {
+    case proto::Order::ASK:
+      CHECK_EQ (book.asks.erase (key), 1);
+      levels = &book.askLevels;
+      break;
+    case proto::Order::BID:
+      CHECK_EQ (book.bids.erase (key), 1);
+      levels = &book.bidLevels;
+      break;
+    default:
+      LOG (FATAL)
+          << "Unexpected order type: " << static_cast<int> (order.type);
+    }
+
+  auto lit = levels->find (order.price);
+  CHECK (lit != levels->end ())
+      << "Price level not found: " << order.price;
+  CHECK_GE (lit->second.units, order.maxUnits);
+  lit->second.units -= order.maxUnits;
+  if (--lit->second.orders == 0)
+    levels->erase (lit);
+
+  if (book.asks.empty () && book.bids.empty ())
+    byAsset.erase (mit);
+}
+
+void
+OrderBook::IndexOrders (const std::string& account,
+                        const std::vector<PackedOrder>& o)
+{
+  for (const auto& order : o)
+    IndexOrder (account, order);
+}
+
+void
+OrderBook::UnindexOrders (const std::string& account,
+                          const std::vector<PackedOrder>& o)
+{
+  for (const auto& order : o)
+    UnindexOrder (account, order);
+}
+
+void
+OrderBook::ReindexOrders (const std::string& account,
+                          const std::vector<PackedOrder>& before,
+                          const std::vector<PackedOrder>& after)
+{
+  /* Both lists are sorted by ID, so we can merge them.  Orders that are
+     removed or changed must be unindexed before the new ones are indexed,
+     since they may have the same key.  */
+  auto a = before.begin ();
+  auto b = after.begin ();
+  while (a != before.end () || b != after.end ())
+    {
+      if (b == after.end () || (a != before.end () && a->id < b->id))
+        {
+          UnindexOrder (account, *a);
+          ++a;
+        }
+      else if (a == before.end () || b->id < a->id)
+        {
+          IndexOrder (account, *b);
+          ++b;
+        }
+      else
+        {
+          if (!SameOrder (*a, *b))
+            {
+              UnindexOrder (account, *a);
+              IndexOrder (account, *b);
+            }
+          ++a;
+          ++b;
+        }
+    }
+}
+
+void
+OrderBook::EraseAccount (
+    const std::map<std::string, AccountOrders>::iterator mit)
+{
+  UnindexOrders (mit->first, mit->second.orders);
+  ReleaseOrders (mit->second.orders);
+  wheel[mit->second.slot].erase (mit->second.wheelPos);
+
+  CHECK_GE (numOrders, mit->second.countedOrders);
+  CHECK_GE (numBytes, mit->second.countedBytes);
+  numOrders -= mit->second.countedOrders;
+  numBytes -= mit->second.countedBytes;
+
+  orders.erase (mit);
+}
+
+size_t
+OrderBook::EstimateBytes (const std::string& account, const AccountOrders& ao)
+{
+  /* The entry in the orders map and in the timing wheel.  */
+  size_t res = NODE_OVERHEAD + sizeof (std::string) + account.size ()
+                + sizeof (AccountOrders)
+                + NODE_OVERHEAD + sizeof (const std::string*);
+
+  /* Each order is stored packed in the account, packed again in the index,
+     and as compact record in the snapshot.  The snapshot also has a copy
+     of the account name, which we count once (although it is actually
+     stored for each asset the account has orders for).  */
+  const size_t perOrder = sizeof (PackedOrder)
+                            + NODE_OVERHEAD + sizeof (OrderKey)
+                            + sizeof (PackedOrder)
+                            + sizeof (SnapshotOrder);
+  res += ao.orders.size () * perOrder;
+  if (!ao.orders.empty ())
+    res += sizeof (std::string) + account.size ();
+
+  return res;
+}
+
+void
+OrderBook::UpdateUsage (const std::string& account, AccountOrders& ao)
+{
+  const size_t bytes = EstimateBytes (account, ao);
+
+  CHECK_GE (numOrders, ao.countedOrders);
+  CHECK_GE (numBytes, ao.countedBytes);
+  numOrders = numOrders - ao.countedOrders + ao.orders.size ();
+  numBytes = numBytes - ao.countedBytes + bytes;
+
+  ao.countedOrders = ao.orders.size ();
+  ao.countedBytes = bytes;
+}
+
+bool
+OrderBook::FitsAccountLimits (const std::vector<PackedOrder>& existing,
+                              const StringInterner::Handle asset) const
+{
+  if (limits.maxOrdersPerAccount > 0
+        && existing.size () >= limits.maxOrdersPerAccount)
+    return false;
+
+  if (limits.maxAssetsPerAccount == 0)
+    return true;
+
+  std::set<StringInterner::Handle> seenAssets;
+  for (const auto& o : existing)
+    {
+      if (o.asset == asset)
+        return true;
+      seenAssets.insert (o.asset);
+    }
+
+  return seenAssets.size () < limits.maxAssetsPerAccount;
+}
+
+size_t
+OrderBook::ApplyAccountLimits (std::vector<PackedOrder>& o)
+{
+  if (limits.maxOrdersPerAccount == 0 && limits.maxAssetsPerAccount == 0)
+    return 0;
+
+  std::vector<PackedOrder> kept;
+  std::set<StringInterner::Handle> seenAssets;
+  for (const auto& order : o)
+    {
+      bool fits = true;
+      if (limits.maxOrdersPerAccount > 0
+            && kept.size () >= limits.maxOrdersPerAccount)
+        fits = false;
+      else if (limits.maxAssetsPerAccount > 0
+                && seenAssets.count (order.asset) == 0
+                && seenAssets.size () >= limits.maxAssetsPerAccount)
+        fits = false;
+
+      if (fits)
+        {
+          seenAssets.insert (order.asset);
+          kept.push_back (order);
+        }
+      else
+        assets.Release (order.asset);
+    }
+
+  const size_t dropped = o.size () - kept.size ();
+  o = std::move (kept);
+
+  return dropped;
+}
+
+void
+OrderBook::EvictOldestAccount ()
+{
+  /* The timing wheel has accounts sorted by their expiry tick (and thus
+     last update) from nextTick on.  Within one slot, they are not sorted,
+     so we pick the oldest from the first non-empty slot.  */
+  for (size_t i = 0; i < wheel.size (); ++i)
+    {
+      const auto& slot = wheel[(nextTick + i) % wheel.size ()];
+
+      auto best = orders.end ();
+      for (const auto* account : slot)
+        {
+          auto mit = orders.find (*account);
+          CHECK (mit != orders.end ());
+          if (best == orders.end ()
+                || mit->second.lastUpdate < best->second.lastUpdate)
+            best = mit;
+        }
+
+      if (best != orders.end ())
+        {
+          VLOG (1) << "Evicting all orders of " << best->first;
+          EraseAccount (best);
+          return;
+        }
+    }
+
+  LOG (FATAL) << "No account found in the timing wheel";
+}
+
+bool
+OrderBook::EvictFurthestOrder ()
+{
+  if (assetsBySize.empty ())
+    return false;
+
+  /* Among the assets with the most orders, take the first one by name.  */
+  const size_t maxCount = assetsBySize.rbegin ()->first;
+  const auto sit
+      = assetsBySize.lower_bound (std::make_pair (maxCount, Asset ()));
+  CHECK (sit != assetsBySize.end ());
+  const auto best = byAsset.find (sit->second);
+  CHECK (best != byAsset.end ())
+      << "Asset with orders not indexed: " << sit->second;
+
+  /* Take the worst order from the side with more orders, i.e. the lowest
+     bid or the highest ask.  */
+  const auto& book = best->second;
+  const std::pair<const OrderKey, PackedOrder>* entry;
+  if (book.bids.size () >= book.asks.size ())
+    entry = &*book.bids.begin ();
+  else
+    entry = &*book.asks.rbegin ();
+  const uint64_t id = entry->first.id;
+
+  auto mit = orders.find (*entry->first.account);
+  CHECK (mit != orders.end ());
+  auto& ao = mit->second;
+
+  auto it = std::lower_bound (ao.orders.begin (), ao.orders.end (), id,
+                              [] (const PackedOrder& o, const uint64_t i)
+                                {
+                                  return o.id < i;
+                                });
+  CHECK (it != ao.orders.end () && it->id == id)
+      << "Indexed order " << id << " of " << mit->first << " not found";
+
+  VLOG (1) << "Evicting order " << id << " of " << mit->first;
+  UnindexOrder (mit->first, *it);
+  assets.Release (it->asset);
+  ao.orders.erase (it);
+  UpdateUsage (mit->first, ao);
+
+  return true;
+}
+
+void
+OrderBook::EnforceMemoryLimit ()
+{
+  if (limits.maxBytes == 0 || numBytes <= limits.maxBytes)
+    return;
+
+  LOG (WARNING)
+      << "Orderbook uses " << numBytes << " bytes, more than the limit of "
+      << limits.maxBytes << ", evicting orders";
+
+  while (numBytes > limits.maxBytes)
+    {
+      CHECK (!orders.empty ());
+      switch (limits.eviction)
         {
-          VLOG (1) << "Timing out orders of " << account;
-          orders.erase (mit);
+        case EvictionPolicy::OLDEST_UPDATE:
+          EvictOldestAccount ();
+          break;
+        case EvictionPolicy::FURTHEST_FROM_TOP:
+          /* If there are no orders left but only accounts (with sequence
+             numbers), we still have to remove those.  */
+          if (!EvictFurthestOrder ())
+            EvictOldestAccount ();
+          break;
         }
     }
 }
 
+void
+OrderBook::SetLimits (const Limits& l)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  limits = l;
+  EnforceMemoryLimit ();
+  PublishSnapshot ();
+}
+
+proto::OrderbookUsage
+OrderBook::GetUsage () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  proto::OrderbookUsage res;
+  res.set_accounts (orders.size ());
+  res.set_orders (numOrders);
+  res.set_bytes (numBytes);
+  res.set_assets (assets.GetSize ());
+
+  return res;
+}
+
 void
 OrderBook::UpdateOrders (proto::OrdersOfAccount&& upd)
 {
@@ -69,149 +576,527 @@ OrderBook::UpdateOrders (proto::OrdersOfAccount&& upd)
       CHECK (o.has_asset () && o.has_type () && o.has_price_sat ());
     }
 
-  const std::string account = std::move (*upd.mutable_account ());
-  upd.clear_account ();
-
   std::lock_guard<std::mutex> lock(mut);
   const auto time = Clock::now ();
 
-  if (upd.orders ().empty ())
+  const std::string& account = upd.account ();
+  auto mit = orders.find (account);
+  if (upd.orders ().empty () && !upd.has_seq ())
     {
       VLOG (1) << "Deleting all orders of " << account;
-      orders.erase (account);
+      if (mit != orders.end ())
+        {
+          EraseAccount (mit);
+          PublishSnapshot ();
+        }
       return;
     }
 
   VLOG (1) << "Updating orders of " << account;
-  updates.emplace (account, time);
-  orders[account] = AccountOrders (std::move (upd), time);
+
+  /* Pack the new orders before releasing the old ones, so that assets
+     which stay the same are not removed from and re-added to the pool.  */
+  std::vector<PackedOrder> packed;
+  packed.reserve (upd.orders ().size ());
+  for (const auto& entry : upd.orders ())
+    packed.push_back (Pack (entry.first, entry.second));
+  std::sort (packed.begin (), packed.end (),
+             [] (const PackedOrder& a, const PackedOrder& b)
+               {
+                 return a.id < b.id;
+               });
+
+  const size_t dropped = ApplyAccountLimits (packed);
+  if (dropped > 0)
+    LOG (WARNING)
+        << "Dropped " << dropped << " orders of " << account
+        << " exceeding the per-account limits";
+
+  /* Orders that an account just refreshes stay in the index as they are,
+     so that their assets are not marked as changed.  */
+  const bool existing = (mit != orders.end ());
+  if (existing)
+    {
+      ReindexOrders (mit->first, mit->second.orders, packed);
+      ReleaseOrders (mit->second.orders);
+    }
+  else
+    {
+      mit = orders.emplace (account, AccountOrders ()).first;
+      IndexOrders (mit->first, packed);
+    }
+
+  auto& ao = mit->second;
+  ao.orders = std::move (packed);
+  ao.hasSeq = upd.has_seq ();
+  ao.seq = upd.seq ();
+  ao.lastUpdate = time;
+  ArmTimeout (mit->first, ao, existing);
+  UpdateUsage (mit->first, ao);
+
+  EnforceMemoryLimit ();
+  PublishSnapshot ();
 }
 
-namespace
+bool
+OrderBook::ApplyDeltas (proto::OrderDeltas&& upd)
 {
+  CHECK (upd.has_account () && upd.has_seq ());
+  for (const auto& entry : upd.added ())
+    {
+      const auto& o = entry.second;
+      CHECK (o.has_asset () && o.has_type () && o.has_price_sat ());
+    }
 
-/**
- * Updates an OrderbookByAsset proto with the given order.  This adds in
- * the order as bid or ask into the matching asset entry.  The bids and
- * asks fields are not kept sorted for now.
- *
- * The order itself is moved into this function, and should already be a copy
- * made prior from the orders-by-account map, with account and id added in.
- */
-void
-AddOrderForAsset (proto::OrderbookByAsset& orders, proto::Order&& o)
-{
-  CHECK (o.has_asset ());
+  const std::string& account = upd.account ();
 
-  proto::OrderbookForAsset* forAsset = nullptr;
-  auto& assetMap = *orders.mutable_assets ();
-  auto mit = assetMap.find (o.asset ());
-  if (mit != assetMap.end ())
-    forAsset = &mit->second;
-  else
+  std::lock_guard<std::mutex> lock(mut);
+
+  auto mit = orders.find (account);
+  if (mit == orders.end ())
     {
-      forAsset = &assetMap[o.asset ()];
-      forAsset->set_asset (o.asset ());
+      VLOG (1) << "Ignoring order deltas for unknown account " << account;
+      return false;
     }
-  o.clear_asset ();
 
-  const auto type = o.type ();
-  o.clear_type ();
-  switch (type)
+  auto& ao = mit->second;
+  if (!ao.hasSeq || ao.seq + 1 != upd.seq ())
     {
-    case proto::Order::ASK:
-      forAsset->add_asks ()->Swap (&o);
-      break;
-    case proto::Order::BID:
-      forAsset->add_bids ()->Swap (&o);
-      break;
-    default:
-      LOG (FATAL) << "Unexpected order type: " << static_cast<int> (type);
+      VLOG (1)
+          << "Ignoring order deltas with sequence number " << upd.seq ()
+          << " for " << account << ", waiting for resync";
+      ao.hasSeq = false;
+      return false;
     }
+
+  VLOG (1) << "Applying order deltas for " << account;
+
+  /* The account's orders are kept sorted by ID.  */
+  const auto idLess = [] (const PackedOrder& o, const uint64_t id)
+    {
+      return o.id < id;
+    };
+
+  const auto removeOrder = [&] (const uint64_t id)
+    {
+      auto it = std::lower_bound (ao.orders.begin (), ao.orders.end (), id,
+                                  idLess);
+      if (it == ao.orders.end () || it->id != id)
+        return;
+      UnindexOrder (mit->first, *it);
+      assets.Release (it->asset);
+      ao.orders.erase (it);
+    };
+  for (const auto id : upd.removed ())
+    removeOrder (id);
+  for (const auto id : upd.locked ())
+    removeOrder (id);
+
+  size_t dropped = 0;
+  for (const auto& entry : upd.added ())
+    {
+      /* Re-adding an unchanged order is a no-op.  */
+      const PackedOrder order = Pack (entry.first, entry.second);
+      auto existing = std::lower_bound (ao.orders.begin (), ao.orders.end (),
+                                        entry.first, idLess);
+      if (existing != ao.orders.end () && SameOrder (*existing, order))
+        {
+          assets.Release (order.asset);
+          continue;
+        }
+
+      removeOrder (entry.first);
+      if (!FitsAccountLimits (ao.orders, order.asset))
+        {
+          assets.Release (order.asset);
+          ++dropped;
+          continue;
+        }
+      auto it = std::lower_bound (ao.orders.begin (), ao.orders.end (),
+                                  entry.first, idLess);
+      ao.orders.insert (it, order);
+      IndexOrder (mit->first, order);
+    }
+
+  if (dropped > 0)
+    LOG (WARNING)
+        << "Dropped " << dropped << " added orders of " << account
+        << " exceeding the per-account limits";
+
+  ao.seq = upd.seq ();
+  ao.lastUpdate = Clock::now ();
+  ArmTimeout (mit->first, ao, true);
+  UpdateUsage (mit->first, ao);
+
+  EnforceMemoryLimit ();
+  PublishSnapshot ();
+  return true;
+}
+
+std::set<uint64_t>
+OrderBook::FindUnchanged (
+    const std::string& account,
+    const google::protobuf::Map<uint64_t, proto::Order>& o) const
+{
+  std::set<uint64_t> res;
+
+  std::lock_guard<std::mutex> lock(mut);
+  const auto mit = orders.find (account);
+  if (mit == orders.end ())
+    return res;
+  const auto& stored = mit->second.orders;
+
+  for (const auto& entry : o)
+    {
+      const auto it = std::lower_bound (
+          stored.begin (), stored.end (), entry.first,
+          [] (const PackedOrder& p, const uint64_t id)
+            {
+              return p.id < id;
+            });
+      if (it != stored.end () && it->id == entry.first
+            && Matches (*it, entry.second))
+        res.insert (entry.first);
+    }
+
+  return res;
+}
+
+bool
+OrderBook::RemoveOrder (const std::string& account, const uint64_t id,
+                        const proto::Order& o)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  auto mit = orders.find (account);
+  if (mit == orders.end ())
+    return false;
+  auto& ao = mit->second;
+
+  auto it = std::lower_bound (ao.orders.begin (), ao.orders.end (), id,
+                              [] (const PackedOrder& p, const uint64_t i)
+                                {
+                                  return p.id < i;
+                                });
+  if (it == ao.orders.end () || it->id != id || !Matches (*it, o))
+    return false;
+
+  VLOG (1) << "Removing order " << id << " of " << account;
+  UnindexOrder (mit->first, *it);
+  assets.Release (it->asset);
+  ao.orders.erase (it);
+  UpdateUsage (mit->first, ao);
+
+  PublishSnapshot ();
+  return true;
 }
 
-/**
- * Sorts all bids and asks in the order lists.  Ties are broken by
- * account and ID.
- */
 void
-SortByPrices (proto::OrderbookByAsset& orders)
+OrderBook::CopyAssetBook (const AssetBook& book, AssetSnapshot& out)
 {
-  const auto byPriceAsc = [] (const proto::Order& a, const proto::Order& b)
+  /* The account pointers in the index keys are unique per account,
+     so we can use them to look up each account's index.  */
+  std::map<const std::string*, uint32_t> accountIndices;
+  const auto addOrder = [&] (const OrderKey& key, const PackedOrder& order,
+                             std::vector<SnapshotOrder>& side)
     {
-      CHECK (a.has_price_sat () && a.has_account () && a.has_id ());
-      CHECK (b.has_price_sat () && b.has_account () && b.has_id ());
+      const auto ins = accountIndices.emplace (key.account,
+                                               out.accounts.size ());
+      if (ins.second)
+        out.accounts.push_back (*key.account);
 
-      if (a.price_sat () != b.price_sat ())
-        return a.price_sat () < b.price_sat ();
-      if (a.account () != b.account ())
-        return a.account () < b.account ();
-      return a.id () < b.id ();
+      SnapshotOrder o;
+      o.id = order.id;
+      o.price = order.price;
+      o.minUnits = order.minUnits;
+      o.maxUnits = order.maxUnits;
+      o.account = ins.first->second;
+      o.flags = order.flags;
+      side.push_back (o);
     };
 
-  for (auto& entry : *orders.mutable_assets ())
-    {
-      auto& asks = *entry.second.mutable_asks ();
-      std::sort (asks.begin (), asks.end (), byPriceAsc);
-      auto& bids = *entry.second.mutable_bids ();
-      std::sort (bids.rbegin (), bids.rend (), byPriceAsc);
-    }
+  out.bids.reserve (book.bids.size ());
+  for (auto it = book.bids.rbegin (); it != book.bids.rend (); ++it)
+    addOrder (it->first, it->second, out.bids);
+
+  out.asks.reserve (book.asks.size ());
+  for (const auto& entry : book.asks)
+    addOrder (entry.first, entry.second, out.asks);
 }
 
-} // anonymous namespace
+void
+OrderBook::UnpackAssetBook (const Asset& asset, const AssetSnapshot& snap,
+                            proto::OrderbookForAsset& out)
+{
+  out.set_asset (asset);
 
-proto::OrderbookByAsset
-OrderBook::InternalGetByAsset (const Asset* asset) const
+  out.mutable_bids ()->Reserve (snap.bids.size ());
+  for (const auto& o : snap.bids)
+    Unpack (snap, o, *out.add_bids ());
+
+  out.mutable_asks ()->Reserve (snap.asks.size ());
+  for (const auto& o : snap.asks)
+    Unpack (snap, o, *out.add_asks ());
+}
+
+void
+OrderBook::CopyAssetDepth (const AssetBook& book, proto::DepthForAsset& out)
 {
-  proto::OrderbookByAsset res;
-  for (const auto& accounts : orders)
+  const auto addLevel = [] (const uint64_t price, const Level& lvl,
+                            proto::PriceLevel& pb)
     {
-      const std::string& acc = accounts.first;
-      for (const auto& order : accounts.second.orders.orders ())
+      pb.set_price_sat (price);
+      pb.set_units (lvl.units);
+      pb.set_orders (lvl.orders);
+    };
+
+  out.mutable_bids ()->Reserve (book.bidLevels.size ());
+  for (auto it = book.bidLevels.rbegin (); it != book.bidLevels.rend (); ++it)
+    addLevel (it->first, it->second, *out.add_bids ());
+
+  out.mutable_asks ()->Reserve (book.askLevels.size ());
+  for (const auto& entry : book.askLevels)
+    addLevel (entry.first, entry.second, *out.add_asks ());
+}
+
+void
+OrderBook::PublishSnapshot ()
+{
+  if (dirtyAssets.empty ())
+    return;
+
+  /* Copying the top-level map costs O(A) for A assets, but it copies just
+     shared pointers (no order data) once per published update, not per
+     changed order.  Each dirty asset is then rebuilt from its index in
+     O(n + l) for its n orders and l price levels.  Patching the previous
+     AssetSnapshot instead would not be cheaper:  It may still be in use by
+     readers, so it would have to be copied first (O(n) already), and its
+     orders are kept in sorted vectors (so that readers can copy them out
+     directly), where each inserted or removed order is O(n) as well.  The
+     depth is at most as large as the orders.  So a full rebuild is within
+     a constant factor of any patch, and it keeps the snapshot trivially
+     consistent with the index.  */
+  auto newSnapshot
+      = std::make_shared<Snapshot> (*std::atomic_load (&snapshot));
+  const uint64_t version = newSnapshot->version + 1;
+
+  /* Index changes are only made for orders that actually differ, so all
+     dirty assets have changed.  The only exception is an asset that got
+     orders and lost them again within the same update.  Unchanged assets
+     keep sharing their data with the previous snapshot.  Removed assets
+     are not remembered, we only record the version of the last removal.  */
+  bool changed = false;
+  for (const auto& asset : dirtyAssets)
+    {
+      const auto mit = byAsset.find (asset);
+      if (mit == byAsset.end ())
         {
-          CHECK (order.second.has_asset ());
-          if (asset != nullptr && order.second.asset () != *asset)
-            continue;
-
-          proto::Order o = order.second;
-          o.set_account (acc);
-          o.set_id (order.first);
-          AddOrderForAsset (res, std::move (o));
+          if (newSnapshot->assets.erase (asset) > 0)
+            {
+              newSnapshot->removedVersion = version;
+              changed = true;
+            }
+          continue;
         }
+
+      auto forAsset = std::make_shared<AssetSnapshot> ();
+      forAsset->version = version;
+      CopyAssetBook (mit->second, *forAsset);
+      forAsset->depth.set_asset (asset);
+      CopyAssetDepth (mit->second, forAsset->depth);
+
+      newSnapshot->assets[asset] = std::move (forAsset);
+      changed = true;
     }
+  dirtyAssets.clear ();
 
-  SortByPrices (res);
+  if (!changed)
+    return;
 
-  return res;
+  newSnapshot->version = version;
+  std::atomic_store (&snapshot,
+                     std::shared_ptr<const Snapshot> (std::move (newSnapshot)));
+
+  /* Taking the lock here ensures that a waiter cannot miss the notification
+     between checking the snapshot and starting to wait.  */
+  std::lock_guard<std::mutex> lock(mutChange);
+  cvChange.notify_all ();
 }
 
 proto::OrderbookForAsset
 OrderBook::GetForAsset (const Asset& asset) const
 {
-  auto allAssets = InternalGetByAsset (&asset);
+  const auto snap = std::atomic_load (&snapshot);
 
-  if (allAssets.assets ().empty ())
-    {
-      proto::OrderbookForAsset res;
-      res.set_asset (asset);
-      return res;
-    }
+  proto::OrderbookForAsset res;
+  res.set_asset (asset);
 
-  CHECK_EQ (allAssets.assets_size (), 1);
-  auto mit = allAssets.mutable_assets ()->find (asset);
-  CHECK (mit != allAssets.mutable_assets ()->end ());
-  CHECK_EQ (mit->first, asset);
-  CHECK_EQ (mit->second.asset (), asset);
+  const auto mit = snap->assets.find (asset);
+  if (mit != snap->assets.end ())
+    UnpackAssetBook (asset, *mit->second, res);
 
-  proto::OrderbookForAsset res;
-  res.Swap (&mit->second);
   return res;
 }
 
 proto::OrderbookByAsset
 OrderBook::GetByAsset () const
 {
-  return InternalGetByAsset (nullptr);
+  const auto snap = std::atomic_load (&snapshot);
+
+  proto::OrderbookByAsset res;
+  auto& assetMap = *res.mutable_assets ();
+  for (const auto& entry : snap->assets)
+    UnpackAssetBook (entry.first, *entry.second, assetMap[entry.first]);
+
+  return res;
+}
+
+proto::DepthForAsset
+OrderBook::GetDepth (const Asset& asset, const unsigned levels) const
+{
+  const auto snap = std::atomic_load (&snapshot);
+
+  proto::DepthForAsset res;
+  res.set_asset (asset);
+
+  const auto mit = snap->assets.find (asset);
+  if (mit == snap->assets.end ())
+    return res;
+  const auto& full = mit->second->depth;
+
+  const auto copyLevels = [levels] (
+      const RepeatedPtrField<proto::PriceLevel>& in,
+      RepeatedPtrField<proto::PriceLevel>& out)
+    {
+      int n = in.size ();
+      if (levels > 0 && levels < static_cast<unsigned> (n))
+        n = levels;
+
+      out.Reserve (n);
+      for (int i = 0; i < n; ++i)
+        *out.Add () = in.Get (i);
+    };
+  copyLevels (full.bids (), *res.mutable_bids ());
+  copyLevels (full.asks (), *res.mutable_asks ());
+
+  return res;
+}
+
+std::vector<std::pair<proto::Order, Amount>>
+OrderBook::SelectBest (const Asset& asset, const proto::Order::Type type,
+                       const Amount units, const uint64_t limitPrice) const
+{
+  const auto snap = std::atomic_load (&snapshot);
+
+  std::vector<std::pair<proto::Order, Amount>> res;
+  const auto mit = snap->assets.find (asset);
+  if (mit == snap->assets.end ())
+    return res;
+
+  const AssetSnapshot& book = *mit->second;
+  const std::vector<SnapshotOrder>* side = nullptr;
+  switch (type)
+    {
+    case proto::Order::ASK:
+      side = &book.asks;
+      break;
+    case proto::Order::BID:
+      side = &book.bids;
+      break;
+    default:
+      LOG (FATAL) << "Unexpected order type: " << static_cast<int> (type);
+    }
+
+  /* The orders are sorted best first, so we can stop as soon as we reach
+     the limit price.  Orders whose min_units are more than we still need
+     are skipped, but a later one may still fit.
+
+     Each trade spends the seller's name output, so only one trade per
+     seller can be negotiated at a time.  Thus we select at most one order
+     per maker when taking asks, and only a single order when taking bids
+     (since then we are the seller in all of them).  */
+  Amount remaining = units;
+  std::set<uint32_t> sellers;
+  for (const auto& o : *side)
+    {
+      if (remaining <= 0)
+        break;
+      if (type == proto::Order::BID && !res.empty ())
+        break;
+      if (sellers.count (o.account) > 0)
+        continue;
+
+      if (type == proto::Order::ASK ? o.price > limitPrice
+                                    : o.price < limitPrice)
+        break;
+
+      const Amount maxUnits = o.maxUnits;
+      const Amount minUnits
+          = (o.flags & PackedOrder::HAS_MIN_UNITS) ? o.minUnits : 1;
+      const Amount cur = std::min (remaining, maxUnits);
+      if (cur < minUnits)
+        continue;
+
+      proto::Order full;
+      Unpack (book, o, full);
+      full.set_asset (asset);
+      full.set_type (type);
+      res.emplace_back (std::move (full), cur);
+      sellers.insert (o.account);
+      remaining -= cur;
+    }
+
+  return res;
+}
+
+proto::BookChange
+OrderBook::WaitForChange (const uint64_t known, const std::set<Asset>& assets,
+                          const std::chrono::milliseconds timeout) const
+{
+  proto::BookChange res;
+
+  /* Fills in res based on the current snapshot and returns true
+     if there is a change to report.  */
+  const auto checkChange = [&] ()
+    {
+      const auto snap = std::atomic_load (&snapshot);
+      res.Clear ();
+      res.set_version (snap->version);
+      if (snap->version == known)
+        return false;
+
+      /* If the known version is in the future (e.g. from before a restart),
+         we can't tell what changed and just report everything.  */
+      const bool all = (known > snap->version);
+      const bool removed = all || snap->removedVersion > known;
+
+      if (assets.empty ())
+        {
+          for (const auto& entry : snap->assets)
+            if (all || entry.second->version > known)
+              res.add_changed_assets (entry.first);
+          if (removed)
+            res.set_assets_removed (true);
+          return true;
+        }
+
+      for (const auto& a : assets)
+        {
+          const auto mit = snap->assets.find (a);
+          if (mit == snap->assets.end ()
+                ? removed
+                : all || mit->second->version > known)
+            res.add_changed_assets (a);
+        }
+      return res.changed_assets_size () > 0;
+    };
+
+  /* If we time out, res contains the version as of the last check (with
+     no changed assets), which is safe for the caller to wait on next.  */
+  std::unique_lock<std::mutex> lock(mutChange);
+  cvChange.wait_for (lock, timeout, checkChange);
+
+  return res;
 }
 
 } // namespace democrit
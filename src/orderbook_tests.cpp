@@ -23,13 +23,20 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <atomic>
 #include <chrono>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 namespace democrit
 {
 namespace
 {
 
+using testing::ElementsAre;
+
 /* ************************************************************************** */
 
 class OrderbookTests : public testing::Test
@@ -46,6 +53,15 @@ protected:
     ob.UpdateOrders (ParseTextProto<proto::OrdersOfAccount> (str));
   }
 
+  /**
+   * Calls ApplyDeltas with data given as text proto.
+   */
+  static bool
+  ApplyDeltas (OrderBook& ob, const std::string& str)
+  {
+    return ob.ApplyDeltas (ParseTextProto<proto::OrderDeltas> (str));
+  }
+
 };
 
 class OrderbookWithoutTimeout : public OrderBook
@@ -233,17 +249,31 @@ TEST_F (OrderbookTests, UpdatesForAccount)
   )"));
 }
 
-TEST_F (OrderbookTests, Timeout)
+TEST_F (OrderbookTests, TieBreaking)
 {
-  constexpr auto TIMEOUT = std::chrono::milliseconds (100);
-  OrderBook o(TIMEOUT);
+  OrderbookWithoutTimeout o;
 
   UpdateOrders (o, R"(
     account: "domob"
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: ASK price_sat: 10 }
+      }
     orders:
       {
         key: 1
-        value: { asset: "gold" type: ASK price_sat: 100 }
+        value: { asset: "gold" type: ASK price_sat: 10 }
+      }
+    orders:
+      {
+        key: 3
+        value: { asset: "gold" type: BID price_sat: 5 }
+      }
+    orders:
+      {
+        key: 4
+        value: { asset: "gold" type: BID price_sat: 5 }
       }
   )");
   UpdateOrders (o, R"(
@@ -251,33 +281,1187 @@ TEST_F (OrderbookTests, Timeout)
     orders:
       {
         key: 1
-        value: { asset: "gold" type: BID price_sat: 10 }
+        value: { asset: "gold" type: ASK price_sat: 10 }
+      }
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: BID price_sat: 5 }
       }
   )");
 
   EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
     asset: "gold"
-    bids: { account: "andy" id: 1 price_sat: 10 }
-    asks: { account: "domob" id: 1 price_sat: 100 }
+    bids: { account: "domob" id: 4 price_sat: 5 }
+    bids: { account: "domob" id: 3 price_sat: 5 }
+    bids: { account: "andy" id: 2 price_sat: 5 }
+    asks: { account: "andy" id: 1 price_sat: 10 }
+    asks: { account: "domob" id: 1 price_sat: 10 }
+    asks: { account: "domob" id: 2 price_sat: 10 }
   )"));
+}
 
-  std::this_thread::sleep_for (0.75 * TIMEOUT);
+TEST_F (OrderbookTests, RemovingAllOrders)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 10 }
+      }
+  )");
   UpdateOrders (o, R"(
     account: "andy"
     orders:
       {
         key: 1
-        value: { asset: "gold" type: BID price_sat: 15 }
+        value: { asset: "silver" type: BID price_sat: 5 }
       }
   )");
-  std::this_thread::sleep_for (0.75 * TIMEOUT);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+  )");
+  UpdateOrders (o, R"(
+    account: "nobody"
+  )");
 
   EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
     asset: "gold"
-    bids: { account: "andy" id: 1 price_sat: 15 }
   )"));
+  EXPECT_THAT (o.GetByAsset (), EqualsOrdersByAsset (R"(
+    assets:
+      {
+        key: "silver"
+        value:
+          {
+            asset: "silver"
+            bids: { account: "andy" id: 1 price_sat: 5 }
+          }
+      }
+  )"));
+}
 
-  std::this_thread::sleep_for (TIMEOUT);
+TEST_F (OrderbookTests, Deltas)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 10
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 10 }
+      }
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: BID price_sat: 5 }
+      }
+    orders:
+      {
+        key: 3
+        value: { asset: "silver" type: ASK price_sat: 1 }
+      }
+  )");
+
+  ASSERT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 11
+    added:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 20 }
+      }
+    added:
+      {
+        key: 4
+        value: { asset: "gold" type: BID price_sat: 6 }
+      }
+    removed: 3
+    removed: 42
+    locked: 2
+  )"));
+
+  EXPECT_THAT (o.GetByAsset (), EqualsOrdersByAsset (R"(
+    assets:
+      {
+        key: "gold"
+        value:
+          {
+            asset: "gold"
+            bids: { account: "domob" id: 4 price_sat: 6 }
+            asks: { account: "domob" id: 1 price_sat: 20 }
+          }
+      }
+  )"));
+
+  ASSERT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 12
+    added:
+      {
+        key: 2
+        value: { asset: "gold" type: BID price_sat: 5 }
+      }
+  )"));
+
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "domob" id: 4 price_sat: 6 }
+    bids: { account: "domob" id: 2 price_sat: 5 }
+    asks: { account: "domob" id: 1 price_sat: 20 }
+  )"));
+}
+
+TEST_F (OrderbookTests, DeltasOnEmptySnapshot)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 1
+  )");
+  ASSERT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 2
+    added:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 10 }
+      }
+  )"));
+
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    asks: { account: "domob" id: 1 price_sat: 10 }
+  )"));
+}
+
+TEST_F (OrderbookTests, DeltasOutOfSequence)
+{
+  OrderbookWithoutTimeout o;
+
+  const std::string delta = R"(
+    account: "domob"
+    seq: 2
+    added:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 10 }
+      }
+  )";
+
+  /* Unknown account.  */
+  EXPECT_FALSE (ApplyDeltas (o, delta));
+
+  /* Snapshot without sequence number.  */
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders:
+      {
+        key: 5
+        value: { asset: "gold" type: BID price_sat: 1 }
+      }
+  )");
+  EXPECT_FALSE (ApplyDeltas (o, delta));
+
+  /* Gap in the sequence.  Afterwards, also the "correct" next delta is
+     ignored until we get a new snapshot.  */
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 0
+    orders:
+      {
+        key: 5
+        value: { asset: "gold" type: BID price_sat: 1 }
+      }
+  )");
+  EXPECT_FALSE (ApplyDeltas (o, delta));
+  EXPECT_FALSE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 1
+  )"));
+
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "domob" id: 5 price_sat: 1 }
+  )"));
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 1
+  )");
+  EXPECT_TRUE (ApplyDeltas (o, delta));
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    asks: { account: "domob" id: 1 price_sat: 10 }
+  )"));
+}
+
+TEST_F (OrderbookTests, ConcurrentReads)
+{
+  OrderbookWithoutTimeout o;
+
+  /* The writer keeps replacing the orders of one account, each time with
+     two asks at increasing prices.  Readers should always see a consistent
+     state with both orders from the same update.  */
+  constexpr unsigned UPDATES = 1'000;
+  constexpr unsigned READERS = 4;
+
+  std::atomic<bool> done(false);
+  std::vector<std::thread> readers;
+  for (unsigned i = 0; i < READERS; ++i)
+    readers.emplace_back ([&] ()
+      {
+        while (!done)
+          {
+            const auto book = o.GetForAsset ("gold");
+            if (book.asks_size () == 0)
+              continue;
+            ASSERT_EQ (book.asks_size (), 2);
+            ASSERT_EQ (book.asks (0).price_sat () + 1,
+                       book.asks (1).price_sat ());
+          }
+      });
+
+  for (unsigned i = 1; i <= UPDATES; ++i)
+    {
+      proto::OrdersOfAccount upd;
+      upd.set_account ("domob");
+      for (unsigned j = 0; j < 2; ++j)
+        {
+          auto& order = (*upd.mutable_orders ())[j];
+          order.set_asset ("gold");
+          order.set_type (proto::Order::ASK);
+          order.set_price_sat (2 * i + j);
+        }
+      o.UpdateOrders (std::move (upd));
+    }
+
+  done = true;
+  for (auto& t : readers)
+    t.join ();
+}
+
+TEST_F (OrderbookTests, Depth)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 0
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 100 max_units: 2 }
+      }
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: ASK price_sat: 110 max_units: 1 }
+      }
+    orders:
+      {
+        key: 3
+        value: { asset: "gold" type: BID price_sat: 50 max_units: 5 }
+      }
+  )");
+  UpdateOrders (o, R"(
+    account: "andy"
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 100 max_units: 3 }
+      }
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: BID price_sat: 40 max_units: 1 }
+      }
+    orders:
+      {
+        key: 3
+        value: { asset: "gold" type: BID price_sat: 30 max_units: 1 }
+      }
+  )");
+
+  EXPECT_THAT (o.GetDepth ("foo", 0), EqualsDepthForAsset (R"(
+    asset: "foo"
+  )"));
+  EXPECT_THAT (o.GetDepth ("gold", 0), EqualsDepthForAsset (R"(
+    asset: "gold"
+    bids: { price_sat: 50 units: 5 orders: 1 }
+    bids: { price_sat: 40 units: 1 orders: 1 }
+    bids: { price_sat: 30 units: 1 orders: 1 }
+    asks: { price_sat: 100 units: 5 orders: 2 }
+    asks: { price_sat: 110 units: 1 orders: 1 }
+  )"));
+  EXPECT_THAT (o.GetDepth ("gold", 1), EqualsDepthForAsset (R"(
+    asset: "gold"
+    bids: { price_sat: 50 units: 5 orders: 1 }
+    asks: { price_sat: 100 units: 5 orders: 2 }
+  )"));
+
+  /* The levels are updated incrementally when orders change.  */
+  ASSERT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 1
+    removed: 3
+    locked: 1
+    added:
+      {
+        key: 4
+        value: { asset: "gold" type: ASK price_sat: 110 max_units: 10 }
+      }
+  )"));
+  EXPECT_THAT (o.GetDepth ("gold", 2), EqualsDepthForAsset (R"(
+    asset: "gold"
+    bids: { price_sat: 40 units: 1 orders: 1 }
+    bids: { price_sat: 30 units: 1 orders: 1 }
+    asks: { price_sat: 100 units: 3 orders: 1 }
+    asks: { price_sat: 110 units: 11 orders: 2 }
+  )"));
+
+  UpdateOrders (o, R"(
+    account: "andy"
+  )");
+  EXPECT_THAT (o.GetDepth ("gold", 5), EqualsDepthForAsset (R"(
+    asset: "gold"
+    asks: { price_sat: 110 units: 11 orders: 2 }
+  )"));
+}
+
+TEST_F (OrderbookTests, FindUnchanged)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 10 max_units: 2 }
+      }
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: BID price_sat: 5 min_units: 1 }
+      }
+    orders:
+      {
+        key: 3
+        value: { asset: "silver" type: ASK price_sat: 20 locked: false }
+      }
+  )");
+
+  const auto upd = ParseTextProto<proto::OrdersOfAccount> (R"(
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 10 max_units: 2 }
+      }
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: BID price_sat: 5 }
+      }
+    orders:
+      {
+        key: 3
+        value: { asset: "silver" type: ASK price_sat: 20 locked: false }
+      }
+    orders:
+      {
+        key: 4
+        value: { asset: "gold" type: ASK price_sat: 10 max_units: 2 }
+      }
+  )");
+
+  EXPECT_THAT (o.FindUnchanged ("domob", upd.orders ()),
+               ElementsAre (1, 3));
+  EXPECT_THAT (o.FindUnchanged ("andy", upd.orders ()), ElementsAre ());
+}
+
+TEST_F (OrderbookTests, FindUnchangedRequiresFields)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 0 } }
+    orders: { key: 2 value: { asset: "gold" type: ASK price_sat: 5 } }
+    orders: { key: 3 value: { asset: "" type: ASK price_sat: 5 } }
+  )");
+
+  /* The missing fields all match the stored orders' values by default,
+     but the orders must still not be treated as unchanged (as they would
+     then skip validation).  */
+  const auto upd = ParseTextProto<proto::OrdersOfAccount> (R"(
+    orders: { key: 1 value: { asset: "gold" type: ASK } }
+    orders: { key: 2 value: { asset: "gold" price_sat: 5 } }
+    orders: { key: 3 value: { type: ASK price_sat: 5 } }
+  )");
+  EXPECT_THAT (o.FindUnchanged ("domob", upd.orders ()), ElementsAre ());
+
+  proto::Order missingPrice;
+  missingPrice.set_asset ("gold");
+  missingPrice.set_type (proto::Order::ASK);
+  EXPECT_FALSE (o.RemoveOrder ("domob", 1, missingPrice));
+}
+
+TEST_F (OrderbookTests, RemoveOrder)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 0
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+    orders: { key: 2 value: { asset: "gold" type: ASK price_sat: 20 } }
+  )");
+
+  const auto order = ParseTextProto<proto::Order> (R"(
+    account: "domob"
+    id: 1
+    asset: "gold"
+    type: ASK
+    price_sat: 10
+  )");
+  EXPECT_FALSE (o.RemoveOrder ("andy", 1, order));
+  EXPECT_FALSE (o.RemoveOrder ("domob", 2, order));
+  EXPECT_FALSE (o.RemoveOrder ("domob", 3, order));
+  EXPECT_TRUE (o.RemoveOrder ("domob", 1, order));
+  EXPECT_FALSE (o.RemoveOrder ("domob", 1, order));
+
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    asks: { account: "domob" id: 2 price_sat: 20 }
+  )"));
+  EXPECT_EQ (o.GetUsage ().orders (), 1);
+
+  /* The account's sequence is not affected.  */
+  EXPECT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 1
+    removed: 1
+  )"));
+}
+
+TEST_F (OrderbookTests, PackedRoundTrip)
+{
+  OrderbookWithoutTimeout o;
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders:
+      {
+        key: 18446744073709551615
+        value:
+          {
+            asset: "gold"
+            type: ASK
+            price_sat: 18446744073709551615
+            min_units: 0
+            max_units: 18446744073709551615
+            locked: false
+          }
+      }
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: BID price_sat: 0 locked: true }
+      }
+    orders:
+      {
+        key: 2
+        value: { asset: "gold" type: BID price_sat: 5 max_units: 7 }
+      }
+  )");
+
+  /* Presence of the optional fields has to be preserved as well.  */
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "domob" id: 2 price_sat: 5 max_units: 7 }
+    bids: { account: "domob" id: 1 price_sat: 0 locked: true }
+    asks:
+      {
+        account: "domob"
+        id: 18446744073709551615
+        price_sat: 18446744073709551615
+        min_units: 0
+        max_units: 18446744073709551615
+        locked: false
+      }
+  )"));
+
+  const auto selected = o.SelectBest ("gold", proto::Order::BID, 3, 0);
+  ASSERT_EQ (selected.size (), 1);
+  EXPECT_THAT (selected[0].first, EqualsOrder (R"(
+    account: "domob"
+    id: 2
+    asset: "gold"
+    type: BID
+    price_sat: 5
+    max_units: 7
+  )"));
+  EXPECT_EQ (selected[0].second, 3);
+}
+
+TEST_F (OrderbookTests, AssetInterning)
+{
+  OrderbookWithoutTimeout o;
+  EXPECT_EQ (o.GetUsage ().assets (), 0);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+    orders: { key: 2 value: { asset: "silver" type: ASK price_sat: 20 } }
+  )");
+  UpdateOrders (o, R"(
+    account: "andy"
+    orders: { key: 1 value: { asset: "gold" type: BID price_sat: 5 } }
+  )");
+  EXPECT_EQ (o.GetUsage ().assets (), 2);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+    orders: { key: 2 value: { asset: "copper" type: ASK price_sat: 20 } }
+  )");
+  EXPECT_EQ (o.GetUsage ().assets (), 2);
+  EXPECT_THAT (o.GetByAsset (), EqualsOrdersByAsset (R"(
+    assets:
+      {
+        key: "copper"
+        value:
+          {
+            asset: "copper"
+            asks: { account: "domob" id: 2 price_sat: 20 }
+          }
+      }
+    assets:
+      {
+        key: "gold"
+        value:
+          {
+            asset: "gold"
+            bids: { account: "andy" id: 1 price_sat: 5 }
+            asks: { account: "domob" id: 1 price_sat: 10 }
+          }
+      }
+  )"));
+
+  /* The asset stays interned as long as any order references it.  */
+  UpdateOrders (o, R"(
+    account: "andy"
+  )");
+  EXPECT_EQ (o.GetUsage ().assets (), 2);
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    asks: { account: "domob" id: 1 price_sat: 10 }
+  )"));
+
+  UpdateOrders (o, R"(
+    account: "domob"
+  )");
+  EXPECT_EQ (o.GetUsage ().assets (), 0);
+  EXPECT_THAT (o.GetByAsset (), EqualsOrdersByAsset (""));
+}
+
+class OrderbookLimitsTests : public OrderbookTests
+{
+
+protected:
+
+  OrderbookWithoutTimeout o;
+  OrderBook::Limits limits;
+
+};
+
+TEST_F (OrderbookLimitsTests, OrdersPerAccount)
+{
+  limits.maxOrdersPerAccount = 2;
+  o.SetLimits (limits);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 0
+    orders: { key: 3 value: { asset: "gold" type: BID price_sat: 30 } }
+    orders: { key: 1 value: { asset: "gold" type: BID price_sat: 10 } }
+    orders: { key: 2 value: { asset: "gold" type: BID price_sat: 20 } }
+  )");
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "domob" id: 2 price_sat: 20 }
+    bids: { account: "domob" id: 1 price_sat: 10 }
+  )"));
+
+  /* Replacing an existing order is fine, but adding a third is not.  */
+  ASSERT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 1
+    added: { key: 1 value: { asset: "gold" type: BID price_sat: 15 } }
+    added: { key: 4 value: { asset: "gold" type: BID price_sat: 40 } }
+  )"));
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "domob" id: 2 price_sat: 20 }
+    bids: { account: "domob" id: 1 price_sat: 15 }
+  )"));
+  EXPECT_EQ (o.GetUsage ().orders (), 2);
+}
+
+TEST_F (OrderbookLimitsTests, AssetsPerAccount)
+{
+  limits.maxAssetsPerAccount = 1;
+  o.SetLimits (limits);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 0
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+    orders: { key: 2 value: { asset: "silver" type: ASK price_sat: 20 } }
+    orders: { key: 3 value: { asset: "gold" type: ASK price_sat: 30 } }
+  )");
+  ASSERT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 1
+    added: { key: 4 value: { asset: "silver" type: ASK price_sat: 40 } }
+  )"));
+
+  EXPECT_THAT (o.GetByAsset (), EqualsOrdersByAsset (R"(
+    assets:
+      {
+        key: "gold"
+        value:
+          {
+            asset: "gold"
+            asks: { account: "domob" id: 1 price_sat: 10 }
+            asks: { account: "domob" id: 3 price_sat: 30 }
+          }
+      }
+  )"));
+}
+
+TEST_F (OrderbookLimitsTests, Usage)
+{
+  auto usage = o.GetUsage ();
+  EXPECT_EQ (usage.accounts (), 0);
+  EXPECT_EQ (usage.orders (), 0);
+  EXPECT_EQ (usage.bytes (), 0);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+  )");
+  usage = o.GetUsage ();
+  EXPECT_EQ (usage.accounts (), 1);
+  EXPECT_EQ (usage.orders (), 1);
+  const auto oneOrder = usage.bytes ();
+  EXPECT_GT (oneOrder, 0);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+    orders: { key: 2 value: { asset: "gold" type: ASK price_sat: 20 } }
+  )");
+  UpdateOrders (o, R"(
+    account: "andy"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+  )");
+  usage = o.GetUsage ();
+  EXPECT_EQ (usage.accounts (), 2);
+  EXPECT_EQ (usage.orders (), 3);
+  EXPECT_GT (usage.bytes (), 2 * oneOrder);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+  )");
+  UpdateOrders (o, R"(
+    account: "andy"
+  )");
+  usage = o.GetUsage ();
+  EXPECT_EQ (usage.accounts (), 0);
+  EXPECT_EQ (usage.orders (), 0);
+  EXPECT_EQ (usage.bytes (), 0);
+}
+
+TEST_F (OrderbookLimitsTests, EvictOldestUpdate)
+{
+  UpdateOrders (o, R"(
+    account: "first"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+  )");
+  limits.maxBytes = 2 * o.GetUsage ().bytes ();
+  limits.eviction = OrderBook::EvictionPolicy::OLDEST_UPDATE;
+  o.SetLimits (limits);
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  UpdateOrders (o, R"(
+    account: "other"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 20 } }
+  )");
+  std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  UpdateOrders (o, R"(
+    account: "third"
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 30 } }
+  )");
+
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    asks: { account: "other" id: 1 price_sat: 20 }
+    asks: { account: "third" id: 1 price_sat: 30 }
+  )"));
+  EXPECT_EQ (o.GetUsage ().accounts (), 2);
+  EXPECT_LE (o.GetUsage ().bytes (), limits.maxBytes);
+}
+
+TEST_F (OrderbookLimitsTests, EvictFurthestFromTop)
+{
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders: { key: 1 value: { asset: "gold" type: BID price_sat: 10 } }
+    orders: { key: 2 value: { asset: "gold" type: BID price_sat: 20 } }
+    orders: { key: 3 value: { asset: "gold" type: BID price_sat: 30 } }
+    orders: { key: 4 value: { asset: "gold" type: ASK price_sat: 50 } }
+    orders: { key: 5 value: { asset: "gold" type: ASK price_sat: 60 } }
+    orders: { key: 6 value: { asset: "silver" type: ASK price_sat: 5 } }
+  )");
+
+  /* Setting the budget to the current size evicts nothing yet.  */
+  limits.maxBytes = o.GetUsage ().bytes ();
+  limits.eviction = OrderBook::EvictionPolicy::FURTHEST_FROM_TOP;
+  o.SetLimits (limits);
+  EXPECT_EQ (o.GetUsage ().orders (), 6);
+
+  /* Adding one more order evicts the lowest bid of gold.  */
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders: { key: 1 value: { asset: "gold" type: BID price_sat: 10 } }
+    orders: { key: 2 value: { asset: "gold" type: BID price_sat: 20 } }
+    orders: { key: 3 value: { asset: "gold" type: BID price_sat: 30 } }
+    orders: { key: 4 value: { asset: "gold" type: ASK price_sat: 50 } }
+    orders: { key: 5 value: { asset: "gold" type: ASK price_sat: 60 } }
+    orders: { key: 6 value: { asset: "silver" type: ASK price_sat: 5 } }
+    orders: { key: 7 value: { asset: "gold" type: ASK price_sat: 70 } }
+  )");
+  EXPECT_EQ (o.GetUsage ().orders (), 6);
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "domob" id: 3 price_sat: 30 }
+    bids: { account: "domob" id: 2 price_sat: 20 }
+    asks: { account: "domob" id: 4 price_sat: 50 }
+    asks: { account: "domob" id: 5 price_sat: 60 }
+    asks: { account: "domob" id: 7 price_sat: 70 }
+  )"));
+  EXPECT_THAT (o.GetForAsset ("silver"), EqualsOrdersForAsset (R"(
+    asset: "silver"
+    asks: { account: "domob" id: 6 price_sat: 5 }
+  )"));
+}
+
+class OrderbookSelectBestTests : public OrderbookTests
+{
+
+protected:
+
+  OrderbookWithoutTimeout o;
+
+  OrderbookSelectBestTests ()
+  {
+    UpdateOrders (o, R"(
+      account: "domob"
+      orders:
+        {
+          key: 1
+          value: { asset: "gold" type: ASK price_sat: 100 max_units: 2 }
+        }
+      orders:
+        {
+          key: 3
+          value: { asset: "gold" type: BID price_sat: 50 max_units: 3 }
+        }
+    )");
+    UpdateOrders (o, R"(
+      account: "bob"
+      orders:
+        {
+          key: 2
+          value:
+            {
+              asset: "gold"
+              type: ASK
+              price_sat: 110
+              min_units: 5
+              max_units: 10
+            }
+        }
+    )");
+    UpdateOrders (o, R"(
+      account: "andy"
+      orders:
+        {
+          key: 1
+          value: { asset: "gold" type: ASK price_sat: 120 max_units: 3 }
+        }
+      orders:
+        {
+          key: 2
+          value: { asset: "gold" type: BID price_sat: 40 max_units: 1 }
+        }
+    )");
+  }
+
+  /**
+   * Runs SelectBest and returns the selected orders as (account, id, units)
+   * triples for easy comparison.
+   */
+  std::vector<std::tuple<std::string, uint64_t, Amount>>
+  Select (const proto::Order::Type type, const Amount units,
+          const uint64_t limit)
+  {
+    std::vector<std::tuple<std::string, uint64_t, Amount>> res;
+    for (const auto& entry : o.SelectBest ("gold", type, units, limit))
+      {
+        EXPECT_EQ (entry.first.asset (), "gold");
+        EXPECT_EQ (entry.first.type (), type);
+        res.emplace_back (entry.first.account (), entry.first.id (),
+                          entry.second);
+      }
+    return res;
+  }
+
+};
+
+TEST_F (OrderbookSelectBestTests, UnknownAsset)
+{
+  EXPECT_THAT (o.SelectBest ("silver", proto::Order::ASK, 10, 1'000),
+               ElementsAre ());
+}
+
+TEST_F (OrderbookSelectBestTests, LimitPrice)
+{
+  EXPECT_THAT (Select (proto::Order::ASK, 100, 109), ElementsAre (
+    std::make_tuple ("domob", 1, 2)
+  ));
+  EXPECT_THAT (Select (proto::Order::BID, 100, 45), ElementsAre (
+    std::make_tuple ("domob", 3, 3)
+  ));
+}
+
+TEST_F (OrderbookSelectBestTests, PartialFill)
+{
+  EXPECT_THAT (Select (proto::Order::ASK, 1, 1'000), ElementsAre (
+    std::make_tuple ("domob", 1, 1)
+  ));
+  EXPECT_THAT (Select (proto::Order::ASK, 8, 1'000), ElementsAre (
+    std::make_tuple ("domob", 1, 2),
+    std::make_tuple ("bob", 2, 6)
+  ));
+  EXPECT_THAT (Select (proto::Order::ASK, 100, 1'000), ElementsAre (
+    std::make_tuple ("domob", 1, 2),
+    std::make_tuple ("bob", 2, 10),
+    std::make_tuple ("andy", 1, 3)
+  ));
+}
+
+TEST_F (OrderbookSelectBestTests, MinUnitsSkipped)
+{
+  EXPECT_THAT (Select (proto::Order::ASK, 5, 1'000), ElementsAre (
+    std::make_tuple ("domob", 1, 2),
+    std::make_tuple ("andy", 1, 3)
+  ));
+}
+
+TEST_F (OrderbookSelectBestTests, OneAskPerSeller)
+{
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 100 max_units: 2 }
+      }
+    orders:
+      {
+        key: 4
+        value: { asset: "gold" type: ASK price_sat: 105 max_units: 5 }
+      }
+  )");
+
+  EXPECT_THAT (Select (proto::Order::ASK, 100, 1'000), ElementsAre (
+    std::make_tuple ("domob", 1, 2),
+    std::make_tuple ("bob", 2, 10),
+    std::make_tuple ("andy", 1, 3)
+  ));
+}
+
+TEST_F (OrderbookSelectBestTests, SingleBid)
+{
+  /* We are the seller for all bids, so only one can be taken.  */
+  EXPECT_THAT (Select (proto::Order::BID, 100, 0), ElementsAre (
+    std::make_tuple ("domob", 3, 3)
+  ));
+}
+
+class OrderbookWaitTests : public OrderbookTests
+{
+
+protected:
+
+  /** Timeout used for waiting calls that are expected to block.  */
+  static constexpr auto WAIT = std::chrono::milliseconds (10);
+
+  OrderbookWithoutTimeout o;
+
+  /**
+   * Sets the orders of an account to a single ask with the given asset
+   * and price.
+   */
+  void
+  SetOrder (const std::string& account, const Asset& asset,
+            const unsigned price)
+  {
+    proto::OrdersOfAccount upd;
+    upd.set_account (account);
+    auto& order = (*upd.mutable_orders ())[1];
+    order.set_asset (asset);
+    order.set_type (proto::Order::ASK);
+    order.set_price_sat (price);
+    o.UpdateOrders (std::move (upd));
+  }
+
+};
+
+constexpr std::chrono::milliseconds OrderbookWaitTests::WAIT;
+
+TEST_F (OrderbookWaitTests, Versions)
+{
+  EXPECT_THAT (o.WaitForChange (0, {}, WAIT), EqualsBookChange (R"(
+    version: 0
+  )"));
+
+  SetOrder ("domob", "gold", 10);
+  EXPECT_THAT (o.WaitForChange (0, {}, WAIT), EqualsBookChange (R"(
+    version: 1
+    changed_assets: "gold"
+  )"));
+
+  /* Refreshing the same orders does not count as change.  */
+  SetOrder ("domob", "gold", 10);
+  EXPECT_THAT (o.WaitForChange (1, {}, WAIT), EqualsBookChange (R"(
+    version: 1
+  )"));
+
+  SetOrder ("andy", "silver", 10);
+  SetOrder ("domob", "gold", 20);
+  EXPECT_THAT (o.WaitForChange (1, {}, WAIT), EqualsBookChange (R"(
+    version: 3
+    changed_assets: "gold"
+    changed_assets: "silver"
+  )"));
+  EXPECT_THAT (o.WaitForChange (2, {}, WAIT), EqualsBookChange (R"(
+    version: 3
+    changed_assets: "gold"
+  )"));
+
+  /* Removing all orders of an asset is a change as well.  */
+  o.UpdateOrders (ParseTextProto<proto::OrdersOfAccount> (R"(
+    account: "andy"
+  )"));
+  EXPECT_THAT (o.WaitForChange (3, {}, WAIT), EqualsBookChange (R"(
+    version: 4
+    assets_removed: true
+  )"));
+  EXPECT_THAT (o.WaitForChange (3, {"silver"}, WAIT), EqualsBookChange (R"(
+    version: 4
+    changed_assets: "silver"
+  )"));
+
+  /* Later changes do not report the removal again.  */
+  SetOrder ("domob", "gold", 30);
+  EXPECT_THAT (o.WaitForChange (4, {}, WAIT), EqualsBookChange (R"(
+    version: 5
+    changed_assets: "gold"
+  )"));
+  EXPECT_THAT (o.WaitForChange (4, {"silver"}, WAIT), EqualsBookChange (R"(
+    version: 5
+  )"));
+}
+
+TEST_F (OrderbookWaitTests, OnlyChangedOrdersCount)
+{
+  o.UpdateOrders (ParseTextProto<proto::OrdersOfAccount> (R"(
+    account: "domob"
+    seq: 1
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+    orders: { key: 2 value: { asset: "silver" type: BID price_sat: 5 } }
+  )"));
+  EXPECT_THAT (o.WaitForChange (0, {}, WAIT), EqualsBookChange (R"(
+    version: 1
+    changed_assets: "gold"
+    changed_assets: "silver"
+  )"));
+
+  /* Only the asset whose order is different is changed.  */
+  o.UpdateOrders (ParseTextProto<proto::OrdersOfAccount> (R"(
+    account: "domob"
+    seq: 2
+    orders: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+    orders: { key: 2 value: { asset: "silver" type: BID price_sat: 6 } }
+  )"));
+  EXPECT_THAT (o.WaitForChange (1, {}, WAIT), EqualsBookChange (R"(
+    version: 2
+    changed_assets: "silver"
+  )"));
+
+  /* Re-adding an unchanged order in a delta is not a change either.  */
+  ASSERT_TRUE (ApplyDeltas (o, R"(
+    account: "domob"
+    seq: 3
+    added: { key: 1 value: { asset: "gold" type: ASK price_sat: 10 } }
+  )"));
+  EXPECT_THAT (o.WaitForChange (2, {}, WAIT), EqualsBookChange (R"(
+    version: 2
+  )"));
+}
+
+TEST_F (OrderbookWaitTests, FilteredByAssets)
+{
+  SetOrder ("domob", "gold", 10);
+  SetOrder ("andy", "silver", 10);
+
+  EXPECT_THAT (o.WaitForChange (1, {"gold", "foo"}, WAIT), EqualsBookChange (R"(
+    version: 2
+  )"));
+  EXPECT_THAT (o.WaitForChange (0, {"gold", "foo"}, WAIT), EqualsBookChange (R"(
+    version: 2
+    changed_assets: "gold"
+  )"));
+
+  /* A known version in the future reports all assets as changed.  */
+  EXPECT_THAT (o.WaitForChange (10, {"gold", "foo"}, WAIT),
+               EqualsBookChange (R"(
+    version: 2
+    changed_assets: "foo"
+    changed_assets: "gold"
+  )"));
+}
+
+TEST_F (OrderbookWaitTests, WakesUpOnChange)
+{
+  proto::BookChange res;
+  std::thread waiter([this, &res] ()
+    {
+      res = o.WaitForChange (0, {"silver"}, std::chrono::seconds (10));
+    });
+
+  SetOrder ("domob", "gold", 10);
+  std::this_thread::sleep_for (WAIT);
+  SetOrder ("andy", "silver", 10);
+  waiter.join ();
+
+  EXPECT_THAT (res, EqualsBookChange (R"(
+    version: 2
+    changed_assets: "silver"
+  )"));
+}
+
+TEST_F (OrderbookTests, Timeout)
+{
+  constexpr auto TIMEOUT = std::chrono::milliseconds (100);
+  OrderBook o(TIMEOUT);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 100 }
+      }
+  )");
+  UpdateOrders (o, R"(
+    account: "andy"
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: BID price_sat: 10 }
+      }
+  )");
+
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "andy" id: 1 price_sat: 10 }
+    asks: { account: "domob" id: 1 price_sat: 100 }
+  )"));
+
+  std::this_thread::sleep_for (0.75 * TIMEOUT);
+  UpdateOrders (o, R"(
+    account: "andy"
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: BID price_sat: 15 }
+      }
+  )");
+  std::this_thread::sleep_for (0.75 * TIMEOUT);
+
+  EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+    asset: "gold"
+    bids: { account: "andy" id: 1 price_sat: 15 }
+  )"));
+
+  std::this_thread::sleep_for (TIMEOUT);
+  EXPECT_THAT (o.GetByAsset (), EqualsOrdersByAsset (""));
+}
+
+TEST_F (OrderbookTests, TimeoutRefreshedRepeatedly)
+{
+  constexpr auto TIMEOUT = std::chrono::milliseconds (100);
+  OrderBook o(TIMEOUT);
+
+  UpdateOrders (o, R"(
+    account: "domob"
+    seq: 0
+    orders:
+      {
+        key: 1
+        value: { asset: "gold" type: ASK price_sat: 100 }
+      }
+  )");
+
+  /* Refreshing the account many times (both with full updates and deltas)
+     keeps it alive for much longer than the timeout.  */
+  for (unsigned i = 1; i <= 10; ++i)
+    {
+      std::this_thread::sleep_for (0.3 * TIMEOUT);
+      if (i % 2 == 0)
+        UpdateOrders (o, R"(
+          account: "domob"
+          seq: 0
+          orders:
+            {
+              key: 1
+              value: { asset: "gold" type: ASK price_sat: 100 }
+            }
+        )");
+      else
+        ASSERT_TRUE (ApplyDeltas (o, R"(
+          account: "domob"
+          seq: 1
+        )"));
+      EXPECT_THAT (o.GetForAsset ("gold"), EqualsOrdersForAsset (R"(
+        asset: "gold"
+        asks: { account: "domob" id: 1 price_sat: 100 }
+      )"));
+    }
+
+  std::this_thread::sleep_for (2 * TIMEOUT);
   EXPECT_THAT (o.GetByAsset (), EqualsOrdersByAsset (""));
 }
 
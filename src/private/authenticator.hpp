@@ -21,6 +21,7 @@
 
 #include <gloox/jid.h>
 
+#include <mutex>
 #include <set>
 #include <string>
 #include <unordered_map>
@@ -33,6 +34,8 @@ namespace democrit
  * In particular, we have a list of XMPP servers / domains that we trust
  * to run XID authentication.  For any JID from those servers, we then
  * see if we can decode the username into a Xaya account.
+ *
+ * This class is thread-safe.
  */
 class Authenticator
 {
@@ -50,6 +53,9 @@ private:
    */
   mutable std::unordered_map<std::string, gloox::JID> knownJids;
 
+  /** Lock protecting knownJids.  */
+  mutable std::mutex mut;
+
   /**
    * Constructs an instance with the list of servers extracted from
    * a comma-separated list of strings.
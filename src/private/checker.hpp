@@ -20,6 +20,7 @@
 #define DEMOCRIT_CHECKER_HPP
 
 #include "assetspec.hpp"
+#include "private/headercache.hpp"
 #include "private/rpcclient.hpp"
 #include "proto/trades.pb.h"
 #include "rpc-stubs/xayarpcclient.h"
@@ -27,6 +28,7 @@
 #include <json/json.h>
 
 #include <string>
+#include <vector>
 
 namespace democrit
 {
@@ -44,6 +46,30 @@ proto::OutPoint OutPointFromJson (const Json::Value& val);
 proto::OutPoint GetNameOutPoint (RpcClient<XayaRpcClient>& rpc,
                                  const std::string& account);
 
+/**
+ * Looks up all the given outpoints with gettxout, using a single batched
+ * JSON-RPC request.  Returns the results in the same order, which are
+ * JSON null for outputs that are spent or do not exist.
+ */
+std::vector<Json::Value> GetTxOuts (RpcClient<XayaRpcClient>& rpc,
+                                    const std::vector<proto::OutPoint>& outs);
+
+/**
+ * Decodes all the given PSBTs.  If possible, this is done natively
+ * (see DecodePsbtNatively).  Otherwise all of them are decoded with
+ * decodepsbt, using a single batched JSON-RPC request.  In either case,
+ * the results are comparable to each other.  Returns the decoded values
+ * in the same order.
+ */
+std::vector<Json::Value> DecodePsbts (RpcClient<XayaRpcClient>& rpc,
+                                      const std::vector<std::string>& psbts);
+
+/**
+ * Decodes a single PSBT like DecodePsbts.
+ */
+Json::Value DecodePsbt (RpcClient<XayaRpcClient>& rpc,
+                        const std::string& psbt);
+
 /**
  * Helper class that implements the verification of trades before the
  * buyer or seller signs them, i.e. the critical things that could result
@@ -60,6 +86,9 @@ private:
   /** Xaya RPC connection for checking the blockchain state.  */
   RpcClient<XayaRpcClient>& xaya;
 
+  /** Cache of recent block headers for checking block ancestry.  */
+  BlockHeaderCache& headers;
+
   /** The buyer's account name.  */
   const std::string buyer;
 
@@ -78,9 +107,10 @@ private:
 public:
 
   explicit TradeChecker (const AssetSpec& as, RpcClient<XayaRpcClient>& x,
+                         BlockHeaderCache& h,
                          const std::string& b, const std::string& s,
                          const Asset& a, const Amount p, const Amount u)
-    : spec(as), xaya(x),
+    : spec(as), xaya(x), headers(h),
       buyer(b), seller(s),
       asset(a), price(p), units(u)
   {}
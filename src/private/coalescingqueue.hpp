@@ -0,0 +1,140 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_COALESCINGQUEUE_HPP
+#define DEMOCRIT_COALESCINGQUEUE_HPP
+
+#include "private/workerpool.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace democrit
+{
+
+/**
+ * Queue of jobs keyed by some string (e.g. an account name), which are
+ * executed asynchronously on a pool of worker threads.  Jobs for the same
+ * key are run strictly in order and never concurrently, while jobs for
+ * different keys run in parallel.
+ *
+ * Each key has a bounded queue of pending jobs.  A job can either be
+ * appended to it, or replace all pending jobs for the key (when it
+ * supersedes them, e.g. a full update of orders).  This way, a flood of
+ * messages from one peer does not cause unbounded work.
+ */
+class CoalescingQueue
+{
+
+private:
+
+  /**
+   * The state of one key that has jobs pending or running.
+   */
+  struct KeyQueue
+  {
+
+    /** Jobs that are waiting to be run.  */
+    std::deque<std::function<void ()>> pending;
+
+    /** Whether or not a worker is currently draining this queue.  */
+    bool running = false;
+
+  };
+
+  /** Maximum number of pending jobs per key.  */
+  const size_t maxPending;
+
+  /** Mutex for this instance and its condition variable.  */
+  std::mutex mut;
+
+  /** Condition variable notified when all queues become empty.  */
+  std::condition_variable cvIdle;
+
+  /** The queues of all keys that have jobs pending or running.  */
+  std::map<std::string, KeyQueue> queues;
+
+  /** Set to true when no more jobs should be accepted.  */
+  bool stopped = false;
+
+  /**
+   * The worker threads.  This is declared last, so that it is destroyed
+   * (finishing all queued work) before the other members.
+   */
+  WorkerPool pool;
+
+  /**
+   * Adds a job for the given key, optionally replacing all pending ones.
+   * Returns false if the job has been dropped because the key's queue
+   * is full or the queue has been stopped.
+   */
+  bool Enqueue (const std::string& key, std::function<void ()> job,
+                bool replace);
+
+  /**
+   * Runs pending jobs of the given key until its queue is empty.
+   */
+  void Drain (const std::string& key);
+
+public:
+
+  /**
+   * Constructs the queue with the given number of worker threads and
+   * limit on pending jobs per key.
+   */
+  explicit CoalescingQueue (unsigned numThreads, size_t maxPending);
+
+  CoalescingQueue () = delete;
+  CoalescingQueue (const CoalescingQueue&) = delete;
+  void operator= (const CoalescingQueue&) = delete;
+
+  /**
+   * Appends a job for the given key, to be run after all jobs already
+   * queued for it.  Returns false (and drops the job) if there are
+   * already too many pending jobs for the key, or if Stop has been called.
+   */
+  bool Push (const std::string& key, std::function<void ()> job);
+
+  /**
+   * Queues a job for the given key, which replaces all jobs pending for
+   * it (but not one that is already running).  The job is dropped
+   * if Stop has been called.
+   */
+  void Replace (const std::string& key, std::function<void ()> job);
+
+  /**
+   * Stops accepting new jobs.  Jobs that are already queued are still
+   * run as usual.
+   */
+  void Stop ();
+
+  /**
+   * Blocks until all queued jobs have been run.
+   */
+  void WaitIdle ();
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_COALESCINGQUEUE_HPP
@@ -0,0 +1,153 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_HEADERCACHE_HPP
+#define DEMOCRIT_HEADERCACHE_HPP
+
+#include "private/rpcclient.hpp"
+#include "rpc-stubs/xayarpcclient.h"
+
+#include <xayautil/uint256.hpp>
+
+#include <json/json.h>
+
+#include <map>
+#include <mutex>
+
+namespace democrit
+{
+
+/**
+ * Thread-safe in-memory cache of recent block headers (or rather, of the
+ * parent hash and height of each block), which allows checking block
+ * ancestry without a sequence of getblockheader calls.
+ *
+ * The parent and height of a block never change, so entries are always
+ * valid.  The cache is kept to the last few blocks of the active chain
+ * by calling Warm with each new tip:  Missing headers are then fetched in
+ * bulk with batched RPC calls, and all entries that are too old or
+ * not on the new active chain anymore (after a reorg) are dropped.
+ *
+ * Headers that are requested but not cached are looked up individually
+ * with getblockheader, so the cache works (just slower) also if it is not
+ * warmed at all.
+ */
+class BlockHeaderCache
+{
+
+private:
+
+  /** The data we store for each block.  */
+  struct Header
+  {
+
+    /** The block's height.  */
+    unsigned height;
+
+    /** The parent block's hash.  */
+    xaya::uint256 parent;
+
+    /** Whether or not the block has a parent (false only for genesis).  */
+    bool hasParent;
+
+  };
+
+  /** RPC connection to Xaya Core.  */
+  RpcClient<XayaRpcClient>& rpc;
+
+  /** Number of blocks back from the tip that are kept by Warm.  */
+  const unsigned maxBlocks;
+
+  /** The cached headers by block hash.  */
+  std::map<xaya::uint256, Header> headers;
+
+  /** The highest block height we have seen.  */
+  unsigned maxHeight;
+
+  /** Mutex protecting the cached data.  */
+  mutable std::mutex mut;
+
+  /**
+   * Mutex held while warming the cache, so that concurrent calls to Warm
+   * do not fetch the same headers twice.
+   */
+  std::mutex mutWarm;
+
+  /**
+   * Parses and validates a getblockheader result for the given hash.
+   */
+  static Header HeaderFromJson (const xaya::uint256& hash,
+                                const Json::Value& val);
+
+  /**
+   * Adds a header to the cache.  Must be called while holding the lock.
+   * If the cache grows too large (e.g. because Warm is not called), this
+   * drops old entries.
+   */
+  void AddHeader (const xaya::uint256& hash, const Header& h);
+
+  /**
+   * Returns the header for a block, either from the cache or by querying
+   * it with getblockheader (and then adding it to the cache).
+   */
+  Header GetHeader (const xaya::uint256& hash);
+
+  /**
+   * Fetches the headers of all blocks in the given height range (inclusive)
+   * on the current active chain, using one batched call to getblockhash and
+   * one to getblockheader, and adds them to the cache.
+   */
+  void FetchRange (unsigned from, unsigned to);
+
+public:
+
+  /** Default number of blocks to keep.  */
+  static constexpr unsigned DEFAULT_BLOCKS = 300;
+
+  explicit BlockHeaderCache (RpcClient<XayaRpcClient>& r,
+                             unsigned n = DEFAULT_BLOCKS);
+
+  BlockHeaderCache () = delete;
+  BlockHeaderCache (const BlockHeaderCache&) = delete;
+  void operator= (const BlockHeaderCache&) = delete;
+
+  /**
+   * Updates the cache for a new chain tip.  This fetches all headers of
+   * the last blocks up to the tip that are not cached yet, and removes
+   * everything else from the cache.  It may throw if the RPC calls fail,
+   * e.g. because of a reorg happening concurrently.
+   */
+  void Warm (const xaya::uint256& tip);
+
+  /**
+   * Checks if the given ancestor block is the child block itself or
+   * one of its n most recent ancestors.
+   */
+  bool IsAncestor (const xaya::uint256& ancestor, const xaya::uint256& child,
+                   int n);
+
+  /**
+   * Returns the number of cached headers.
+   */
+  size_t GetSize () const;
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_HEADERCACHE_HPP
@@ -0,0 +1,83 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_INTERNER_HPP
+#define DEMOCRIT_INTERNER_HPP
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+namespace democrit
+{
+
+/**
+ * A reference-counted pool of strings.  Interning a string returns a
+ * pointer to a single shared copy of it, which stays valid until all
+ * references to it have been released.  This is used to avoid storing
+ * many copies of strings that repeat a lot (like asset names), and
+ * allows comparing them for equality just by pointer.
+ *
+ * This class does no synchronisation on its own.
+ */
+class StringInterner
+{
+
+public:
+
+  /** Handle to an interned string.  */
+  using Handle = const std::string*;
+
+private:
+
+  /** The interned strings with their reference counts.  */
+  std::unordered_map<std::string, unsigned> strings;
+
+public:
+
+  StringInterner () = default;
+
+  StringInterner (const StringInterner&) = delete;
+  void operator= (const StringInterner&) = delete;
+
+  /**
+   * Interns the given string, returning its handle.  Each call to Intern
+   * must be matched by a call to Release for the handle.
+   */
+  Handle Intern (const std::string& str);
+
+  /**
+   * Releases one reference to an interned string.  If that was the last
+   * one, the string is removed from the pool.
+   */
+  void Release (Handle h);
+
+  /**
+   * Returns the number of distinct strings in the pool.
+   */
+  size_t
+  GetSize () const
+  {
+    return strings.size ();
+  }
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_INTERNER_HPP
@@ -19,6 +19,8 @@
 #ifndef DEMOCRIT_MUCCLIENT_HPP
 #define DEMOCRIT_MUCCLIENT_HPP
 
+#include "private/sendqueue.hpp"
+
 #include <charon/xmppclient.hpp>
 
 #include <gloox/jid.h>
@@ -46,6 +48,11 @@ namespace democrit
  * for that).  The MucClient also takes care of mapping in-room nick names
  * to real JIDs, which we can then "soft rely on" as being authenticated
  * through XID.
+ *
+ * Outgoing messages are not sent directly from the calling thread, but
+ * queued and sent by a dedicated thread.  Private messages (which are used
+ * for trades) take precedence over broadcasts, and the overall rate is
+ * limited so that we do not exceed what the server allows.
  */
 class MucClient : private charon::XmppClient,
                   private gloox::MUCRoomHandler,
@@ -123,12 +130,19 @@ private:
    */
   bool ResolveNickname (const std::string& nick, gloox::JID& jid) const;
 
+  /** The queue for outgoing messages.  */
+  std::unique_ptr<SendQueue> sendQueue;
+
   /**
-   * Adds the given stanza extensions to the message and then broadcasts it
-   * using normal "send" functionality.  This code is shared between sending
-   * public and private messages.
+   * Adds the given stanza extensions to the message and then queues it
+   * for sending.  This code is shared between sending public and private
+   * messages.  The group and supersedes arguments are used for coalescing
+   * as per SendQueue::Push.  If we are not connected, the message is
+   * dropped with a warning.
    */
-  void SendMessage (gloox::Message&& msg, ExtensionData&& ext);
+  void QueueMessage (std::shared_ptr<gloox::Message> msg, ExtensionData&& ext,
+                     SendQueue::Priority prio, const std::string& group,
+                     bool supersedes);
 
   void handleMUCError (gloox::MUCRoom* r, gloox::StanzaError) override;
   bool handleMUCRoomCreation (gloox::MUCRoom* r) override;
@@ -182,6 +196,14 @@ protected:
   HandlePrivate (const gloox::JID& sender, const gloox::Stanza& msg)
   {}
 
+  /**
+   * Handler called when a new participant joins the room.  It is called
+   * with the full JID (not the nickname).
+   */
+  virtual void
+  HandleJoin (const gloox::JID& joined)
+  {}
+
   /**
    * Handler called when a participant leaves the room.  This can be used
    * to then e.g. immediately remove their orders from the orderbook.  It is
@@ -240,6 +262,15 @@ public:
    */
   void PublishMessage (ExtensionData&& ext);
 
+  /**
+   * Publishes a message to the channel as part of a coalescing group.
+   * If supersedes is true, all messages of the same group that have not
+   * yet been sent are dropped (e.g. because this is a full update of
+   * some data that they were incremental changes to).
+   */
+  void PublishMessage (ExtensionData&& ext, const std::string& group,
+                       bool supersedes);
+
   /**
    * Sends a private message to a target JID.  Note that Democrit uses "real"
    * XMPP messages to the actual JID for private messaging, not MUC private
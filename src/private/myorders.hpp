@@ -21,11 +21,16 @@
 
 #include "private/intervaljob.hpp"
 #include "private/state.hpp"
+#include "private/workerpool.hpp"
 #include "proto/orders.pb.h"
 
+#include <atomic>
 #include <chrono>
 #include <mutex>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace democrit
 {
@@ -45,6 +50,26 @@ private:
   /** Global state instance, which holds the orders.  */
   State& state;
 
+  /**
+   * Lock held while changing our orders and broadcasting the corresponding
+   * update.  This ensures that broadcasts are sent out in the same order
+   * as the changes were made and their sequence numbers assigned.
+   */
+  std::mutex mutBroadcast;
+
+  /** The sequence number of the last broadcast snapshot or delta.  */
+  uint64_t seq = 0;
+
+  /**
+   * Set to true if the next update must be sent as full snapshot rather
+   * than a delta, e.g. because a previous broadcast could not be sent.
+   * This is atomic so that RequestSnapshot does not need to lock.
+   */
+  std::atomic<bool> needSnapshot;
+
+  /** Worker threads used to validate orders during refreshes.  */
+  std::unique_ptr<WorkerPool> validators;
+
   /** The worker job to send refreshing broadcasts.  */
   std::unique_ptr<IntervalJob> refresher;
 
@@ -54,10 +79,38 @@ private:
   void StartRefresher (std::chrono::milliseconds intv);
 
   /**
-   * Runs a single refresh iteration.
+   * Runs a single refresh iteration.  This validates all our orders
+   * and drops invalid ones, and then broadcasts a full snapshot.
+   *
+   * Validation may involve slow calls (e.g. RPCs to a GSP), so it is done
+   * without holding any locks.  We take a copy of the orders first, validate
+   * them concurrently on the worker pool, and then drop invalid orders
+   * only if they have not been modified in the mean time.
    */
   void RunRefresh ();
 
+  /**
+   * Validates all given orders in parallel batches on the worker pool.
+   * Returns a vector with one entry for each order, which is true
+   * if the order was valid.
+   */
+  std::vector<bool> ValidateAll (
+      const std::string& account,
+      const std::vector<std::pair<uint64_t, proto::Order>>& toValidate) const;
+
+  /**
+   * Broadcasts a full snapshot of our (unlocked) orders.  Must be called
+   * with mutBroadcast held.
+   */
+  void BroadcastSnapshot ();
+
+  /**
+   * Broadcasts the given change to our orders as delta, or falls back to
+   * a full snapshot if that is not possible.  Must be called with
+   * mutBroadcast held.
+   */
+  void BroadcastDeltas (proto::OrderDeltas&& deltas);
+
   /**
    * Internal implementation of GetOrders (returns all own orders),
    * which allows specifying whether to include locked orders or not.
@@ -71,6 +124,9 @@ protected:
    * returns true, but it can be overridden to add proper validation.
    * This is used when adding an order, and also when orders are refreshed
    * to weed out invalid ones.
+   *
+   * It is called without holding any locks, and potentially from multiple
+   * threads in parallel.
    */
   virtual bool ValidateOrder (const std::string& account,
                               const proto::Order& o) const;
@@ -80,15 +136,36 @@ protected:
    * updates for the orders of the current account.  This is mostly used
    * to broadcast them via XMPP, but can be used directly in tests as
    * well.
+   *
+   * The orders passed in are a full snapshot, with a sequence number
+   * set that further deltas will be based on.  The function should return
+   * false if the update could not be sent, in which case the next change
+   * will be broadcast as full snapshot again.
+   */
+  virtual bool
+  UpdateOrders (const proto::OrdersOfAccount& ownOrders)
+  {
+    return true;
+  }
+
+  /**
+   * Subclasses can implement this method to be notified of incremental
+   * changes to the orders of the current account, following onto
+   * the last snapshot or delta.  It should return false if the update
+   * could not be sent.  In that case, a full snapshot is sent via
+   * UpdateOrders instead.  The default implementation does just that.
    */
-  virtual void UpdateOrders (const proto::OrdersOfAccount& ownOrders)
-  {}
+  virtual bool
+  UpdateOrderDeltas (const proto::OrderDeltas& deltas)
+  {
+    return false;
+  }
 
 public:
 
   template <typename Rep, typename Period>
     explicit MyOrders (State& s, const std::chrono::duration<Rep, Period> intv)
-    : state(s)
+    : state(s), needSnapshot(true)
   {
     StartRefresher (intv);
   }
@@ -132,6 +209,17 @@ public:
    */
   void Unlock (uint64_t id);
 
+  /**
+   * Requests that the next update to our orders is broadcast as full
+   * snapshot rather than a delta.  This is used e.g. when a new participant
+   * joins, which would not be able to apply deltas.
+   */
+  void
+  RequestSnapshot ()
+  {
+    needSnapshot = true;
+  }
+
   /**
    * Returns the current set of own orders.  This includes locked orders.
    */
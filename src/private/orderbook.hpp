@@ -20,15 +20,23 @@
 #define DEMOCRIT_ORDERBOOK_HPP
 
 #include "assetspec.hpp"
+#include "private/interner.hpp"
 #include "private/intervaljob.hpp"
 #include "proto/orders.pb.h"
 
+#include <google/protobuf/map.h>
+
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
 #include <map>
 #include <mutex>
 #include <memory>
-#include <queue>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace democrit
 {
@@ -46,11 +54,57 @@ namespace democrit
  * Validation of received orders (with an AssetSpec) has to be done outside,
  * before passing the orders in here, if desired.
  *
+ * To bound the memory used, limits can be configured for the number of
+ * orders and assets per account as well as for the (estimated) total size
+ * of the book.  Orders exceeding the per-account limits are dropped, and
+ * when the total size is exceeded, orders are evicted.
+ *
  * This class does necessary synchronisation on its own.
  */
 class OrderBook
 {
 
+public:
+
+  /**
+   * The policy for choosing what to drop when the orderbook exceeds
+   * its memory budget.
+   */
+  enum class EvictionPolicy
+  {
+
+    /** Remove all orders of the account that was updated least recently.  */
+    OLDEST_UPDATE,
+
+    /**
+     * Remove the single order that is furthest from the top of the book
+     * (the lowest bid or highest ask) of the asset with the most orders.
+     */
+    FURTHEST_FROM_TOP,
+
+  };
+
+  /**
+   * Configurable limits for the stored orders.  A value of zero means
+   * that the respective limit is not enforced.
+   */
+  struct Limits
+  {
+
+    /** Maximum number of orders stored for a single account.  */
+    size_t maxOrdersPerAccount = 0;
+
+    /** Maximum number of distinct assets a single account has orders for.  */
+    size_t maxAssetsPerAccount = 0;
+
+    /** Budget for the estimated total memory (see GetUsage).  */
+    size_t maxBytes = 0;
+
+    /** What to evict when the memory budget is exceeded.  */
+    EvictionPolicy eviction = EvictionPolicy::OLDEST_UPDATE;
+
+  };
+
 private:
 
   /**
@@ -74,22 +128,83 @@ private:
    */
   Clock::duration timeoutIntv;
 
+  /**
+   * A slot in the timing wheel.  It holds pointers to the account names
+   * (the keys in the orders map) of all accounts whose expiry falls into
+   * the slot's tick.
+   */
+  using WheelSlot = std::list<const std::string*>;
+
+  /**
+   * Compact representation of an order as stored internally.  The asset is
+   * interned, and the account is implied by where the order is stored
+   * (or given by the OrderKey in the index).  Protocol buffers are only
+   * created from this when returning data to callers.
+   */
+  struct PackedOrder
+  {
+
+    /** Flag bits for the presence of optional fields.  */
+    enum Flags : uint8_t
+    {
+      HAS_MIN_UNITS = 1 << 0,
+      HAS_MAX_UNITS = 1 << 1,
+      HAS_LOCKED = 1 << 2,
+      LOCKED = 1 << 3,
+    };
+
+    /** The order's ID.  */
+    uint64_t id;
+
+    /** The price per unit.  */
+    uint64_t price;
+
+    /** Minimum units (if HAS_MIN_UNITS is set).  */
+    uint64_t minUnits;
+
+    /** Maximum units (if HAS_MAX_UNITS is set).  */
+    uint64_t maxUnits;
+
+    /** The interned asset.  */
+    StringInterner::Handle asset;
+
+    /** The type of order.  */
+    proto::Order::Type type;
+
+    /** Combination of the Flags bits.  */
+    uint8_t flags;
+
+  };
+
   /**
    * The per-account data that we store for the orderbook.
    */
   struct AccountOrders
   {
 
-    /** The actual orders of that account.  */
-    proto::OrdersOfAccount orders;
+    /** The orders of that account, sorted by ID.  */
+    std::vector<PackedOrder> orders;
+
+    /** Whether or not we have a sequence number for the orders.  */
+    bool hasSeq = false;
+
+    /** The sequence number of the orders (if hasSeq is set).  */
+    uint64_t seq = 0;
 
     /** The last update time.  */
     Clock::time_point lastUpdate;
 
-    explicit AccountOrders (proto::OrdersOfAccount&& o,
-                            const Clock::time_point t)
-      : orders(std::move (o)), lastUpdate(t)
-    {}
+    /** The index of the timing-wheel slot this account is in.  */
+    size_t slot;
+
+    /** The account's entry in its timing-wheel slot.  */
+    WheelSlot::iterator wheelPos;
+
+    /** The number of orders as last counted into the usage totals.  */
+    size_t countedOrders = 0;
+
+    /** The estimated bytes as last counted into the usage totals.  */
+    size_t countedBytes = 0;
 
     AccountOrders () = default;
     AccountOrders (AccountOrders&&) = default;
@@ -103,39 +218,224 @@ private:
   /** Orders of all other accounts that we know of.  */
   std::map<std::string, AccountOrders> orders;
 
+  /** Interned asset strings of all orders we have.  */
+  StringInterner assets;
+
+  /** The limits we enforce.  */
+  Limits limits;
+
+  /** Total number of orders in all accounts.  */
+  size_t numOrders = 0;
+
+  /** Total estimated bytes used by all accounts.  */
+  size_t numBytes = 0;
+
   /**
-   * An entry into the queue of update events.
+   * Key for an order inside the per-asset index.  Orders are sorted by
+   * price first, with ties broken by account and ID.
    */
-  struct UpdateEvent
+  struct OrderKey
   {
 
-    /** The account that was updated.  */
-    std::string account;
+    /** The order's price per unit.  */
+    uint64_t price;
 
-    /** The update's time.  */
-    Clock::time_point time;
+    /**
+     * The account owning the order.  This points to the key in the orders
+     * map, which stays valid as long as the account has indexed orders.
+     */
+    const std::string* account;
 
-    explicit UpdateEvent (const std::string& a, const Clock::time_point t)
-      : account(a), time(t)
+    /** The order's ID within the account.  */
+    uint64_t id;
+
+    explicit OrderKey (const uint64_t p, const std::string& a, const uint64_t i)
+      : price(p), account(&a), id(i)
     {}
 
-    UpdateEvent (UpdateEvent&&) = default;
-    UpdateEvent (const UpdateEvent&) = delete;
-    void operator= (const UpdateEvent&) = delete;
+    friend bool
+    operator< (const OrderKey& a, const OrderKey& b)
+    {
+      if (a.price != b.price)
+        return a.price < b.price;
+      if (a.account != b.account)
+        return *a.account < *b.account;
+      return a.id < b.id;
+    }
+
+  };
+
+  /**
+   * Aggregate data of all orders at one price level.
+   */
+  struct Level
+  {
+
+    /** Total units (max_units) of the orders.  */
+    uint64_t units = 0;
+
+    /** Number of orders.  */
+    unsigned orders = 0;
+
+  };
+
+  /**
+   * The indexed orderbook of one asset.  In addition to the orders
+   * themselves, aggregates per price level are kept up-to-date
+   * incrementally as orders are indexed and unindexed.
+   */
+  struct AssetBook
+  {
+
+    /** All bids, by increasing price (must be iterated in reverse).  */
+    std::map<OrderKey, PackedOrder> bids;
+
+    /** All asks, by increasing price.  */
+    std::map<OrderKey, PackedOrder> asks;
+
+    /** Bid levels by increasing price.  */
+    std::map<uint64_t, Level> bidLevels;
+
+    /** Ask levels by increasing price.  */
+    std::map<uint64_t, Level> askLevels;
+
+  };
+
+  /**
+   * Index of all orders by asset.  This is kept in sync with the orders
+   * map whenever orders are updated or timed out, so that queries can
+   * just copy out the already sorted data.
+   */
+  std::map<Asset, AssetBook> byAsset;
+
+  /**
+   * All assets in byAsset together with their number of orders (bids and
+   * asks), ordered by that count.  This lets the eviction find the asset
+   * with the most orders without scanning all of them.
+   */
+  std::set<std::pair<size_t, Asset>> assetsBySize;
+
+  /**
+   * Assets whose index has changed since the last published snapshot.
+   * Orders are only unindexed and indexed again if they actually differ,
+   * so that being marked here means a real change to the asset's book.
+   */
+  std::set<Asset> dirtyAssets;
+
+  /**
+   * Compact representation of an order in a published snapshot.  This is
+   * like PackedOrder, but self-contained (without pointers into the
+   * writer-side data), since snapshots live on after the lock is released.
+   * The asset and type are implied by where the order is stored.
+   */
+  struct SnapshotOrder
+  {
+
+    /** The order's ID.  */
+    uint64_t id;
+
+    /** The price per unit.  */
+    uint64_t price;
+
+    /** Minimum units (if HAS_MIN_UNITS is set).  */
+    uint64_t minUnits;
+
+    /** Maximum units (if HAS_MAX_UNITS is set).  */
+    uint64_t maxUnits;
+
+    /** Index of the owning account in the asset's accounts list.  */
+    uint32_t account;
+
+    /** Combination of the PackedOrder::Flags bits.  */
+    uint8_t flags;
+
+  };
+
+  /**
+   * The published data for one asset.
+   */
+  struct AssetSnapshot
+  {
+
+    /** The orderbook version at which this asset last changed.  */
+    uint64_t version;
+
+    /** Names of all accounts with orders for this asset.  */
+    std::vector<std::string> accounts;
+
+    /** All bids, best (highest price) first.  */
+    std::vector<SnapshotOrder> bids;
+
+    /** All asks, best (lowest price) first.  */
+    std::vector<SnapshotOrder> asks;
+
+    /** All price levels.  */
+    proto::DepthForAsset depth;
+
+  };
+
+  /**
+   * Immutable state of the orderbook as seen by readers.  Each asset's book
+   * is shared between successive snapshots as long as it does not change.
+   */
+  struct Snapshot
+  {
+
+    /** The version of the orderbook this corresponds to.  */
+    uint64_t version = 0;
+
+    /** The data per asset (for all assets with orders).  */
+    std::map<Asset, std::shared_ptr<const AssetSnapshot>> assets;
+
+    /**
+     * The last version at which some asset lost all its orders (or zero
+     * if that never happened).  We do not keep track of removed assets
+     * individually, since that would grow without bounds.  Instead,
+     * all assets without orders are considered changed since a known
+     * version before this.
+     */
+    uint64_t removedVersion = 0;
 
   };
 
   /**
-   * A queue of all the order updates we have received.  When trying to
-   * time out orders, we process the front elements of the queue, until
-   * the timestamp is too fresh.  Note that if an account is updated
-   * again, any previous entries remain in the queue (and will just be
-   * ignored when timing out orders).
+   * The currently published snapshot.  Writers (holding the lock) replace
+   * it atomically after each change, and readers just grab a reference
+   * to it without taking the lock.  This must only be accessed through
+   * std::atomic_load and std::atomic_store.
    */
-  std::queue<UpdateEvent> updates;
+  std::shared_ptr<const Snapshot> snapshot;
 
-  /** Lock used for this instance.  */
-  std::mutex mut;
+  /**
+   * Mutex used for waiting on changes.  This is separate from the main
+   * lock, so that waiters do not interfere with updates.
+   */
+  mutable std::mutex mutChange;
+
+  /** Condition variable notified whenever a new snapshot is published.  */
+  mutable std::condition_variable cvChange;
+
+  /**
+   * Hashed timing wheel for the account timeouts.  Time is divided into
+   * ticks of length timeoutIntv (starting at wheelStart), and each account
+   * is in exactly one slot, namely the one for the tick in which its orders
+   * expire (modulo the wheel size).  When an account is updated, it is
+   * just moved over to its new slot.  The wheel is large enough that
+   * all pending expiries fit into it without wrapping around.
+   */
+  std::vector<WheelSlot> wheel;
+
+  /** The time corresponding to the start of tick zero.  */
+  Clock::time_point wheelStart;
+
+  /** The first tick that has not been fully processed yet.  */
+  uint64_t nextTick;
+
+  /**
+   * Lock used for this instance.  It protects all the writer-side data,
+   * but is not needed for reading the published snapshot.
+   */
+  mutable std::mutex mut;
 
   /** The worker job to run timeouts.  */
   std::unique_ptr<IntervalJob> timeouter;
@@ -151,12 +451,165 @@ private:
   void RunTimeout ();
 
   /**
-   * Internal implementation of GetByAsset, which allows filtering for
-   * only one of the assets (ignoring all others).  This is used both
-   * for GetForAsset and GetByAsset.  If asset is set as null, then all
-   * assets will be returned instead.
+   * Returns the timing-wheel tick a given time point falls into.
+   */
+  uint64_t GetTick (Clock::time_point t) const;
+
+  /**
+   * Puts the given account into the timing-wheel slot matching its
+   * last update time.  If the account is already in the wheel (i.e.
+   * existing is true), it is moved from its current slot.
    */
-  proto::OrderbookByAsset InternalGetByAsset (const Asset* asset) const;
+  void ArmTimeout (const std::string& account, AccountOrders& ao,
+                   bool existing);
+
+  /**
+   * Converts an order from the proto format to the internal one.
+   * This interns the asset, which must be released again when
+   * the order is removed.
+   */
+  PackedOrder Pack (uint64_t id, const proto::Order& order);
+
+  /**
+   * Returns the flag bits of a PackedOrder corresponding to the given order.
+   */
+  static uint8_t GetFlags (const proto::Order& order);
+
+  /**
+   * Returns true if the given packed order has the same data as the
+   * given proto order (ignoring the latter's account and ID fields).
+   * The proto order must have all required fields set for this.
+   */
+  static bool Matches (const PackedOrder& packed, const proto::Order& order);
+
+  /**
+   * Returns true if the two packed orders are the same (including their ID).
+   */
+  static bool SameOrder (const PackedOrder& a, const PackedOrder& b);
+
+  /**
+   * Converts an order from a snapshot to the proto format as used
+   * in OrderbookForAsset (i.e. with account and ID but without asset
+   * and type).
+   */
+  static void Unpack (const AssetSnapshot& snap, const SnapshotOrder& order,
+                      proto::Order& out);
+
+  /**
+   * Releases the interned assets of all the given orders.
+   */
+  void ReleaseOrders (const std::vector<PackedOrder>& o);
+
+  /**
+   * Adds a single order of the given account to the per-asset index.
+   * The account must be the key in the orders map.
+   */
+  void IndexOrder (const std::string& account, const PackedOrder& order);
+
+  /**
+   * Removes a single order of the given account from the per-asset index.
+   */
+  void UnindexOrder (const std::string& account, const PackedOrder& order);
+
+  /**
+   * Adds all orders of the given account to the per-asset index.
+   */
+  void IndexOrders (const std::string& account,
+                    const std::vector<PackedOrder>& o);
+
+  /**
+   * Removes all orders of the given account from the per-asset index.
+   */
+  void UnindexOrders (const std::string& account,
+                      const std::vector<PackedOrder>& o);
+
+  /**
+   * Updates the per-asset index for a change of the given account's orders
+   * from before to after (both sorted by ID).  Only orders that are actually
+   * different are unindexed and indexed again.
+   */
+  void ReindexOrders (const std::string& account,
+                      const std::vector<PackedOrder>& before,
+                      const std::vector<PackedOrder>& after);
+
+  /**
+   * Removes the given account's orders completely (from the orders map
+   * as well as the index).  The iterator must be valid.
+   */
+  void EraseAccount (std::map<std::string, AccountOrders>::iterator mit);
+
+  /**
+   * Returns the estimated memory used for the given account and its orders.
+   * This includes the stored and indexed orders as well as their copies
+   * in the published snapshot, but not the interned asset strings (which
+   * are shared between all accounts).
+   */
+  static size_t EstimateBytes (const std::string& account,
+                               const AccountOrders& ao);
+
+  /**
+   * Updates the usage totals after the given account's orders have
+   * been changed.
+   */
+  void UpdateUsage (const std::string& account, AccountOrders& ao);
+
+  /**
+   * Checks if an order for the given asset can be added to the account's
+   * existing orders without exceeding the per-account limits.
+   */
+  bool FitsAccountLimits (const std::vector<PackedOrder>& existing,
+                          StringInterner::Handle asset) const;
+
+  /**
+   * Drops orders exceeding the per-account limits from the given list
+   * (sorted by ID).  Orders with lower IDs are kept preferentially.
+   * Returns the number of dropped orders.
+   */
+  size_t ApplyAccountLimits (std::vector<PackedOrder>& o);
+
+  /**
+   * Removes the account that was updated least recently.
+   */
+  void EvictOldestAccount ();
+
+  /**
+   * Removes the order furthest from the top of the book of the asset with
+   * the most orders.  Returns false if there are no orders at all.
+   */
+  bool EvictFurthestOrder ();
+
+  /**
+   * Evicts orders according to the eviction policy until the memory
+   * budget is respected again.
+   */
+  void EnforceMemoryLimit ();
+
+  /**
+   * Copies the indexed orders for one asset over to the compact
+   * format used in snapshots.
+   */
+  static void CopyAssetBook (const AssetBook& book, AssetSnapshot& out);
+
+  /**
+   * Converts the orders of one asset in a snapshot to the proto format
+   * returned from the public interface.
+   */
+  static void UnpackAssetBook (const Asset& asset, const AssetSnapshot& snap,
+                               proto::OrderbookForAsset& out);
+
+  /**
+   * Copies the price levels for one asset over to the proto format.
+   */
+  static void CopyAssetDepth (const AssetBook& book,
+                              proto::DepthForAsset& out);
+
+  /**
+   * Builds a new snapshot, with all dirty assets rebuilt from the index
+   * and the others shared with the current snapshot, and publishes it
+   * with a new version (if there are any dirty assets).
+   * Must be called with the lock held.
+   */
+  void PublishSnapshot ();
 
 public:
 
@@ -164,11 +617,20 @@ public:
     explicit OrderBook (const std::chrono::duration<Rep, Period> to)
     : timeout(to), timeoutIntv(MAX_TIMEOUT_INTV)
   {
-    /* If the timeout interval is longer than the actual timeout (because
-       we set it to something very short in a test), set the timeout
-       interval to the same value instead.  */
-    if (timeoutIntv > timeout)
-      timeoutIntv = timeout;
+    /* If the timeout interval is not much shorter than the actual timeout
+       (because we set it to something very short in a test), use a fraction
+       of the timeout instead.  Ticks with no expiring accounts are cheap
+       with the timing wheel, so this does not hurt.  */
+    if (timeoutIntv > timeout / 4)
+      timeoutIntv = timeout / 4;
+
+    /* Expiries are at most one timeout in the future.  We need one more
+       slot to account for rounding, and one for the current tick.  */
+    wheel.resize (timeout / timeoutIntv + 2);
+    wheelStart = Clock::now ();
+    nextTick = 0;
+
+    std::atomic_store (&snapshot, std::make_shared<const Snapshot> ());
 
     StartTimeouter ();
   }
@@ -177,16 +639,55 @@ public:
   OrderBook (const OrderBook&) = delete;
   void operator= (const OrderBook&) = delete;
 
+  /**
+   * Sets the limits to enforce.  They are applied to all future updates,
+   * and the memory budget is enforced immediately.
+   */
+  void SetLimits (const Limits& l);
+
+  /**
+   * Returns statistics about the memory currently used for the orders.
+   */
+  proto::OrderbookUsage GetUsage () const;
+
   /**
    * Updates the orders of the given account in the database.  If there
-   * are no orders specified, then the account will be removed from our
-   * database instead.
+   * are no orders specified and no sequence number, then the account will be
+   * removed from our database instead.  (With a sequence number, the empty
+   * set of orders is kept, so that deltas can be applied on top of it.)
    */
   void UpdateOrders (proto::OrdersOfAccount&& upd);
 
+  /**
+   * Applies an incremental update to the orders of an account.  This only
+   * has an effect if the sequence number follows directly onto the last
+   * snapshot or delta we have for the account.  Returns true if the
+   * update was applied, and false if it was ignored.
+   */
+  bool ApplyDeltas (proto::OrderDeltas&& upd);
+
+  /**
+   * Returns the IDs of those of the given orders that are already stored
+   * unchanged for the account.  This allows callers to skip validating
+   * orders again that an account just refreshes.
+   */
+  std::set<uint64_t> FindUnchanged (
+      const std::string& account,
+      const google::protobuf::Map<uint64_t, proto::Order>& o) const;
+
+  /**
+   * Removes the given order of an account, but only if it is still stored
+   * unchanged.  This can be used to drop orders that became invalid without
+   * interfering with concurrent updates.  Returns true if it was removed.
+   */
+  bool RemoveOrder (const std::string& account, uint64_t id,
+                    const proto::Order& o);
+
   /**
    * Returns the orderbook for a given asset (not including our
-   * own orders if any).
+   * own orders if any).  This (as well as GetByAsset) reads from the
+   * latest published snapshot and does not block on concurrent updates.
+   * The returned protos are built from the snapshot's compact data.
    */
   proto::OrderbookForAsset GetForAsset (const Asset& asset) const;
 
@@ -195,6 +696,43 @@ public:
    */
   proto::OrderbookByAsset GetByAsset () const;
 
+  /**
+   * Returns the aggregated price levels for the given asset, with at most
+   * the given number of best levels on each side (or all if levels is zero).
+   * The levels are prepared when publishing a snapshot, so that this only
+   * needs to copy out the requested levels.
+   */
+  proto::DepthForAsset GetDepth (const Asset& asset, unsigned levels) const;
+
+  /**
+   * Selects the best orders of the given type for the given asset, to fill
+   * up to the given number of units.  Only orders at or better than the
+   * limit price (i.e. asks with at most and bids with at least that price)
+   * are considered, and each order's min_units and max_units are respected.
+   * Since a seller can only be in one trade at a time, at most one ask
+   * is selected per account, and at most one bid overall.
+   * Returns the selected orders (with all fields filled in) together
+   * with the number of units to take from each.
+   */
+  std::vector<std::pair<proto::Order, Amount>> SelectBest (
+      const Asset& asset, proto::Order::Type type,
+      Amount units, uint64_t limitPrice) const;
+
+  /**
+   * Blocks until the orderbook version is different from the given known
+   * one and (if the list of assets is non-empty) one of the given assets
+   * has changed since the known version, or until the timeout expires.
+   * Returns the current version and the assets that have changed since
+   * the known version (restricted to the given assets if any).
+   *
+   * Assets that have no orders are reported as changed if any asset lost
+   * all its orders since the known version.  Without a list of assets,
+   * those are not reported individually; instead, assets_removed is set.
+   */
+  proto::BookChange WaitForChange (uint64_t known,
+                                   const std::set<Asset>& assets,
+                                   std::chrono::milliseconds timeout) const;
+
 };
 
 } // namespace democrit
@@ -0,0 +1,63 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_PSBT_HPP
+#define DEMOCRIT_PSBT_HPP
+
+#include <json/json.h>
+
+#include <string>
+
+namespace democrit
+{
+
+/**
+ * Tries to decode a base64-encoded PSBT (BIP 174) without calling
+ * Xaya Core's decodepsbt.  On success, the result is a JSON object with
+ * the same structure that decodepsbt uses for the parts we care about:
+ *
+ *  - "tx" holds the unsigned transaction with its "txid", "btxid",
+ *    "version", "locktime", "vin" (with "txid", "vout" and "sequence")
+ *    and "vout" (with "value", "n" and "scriptPubKey").  The scriptPubKey
+ *    contains the script's "hex" and, for name operations, "nameOp".
+ *  - "inputs" and "outputs" hold one object per input and output,
+ *    mapping the hex-encoded keys of the PSBT map to the hex-encoded values.
+ *    Unlike with decodepsbt, these are not further interpreted; but they can
+ *    be compared to see whether signing changed them.
+ *
+ * Returns false if the string is not a PSBT this function can decode,
+ * in which case decodepsbt should be used instead.
+ */
+bool DecodePsbtNatively (const std::string& psbt, Json::Value& res);
+
+/**
+ * Decodes a Xaya address (base58check or bech32 for any of the networks)
+ * to the scriptPubKey it pays to, in hex.  Returns false if the address
+ * is invalid or of an unknown type.
+ */
+bool AddressToScript (const std::string& addr, std::string& script);
+
+/**
+ * Checks whether the given scriptPubKey (in hex) pays to the given address.
+ * The script may have a name operation prefixed to the address part.
+ */
+bool ScriptPaysToAddress (const std::string& script, const std::string& addr);
+
+} // namespace democrit
+
+#endif // DEMOCRIT_PSBT_HPP
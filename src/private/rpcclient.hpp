@@ -21,15 +21,38 @@
 
 #include <jsonrpccpp/client.h>
 #include <jsonrpccpp/client/connectors/httpclient.h>
+#include <jsonrpccpp/client/rpcprotocolclient.h>
+
+#include <json/json.h>
 
 #include <map>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace democrit
 {
 
+/**
+ * A single method call that is part of a batched JSON-RPC request.
+ */
+struct BatchedCall
+{
+
+  /** The method to call.  */
+  std::string method;
+
+  /** The parameters to pass (a JSON array or object).  */
+  Json::Value params;
+
+  explicit BatchedCall (const std::string& m, const Json::Value& p)
+    : method(m), params(p)
+  {}
+
+};
+
 /**
  * Thin wrapper around a libjson-rpc-cpp JSON-RPC client, which makes
  * sure it is thread-safe by using a separate HTTP client instance for
@@ -56,6 +79,31 @@ private:
   /** Mutex protecting the maps.  */
   std::mutex mut;
 
+  /**
+   * References to the RPC and HTTP client instances of one thread.
+   */
+  struct ThreadClients
+  {
+
+    /** The JSON-RPC client.  */
+    T& rpc;
+
+    /** The HTTP client used by it.  */
+    jsonrpc::HttpClient& http;
+
+  };
+
+  /**
+   * Returns the clients for the current thread, creating them if needed.
+   */
+  ThreadClients GetThreadClients ();
+
+  /**
+   * Returns the HTTP client instance for the current thread, creating
+   * it (and the corresponding RPC client) if needed.
+   */
+  jsonrpc::HttpClient& GetHttpClient ();
+
 public:
 
   /**
@@ -87,6 +135,16 @@ public:
     return &(this->operator* ());
   }
 
+  /**
+   * Sends all the given method calls to the server as a single JSON-RPC
+   * batch request (i.e. in one round trip), and returns their results in
+   * the same order.  If any of the calls failed or the server's reply
+   * does not contain a response for each of them, a JsonRpcException
+   * for the first failure is thrown, just like it would have been if
+   * the methods were called individually.
+   */
+  std::vector<Json::Value> CallBatch (const std::vector<BatchedCall>& calls);
+
 };
 
 } // namespace democrit
@@ -22,15 +22,15 @@ namespace democrit
 {
 
 template <typename T>
-  T&
-  RpcClient<T>::operator* ()
+  typename RpcClient<T>::ThreadClients
+  RpcClient<T>::GetThreadClients ()
 {
   std::lock_guard<std::mutex> lock(mut);
   const auto id = std::this_thread::get_id ();
 
   const auto mit = rpcClients.find (id);
   if (mit != rpcClients.end ())
-    return mit->second;
+    return ThreadClients {mit->second, httpClients.at (id)};
 
   const auto http = httpClients.emplace (id, endpoint);
   const auto rpc = rpcClients.emplace (
@@ -38,7 +38,86 @@ template <typename T>
       std::forward_as_tuple (id),
       std::forward_as_tuple (http.first->second, clientVersion));
 
-  return rpc.first->second;
+  return ThreadClients {rpc.first->second, http.first->second};
+}
+
+template <typename T>
+  T&
+  RpcClient<T>::operator* ()
+{
+  return GetThreadClients ().rpc;
+}
+
+template <typename T>
+  jsonrpc::HttpClient&
+  RpcClient<T>::GetHttpClient ()
+{
+  return GetThreadClients ().http;
+}
+
+template <typename T>
+  std::vector<Json::Value>
+  RpcClient<T>::CallBatch (const std::vector<BatchedCall>& calls)
+{
+  std::vector<Json::Value> res;
+  if (calls.empty ())
+    return res;
+
+  jsonrpc::BatchCall batch;
+  std::vector<int> ids;
+  for (const auto& c : calls)
+    ids.push_back (batch.addCall (c.method, c.params));
+
+  /* We do not use jsonrpc::Client::CallProcedures here, as its BatchResponse
+     does not let us tell a missing response apart from a null result.
+     Instead, we send the request and match up the responses ourselves.  */
+  std::string responseStr;
+  GetHttpClient ().SendRPCMessage (batch.toString (), responseStr);
+
+  Json::Value responses;
+  std::istringstream in(responseStr);
+  Json::CharReaderBuilder rbuilder;
+  std::string parseErrs;
+  if (!Json::parseFromStream (rbuilder, in, &responses, &parseErrs))
+    throw jsonrpc::JsonRpcException (
+        jsonrpc::Errors::ERROR_RPC_JSON_PARSE_ERROR, parseErrs);
+  if (!responses.isArray ())
+    throw jsonrpc::JsonRpcException (
+        jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+        "batch response is not an array");
+
+  std::map<int, Json::Value> byId;
+  for (const auto& r : responses)
+    {
+      if (!r.isObject ())
+        throw jsonrpc::JsonRpcException (
+            jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+            "invalid element in batch response");
+
+      /* Responses without a matching id (e.g. an error with null id)
+         cannot be attributed to a call and are treated as missing.  */
+      if (!r.isMember ("id") || !r["id"].isInt ())
+        continue;
+      byId.emplace (r["id"].asInt (), r);
+    }
+
+  jsonrpc::RpcProtocolClient protocol(clientVersion);
+  for (const int id : ids)
+    {
+      const auto mit = byId.find (id);
+      if (mit == byId.end ())
+        throw jsonrpc::JsonRpcException (
+            jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+            "batch response is missing a call");
+
+      /* This throws a JsonRpcException with the server's error code and
+         message if the call failed, just like for a single call.  */
+      Json::Value result;
+      protocol.HandleResponse (mit->second, result);
+      res.push_back (result);
+    }
+
+  return res;
 }
 
 } // namespace democrit
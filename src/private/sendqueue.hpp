@@ -0,0 +1,164 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_SENDQUEUE_HPP
+#define DEMOCRIT_SENDQUEUE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace democrit
+{
+
+/**
+ * Queue of outgoing messages that are sent by a dedicated thread.  Messages
+ * have a priority, with all high-priority messages being sent before any
+ * normal ones.  Within one priority, messages are sent in order.  The rate
+ * of sending is limited through a token bucket.
+ *
+ * Messages can be put into a coalescing group.  When a message that
+ * supersedes the others is queued for a group, all still pending messages
+ * of that group are dropped.  This is used e.g. for order broadcasts, where
+ * only the latest full update matters.
+ *
+ * The queue does not know what sending means; each message is represented
+ * by a callback that does the actual sending.
+ */
+class SendQueue
+{
+
+public:
+
+  /** Priorities of messages.  */
+  enum class Priority
+  {
+    HIGH,
+    NORMAL,
+  };
+
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  /**
+   * A message that is waiting to be sent.
+   */
+  struct Entry
+  {
+
+    /** The coalescing group (empty for none).  */
+    std::string group;
+
+    /** The callback that sends the message.  */
+    std::function<void ()> send;
+
+  };
+
+  /** The maximum rate of messages per second (zero for unlimited).  */
+  const double rate;
+
+  /** The maximum number of tokens in the bucket.  */
+  const double burst;
+
+  /** Mutex for this instance and its condition variables.  */
+  std::mutex mut;
+
+  /** Used to wake up the sender thread on changes.  */
+  std::condition_variable cv;
+
+  /** Notified when the queue becomes empty and nothing is being sent.  */
+  std::condition_variable cvIdle;
+
+  /** Pending high-priority messages.  */
+  std::deque<Entry> high;
+
+  /** Pending normal-priority messages.  */
+  std::deque<Entry> normal;
+
+  /** Current number of tokens in the bucket.  */
+  double tokens;
+
+  /** The time at which tokens were last added to the bucket.  */
+  Clock::time_point lastRefill;
+
+  /** Whether or not a message is being sent right now.  */
+  bool sending;
+
+  /** Set to true to signal that the sender thread should stop.  */
+  bool stop;
+
+  /** The sender thread.  */
+  std::thread sender;
+
+  /**
+   * Main loop of the sender thread.
+   */
+  void RunSender ();
+
+  /**
+   * Adds tokens to the bucket for the time elapsed since the last refill.
+   * Must be called with the lock held.
+   */
+  void Refill ();
+
+public:
+
+  /**
+   * Constructs the queue and starts the sender thread.  At most rate messages
+   * per second are sent on average, with bursts of up to the given size.
+   * If rate is zero, there is no limit.
+   */
+  explicit SendQueue (double rate, unsigned burst);
+
+  /**
+   * Stops the sender thread.  Messages still pending are dropped.
+   */
+  ~SendQueue ();
+
+  SendQueue () = delete;
+  SendQueue (const SendQueue&) = delete;
+  void operator= (const SendQueue&) = delete;
+
+  /**
+   * Queues a message.  If supersedes is true, all pending messages of the
+   * same (non-empty) group are dropped.
+   */
+  void Push (Priority prio, std::function<void ()> send,
+             const std::string& group = "", bool supersedes = false);
+
+  /**
+   * Blocks until all queued messages have been sent.
+   */
+  void Flush ();
+
+  /**
+   * Drops all messages that are still pending.  A message that is being
+   * sent right now is not affected.
+   */
+  void Clear ();
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_SENDQUEUE_HPP
@@ -0,0 +1,99 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_SPENDWATCHER_HPP
+#define DEMOCRIT_SPENDWATCHER_HPP
+
+#include "private/rpcclient.hpp"
+#include "proto/trades.pb.h"
+#include "rpc-stubs/xayarpcclient.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace democrit
+{
+
+/**
+ * Keeps track of whether a set of outpoints (the inputs of all pending
+ * trades) is spent.  The watched set is refreshed with Update, which looks
+ * up all outpoints in a single batched request when the chain tip has
+ * changed, and otherwise only those that were not watched before.  In
+ * between, trades can query the spent state without any RPC calls.
+ *
+ * This means that a double spend is noticed only with the next block
+ * (rather than when it enters the mempool), which is fine since trades
+ * are only marked as failed after some confirmations anyway.
+ */
+class SpendWatcher
+{
+
+private:
+
+  /** An outpoint as (txid, vout) pair.  */
+  using OutPointKey = std::pair<std::string, uint32_t>;
+
+  /** RPC connection to Xaya Core.  */
+  RpcClient<XayaRpcClient>& rpc;
+
+  /** The watched outpoints and whether or not they are spent.  */
+  std::map<OutPointKey, bool> spent;
+
+  /** The block hash at which the spent states are valid.  */
+  std::string checkedTip;
+
+  /** Mutex protecting the state.  */
+  mutable std::mutex mut;
+
+public:
+
+  explicit SpendWatcher (RpcClient<XayaRpcClient>& r)
+    : rpc(r)
+  {}
+
+  SpendWatcher () = delete;
+  SpendWatcher (const SpendWatcher&) = delete;
+  void operator= (const SpendWatcher&) = delete;
+
+  /**
+   * Replaces the set of watched outpoints, and makes sure that their
+   * spent state is known for the given chain tip.
+   */
+  void Update (const std::vector<proto::OutPoint>& outs,
+               const std::string& tip);
+
+  /**
+   * Removes all watched outpoints, e.g. if an update failed.
+   */
+  void Clear ();
+
+  /**
+   * Looks up whether the given outpoint is spent.  Returns false if it
+   * is not watched.
+   */
+  bool GetSpent (const proto::OutPoint& out, bool& res) const;
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_SPENDWATCHER_HPP
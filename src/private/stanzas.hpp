@@ -108,6 +108,23 @@ public:
 
 };
 
+/**
+ * Stanza for encoding incremental updates to the orders of an account,
+ * as sent by the user to the broadcast channel in between full
+ * AccountOrdersStanza snapshots.
+ */
+class OrderDeltasStanza
+    : public ProtoStanza<proto::OrderDeltas, 3, OrderDeltasStanza>
+{
+
+public:
+
+  static constexpr const char* TAG = "orderdeltas";
+
+  using ProtoStanza::ProtoStanza;
+
+};
+
 /**
  * Stanza for encoding a processing message, which contains the data exchanged
  * privately between accounts while negotiating a trade.
@@ -19,17 +19,102 @@
 #ifndef DEMOCRIT_STATE_HPP
 #define DEMOCRIT_STATE_HPP
 
+#include "private/statestore.hpp"
 #include "proto/state.pb.h"
 
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 namespace democrit
 {
 
+/**
+ * Record of the changes made to the State within one AccessState call.
+ * Code modifying the state has to record each modification here as well,
+ * so that it can be written to the log of the StateStore (if the state
+ * is persisted) as a typed update, without having to compare the full
+ * state before and after.
+ */
+class StateChanges
+{
+
+private:
+
+  /**
+   * Whether or not changes are recorded at all.  If the state is not
+   * persisted, there is no need to copy the data for the records.
+   */
+  const bool enabled;
+
+  /** The recorded updates (without sequence numbers).  */
+  std::vector<proto::StateUpdate> records;
+
+  explicit StateChanges (const bool e)
+    : enabled(e)
+  {}
+
+  /**
+   * Adds a new record and returns it to be filled in, or returns null
+   * if recording is disabled.
+   */
+  proto::StateUpdate* Add ();
+
+  friend class State;
+
+public:
+
+  StateChanges () = delete;
+  StateChanges (const StateChanges&) = delete;
+  void operator= (const StateChanges&) = delete;
+
+  /**
+   * Records that an own order has been added or modified.
+   */
+  void OwnOrderSet (uint64_t id, const proto::Order& o);
+
+  /**
+   * Records that an own order has been removed.
+   */
+  void OwnOrderRemoved (uint64_t id);
+
+  /**
+   * Records that the next free ID for own orders has been changed.
+   */
+  void NextFreeId (uint64_t id);
+
+  /**
+   * Records that the given trade has been appended to the active trades.
+   */
+  void TradeAdded (const proto::TradeState& t);
+
+  /**
+   * Records that the active trade at the given position has been
+   * changed to the given data.
+   */
+  void TradeUpdated (int index, const proto::TradeState& t);
+
+  /**
+   * Records that the active trade at the given position has been removed
+   * and the given entry been appended to the archive.  The positions of
+   * all later active trades are reduced by one after this.
+   */
+  void TradeArchived (int index, const proto::Trade& archived);
+
+  /**
+   * Records that the given number of oldest entries have been dropped from
+   * the trade archive (and the archive offset increased accordingly).
+   */
+  void ArchiveDropped (unsigned n);
+
+};
+
 /**
  * Wrapper around the global state that an instance holds in form of
- * a State proto.  It mostly handles synchronisation for accessing the state.
+ * a State proto.  It mostly handles synchronisation for accessing the state,
+ * and (optionally) persisting it to disk through a StateStore.
  */
 class State
 {
@@ -46,6 +131,22 @@ private:
    */
   mutable std::mutex mut;
 
+  /**
+   * The storage used to persist the state.  May be null, in which case
+   * the state is only kept in memory.
+   */
+  std::unique_ptr<StateStore> store;
+
+  /**
+   * Writes the recorded changes to the store.  If the log should be
+   * compacted, this starts the compaction and returns a copy of the
+   * state together with its sequence number, which the caller has to
+   * pass to FinishCompaction after releasing the lock.  Otherwise
+   * null is returned.  Must be called while holding the lock.
+   */
+  std::unique_ptr<proto::State> Persist (StateChanges& changes,
+                                         uint64_t& seq);
+
 public:
 
   /**
@@ -58,19 +159,41 @@ public:
     state.set_account (account);
   }
 
+  /**
+   * Creates an instance that is persisted in the given store.  If the store
+   * has data already, the state is restored from it (and it must be for
+   * the same account).  Otherwise an empty state for the account is created.
+   * If the store is null, this is the same as the plain constructor.
+   */
+  explicit State (const std::string& account,
+                  std::unique_ptr<StateStore> s);
+
   State () = delete;
   State (const State&) = delete;
   void operator= (const State&) = delete;
 
   /**
-   * Exposes the state in a mutable form within the callback.
+   * Exposes the state in a mutable form within the callback, together with
+   * a StateChanges instance in which all modifications must be recorded.
+   * Afterwards, the recorded changes are persisted if we have a store.
    */
   template <typename Fcn>
     void
     AccessState (const Fcn& f)
   {
-    std::lock_guard<std::mutex> lock(mut);
-    f (state);
+    std::unique_ptr<proto::State> toCompact;
+    uint64_t seq;
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      StateChanges changes(store != nullptr);
+      f (state, changes);
+      if (store != nullptr)
+        toCompact = Persist (changes, seq);
+    }
+
+    /* Writing the snapshot does not block other accesses.  */
+    if (toCompact != nullptr)
+      store->FinishCompaction (seq, *toCompact);
   }
 
   /**
@@ -0,0 +1,204 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_STATESTORE_HPP
+#define DEMOCRIT_STATESTORE_HPP
+
+#include "private/intervaljob.hpp"
+#include "proto/state.pb.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace democrit
+{
+
+/**
+ * Durable on-disk storage for the global State proto.  It consists of
+ * a snapshot of the full state plus a write-ahead log of StateUpdate
+ * records applied on top of it.
+ *
+ * Records are appended to the log with a plain write (which is cheap),
+ * while the actual fsync is batched and done periodically by a background
+ * thread.  When the log grows large enough, it is compacted into a fresh
+ * snapshot by the owning State instance.  For this, the current log is
+ * first moved aside (so that new records go to a fresh log), and then the
+ * snapshot is written without blocking further updates.
+ *
+ * All methods except Sync and FinishCompaction must be called while holding
+ * the lock of the owning State, i.e. there is just one logical writer.
+ */
+class StateStore
+{
+
+private:
+
+  /** The directory in which the files are stored.  */
+  const std::string dir;
+
+  /** File descriptor of the write-ahead log.  */
+  int walFd;
+
+  /**
+   * File descriptor of the previous log while a compaction is running
+   * (or -1 if none is).
+   */
+  int oldWalFd;
+
+  /** Set while a compaction is in progress.  */
+  std::atomic<bool> compacting;
+
+  /** Current size of the write-ahead log in bytes.  */
+  size_t walBytes;
+
+  /** Sequence number to assign to the next appended update.  */
+  uint64_t nextSeq;
+
+  /**
+   * Mutex protecting the dirty flag and the file descriptors as seen by
+   * the sync thread.  It is separate from the State lock so that the sync
+   * thread does not need to block writers.
+   */
+  std::mutex mutSync;
+
+  /**
+   * Mutex held while syncing and when closing the previous log, so that
+   * it is not closed while being synced.
+   */
+  std::mutex mutClose;
+
+  /** Set to true when there are writes to the log that are not synced.  */
+  bool dirty;
+
+  /** Background job that syncs the log periodically.  */
+  std::unique_ptr<IntervalJob> syncer;
+
+  std::string GetSnapshotPath () const;
+  std::string GetWalPath () const;
+  std::string GetOldWalPath () const;
+
+  /**
+   * Replays all complete records from the given log file onto the state,
+   * skipping those already included in it.  Returns false if the log
+   * is incomplete or corrupt (or a record is missing), in which case
+   * no further records must be applied.
+   */
+  bool ReplayLog (const std::string& path, proto::State& out,
+                  unsigned& replayed);
+
+  /**
+   * Durably writes a snapshot of the given state as of the given sequence
+   * number, replacing the previous one.
+   */
+  void WriteSnapshot (uint64_t seq, const proto::State& full);
+
+public:
+
+  /**
+   * Opens (or creates) the storage in the given directory.
+   */
+  explicit StateStore (const std::string& d);
+
+  /**
+   * Syncs all outstanding writes and closes the storage.
+   */
+  ~StateStore ();
+
+  StateStore () = delete;
+  StateStore (const StateStore&) = delete;
+  void operator= (const StateStore&) = delete;
+
+  /**
+   * Loads the stored state by reading the snapshot and replaying the
+   * write-ahead log (including the previous one, if a compaction was
+   * interrupted) on top of it.  A truncated or corrupt record at the end
+   * of the log (e.g. from a crash while writing) is ignored.  Returns false
+   * if there is no stored data at all.
+   */
+  bool Load (proto::State& out);
+
+  /**
+   * Appends an update to the write-ahead log.  The sequence number is
+   * filled in by this method.  The data is synced to disk in the background.
+   */
+  void Append (proto::StateUpdate& upd);
+
+  /**
+   * Writes a new snapshot of the given full state (which must include
+   * all appended updates) and clears the write-ahead log.  This is used
+   * at startup, and is done all at once while the caller holds the lock.
+   */
+  void Compact (const proto::State& full);
+
+  /**
+   * Returns true if a compaction started by BeginCompaction has not
+   * been finished yet.
+   */
+  bool
+  IsCompacting () const
+  {
+    return compacting;
+  }
+
+  /**
+   * Starts a compaction by moving the current log aside and continuing
+   * with a fresh one.  Returns the sequence number of the last update
+   * written so far, i.e. the one that the state at this moment
+   * corresponds to.  The caller must then pass a copy of that state
+   * to FinishCompaction.
+   */
+  uint64_t BeginCompaction ();
+
+  /**
+   * Writes the given full state (corresponding to the sequence number
+   * returned by BeginCompaction) as new snapshot and removes the previous
+   * log.  This does the actual disk I/O, and can (and should) be called
+   * without holding the State lock.
+   */
+  void FinishCompaction (uint64_t seq, const proto::State& full);
+
+  /**
+   * Returns the current size of the write-ahead log in bytes.
+   */
+  size_t
+  GetWalSize () const
+  {
+    return walBytes;
+  }
+
+  /**
+   * Makes sure all appended updates are synced to disk.  This is done
+   * automatically in the background, but can be called explicitly
+   * as well (e.g. in tests).
+   */
+  void Sync ();
+
+  /**
+   * Applies an update to the given state.
+   */
+  static void ApplyUpdate (const proto::StateUpdate& upd, proto::State& s);
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_STATESTORE_HPP
@@ -0,0 +1,146 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_TIPNOTIFIER_HPP
+#define DEMOCRIT_TIPNOTIFIER_HPP
+
+#include "private/intervaljob.hpp"
+#include "private/rpcclient.hpp"
+#include "rpc-stubs/xayarpcclient.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace democrit
+{
+
+/**
+ * Source of notifications about changes of the blockchain tip.  Other
+ * components can register listeners with it, which get called whenever
+ * a new best block hash is seen.
+ *
+ * The base class just handles the listeners.  Subclasses implement the
+ * actual source of updates (e.g. polling Xaya Core) and call UpdateTip.
+ */
+class TipNotifier
+{
+
+public:
+
+  /** Type of listener callbacks, which receive the new tip's hash.  */
+  using Listener = std::function<void (const std::string& hash)>;
+
+private:
+
+  /**
+   * Mutex for this instance.  It is held while listeners are being
+   * called, so that removing a listener waits for any ongoing call.
+   */
+  mutable std::mutex mut;
+
+  /** The registered listeners by ID.  */
+  std::map<unsigned, Listener> listeners;
+
+  /** The next ID to assign to a listener.  */
+  unsigned nextId;
+
+  /** The current tip as last seen (empty if none yet).  */
+  std::string tip;
+
+protected:
+
+  /**
+   * Sets the current tip, notifying all listeners if it changed.
+   */
+  void UpdateTip (const std::string& hash);
+
+public:
+
+  TipNotifier ()
+    : nextId(1)
+  {}
+
+  virtual ~TipNotifier () = default;
+
+  TipNotifier (const TipNotifier&) = delete;
+  void operator= (const TipNotifier&) = delete;
+
+  /**
+   * Registers a new listener and returns its ID.  Listeners are called
+   * from the notifier's thread, and should not block for long (e.g.
+   * only wake up some other thread that handles the event).
+   */
+  unsigned AddListener (const Listener& cb);
+
+  /**
+   * Removes a listener again.  After this returns, the listener is
+   * guaranteed to not be running and not called anymore.
+   */
+  void RemoveListener (unsigned id);
+
+  /**
+   * Returns the current tip's block hash.  Returns an empty string if no
+   * tip is known yet.
+   */
+  std::string GetTip () const;
+
+};
+
+/**
+ * TipNotifier that polls Xaya Core for the best block hash at regular
+ * intervals.  This is a simple but cheap (a single RPC call per interval)
+ * way to get notified of new blocks without requiring a ZMQ setup.
+ */
+class RpcTipNotifier : public TipNotifier
+{
+
+private:
+
+  /** RPC connection to Xaya Core.  */
+  RpcClient<XayaRpcClient>& rpc;
+
+  /** The job doing the polling.  */
+  std::unique_ptr<IntervalJob> poller;
+
+  /**
+   * Queries the current best block and updates the tip.
+   */
+  void Poll ();
+
+public:
+
+  /**
+   * Constructs the notifier, which starts polling immediately.
+   */
+  explicit RpcTipNotifier (RpcClient<XayaRpcClient>& r,
+                           std::chrono::milliseconds intv);
+
+  /**
+   * Stops polling.
+   */
+  ~RpcTipNotifier ();
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_TIPNOTIFIER_HPP
@@ -21,18 +21,33 @@
 
 #include "assetspec.hpp"
 #include "private/checker.hpp"
+#include "private/headercache.hpp"
 #include "private/intervaljob.hpp"
 #include "private/myorders.hpp"
 #include "private/rpcclient.hpp"
+#include "private/spendwatcher.hpp"
 #include "private/state.hpp"
+#include "private/tipnotifier.hpp"
+#include "private/wakeupjob.hpp"
+#include "private/workerpool.hpp"
 #include "proto/orders.pb.h"
 #include "proto/processing.pb.h"
 #include "proto/trades.pb.h"
 #include "rpc-stubs/demgsprpcclient.h"
 #include "rpc-stubs/xayarpcclient.h"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace democrit
@@ -78,8 +93,12 @@ private:
    */
   proto::TradeState& pb;
 
-  /** TradeChecker instance based on this Trade's data.  */
-  std::unique_ptr<TradeChecker> checker;
+  /**
+   * TradeChecker instance based on this Trade's data.  This is only
+   * constructed on demand (see GetChecker), since many uses of Trade
+   * (e.g. just looking up its identifier or public data) do not need it.
+   */
+  mutable std::unique_ptr<TradeChecker> checker;
 
   /**
    * True if pb is mutable (i.e. the instance is constructed from a non-const
@@ -91,25 +110,25 @@ private:
                   const proto::TradeState& p)
     : tm(t), account(a),
       pb(const_cast<proto::TradeState&> (p)), isMutable(false)
-  {
-    checker = BuildTradeChecker ();
-  }
+  {}
 
   explicit Trade (const TradeManager& t, const std::string& a,
                   proto::TradeState& p)
     : tm(t), account(a),
       pb(p), isMutable(true)
-  {
-    checker = BuildTradeChecker ();
-  }
+  {}
 
   /**
    * Constructs a TradeChecker instance based on this trade's data.
-   * This is called from the constructor to initialise our checker
-   * member variable, which is then used for further processing.
    */
   std::unique_ptr<TradeChecker> BuildTradeChecker () const;
 
+  /**
+   * Returns the TradeChecker for this trade, constructing it first
+   * if that has not been done yet.
+   */
+  const TradeChecker& GetChecker () const;
+
   /**
    * Returns an ID that is used to identify the particular trade among
    * all active trades, e.g. when matching up with received messages.
@@ -119,6 +138,12 @@ private:
    */
   std::string GetIdentifier () const;
 
+  /**
+   * Returns the identifier of a trade based directly on its data,
+   * without the need to construct a full Trade instance.
+   */
+  static std::string GetIdentifier (const proto::TradeState& data);
+
   /**
    * Returns the type of order this is from our point of view.  In other words,
    * ASK if we are selling, and BID if we are buying.
@@ -181,6 +206,11 @@ private:
   std::string ConstructTransaction (const TradeChecker& checker,
                                     const proto::OutPoint& nameIn) const;
 
+  /**
+   * Decodes our_psbt and fills in the btxid and inputs fields from it.
+   */
+  void CacheTransactionData ();
+
   friend class TestTradeManager;
   friend class TradeManager;
 
@@ -272,16 +302,263 @@ private:
   /** RPC client for the g/dem GSP.  */
   RpcClient<DemGspRpcClient>& demGsp;
 
-  /** The periodic job running trade updates.  */
+  /**
+   * Cache of recent block headers, shared between all trade checkers.
+   * It is warmed whenever a new tip is seen (if tip updates are enabled).
+   * It is mutable as it is used (and filled) by checkers of const trades.
+   */
+  mutable BlockHeaderCache headers;
+
+  /**
+   * Watcher for the inputs of pending trades, used to detect double spends.
+   * It is refreshed before updating trades, and then used by the updates
+   * of the individual trades.
+   */
+  SpendWatcher spends;
+
+  /**
+   * Index of the active trades in the global state by their identifier
+   * (see Trade::GetIdentifier), mapping to their position in the state's
+   * trades field.  This is used to find the trade an incoming message
+   * refers to without scanning all of them.  There may in theory be
+   * multiple trades with the same identifier, hence a multimap.
+   *
+   * The index is only accessed while holding the state lock.  New trades
+   * are added to it when created, and it is rebuilt from scratch when
+   * trades are archived or if it is detected to be out of sync with the
+   * state (e.g. because trades have been added to it directly).
+   */
+  std::unordered_multimap<std::string, int> tradeIndex;
+
+  /** The number of trades in the state that tradeIndex corresponds to.  */
+  int numIndexedTrades;
+
+  /**
+   * Secondary indexes into the trade archive, used to answer trade queries
+   * without scanning the full archive.  They refer to archived trades by
+   * their absolute position (index in trade_archive plus the offset).
+   */
+  struct ArchiveIndex
+  {
+
+    /** Positions by counterparty, in increasing order.  */
+    std::map<std::string, std::deque<uint64_t>> byCounterparty;
+
+    /** Positions by asset, in increasing order.  */
+    std::map<std::string, std::deque<uint64_t>> byAsset;
+
+    /** Positions by trade state, in increasing order.  */
+    std::map<int, std::deque<uint64_t>> byState;
+
+    /**
+     * Positions by start time.  Entries for pruned trades are only
+     * removed from this in bulk from time to time.
+     */
+    std::multimap<int64_t, uint64_t> byStartTime;
+
+    /** The absolute position up to which archived trades are indexed.  */
+    uint64_t end;
+
+    /** The archive offset at the time of the last pruning.  */
+    uint64_t offset;
+
+  };
+
+  /**
+   * The archive index.  Like the trade index, it is only accessed
+   * while holding the state lock.  It is mutable so that it can be
+   * brought up-to-date in const query methods.
+   */
+  mutable ArchiveIndex archiveIndex;
+
+  /** Worker threads used to run the RPC-bound trade updates.  */
+  std::unique_ptr<WorkerPool> updatePool;
+
+  /**
+   * Mutex held while running trade updates, so that the fallback poller
+   * and event-triggered updates do not process the same trades at once.
+   */
+  std::mutex mutUpdates;
+
+  /**
+   * Identifiers of trades that are currently owned exclusively by someone
+   * processing them without holding the state lock, i.e. a message handler
+   * or a trade update.  While a trade is owned, nobody else modifies or
+   * archives it.  This makes sure that the side-effecting RPCs done when
+   * processing a trade (locking coins, broadcasting) run exactly once.
+   */
+  std::set<std::string> ownedTrades;
+
+  /** Mutex for ownedTrades.  */
+  std::mutex mutOwned;
+
+  /** Notified when a trade is released.  */
+  std::condition_variable cvOwned;
+
+  /**
+   * The periodic job running trade updates.  With tip notifications
+   * enabled, this is just a fallback in case some event is missed.
+   */
   std::unique_ptr<IntervalJob> updater;
 
+  /**
+   * Job running trade updates in response to events, i.e. a new chain tip
+   * (for pending trades) or an initiated trade reaching its timeout.
+   */
+  std::unique_ptr<WakeupJob> wakeups;
+
+  /** Set when a new tip has been seen and pending trades need updating.  */
+  std::atomic<bool> newTip;
+
+  /** The tip notifier we are registered with (if any).  */
+  TipNotifier* tipNotifier;
+
+  /** Our listener ID with the tip notifier.  */
+  unsigned tipListener;
+
   /**
    * Processes all active trades, runs a periodic update on them (e.g. to see
    * if they have timed out) and moves those that are finalised to the
    * trade archive instead.
+   *
+   * The updates themselves involve blocking RPC calls, so they are done
+   * concurrently on copies of the trades without holding the state lock.
+   * Each trade is written back (and archived if it is finalised) as soon
+   * as its own update is done.  Trades that are owned by a message handler
+   * at the time are skipped (and also not archived); they will be
+   * processed on the next run.
    */
   void UpdateAndArchiveTrades ();
 
+  /**
+   * Runs the update like UpdateAndArchiveTrades, but only on those active
+   * trades for which the filter returns true.  Finalised trades are
+   * archived in either case.
+   */
+  void UpdateAndArchiveTrades (
+      const std::function<bool (const proto::TradeState&)>& filter);
+
+  /**
+   * Runs the event-triggered updates when the wakeup job fires.  This always
+   * checks initiated trades for timeouts (which requires no RPC calls), and
+   * pending trades only if the chain tip has changed since the last time.
+   */
+  void RunWakeupUpdates ();
+
+  /**
+   * Schedules a wakeup for when a trade that was just initiated
+   * would time out.
+   */
+  void ScheduleTimeout ();
+
+  /**
+   * Runs Trade::Update on all the given trades in parallel on the
+   * worker pool.  If an update fails with a JSON-RPC error, the
+   * corresponding trade is left unchanged.  After each update, the
+   * done callback is invoked on the worker thread with the original
+   * and the updated data of the trade.
+   */
+  void UpdateInParallel (
+      const std::string& account, std::vector<proto::TradeState>& trades,
+      const std::function<void (const proto::TradeState&,
+                                proto::TradeState&)>& done) const;
+
+  /**
+   * Removes the oldest entries from the trade archive if it is larger
+   * than the configured limit.
+   */
+  static void DropExcessArchive (proto::State& s, StateChanges& changes);
+
+  /**
+   * Runs the further processing of a trade that has just been archived,
+   * e.g. releasing locked inputs or restoring our order if it failed.
+   */
+  void FinishArchivedTrade (const std::string& account,
+                            const proto::TradeState& t) const;
+
+  /**
+   * Updates the spend watcher with the inputs of all pending trades
+   * among the given ones, if there are any.
+   */
+  void WatchPendingInputs (const std::vector<proto::TradeState>& trades);
+
+  /**
+   * Takes ownership of the trade with the given identifier, blocking
+   * until it is not owned by anyone else anymore.  This must not be called
+   * while holding the state lock.
+   */
+  void ClaimTrade (const std::string& id);
+
+  /**
+   * Takes ownership of the given trade if it is not owned by someone else.
+   * Returns false (without blocking) if it is.
+   */
+  bool TryClaimTrade (const std::string& id);
+
+  /**
+   * Returns true if the given trade is currently owned by someone.
+   */
+  bool IsTradeOwned (const std::string& id);
+
+  /**
+   * Releases ownership of a trade claimed before.
+   */
+  void ReleaseTrade (const std::string& id);
+
+  /**
+   * Rebuilds the trade index from scratch based on the given state.
+   * Must be called while holding the state lock.
+   */
+  void RebuildTradeIndex (const proto::State& s);
+
+  /**
+   * Updates the trade index for a trade that has just been appended
+   * to the state's trades.  Must be called while holding the state lock.
+   */
+  void IndexNewTrade (const proto::State& s);
+
+  /**
+   * Brings the archive index up-to-date with the given state, i.e. indexes
+   * newly archived trades and prunes entries for dropped ones.
+   * Must be called while holding the state lock.
+   */
+  void SyncArchiveIndex (const proto::State& s) const;
+
+  /**
+   * Looks up the position in the state's trades list of the first active
+   * trade with the given identifier for which the predicate returns true
+   * (using the trade index).  Returns -1 if there is no such trade.
+   * Must be called while holding the state lock.
+   */
+  int FindTradePos (const proto::State& s, const std::string& id,
+                    const std::function<bool (const proto::TradeState&)>& pred);
+
+  /**
+   * Looks up the position in the state's trades list of the active trade
+   * that a given processing message refers to (using the trade index).
+   * Returns -1 if there is no such trade.  Must be called while holding
+   * the state lock.
+   */
+  int FindTradePosForMessage (const proto::State& s,
+                              const proto::ProcessingMessage& msg);
+
+  /**
+   * Looks up the active trade that a given processing message refers to
+   * in the state.  Returns null if there is no such trade.  Must be called
+   * while holding the state lock.
+   */
+  const proto::TradeState* FindTradeForMessage (
+      const proto::State& s, const proto::ProcessingMessage& msg);
+
+  /**
+   * Handles a processing message for the given trade, and fills in our
+   * reply if there is one (in which case true is returned).
+   */
+  bool HandleMessageForTrade (const std::string& account,
+                              proto::TradeState& data,
+                              const proto::ProcessingMessage& msg,
+                              proto::ProcessingMessage& reply);
+
   /**
    * Adds a new trade, based on one of our own orders being taken by
    * some counterparty.
@@ -320,25 +597,40 @@ public:
   /**
    * Constructs a new instance based on the given references.  If startUpdates
    * is set, then an interval job is started for periodic updates of trades
-   * based on the timeout.  Unit tests disable updates and instead run them
-   * manually as needed.
+   * based on the timeout, as well as a job for event-triggered updates.
+   * Unit tests disable updates and instead run them manually as needed.
    */
   explicit TradeManager (State& s, MyOrders& mo, const AssetSpec& as,
                          RpcClient<XayaRpcClient>& x,
                          RpcClient<DemGspRpcClient>& d,
                          bool startUpdates);
 
-  virtual ~TradeManager () = default;
+  virtual ~TradeManager ();
 
   TradeManager () = delete;
   TradeManager (const TradeManager&) = delete;
   void operator= (const TradeManager&) = delete;
 
+  /**
+   * Registers with the given tip notifier, so that pending trades are
+   * updated whenever the chain tip changes rather than only by the
+   * periodic polling.  This has only an effect if the instance has been
+   * constructed with startUpdates.  The notifier must outlive this instance.
+   */
+  void EnableTipUpdates (TipNotifier& n);
+
   /**
    * Returns the public data about all trades in our state.
    */
   std::vector<proto::Trade> GetTrades () const;
 
+  /**
+   * Returns one page of trades (active and archived) matching the given
+   * query.  This uses the archive index, so that only the requested window
+   * of the archive needs to be looked at and returned.
+   */
+  proto::TradeQueryResult QueryTrades (const proto::TradeQuery& q) const;
+
   /**
    * Adds a new trade, based on taking the given order (i.e. we are the
    * taker, and the order is from the counterparty).  Returns true on success,
@@ -354,6 +646,10 @@ public:
    *
    * This method returns true if we have a reply, in which case it is filled
    * in accordingly.
+   *
+   * It is safe to call this concurrently for messages of different trades.
+   * Messages for the same trade are serialised (by taking ownership of the
+   * trade while handling them), but should be passed in order.
    */
   bool ProcessMessage (const proto::ProcessingMessage& msg,
                        proto::ProcessingMessage& reply);
@@ -0,0 +1,114 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_WAKEUPJOB_HPP
+#define DEMOCRIT_WAKEUPJOB_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace democrit
+{
+
+/**
+ * A worker thread that runs a given job whenever it is triggered, either
+ * explicitly right away (e.g. on some external event) or at scheduled
+ * points in time.  Triggers that happen while the job is running or
+ * before it gets to run are coalesced into a single execution.
+ *
+ * This complements IntervalJob for work that should happen in response
+ * to events instead of at fixed intervals.
+ */
+class WakeupJob
+{
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  /** The job to execute.  */
+  std::function<void ()> job;
+
+  /** Mutex for this instance and its condition variable.  */
+  std::mutex mut;
+
+  /** Set to true to signal that the worker thread should stop.  */
+  bool stop;
+
+  /** Set to true if the job should run as soon as possible.  */
+  bool triggered;
+
+  /** Scheduled wakeup times, with the earliest at the top.  */
+  std::priority_queue<Clock::time_point, std::vector<Clock::time_point>,
+                      std::greater<Clock::time_point>> scheduled;
+
+  /** Used to wake up the worker thread on changes.  */
+  std::condition_variable cv;
+
+  /** The worker thread.  */
+  std::thread worker;
+
+public:
+
+  /**
+   * Constructs the job, which starts the worker (but does not yet run
+   * the job until it is triggered).
+   */
+  explicit WakeupJob (const std::function<void ()>& j);
+
+  /**
+   * Destroys the job, which stops the worker.
+   */
+  ~WakeupJob ();
+
+  WakeupJob () = delete;
+  WakeupJob (const WakeupJob&) = delete;
+  void operator= (const WakeupJob&) = delete;
+
+  /**
+   * Requests the job to run as soon as possible.
+   */
+  void Trigger ();
+
+  /**
+   * Schedules the job to run at the given time.
+   */
+  void TriggerAt (Clock::time_point t);
+
+  /**
+   * Schedules the job to run after the given duration.
+   */
+  template <typename Rep, typename Period>
+    void
+    TriggerAfter (const std::chrono::duration<Rep, Period> d)
+  {
+    TriggerAt (Clock::now () + d);
+  }
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_WAKEUPJOB_HPP
@@ -0,0 +1,107 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOCRIT_WORKERPOOL_HPP
+#define DEMOCRIT_WORKERPOOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace democrit
+{
+
+/**
+ * A fixed set of worker threads that execute submitted jobs.  This is used
+ * to run blocking operations (e.g. RPC calls for validating orders or
+ * updating trades) concurrently, without holding any global locks.
+ *
+ * Jobs must not submit other jobs and wait for them (e.g. through RunAll)
+ * from a worker thread, as that can deadlock the pool.
+ */
+class WorkerPool
+{
+
+private:
+
+  /** Queue of jobs waiting to be executed.  */
+  std::queue<std::function<void ()>> jobs;
+
+  /** Mutex for this instance and its condition variable.  */
+  std::mutex mut;
+
+  /** Used to wake up workers when jobs are added or we stop.  */
+  std::condition_variable cv;
+
+  /** Set to true to signal that the worker threads should stop.  */
+  bool stop;
+
+  /** The worker threads.  */
+  std::vector<std::thread> workers;
+
+  /**
+   * Main loop of each worker thread.
+   */
+  void RunWorker ();
+
+public:
+
+  /**
+   * Constructs the pool, which starts the given number of worker threads
+   * immediately.  At least one thread is always started.
+   */
+  explicit WorkerPool (unsigned numThreads);
+
+  /**
+   * Destroys the pool.  This finishes all jobs that are already queued
+   * and then stops the workers.
+   */
+  ~WorkerPool ();
+
+  WorkerPool () = delete;
+  WorkerPool (const WorkerPool&) = delete;
+  void operator= (const WorkerPool&) = delete;
+
+  /**
+   * Returns the number of worker threads.
+   */
+  unsigned
+  GetNumThreads () const
+  {
+    return workers.size ();
+  }
+
+  /**
+   * Queues a job to be run asynchronously by one of the workers.
+   */
+  void Submit (std::function<void ()> job);
+
+  /**
+   * Runs all the given jobs on the pool, and blocks until all of them
+   * are finished.
+   */
+  void RunAll (std::vector<std::function<void ()>> batch);
+
+};
+
+} // namespace democrit
+
+#endif // DEMOCRIT_WORKERPOOL_HPP
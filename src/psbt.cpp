@@ -0,0 +1,819 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/psbt.hpp"
+
+#include <xayautil/hash.hpp>
+#include <xayautil/uint256.hpp>
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace democrit
+{
+
+namespace
+{
+
+/** Number of satoshis in one CHI.  */
+constexpr uint64_t COIN = 100'000'000;
+
+/* Script opcodes we need.  */
+constexpr uint8_t OP_0 = 0x00;
+constexpr uint8_t OP_PUSHDATA1 = 0x4c;
+constexpr uint8_t OP_PUSHDATA2 = 0x4d;
+constexpr uint8_t OP_PUSHDATA4 = 0x4e;
+constexpr uint8_t OP_1 = 0x51;
+constexpr uint8_t OP_2 = 0x52;
+constexpr uint8_t OP_2DROP = 0x6d;
+constexpr uint8_t OP_DROP = 0x75;
+constexpr uint8_t OP_DUP = 0x76;
+constexpr uint8_t OP_EQUAL = 0x87;
+constexpr uint8_t OP_EQUALVERIFY = 0x88;
+constexpr uint8_t OP_HASH160 = 0xa9;
+constexpr uint8_t OP_CHECKSIG = 0xac;
+
+/* Xaya's name operations.  */
+constexpr uint8_t OP_NAME_REGISTER = OP_1;
+constexpr uint8_t OP_NAME_UPDATE = OP_2;
+
+/** Base58 version bytes of P2PKH addresses (mainnet and test networks).  */
+constexpr uint8_t PUBKEY_ADDRESS[] = {28, 88};
+
+/** Base58 version bytes of P2SH addresses (mainnet and test networks).  */
+constexpr uint8_t SCRIPT_ADDRESS[] = {30, 90};
+
+/** Human-readable parts of bech32 addresses for all networks.  */
+const char* const BECH32_HRPS[] = {"chi", "chitn", "chirt"};
+
+/** Key type of the unsigned transaction in the global PSBT map.  */
+constexpr uint8_t PSBT_GLOBAL_UNSIGNED_TX = 0x00;
+
+/** Key type of the PSBT version in the global map.  */
+constexpr uint8_t PSBT_GLOBAL_VERSION = 0xfb;
+
+/**
+ * Simple helper class for deserialising data in Bitcoin's format.
+ * All methods return false if there is not enough data left.
+ */
+class Reader
+{
+
+private:
+
+  /** The data being read.  */
+  const std::string& data;
+
+  /** The current position.  */
+  size_t pos = 0;
+
+public:
+
+  explicit Reader (const std::string& d)
+    : data(d)
+  {}
+
+  Reader () = delete;
+  Reader (const Reader&) = delete;
+  void operator= (const Reader&) = delete;
+
+  bool
+  AtEnd () const
+  {
+    return pos == data.size ();
+  }
+
+  /**
+   * Returns all data from the current position to the end.
+   */
+  std::string
+  GetRemainder () const
+  {
+    return data.substr (pos);
+  }
+
+  bool
+  ReadBytes (const uint64_t n, std::string& out)
+  {
+    if (data.size () - pos < n)
+      return false;
+
+    out = data.substr (pos, n);
+    pos += n;
+    return true;
+  }
+
+  /**
+   * Reads an unsigned little-endian integer with the given number of bytes.
+   */
+  bool
+  ReadUInt (const unsigned bytes, uint64_t& out)
+  {
+    CHECK_LE (bytes, 8);
+    if (data.size () - pos < bytes)
+      return false;
+
+    out = 0;
+    for (unsigned i = 0; i < bytes; ++i)
+      out |= static_cast<uint64_t> (static_cast<uint8_t> (data[pos + i]))
+                << (8 * i);
+    pos += bytes;
+
+    return true;
+  }
+
+  /**
+   * Reads a "compact size" integer.  Non-canonical encodings are rejected.
+   */
+  bool
+  ReadCompactSize (uint64_t& out)
+  {
+    uint64_t first;
+    if (!ReadUInt (1, first))
+      return false;
+
+    unsigned bytes;
+    uint64_t min;
+    switch (first)
+      {
+      case 253:
+        bytes = 2;
+        min = 253;
+        break;
+      case 254:
+        bytes = 4;
+        min = 0x10000;
+        break;
+      case 255:
+        bytes = 8;
+        min = 0x100000000;
+        break;
+      default:
+        out = first;
+        return true;
+      }
+
+    return ReadUInt (bytes, out) && out >= min;
+  }
+
+  /**
+   * Reads a byte string prefixed by its length.
+   */
+  bool
+  ReadVarBytes (std::string& out)
+  {
+    uint64_t n;
+    return ReadCompactSize (n) && ReadBytes (n, out);
+  }
+
+};
+
+std::string
+HexEncode (const std::string& data)
+{
+  static const char* const DIGITS = "0123456789abcdef";
+
+  std::string res;
+  res.reserve (2 * data.size ());
+  for (const unsigned char c : data)
+    {
+      res.push_back (DIGITS[c >> 4]);
+      res.push_back (DIGITS[c & 0xf]);
+    }
+
+  return res;
+}
+
+bool
+HexDecode (const std::string& hex, std::string& data)
+{
+  if (hex.size () % 2 != 0)
+    return false;
+
+  const auto digit = [] (const char c)
+    {
+      if (c >= '0' && c <= '9')
+        return c - '0';
+      if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+      return -1;
+    };
+
+  data.clear ();
+  for (size_t i = 0; i < hex.size (); i += 2)
+    {
+      const int hi = digit (hex[i]);
+      const int lo = digit (hex[i + 1]);
+      if (hi < 0 || lo < 0)
+        return false;
+      data.push_back (static_cast<char> ((hi << 4) | lo));
+    }
+
+  return true;
+}
+
+bool
+DecodeBase64 (const std::string& encoded, std::string& data)
+{
+  if (encoded.empty () || encoded.size () % 4 != 0)
+    return false;
+
+  const auto value = [] (const char c)
+    {
+      if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+      if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+      if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+      if (c == '+')
+        return 62;
+      if (c == '/')
+        return 63;
+      return -1;
+    };
+
+  data.clear ();
+  uint32_t acc = 0;
+  unsigned bits = 0;
+  bool padding = false;
+  for (size_t i = 0; i < encoded.size (); ++i)
+    {
+      if (encoded[i] == '=')
+        {
+          if (i + 2 < encoded.size ())
+            return false;
+          padding = true;
+          continue;
+        }
+      if (padding)
+        return false;
+
+      const int v = value (encoded[i]);
+      if (v < 0)
+        return false;
+
+      acc = ((acc << 6) | v) & 0xffff;
+      bits += 6;
+      if (bits >= 8)
+        {
+          bits -= 8;
+          data.push_back (static_cast<char> ((acc >> bits) & 0xff));
+        }
+    }
+
+  return true;
+}
+
+/**
+ * Computes the double-SHA256 hash of some data, returned as raw bytes.
+ */
+std::string
+DoubleSha256 (const std::string& data)
+{
+  const auto toBytes = [] (const xaya::uint256& hash)
+    {
+      return std::string (reinterpret_cast<const char*> (hash.GetBlob ()),
+                          xaya::uint256::NUM_BYTES);
+    };
+
+  return toBytes (xaya::SHA256::Hash (toBytes (xaya::SHA256::Hash (data))));
+}
+
+/**
+ * Converts a raw hash (e.g. a txid) to its hex form as used in the RPC
+ * interface, which is in reversed byte order.
+ */
+std::string
+HashToHex (const std::string& hash)
+{
+  return HexEncode (std::string (hash.rbegin (), hash.rend ()));
+}
+
+/**
+ * Reads a single script operation.  For push operations, the pushed data
+ * is returned as well.
+ */
+bool
+ReadScriptOp (Reader& r, uint8_t& opcode, std::string& push)
+{
+  uint64_t op;
+  if (!r.ReadUInt (1, op))
+    return false;
+  opcode = op;
+  push.clear ();
+
+  uint64_t len;
+  if (opcode < OP_PUSHDATA1)
+    len = opcode;
+  else if (opcode == OP_PUSHDATA1)
+    {
+      if (!r.ReadUInt (1, len))
+        return false;
+    }
+  else if (opcode == OP_PUSHDATA2)
+    {
+      if (!r.ReadUInt (2, len))
+        return false;
+    }
+  else if (opcode == OP_PUSHDATA4)
+    {
+      if (!r.ReadUInt (4, len))
+        return false;
+    }
+  else
+    return true;
+
+  return r.ReadBytes (len, push);
+}
+
+/**
+ * Checks if a script is a name operation.  If it is, the name operation
+ * is returned in the format of Xaya Core's "nameOp" (with UTF-8 encoding
+ * for name and value), together with the remaining address script.
+ */
+bool
+SplitNameScript (const std::string& script, Json::Value& nameOp,
+                 std::string& addrScript)
+{
+  Reader r(script);
+  uint8_t opcode;
+  std::string data;
+
+  if (!ReadScriptOp (r, opcode, data))
+    return false;
+  std::string op;
+  switch (opcode)
+    {
+    case OP_NAME_REGISTER:
+      op = "name_register";
+      break;
+    case OP_NAME_UPDATE:
+      op = "name_update";
+      break;
+    default:
+      return false;
+    }
+
+  std::string name, value;
+  if (!ReadScriptOp (r, opcode, name) || opcode > OP_PUSHDATA4)
+    return false;
+  if (!ReadScriptOp (r, opcode, value) || opcode > OP_PUSHDATA4)
+    return false;
+  if (!ReadScriptOp (r, opcode, data) || opcode != OP_2DROP)
+    return false;
+  if (!ReadScriptOp (r, opcode, data) || opcode != OP_DROP)
+    return false;
+
+  nameOp = Json::Value (Json::objectValue);
+  nameOp["op"] = op;
+  nameOp["name"] = name;
+  nameOp["name_encoding"] = "utf8";
+  nameOp["value"] = value;
+  nameOp["value_encoding"] = "utf8";
+  addrScript = r.GetRemainder ();
+
+  return true;
+}
+
+/**
+ * Decodes a transaction in the non-witness serialisation format, as used
+ * for the unsigned transaction inside a PSBT.
+ */
+bool
+DecodeTransaction (const std::string& raw, Json::Value& tx)
+{
+  Reader r(raw);
+
+  uint64_t version;
+  if (!r.ReadUInt (4, version))
+    return false;
+
+  /* Zero inputs would be the marker of the witness serialisation, which
+     is not allowed for the unsigned transaction.  */
+  uint64_t numIn;
+  if (!r.ReadCompactSize (numIn) || numIn == 0)
+    return false;
+
+  Json::Value vin(Json::arrayValue);
+  for (uint64_t i = 0; i < numIn; ++i)
+    {
+      std::string hash, scriptSig;
+      uint64_t n, sequence;
+      if (!r.ReadBytes (32, hash) || !r.ReadUInt (4, n)
+            || !r.ReadVarBytes (scriptSig) || !r.ReadUInt (4, sequence))
+        return false;
+      if (!scriptSig.empty ())
+        return false;
+
+      Json::Value in(Json::objectValue);
+      in["txid"] = HashToHex (hash);
+      in["vout"] = static_cast<Json::UInt> (n);
+      in["sequence"] = static_cast<Json::UInt> (sequence);
+      vin.append (in);
+    }
+
+  uint64_t numOut;
+  if (!r.ReadCompactSize (numOut))
+    return false;
+
+  Json::Value vout(Json::arrayValue);
+  for (uint64_t i = 0; i < numOut; ++i)
+    {
+      uint64_t value;
+      std::string script;
+      if (!r.ReadUInt (8, value) || !r.ReadVarBytes (script))
+        return false;
+      if (static_cast<int64_t> (value) < 0)
+        return false;
+
+      Json::Value scriptPubKey(Json::objectValue);
+      scriptPubKey["hex"] = HexEncode (script);
+      Json::Value nameOp;
+      std::string addrScript;
+      if (SplitNameScript (script, nameOp, addrScript))
+        scriptPubKey["nameOp"] = nameOp;
+
+      Json::Value out(Json::objectValue);
+      out["value"] = static_cast<double> (value) / COIN;
+      out["n"] = static_cast<Json::UInt> (i);
+      out["scriptPubKey"] = scriptPubKey;
+      vout.append (out);
+    }
+
+  uint64_t locktime;
+  if (!r.ReadUInt (4, locktime) || !r.AtEnd ())
+    return false;
+
+  /* The btxid is the hash of the transaction with all signature data
+     removed.  The unsigned transaction has no signatures anyway, so
+     it is the same as the txid here.  */
+  const std::string txid = HashToHex (DoubleSha256 (raw));
+
+  tx = Json::Value (Json::objectValue);
+  tx["txid"] = txid;
+  tx["btxid"] = txid;
+  tx["version"] = static_cast<Json::Int> (static_cast<int32_t> (version));
+  tx["locktime"] = static_cast<Json::UInt> (locktime);
+  tx["vin"] = vin;
+  tx["vout"] = vout;
+
+  return true;
+}
+
+/** A PSBT map with raw keys and values.  */
+using PsbtMap = std::map<std::string, std::string>;
+
+/**
+ * Reads a PSBT key-value map up to and including its terminator.
+ */
+bool
+ReadPsbtMap (Reader& r, PsbtMap& m)
+{
+  m.clear ();
+  while (true)
+    {
+      std::string key, value;
+      if (!r.ReadVarBytes (key))
+        return false;
+      if (key.empty ())
+        return true;
+
+      if (!r.ReadVarBytes (value))
+        return false;
+      if (!m.emplace (key, value).second)
+        return false;
+    }
+}
+
+Json::Value
+PsbtMapToJson (const PsbtMap& m)
+{
+  Json::Value res(Json::objectValue);
+  for (const auto& entry : m)
+    res[HexEncode (entry.first)] = HexEncode (entry.second);
+  return res;
+}
+
+/**
+ * Reads the given number of PSBT maps (for inputs or outputs) into
+ * a JSON array.
+ */
+bool
+ReadPsbtMaps (Reader& r, const unsigned n, Json::Value& res)
+{
+  res = Json::Value (Json::arrayValue);
+  for (unsigned i = 0; i < n; ++i)
+    {
+      PsbtMap m;
+      if (!ReadPsbtMap (r, m))
+        return false;
+      res.append (PsbtMapToJson (m));
+    }
+
+  return true;
+}
+
+bool
+DecodeBase58Check (const std::string& encoded, std::string& payload)
+{
+  static const std::string ALPHABET
+      = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+  /* Addresses are much shorter, and limiting the length keeps the
+     quadratic decoding cheap.  */
+  if (encoded.size () > 64)
+    return false;
+
+  size_t zeros = 0;
+  while (zeros < encoded.size () && encoded[zeros] == '1')
+    ++zeros;
+
+  /* The decoded number as big-endian bytes.  */
+  std::vector<uint8_t> bytes;
+  for (size_t i = zeros; i < encoded.size (); ++i)
+    {
+      const size_t digit = ALPHABET.find (encoded[i]);
+      if (digit == std::string::npos)
+        return false;
+
+      uint32_t carry = digit;
+      for (auto it = bytes.rbegin (); it != bytes.rend (); ++it)
+        {
+          carry += 58 * static_cast<uint32_t> (*it);
+          *it = carry & 0xff;
+          carry >>= 8;
+        }
+      for (; carry > 0; carry >>= 8)
+        bytes.insert (bytes.begin (), carry & 0xff);
+    }
+
+  const std::string data = std::string (zeros, '\0')
+                              + std::string (bytes.begin (), bytes.end ());
+  if (data.size () < 4)
+    return false;
+
+  payload = data.substr (0, data.size () - 4);
+  return DoubleSha256 (payload).substr (0, 4) == data.substr (payload.size ());
+}
+
+uint32_t
+Bech32Polymod (const std::vector<uint8_t>& values)
+{
+  static const uint32_t GENERATOR[] =
+    {
+      0x3b6a57b2, 0x26508e6d, 0x1ea119fa, 0x3d4233dd, 0x2a1462b3,
+    };
+
+  uint32_t chk = 1;
+  for (const auto v : values)
+    {
+      const uint32_t top = chk >> 25;
+      chk = ((chk & 0x1ffffff) << 5) ^ v;
+      for (unsigned i = 0; i < 5; ++i)
+        if ((top >> i) & 1)
+          chk ^= GENERATOR[i];
+    }
+
+  return chk;
+}
+
+/**
+ * Decodes a segwit address (bech32 for version 0 and bech32m for later
+ * versions, as per BIP 173 and BIP 350) to its scriptPubKey.
+ */
+bool
+DecodeSegwitAddress (const std::string& addr, std::string& script)
+{
+  static const std::string CHARSET = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
+
+  if (addr.size () > 90)
+    return false;
+
+  bool hasLower = false;
+  bool hasUpper = false;
+  std::string str;
+  for (const char c : addr)
+    {
+      if (c < 33 || c > 126)
+        return false;
+      if (c >= 'a' && c <= 'z')
+        hasLower = true;
+      if (c >= 'A' && c <= 'Z')
+        {
+          hasUpper = true;
+          str.push_back (c - 'A' + 'a');
+        }
+      else
+        str.push_back (c);
+    }
+  if (hasLower && hasUpper)
+    return false;
+
+  const size_t sep = str.rfind ('1');
+  if (sep == std::string::npos || sep == 0 || sep + 7 > str.size ())
+    return false;
+
+  const std::string hrp = str.substr (0, sep);
+  bool hrpFound = false;
+  for (const char* h : BECH32_HRPS)
+    if (hrp == h)
+      hrpFound = true;
+  if (!hrpFound)
+    return false;
+
+  std::vector<uint8_t> values;
+  for (const char c : hrp)
+    values.push_back (c >> 5);
+  values.push_back (0);
+  for (const char c : hrp)
+    values.push_back (c & 31);
+
+  std::vector<uint8_t> data;
+  for (size_t i = sep + 1; i < str.size (); ++i)
+    {
+      const size_t v = CHARSET.find (str[i]);
+      if (v == std::string::npos)
+        return false;
+      data.push_back (v);
+      values.push_back (v);
+    }
+  data.resize (data.size () - 6);
+  if (data.empty ())
+    return false;
+
+  const unsigned version = data[0];
+  if (version > 16)
+    return false;
+  const uint32_t expectedCheck = (version == 0 ? 1 : 0x2bc830a3);
+  if (Bech32Polymod (values) != expectedCheck)
+    return false;
+
+  uint32_t acc = 0;
+  unsigned bits = 0;
+  std::string program;
+  for (size_t i = 1; i < data.size (); ++i)
+    {
+      acc = ((acc << 5) | data[i]) & 0xfff;
+      bits += 5;
+      if (bits >= 8)
+        {
+          bits -= 8;
+          program.push_back (static_cast<char> ((acc >> bits) & 0xff));
+        }
+    }
+  if (bits >= 5 || ((acc << (8 - bits)) & 0xff) != 0)
+    return false;
+
+  if (program.size () < 2 || program.size () > 40)
+    return false;
+  if (version == 0 && program.size () != 20 && program.size () != 32)
+    return false;
+
+  script.clear ();
+  script.push_back (version == 0 ? OP_0 : OP_1 + version - 1);
+  script.push_back (program.size ());
+  script += program;
+
+  return true;
+}
+
+/**
+ * Decodes an address to the raw scriptPubKey.
+ */
+bool
+AddressToRawScript (const std::string& addr, std::string& script)
+{
+  if (DecodeSegwitAddress (addr, script))
+    return true;
+
+  std::string payload;
+  if (!DecodeBase58Check (addr, payload) || payload.size () != 21)
+    return false;
+
+  const uint8_t version = payload[0];
+  const std::string hash = payload.substr (1);
+
+  for (const auto v : PUBKEY_ADDRESS)
+    if (version == v)
+      {
+        script = std::string ({static_cast<char> (OP_DUP),
+                               static_cast<char> (OP_HASH160), 20});
+        script += hash;
+        script.push_back (OP_EQUALVERIFY);
+        script.push_back (OP_CHECKSIG);
+        return true;
+      }
+
+  for (const auto v : SCRIPT_ADDRESS)
+    if (version == v)
+      {
+        script = std::string ({static_cast<char> (OP_HASH160), 20});
+        script += hash;
+        script.push_back (OP_EQUAL);
+        return true;
+      }
+
+  return false;
+}
+
+} // anonymous namespace
+
+bool
+DecodePsbtNatively (const std::string& psbt, Json::Value& res)
+{
+  std::string data;
+  if (!DecodeBase64 (psbt, data))
+    return false;
+
+  Reader r(data);
+  std::string magic;
+  if (!r.ReadBytes (5, magic) || magic != std::string ("psbt\xff", 5))
+    return false;
+
+  PsbtMap global;
+  if (!ReadPsbtMap (r, global))
+    return false;
+
+  /* We only support version 0, which has the unsigned transaction
+     in the global map.  */
+  const auto mitVersion
+      = global.find (std::string (1, static_cast<char> (PSBT_GLOBAL_VERSION)));
+  if (mitVersion != global.end ()
+        && mitVersion->second != std::string (4, '\0'))
+    return false;
+
+  const auto mitTx
+      = global.find (std::string (1, PSBT_GLOBAL_UNSIGNED_TX));
+  if (mitTx == global.end ())
+    return false;
+
+  Json::Value tx;
+  if (!DecodeTransaction (mitTx->second, tx))
+    return false;
+
+  Json::Value inputs, outputs;
+  if (!ReadPsbtMaps (r, tx["vin"].size (), inputs)
+        || !ReadPsbtMaps (r, tx["vout"].size (), outputs)
+        || !r.AtEnd ())
+    return false;
+
+  res = Json::Value (Json::objectValue);
+  res["tx"] = tx;
+  res["inputs"] = inputs;
+  res["outputs"] = outputs;
+
+  return true;
+}
+
+bool
+AddressToScript (const std::string& addr, std::string& script)
+{
+  std::string raw;
+  if (!AddressToRawScript (addr, raw))
+    return false;
+
+  script = HexEncode (raw);
+  return true;
+}
+
+bool
+ScriptPaysToAddress (const std::string& script, const std::string& addr)
+{
+  std::string expected;
+  if (!AddressToRawScript (addr, expected))
+    return false;
+
+  std::string raw;
+  if (!HexDecode (script, raw))
+    return false;
+
+  Json::Value nameOp;
+  std::string addrScript;
+  if (!SplitNameScript (raw, nameOp, addrScript))
+    addrScript = raw;
+
+  return addrScript == expected;
+}
+
+} // namespace democrit
@@ -0,0 +1,258 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/psbt.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace democrit
+{
+namespace
+{
+
+/* ************************************************************************** */
+
+/**
+ * PSBT used for testing.  It is a version-0x7100 transaction with two
+ * inputs and three outputs:  A P2WPKH output with 12.5 CHI, a name_update
+ * of p/seller to a P2WPKH address, and a P2PKH output with 42 satoshi.
+ * The first input has a witness UTXO set in the PSBT.
+ */
+const std::string UNSIGNED_PSBT
+    = "cHNidP8BAOYAcQAAAh8eHRwbGhkYFxYVFBMSERAPDg0MCwoJCAcGBQQDAgEAAQAAAAD/"
+      "////Pz49PDs6OTg3NjU0MzIxMC8uLSwrKikoJyYlJCMiISAAAAAAAP3///8DgHyBSgAA"
+      "AAAWABQBAgMEBQYHCAkKCwwNDg8QERITFEBCDwAAAAAAQFIIcC9zZWxsZXIdeyJnIjp7"
+      "InRlc3QiOnsidG8iOiJidXllciJ9fX1tdQAUZWZnaGlqa2xtbm9wcXJzdHV2d3gqAAAA"
+      "AAAAABl2qRTJysvMzc7P0NHS09TV1tfY2drb3IisAAAAAAABAQoRERERERERERERAAAA"
+      "AAA=";
+
+/**
+ * The same PSBT, but with a final scriptSig added to the second input.
+ */
+const std::string SIGNED_PSBT
+    = "cHNidP8BAOYAcQAAAh8eHRwbGhkYFxYVFBMSERAPDg0MCwoJCAcGBQQDAgEAAQAAAAD/"
+      "////Pz49PDs6OTg3NjU0MzIxMC8uLSwrKikoJyYlJCMiISAAAAAAAP3///8DgHyBSgAA"
+      "AAAWABQBAgMEBQYHCAkKCwwNDg8QERITFEBCDwAAAAAAQFIIcC9zZWxsZXIdeyJnIjp7"
+      "InRlc3QiOnsidG8iOiJidXllciJ9fX1tdQAUZWZnaGlqa2xtbm9wcXJzdHV2d3gqAAAA"
+      "AAAAABl2qRTJysvMzc7P0NHS09TV1tfY2drb3IisAAAAAAABAQoRERERERERERERAAEH"
+      "BSIiIiIiAAAAAA==";
+
+/** The expected txid (and btxid) of the test PSBT.  */
+const std::string TXID
+    = "503d9eb01c17e793f2cc98b3b5840efa6479013a851be2d0c9bf5d637065b445";
+
+/** The name script of the second output.  */
+const std::string NAME_SCRIPT
+    = "5208702f73656c6c65721d7b2267223a7b2274657374223a7b22746f223a2262"
+      "75796572227d7d7d6d75001465666768696a6b6c6d6e6f707172737475767778";
+
+TEST (DecodePsbtNativelyTests, Transaction)
+{
+  Json::Value decoded;
+  ASSERT_TRUE (DecodePsbtNatively (UNSIGNED_PSBT, decoded));
+
+  const auto& tx = decoded["tx"];
+  EXPECT_EQ (tx["txid"].asString (), TXID);
+  EXPECT_EQ (tx["btxid"].asString (), TXID);
+  EXPECT_EQ (tx["version"].asInt (), 0x7100);
+  EXPECT_EQ (tx["locktime"].asUInt (), 0);
+
+  const auto& vin = tx["vin"];
+  ASSERT_EQ (vin.size (), 2);
+  EXPECT_EQ (vin[0]["txid"].asString (),
+             "000102030405060708090a0b0c0d0e0f"
+             "101112131415161718191a1b1c1d1e1f");
+  EXPECT_EQ (vin[0]["vout"].asUInt (), 1);
+  EXPECT_EQ (vin[0]["sequence"].asUInt (), 0xffffffff);
+  EXPECT_EQ (vin[1]["txid"].asString (),
+             "202122232425262728292a2b2c2d2e2f"
+             "303132333435363738393a3b3c3d3e3f");
+  EXPECT_EQ (vin[1]["vout"].asUInt (), 0);
+  EXPECT_EQ (vin[1]["sequence"].asUInt (), 0xfffffffd);
+
+  const auto& vout = tx["vout"];
+  ASSERT_EQ (vout.size (), 3);
+
+  EXPECT_EQ (vout[0]["n"].asUInt (), 0);
+  EXPECT_EQ (vout[0]["value"].asDouble (), 12.5);
+  EXPECT_EQ (vout[0]["scriptPubKey"]["hex"].asString (),
+             "00140102030405060708090a0b0c0d0e0f1011121314");
+  EXPECT_FALSE (vout[0]["scriptPubKey"].isMember ("nameOp"));
+
+  EXPECT_EQ (vout[1]["n"].asUInt (), 1);
+  EXPECT_EQ (vout[1]["value"].asDouble (), 0.01);
+  EXPECT_EQ (vout[1]["scriptPubKey"]["hex"].asString (), NAME_SCRIPT);
+  const auto& nameOp = vout[1]["scriptPubKey"]["nameOp"];
+  EXPECT_EQ (nameOp["op"].asString (), "name_update");
+  EXPECT_EQ (nameOp["name"].asString (), "p/seller");
+  EXPECT_EQ (nameOp["name_encoding"].asString (), "utf8");
+  EXPECT_EQ (nameOp["value"].asString (), R"({"g":{"test":{"to":"buyer"}}})");
+  EXPECT_EQ (nameOp["value_encoding"].asString (), "utf8");
+
+  EXPECT_EQ (vout[2]["n"].asUInt (), 2);
+  EXPECT_EQ (vout[2]["value"].asDouble (), 42e-8);
+  EXPECT_EQ (vout[2]["scriptPubKey"]["hex"].asString (),
+             "76a914c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdc88ac");
+}
+
+TEST (DecodePsbtNativelyTests, Maps)
+{
+  Json::Value before, after;
+  ASSERT_TRUE (DecodePsbtNatively (UNSIGNED_PSBT, before));
+  ASSERT_TRUE (DecodePsbtNatively (SIGNED_PSBT, after));
+
+  EXPECT_EQ (before["tx"], after["tx"]);
+
+  const auto& inBefore = before["inputs"];
+  const auto& inAfter = after["inputs"];
+  ASSERT_EQ (inBefore.size (), 2);
+  ASSERT_EQ (inAfter.size (), 2);
+
+  EXPECT_EQ (inBefore[0]["01"].asString (), "11111111111111111111");
+  EXPECT_EQ (inBefore[0], inAfter[0]);
+
+  EXPECT_EQ (inBefore[1], Json::Value (Json::objectValue));
+  EXPECT_EQ (inAfter[1]["07"].asString (), "2222222222");
+
+  EXPECT_EQ (before["outputs"].size (), 3);
+  EXPECT_EQ (before["outputs"], after["outputs"]);
+}
+
+TEST (DecodePsbtNativelyTests, Invalid)
+{
+  const std::string tests[] =
+    {
+      "",
+      "psbt 1",
+      "not base64!",
+      /* Valid base64, but not a PSBT.  */
+      "Zm9vYmFy",
+      /* Truncated.  */
+      UNSIGNED_PSBT.substr (0, 200),
+      /* Data after the end.  */
+      UNSIGNED_PSBT.substr (0, UNSIGNED_PSBT.size () - 4) + "AAAAAA==",
+    };
+
+  for (const auto& t : tests)
+    {
+      Json::Value decoded;
+      EXPECT_FALSE (DecodePsbtNatively (t, decoded)) << t;
+    }
+}
+
+/* ************************************************************************** */
+
+TEST (AddressToScriptTests, Valid)
+{
+  const struct
+  {
+    std::string address;
+    std::string script;
+  } tests[] =
+    {
+      {
+        "chirt1qqypqxpq9qcrsszg2pvxq6rs0zqg3yyc5sm75e5",
+        "00140102030405060708090a0b0c0d0e0f1011121314",
+      },
+      {
+        "CHIRT1QQYPQXPQ9QCRSSZG2PVXQ6RS0ZQG3YYC5SM75E5",
+        "00140102030405060708090a0b0c0d0e0f1011121314",
+      },
+      {
+        "chi1qv4nxw6rfdf4kcmtwdac8zunnw36hvamc2he5e2",
+        "001465666768696a6b6c6d6e6f707172737475767778",
+      },
+      {
+        "chitn1qrc0jqgfzyvjz2f389q5j52ev95hz7vp3xgengdfkxuurjw3m8s7saauu8a",
+        "00201e1f202122232425262728292a2b2c2d2e2f"
+        "303132333435363738393a3b3c3d",
+      },
+      {
+        "chi1prc0jqgfzyvjz2f389q5j52ev95hz7vp3xgengdfkxuurjw3m8s7saa4znz",
+        "51201e1f202122232425262728292a2b2c2d2e2f"
+        "303132333435363738393a3b3c3d",
+      },
+      {
+        "cj94QdjBd1beBpywSKiwoVvEQR4ESSqTg1",
+        "76a914c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdc88ac",
+      },
+      {
+        "CarsL7qu2Bo57pcjy9jphyb2e9bdobSicA",
+        "76a914c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdc88ac",
+      },
+      {
+        "DPY5JLSUSYipkgtv1zQTgE8buA7XG3ypRa",
+        "a914c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdc87",
+      },
+    };
+
+  for (const auto& t : tests)
+    {
+      std::string script;
+      ASSERT_TRUE (AddressToScript (t.address, script)) << t.address;
+      EXPECT_EQ (script, t.script) << t.address;
+    }
+}
+
+TEST (AddressToScriptTests, Invalid)
+{
+  const std::string tests[] =
+    {
+      "",
+      "addr 1",
+      /* Wrong checksums.  */
+      "chirt1qqypqxpq9qcrsszg2pvxq6rs0zqg3yyc5sm75e6",
+      "cj94QdjBd1beBpywSKiwoVvEQR4ESSqTg2",
+      /* Mixed case.  */
+      "chirt1qqypqxpq9qcrsszg2pvxq6rs0zqg3yyc5SM75E5",
+      /* Valid, but for Bitcoin.  */
+      "bc1qqypqxpq9qcrsszg2pvxq6rs0zqg3yyc5fcj4z3",
+      "1KPym5Vq98pYDgiKHQQu8Ty122PDwfmzgL",
+    };
+
+  for (const auto& t : tests)
+    {
+      std::string script;
+      EXPECT_FALSE (AddressToScript (t, script)) << t;
+    }
+}
+
+TEST (ScriptPaysToAddressTests, Works)
+{
+  const std::string addr1 = "chirt1qqypqxpq9qcrsszg2pvxq6rs0zqg3yyc5sm75e5";
+  const std::string addr2 = "chirt1qv4nxw6rfdf4kcmtwdac8zunnw36hvamcsrv25z";
+
+  EXPECT_TRUE (ScriptPaysToAddress (
+      "00140102030405060708090a0b0c0d0e0f1011121314", addr1));
+  EXPECT_FALSE (ScriptPaysToAddress (
+      "00140102030405060708090a0b0c0d0e0f1011121314", addr2));
+
+  EXPECT_TRUE (ScriptPaysToAddress (NAME_SCRIPT, addr2));
+  EXPECT_FALSE (ScriptPaysToAddress (NAME_SCRIPT, addr1));
+
+  EXPECT_FALSE (ScriptPaysToAddress ("invalid hex", addr1));
+  EXPECT_FALSE (ScriptPaysToAddress (
+      "00140102030405060708090a0b0c0d0e0f1011121314", "invalid"));
+}
+
+/* ************************************************************************** */
+
+} // anonymous namespace
+} // namespace democrit
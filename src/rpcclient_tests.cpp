@@ -22,9 +22,13 @@
 #include "rpc-stubs/testrpcserverstub.h"
 
 #include <jsonrpccpp/server/connectors/httpserver.h>
+#include <jsonrpccpp/server/iclientconnectionhandler.h>
+
+#include <json/json.h>
 
 #include <gtest/gtest.h>
 
+#include <atomic>
 #include <chrono>
 #include <sstream>
 #include <vector>
@@ -52,6 +56,48 @@ public:
 
 };
 
+/**
+ * Connection handler that wraps the server's actual handler, and can
+ * drop the last response from batch replies.  This simulates a broken
+ * server that does not answer all calls of a batch.
+ */
+class TruncatingHandler : public jsonrpc::IClientConnectionHandler
+{
+
+private:
+
+  /** The wrapped handler.  */
+  jsonrpc::IClientConnectionHandler& base;
+
+public:
+
+  /** Whether batch replies should be truncated.  */
+  std::atomic<bool> truncate;
+
+  explicit TruncatingHandler (jsonrpc::IClientConnectionHandler& b)
+    : base(b), truncate(false)
+  {}
+
+  void
+  HandleRequest (const std::string& request, std::string& response) override
+  {
+    base.HandleRequest (request, response);
+    if (!truncate)
+      return;
+
+    Json::Value val;
+    std::istringstream in(response);
+    in >> val;
+    if (!val.isArray () || val.empty ())
+      return;
+
+    Json::Value removed;
+    val.removeIndex (val.size () - 1, &removed);
+    response = Json::writeString (Json::StreamWriterBuilder (), val);
+  }
+
+};
+
 class RpcClientTests : public testing::Test
 {
 
@@ -66,6 +112,9 @@ private:
   /** The test RPC server.  */
   TestRpcServer rpcServer;
 
+  /** Handler wrapping the RPC server's, so we can truncate replies.  */
+  TruncatingHandler handler;
+
   /**
    * Returns the endpoint to use for the test server as string.
    */
@@ -91,8 +140,10 @@ protected:
   RpcClientTests ()
     : httpServer(PORT, "", "", SERVER_THREADS),
       rpcServer(httpServer),
+      handler(*httpServer.GetHandler ()),
       client(GetEndpoint ())
   {
+    httpServer.SetHandler (&handler);
     rpcServer.StartListening ();
   }
 
@@ -101,6 +152,15 @@ protected:
     rpcServer.StopListening ();
   }
 
+  /**
+   * Makes the server drop the last response from all batch replies.
+   */
+  void
+  TruncateBatchReplies ()
+  {
+    handler.truncate = true;
+  }
+
 };
 
 TEST_F (RpcClientTests, SingleThread)
@@ -109,6 +169,50 @@ TEST_F (RpcClientTests, SingleThread)
   EXPECT_EQ ((*client).echo (100), 100);
 }
 
+TEST_F (RpcClientTests, Batch)
+{
+  EXPECT_TRUE (client.CallBatch ({}).empty ());
+
+  std::vector<BatchedCall> calls;
+  for (int i = 0; i < 10; ++i)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append (i);
+      calls.emplace_back ("echo", params);
+    }
+
+  const auto res = client.CallBatch (calls);
+  ASSERT_EQ (res.size (), calls.size ());
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ (res[i], i);
+}
+
+TEST_F (RpcClientTests, BatchWithError)
+{
+  Json::Value params(Json::arrayValue);
+  params.append (42);
+
+  std::vector<BatchedCall> calls;
+  calls.emplace_back ("echo", params);
+  calls.emplace_back ("invalid method", params);
+
+  EXPECT_THROW (client.CallBatch (calls), jsonrpc::JsonRpcException);
+}
+
+TEST_F (RpcClientTests, BatchWithMissingResponse)
+{
+  std::vector<BatchedCall> calls;
+  for (int i = 0; i < 3; ++i)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append (i);
+      calls.emplace_back ("echo", params);
+    }
+
+  TruncateBatchReplies ();
+  EXPECT_THROW (client.CallBatch (calls), jsonrpc::JsonRpcException);
+}
+
 TEST_F (RpcClientTests, ManyThreads)
 {
   constexpr int numThreads = SERVER_THREADS;
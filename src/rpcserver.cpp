@@ -24,11 +24,18 @@
 #include <jsonrpccpp/common/errors.h>
 #include <jsonrpccpp/common/exception.h>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <chrono>
+#include <set>
+
 namespace democrit
 {
 
+DEFINE_int32 (democrit_rpc_wait_timeout_ms, 5'000,
+              "Maximum time (in milliseconds) that waitforbookchange blocks");
+
 void
 RpcServer::Run ()
 {
@@ -62,6 +69,13 @@ RpcServer::getstatus ()
   res["connected"] = daemon.IsConnected ();
   res["gameid"] = daemon.GetAssetSpec ().GetGameId ();
   res["account"] = daemon.GetAccount ();
+  res["orderbook"] = ProtoToJson (daemon.GetOrderbookUsage ());
+
+  const auto cacheStats = daemon.GetAssetCacheStats ();
+  Json::Value cache(Json::objectValue);
+  cache["hits"] = static_cast<Json::UInt64> (cacheStats.hits);
+  cache["misses"] = static_cast<Json::UInt64> (cacheStats.misses);
+  res["assetcache"] = cache;
 
   return res;
 }
@@ -80,6 +94,47 @@ RpcServer::getordersbyasset ()
   return ProtoToJson (daemon.GetOrdersByAsset ());
 }
 
+Json::Value
+RpcServer::waitforbookchange (const Json::Value& assets,
+                              const Json::Value& knownVersion)
+{
+  VLOG (1)
+      << "RPC method called: waitforbookchange " << knownVersion
+      << "\n" << assets;
+
+  /* Book versions are uint64, so the known version is passed as generic
+     JSON value (like the price for takebest) rather than an int.  */
+  if (!assets.isArray () || !knownVersion.isUInt64 ())
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "invalid arguments");
+
+  std::set<Asset> assetSet;
+  for (const auto& a : assets)
+    {
+      if (!a.isString ())
+        throw jsonrpc::JsonRpcException (
+            jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS, "invalid asset");
+      assetSet.insert (a.asString ());
+    }
+
+  const auto timeout
+      = std::chrono::milliseconds (FLAGS_democrit_rpc_wait_timeout_ms);
+  return ProtoToJson (daemon.WaitForBookChange (knownVersion.asUInt64 (),
+                                                assetSet, timeout));
+}
+
+Json::Value
+RpcServer::getdepth (const std::string& asset, const int levels)
+{
+  LOG (INFO) << "RPC method called: getdepth " << asset << " " << levels;
+
+  if (levels < 0)
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "invalid number of levels");
+
+  return ProtoToJson (daemon.GetDepth (asset, levels));
+}
+
 Json::Value
 RpcServer::getownorders ()
 {
@@ -118,6 +173,19 @@ RpcServer::gettrades ()
   return res;
 }
 
+Json::Value
+RpcServer::querytrades (const Json::Value& query)
+{
+  LOG (INFO) << "RPC method called: querytrades\n" << query;
+
+  proto::TradeQuery q;
+  if (!ProtoFromJson (query, q))
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "invalid query");
+
+  return ProtoToJson (daemon.QueryTrades (q));
+}
+
 bool
 RpcServer::takeorder (const Json::Value& order, const int units)
 {
@@ -131,4 +199,31 @@ RpcServer::takeorder (const Json::Value& order, const int units)
   return daemon.TakeOrder (o, units);
 }
 
+Json::Value
+RpcServer::takebest (const std::string& asset, const Json::Value& limitPrice,
+                     const std::string& type, const int units)
+{
+  LOG (INFO)
+      << "RPC method called: takebest " << asset << " " << type
+      << " " << units << " " << limitPrice;
+
+  /* The price is passed as generic JSON value, so that it can be
+     any uint64 and not just an int.  */
+  if (!limitPrice.isUInt64 () || units <= 0)
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "invalid arguments");
+
+  proto::Order::Type t;
+  if (type == "ask")
+    t = proto::Order::ASK;
+  else if (type == "bid")
+    t = proto::Order::BID;
+  else
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "invalid order type");
+
+  return ProtoToJson (daemon.TakeBest (asset, t, units,
+                                       limitPrice.asUInt64 ()));
+}
+
 } // namespace democrit
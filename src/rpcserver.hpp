@@ -71,13 +71,19 @@ public:
 
   Json::Value getordersforasset (const std::string& asset) override;
   Json::Value getordersbyasset () override;
+  Json::Value waitforbookchange (const Json::Value& assets,
+                                 const Json::Value& knownVersion) override;
+  Json::Value getdepth (const std::string& asset, int levels) override;
 
   Json::Value getownorders () override;
   bool addorder (const Json::Value& order) override;
   Json::Value cancelorder (int id) override;
 
   Json::Value gettrades () override;
+  Json::Value querytrades (const Json::Value& query) override;
   bool takeorder (const Json::Value& order, int units) override;
+  Json::Value takebest (const std::string& asset, const Json::Value& limitPrice,
+                        const std::string& type, int units) override;
 
 };
 
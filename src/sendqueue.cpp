@@ -0,0 +1,170 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/sendqueue.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace democrit
+{
+
+SendQueue::SendQueue (const double r, const unsigned b)
+  : rate(r), burst(std::max (b, 1u)), tokens(burst),
+    lastRefill(Clock::now ()), sending(false), stop(false)
+{
+  CHECK_GE (rate, 0.0);
+
+  sender = std::thread ([this] ()
+    {
+      RunSender ();
+    });
+}
+
+SendQueue::~SendQueue ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stop = true;
+    cv.notify_all ();
+  }
+
+  sender.join ();
+
+  VLOG_IF (1, !high.empty () || !normal.empty ())
+      << "Dropping " << (high.size () + normal.size ())
+      << " unsent messages";
+}
+
+void
+SendQueue::Refill ()
+{
+  const auto now = Clock::now ();
+  const std::chrono::duration<double> elapsed = now - lastRefill;
+  tokens = std::min (burst, tokens + elapsed.count () * rate);
+  lastRefill = now;
+}
+
+void
+SendQueue::RunSender ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (true)
+    {
+      cv.wait (lock, [this] ()
+        {
+          return stop || !high.empty () || !normal.empty ();
+        });
+      if (stop)
+        return;
+
+      if (rate > 0.0)
+        {
+          Refill ();
+          if (tokens < 1.0)
+            {
+              /* Wait until the next token is available.  We re-check
+                 everything afterwards, since a more important message
+                 may have been queued or we may have to stop.  */
+              const std::chrono::duration<double> wait((1.0 - tokens) / rate);
+              cv.wait_for (lock, wait);
+              continue;
+            }
+          tokens -= 1.0;
+        }
+
+      auto& q = high.empty () ? normal : high;
+      Entry e = std::move (q.front ());
+      q.pop_front ();
+
+      sending = true;
+      lock.unlock ();
+      e.send ();
+      lock.lock ();
+      sending = false;
+
+      if (high.empty () && normal.empty ())
+        cvIdle.notify_all ();
+    }
+}
+
+void
+SendQueue::Push (const Priority prio, std::function<void ()> send,
+                 const std::string& group, const bool supersedes)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (supersedes && !group.empty ())
+    for (auto* q : {&high, &normal})
+      {
+        const auto oldSize = q->size ();
+        q->erase (std::remove_if (q->begin (), q->end (),
+                                  [&group] (const Entry& e)
+                                    {
+                                      return e.group == group;
+                                    }),
+                  q->end ());
+        VLOG_IF (1, q->size () < oldSize)
+            << "Dropped " << (oldSize - q->size ())
+            << " superseded messages of group " << group;
+      }
+
+  Entry e;
+  e.group = group;
+  e.send = std::move (send);
+
+  switch (prio)
+    {
+    case Priority::HIGH:
+      high.push_back (std::move (e));
+      break;
+    case Priority::NORMAL:
+      normal.push_back (std::move (e));
+      break;
+    }
+
+  cv.notify_all ();
+}
+
+void
+SendQueue::Flush ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  cvIdle.wait (lock, [this] ()
+    {
+      return high.empty () && normal.empty () && !sending;
+    });
+}
+
+void
+SendQueue::Clear ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  VLOG_IF (1, !high.empty () || !normal.empty ())
+      << "Clearing " << (high.size () + normal.size ())
+      << " pending messages";
+  high.clear ();
+  normal.clear ();
+
+  if (!sending)
+    cvIdle.notify_all ();
+}
+
+} // namespace democrit
@@ -0,0 +1,173 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/sendqueue.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace democrit
+{
+namespace
+{
+
+using testing::ElementsAre;
+
+class SendQueueTests : public testing::Test
+{
+
+private:
+
+  std::mutex mutGate;
+  std::condition_variable cvGate;
+  bool open = false;
+  bool blocked = false;
+
+protected:
+
+  /** Messages "sent" so far.  */
+  std::vector<std::string> sent;
+  std::mutex mutSent;
+
+  /**
+   * Returns a send callback that records the given message.
+   */
+  std::function<void ()>
+  Message (const std::string& msg)
+  {
+    return [this, msg] ()
+      {
+        std::lock_guard<std::mutex> lock(mutSent);
+        sent.push_back (msg);
+      };
+  }
+
+  /**
+   * Queues a message that blocks the sender until OpenGate is called,
+   * and waits until the sender is blocked on it.
+   */
+  void
+  BlockSender (SendQueue& q)
+  {
+    q.Push (SendQueue::Priority::HIGH, [this] ()
+      {
+        std::unique_lock<std::mutex> lock(mutGate);
+        blocked = true;
+        cvGate.notify_all ();
+        cvGate.wait (lock, [this] () { return open; });
+      });
+
+    std::unique_lock<std::mutex> lock(mutGate);
+    cvGate.wait (lock, [this] () { return blocked; });
+  }
+
+  void
+  OpenGate ()
+  {
+    std::lock_guard<std::mutex> lock(mutGate);
+    open = true;
+    cvGate.notify_all ();
+  }
+
+};
+
+TEST_F (SendQueueTests, InOrder)
+{
+  SendQueue q(0, 1);
+  for (const std::string msg : {"a", "b", "c"})
+    q.Push (SendQueue::Priority::NORMAL, Message (msg));
+  q.Flush ();
+  EXPECT_THAT (sent, ElementsAre ("a", "b", "c"));
+}
+
+TEST_F (SendQueueTests, HighPriorityFirst)
+{
+  SendQueue q(0, 1);
+  BlockSender (q);
+
+  q.Push (SendQueue::Priority::NORMAL, Message ("normal 1"));
+  q.Push (SendQueue::Priority::HIGH, Message ("high 1"));
+  q.Push (SendQueue::Priority::NORMAL, Message ("normal 2"));
+  q.Push (SendQueue::Priority::HIGH, Message ("high 2"));
+
+  OpenGate ();
+  q.Flush ();
+  EXPECT_THAT (sent,
+               ElementsAre ("high 1", "high 2", "normal 1", "normal 2"));
+}
+
+TEST_F (SendQueueTests, Coalescing)
+{
+  SendQueue q(0, 1);
+  BlockSender (q);
+
+  q.Push (SendQueue::Priority::NORMAL, Message ("full 1"), "orders", true);
+  q.Push (SendQueue::Priority::NORMAL, Message ("delta 1"), "orders", false);
+  q.Push (SendQueue::Priority::NORMAL, Message ("other"), "other", false);
+  q.Push (SendQueue::Priority::NORMAL, Message ("none"));
+  q.Push (SendQueue::Priority::NORMAL, Message ("full 2"), "orders", true);
+  q.Push (SendQueue::Priority::NORMAL, Message ("delta 2"), "orders", false);
+
+  OpenGate ();
+  q.Flush ();
+  EXPECT_THAT (sent, ElementsAre ("other", "none", "full 2", "delta 2"));
+}
+
+TEST_F (SendQueueTests, Clear)
+{
+  SendQueue q(0, 1);
+  BlockSender (q);
+
+  q.Push (SendQueue::Priority::NORMAL, Message ("normal"));
+  q.Push (SendQueue::Priority::HIGH, Message ("high"));
+  q.Clear ();
+  q.Push (SendQueue::Priority::NORMAL, Message ("after"));
+
+  OpenGate ();
+  q.Flush ();
+  EXPECT_THAT (sent, ElementsAre ("after"));
+}
+
+TEST_F (SendQueueTests, RateLimit)
+{
+  constexpr unsigned RATE = 100;
+  constexpr unsigned BURST = 5;
+  constexpr unsigned MESSAGES = 25;
+
+  SendQueue q(RATE, BURST);
+
+  const auto before = std::chrono::steady_clock::now ();
+  for (unsigned i = 0; i < MESSAGES; ++i)
+    q.Push (SendQueue::Priority::NORMAL, Message ("msg"));
+  q.Flush ();
+  const auto after = std::chrono::steady_clock::now ();
+
+  /* The first burst goes out immediately, the others at the rate.  */
+  EXPECT_EQ (sent.size (), MESSAGES);
+  EXPECT_GE (after - before,
+             std::chrono::milliseconds (1'000 * (MESSAGES - BURST) / RATE));
+}
+
+} // anonymous namespace
+} // namespace democrit
@@ -0,0 +1,100 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/spendwatcher.hpp"
+
+#include "private/checker.hpp"
+
+#include <glog/logging.h>
+
+#include <set>
+
+namespace democrit
+{
+
+void
+SpendWatcher::Update (const std::vector<proto::OutPoint>& outs,
+                      const std::string& tip)
+{
+  std::set<OutPointKey> keys;
+  for (const auto& out : outs)
+    keys.emplace (out.hash (), out.n ());
+
+  std::map<OutPointKey, bool> newSpent;
+  std::vector<proto::OutPoint> toCheck;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const bool newTip = (tip != checkedTip);
+    for (const auto& key : keys)
+      {
+        const auto mit = spent.find (key);
+        if (!newTip && mit != spent.end ())
+          {
+            newSpent.emplace (key, mit->second);
+            continue;
+          }
+
+        proto::OutPoint out;
+        out.set_hash (key.first);
+        out.set_n (key.second);
+        toCheck.push_back (std::move (out));
+      }
+  }
+
+  if (!toCheck.empty ())
+    {
+      VLOG (1)
+          << "Checking " << toCheck.size () << " of " << keys.size ()
+          << " watched outpoints at tip " << tip;
+
+      const auto utxos = GetTxOuts (rpc, toCheck);
+      CHECK_EQ (utxos.size (), toCheck.size ());
+      for (size_t i = 0; i < toCheck.size (); ++i)
+        {
+          const OutPointKey key(toCheck[i].hash (), toCheck[i].n ());
+          newSpent.emplace (key, utxos[i].isNull ());
+        }
+    }
+
+  std::lock_guard<std::mutex> lock(mut);
+  spent.swap (newSpent);
+  checkedTip = tip;
+}
+
+void
+SpendWatcher::Clear ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  spent.clear ();
+  checkedTip.clear ();
+}
+
+bool
+SpendWatcher::GetSpent (const proto::OutPoint& out, bool& res) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = spent.find (OutPointKey (out.hash (), out.n ()));
+  if (mit == spent.end ())
+    return false;
+
+  res = mit->second;
+  return true;
+}
+
+} // namespace democrit
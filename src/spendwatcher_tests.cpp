@@ -0,0 +1,135 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/spendwatcher.hpp"
+
+#include "mockxaya.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace democrit
+{
+namespace
+{
+
+class SpendWatcherTests : public testing::Test
+{
+
+protected:
+
+  TestEnvironment<MockXayaRpcServer> env;
+  SpendWatcher watcher;
+
+  SpendWatcherTests ()
+    : watcher(env.GetXayaRpc ())
+  {}
+
+  static proto::OutPoint
+  OutPoint (const std::string& hash, const unsigned n)
+  {
+    proto::OutPoint res;
+    res.set_hash (hash);
+    res.set_n (n);
+    return res;
+  }
+
+  /**
+   * Expects that the given outpoint is watched and has the given
+   * spent state.
+   */
+  void
+  ExpectSpent (const proto::OutPoint& out, const bool expected) const
+  {
+    bool spent;
+    ASSERT_TRUE (watcher.GetSpent (out, spent));
+    EXPECT_EQ (spent, expected);
+  }
+
+  /**
+   * Expects that the given outpoint is not watched.
+   */
+  void
+  ExpectNotWatched (const proto::OutPoint& out) const
+  {
+    bool spent;
+    EXPECT_FALSE (watcher.GetSpent (out, spent));
+  }
+
+};
+
+TEST_F (SpendWatcherTests, Basic)
+{
+  env.GetXayaServer ().AddUtxo ("a", 1);
+
+  watcher.Update ({OutPoint ("a", 1), OutPoint ("b", 2)}, "tip");
+  ExpectSpent (OutPoint ("a", 1), false);
+  ExpectSpent (OutPoint ("b", 2), true);
+  ExpectNotWatched (OutPoint ("a", 2));
+  ExpectNotWatched (OutPoint ("c", 1));
+}
+
+TEST_F (SpendWatcherTests, Duplicates)
+{
+  env.GetXayaServer ().AddUtxo ("a", 1);
+  watcher.Update ({OutPoint ("a", 1), OutPoint ("a", 1)}, "tip");
+  ExpectSpent (OutPoint ("a", 1), false);
+}
+
+TEST_F (SpendWatcherTests, ChecksOncePerTip)
+{
+  watcher.Update ({OutPoint ("a", 1)}, "tip 1");
+  ExpectSpent (OutPoint ("a", 1), true);
+
+  /* With the same tip, the known state is not checked again.  Only the
+     newly added outpoint is looked up.  */
+  env.GetXayaServer ().AddUtxo ("a", 1);
+  env.GetXayaServer ().AddUtxo ("b", 1);
+  watcher.Update ({OutPoint ("a", 1), OutPoint ("b", 1)}, "tip 1");
+  ExpectSpent (OutPoint ("a", 1), true);
+  ExpectSpent (OutPoint ("b", 1), false);
+
+  watcher.Update ({OutPoint ("a", 1), OutPoint ("b", 1)}, "tip 2");
+  ExpectSpent (OutPoint ("a", 1), false);
+  ExpectSpent (OutPoint ("b", 1), false);
+}
+
+TEST_F (SpendWatcherTests, ReplacesWatchedSet)
+{
+  watcher.Update ({OutPoint ("a", 1), OutPoint ("b", 1)}, "tip");
+  watcher.Update ({OutPoint ("b", 1), OutPoint ("c", 1)}, "tip");
+  ExpectNotWatched (OutPoint ("a", 1));
+  ExpectSpent (OutPoint ("b", 1), true);
+  ExpectSpent (OutPoint ("c", 1), true);
+
+  watcher.Update ({}, "tip");
+  ExpectNotWatched (OutPoint ("b", 1));
+  ExpectNotWatched (OutPoint ("c", 1));
+}
+
+TEST_F (SpendWatcherTests, Clear)
+{
+  watcher.Update ({OutPoint ("a", 1)}, "tip");
+  watcher.Clear ();
+  ExpectNotWatched (OutPoint ("a", 1));
+}
+
+} // anonymous namespace
+} // namespace democrit
@@ -22,6 +22,7 @@ namespace democrit
 {
 
 constexpr const char* AccountOrdersStanza::TAG;
+constexpr const char* OrderDeltasStanza::TAG;
 constexpr const char* ProcessingMessageStanza::TAG;
 
 } // namespace democrit
@@ -89,6 +89,20 @@ TEST_F (StanzasTests, AccountOrdersStanza)
   )");
 }
 
+TEST_F (StanzasTests, OrderDeltasStanza)
+{
+  ProtoStanzaRoundtrip<OrderDeltasStanza> (R"(
+    seq: 42
+    added:
+      {
+        key: 101
+        value: { asset: "gold" type: BID price_sat: 10 }
+      }
+    removed: 5
+    locked: 102
+  )");
+}
+
 TEST_F (StanzasTests, ProcessingMessageStanza)
 {
   ProtoStanzaRoundtrip<ProcessingMessageStanza> (R"(
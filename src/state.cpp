@@ -0,0 +1,155 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/state.hpp"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+namespace democrit
+{
+
+DEFINE_int64 (democrit_state_compact_bytes, 1 << 22,
+              "Size of the state log (in bytes) at which it gets compacted"
+              " into a new snapshot");
+
+proto::StateUpdate*
+StateChanges::Add ()
+{
+  if (!enabled)
+    return nullptr;
+
+  records.emplace_back ();
+  return &records.back ();
+}
+
+void
+StateChanges::OwnOrderSet (const uint64_t id, const proto::Order& o)
+{
+  auto* upd = Add ();
+  if (upd == nullptr)
+    return;
+
+  auto& change = *upd->mutable_own_order_set ();
+  change.set_id (id);
+  *change.mutable_order () = o;
+}
+
+void
+StateChanges::OwnOrderRemoved (const uint64_t id)
+{
+  auto* upd = Add ();
+  if (upd != nullptr)
+    upd->set_own_order_removed (id);
+}
+
+void
+StateChanges::NextFreeId (const uint64_t id)
+{
+  auto* upd = Add ();
+  if (upd != nullptr)
+    upd->set_next_free_id (id);
+}
+
+void
+StateChanges::TradeAdded (const proto::TradeState& t)
+{
+  auto* upd = Add ();
+  if (upd != nullptr)
+    *upd->mutable_trade_added () = t;
+}
+
+void
+StateChanges::TradeUpdated (const int index, const proto::TradeState& t)
+{
+  CHECK_GE (index, 0);
+
+  auto* upd = Add ();
+  if (upd == nullptr)
+    return;
+
+  auto& change = *upd->mutable_trade_updated ();
+  change.set_index (index);
+  *change.mutable_trade () = t;
+}
+
+void
+StateChanges::TradeArchived (const int index, const proto::Trade& archived)
+{
+  CHECK_GE (index, 0);
+
+  auto* upd = Add ();
+  if (upd == nullptr)
+    return;
+
+  auto& change = *upd->mutable_trade_archived ();
+  change.set_index (index);
+  *change.mutable_archived () = archived;
+}
+
+void
+StateChanges::ArchiveDropped (const unsigned n)
+{
+  auto* upd = Add ();
+  if (upd != nullptr)
+    upd->set_archive_dropped (n);
+}
+
+/* ************************************************************************** */
+
+State::State (const std::string& account, std::unique_ptr<StateStore> s)
+  : store(std::move (s))
+{
+  if (store == nullptr)
+    {
+      state.set_account (account);
+      return;
+    }
+
+  if (store->Load (state))
+    {
+      CHECK_EQ (state.account (), account)
+          << "Stored state is for a different account";
+    }
+  else
+    state.set_account (account);
+
+  /* Start from a fresh snapshot, which also discards any incomplete
+     data at the end of the log.  */
+  store->Compact (state);
+}
+
+std::unique_ptr<proto::State>
+State::Persist (StateChanges& changes, uint64_t& seq)
+{
+  if (changes.records.empty ())
+    return nullptr;
+
+  for (auto& upd : changes.records)
+    store->Append (upd);
+
+  if (store->IsCompacting ()
+        || store->GetWalSize () < static_cast<size_t> (
+                                      FLAGS_democrit_state_compact_bytes))
+    return nullptr;
+
+  seq = store->BeginCompaction ();
+  return std::make_unique<proto::State> (state);
+}
+
+} // namespace democrit
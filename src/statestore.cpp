@@ -0,0 +1,452 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/statestore.hpp"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace democrit
+{
+
+DEFINE_int32 (democrit_state_sync_ms, 100,
+              "Interval (in milliseconds) for syncing the state log to disk");
+
+namespace
+{
+
+/** Size of the header of a log record (length and checksum).  */
+constexpr size_t RECORD_HEADER = 8;
+
+/**
+ * Computes the CRC-32 checksum (as used e.g. by zlib) of the given data.
+ */
+uint32_t
+Crc32 (const std::string& data)
+{
+  static const auto table = [] ()
+    {
+      std::array<uint32_t, 256> res;
+      for (uint32_t i = 0; i < 256; ++i)
+        {
+          uint32_t c = i;
+          for (unsigned k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+          res[i] = c;
+        }
+      return res;
+    } ();
+
+  uint32_t crc = 0xFFFFFFFF;
+  for (const unsigned char c : data)
+    crc = table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+
+  return crc ^ 0xFFFFFFFF;
+}
+
+void
+EncodeUint32 (const uint32_t val, std::string& out)
+{
+  for (unsigned i = 0; i < 4; ++i)
+    out.push_back (static_cast<char> ((val >> (8 * i)) & 0xFF));
+}
+
+uint32_t
+DecodeUint32 (const std::string& data, const size_t pos)
+{
+  uint32_t res = 0;
+  for (unsigned i = 0; i < 4; ++i)
+    res |= static_cast<uint32_t> (static_cast<unsigned char> (data[pos + i]))
+              << (8 * i);
+  return res;
+}
+
+/**
+ * Reads the full content of a file.  Returns false if the file
+ * does not exist.
+ */
+bool
+ReadFile (const std::string& path, std::string& out)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return false;
+
+  std::ostringstream buf;
+  buf << in.rdbuf ();
+  out = buf.str ();
+
+  return true;
+}
+
+/**
+ * Writes all the given data to a file descriptor, retrying on partial
+ * writes.  CHECK-fails on errors, as we cannot reasonably continue if
+ * persisting the state fails.
+ */
+void
+WriteAll (const int fd, const std::string& data)
+{
+  size_t done = 0;
+  while (done < data.size ())
+    {
+      const ssize_t n = ::write (fd, data.data () + done, data.size () - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      PCHECK (n > 0) << "Failed to write state data";
+      done += n;
+    }
+}
+
+/**
+ * Syncs the directory at the given path, so that renames inside it
+ * are durable.
+ */
+void
+SyncDirectory (const std::string& path)
+{
+  const int fd = ::open (path.c_str (), O_RDONLY | O_DIRECTORY);
+  PCHECK (fd >= 0) << "Failed to open directory " << path;
+  PCHECK (::fsync (fd) == 0) << "Failed to sync directory " << path;
+  ::close (fd);
+}
+
+} // anonymous namespace
+
+StateStore::StateStore (const std::string& d)
+  : dir(d), oldWalFd(-1), compacting(false),
+    walBytes(0), nextSeq(1), dirty(false)
+{
+  const int rc = ::mkdir (dir.c_str (), 0700);
+  PCHECK (rc == 0 || errno == EEXIST) << "Failed to create directory " << dir;
+
+  walFd = ::open (GetWalPath ().c_str (), O_WRONLY | O_CREAT | O_APPEND, 0600);
+  PCHECK (walFd >= 0) << "Failed to open state log " << GetWalPath ();
+
+  struct stat st;
+  PCHECK (::fstat (walFd, &st) == 0);
+  walBytes = st.st_size;
+
+  syncer = std::make_unique<IntervalJob> (
+      std::chrono::milliseconds (FLAGS_democrit_state_sync_ms),
+      [this] ()
+        {
+          Sync ();
+        });
+}
+
+StateStore::~StateStore ()
+{
+  CHECK (!compacting) << "State store destroyed during compaction";
+
+  syncer.reset ();
+  Sync ();
+  ::close (walFd);
+}
+
+std::string
+StateStore::GetSnapshotPath () const
+{
+  return dir + "/state.snapshot";
+}
+
+std::string
+StateStore::GetWalPath () const
+{
+  return dir + "/state.log";
+}
+
+std::string
+StateStore::GetOldWalPath () const
+{
+  return dir + "/state.log.old";
+}
+
+bool
+StateStore::Load (proto::State& out)
+{
+  out.Clear ();
+
+  uint64_t snapshotSeq = 0;
+  std::string data;
+  const bool found = ReadFile (GetSnapshotPath (), data);
+  if (found)
+    {
+      proto::StateSnapshot snapshot;
+      CHECK (snapshot.ParseFromString (data))
+          << "Failed to parse state snapshot " << GetSnapshotPath ();
+      snapshotSeq = snapshot.seq ();
+      out = std::move (*snapshot.mutable_state ());
+    }
+  nextSeq = snapshotSeq + 1;
+
+  /* If a compaction was interrupted, the previous log (which may not be
+     part of the snapshot yet) comes before the current one.  */
+  unsigned replayed = 0;
+  if (ReplayLog (GetOldWalPath (), out, replayed))
+    ReplayLog (GetWalPath (), out, replayed);
+
+  LOG (INFO)
+      << "Loaded state from " << dir << " with " << replayed
+      << " replayed log records";
+
+  return found || nextSeq > 1;
+}
+
+bool
+StateStore::ReplayLog (const std::string& path, proto::State& out,
+                       unsigned& replayed)
+{
+  std::string data;
+  if (!ReadFile (path, data))
+    return true;
+
+  size_t pos = 0;
+  bool complete = true;
+  while (pos < data.size ())
+    {
+      complete = false;
+      if (data.size () - pos < RECORD_HEADER)
+        break;
+
+      const uint32_t len = DecodeUint32 (data, pos);
+      const uint32_t crc = DecodeUint32 (data, pos + 4);
+      if (data.size () - pos - RECORD_HEADER < len)
+        break;
+
+      const std::string payload = data.substr (pos + RECORD_HEADER, len);
+      if (Crc32 (payload) != crc)
+        break;
+
+      proto::StateUpdate upd;
+      if (!upd.ParseFromString (payload))
+        break;
+
+      /* If we crashed between writing a new snapshot and clearing the log,
+         the log will still contain updates that are already part of
+         the snapshot.  Those must not be applied again.  Records modify
+         the state in place, so they must also not be applied if some
+         record before them is missing.  */
+      if (upd.seq () > nextSeq)
+        break;
+
+      complete = true;
+      pos += RECORD_HEADER + len;
+      if (upd.seq () < nextSeq)
+        continue;
+
+      ApplyUpdate (upd, out);
+      nextSeq = upd.seq () + 1;
+      ++replayed;
+    }
+
+  LOG_IF (WARNING, !complete)
+      << "Ignoring " << (data.size () - pos)
+      << " bytes of incomplete or corrupt data at the end of " << path;
+
+  return complete;
+}
+
+void
+StateStore::Append (proto::StateUpdate& upd)
+{
+  upd.set_seq (nextSeq++);
+
+  std::string payload;
+  CHECK (upd.SerializeToString (&payload));
+
+  std::string record;
+  EncodeUint32 (payload.size (), record);
+  EncodeUint32 (Crc32 (payload), record);
+  record += payload;
+
+  WriteAll (walFd, record);
+  walBytes += record.size ();
+
+  std::lock_guard<std::mutex> lock(mutSync);
+  dirty = true;
+}
+
+void
+StateStore::WriteSnapshot (const uint64_t seq, const proto::State& full)
+{
+  proto::StateSnapshot snapshot;
+  snapshot.set_seq (seq);
+  *snapshot.mutable_state () = full;
+
+  std::string data;
+  CHECK (snapshot.SerializeToString (&data));
+
+  const std::string tmpPath = GetSnapshotPath () + ".tmp";
+  const int fd
+      = ::open (tmpPath.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  PCHECK (fd >= 0) << "Failed to open " << tmpPath;
+  WriteAll (fd, data);
+  PCHECK (::fsync (fd) == 0) << "Failed to sync " << tmpPath;
+  ::close (fd);
+
+  PCHECK (::rename (tmpPath.c_str (), GetSnapshotPath ().c_str ()) == 0)
+      << "Failed to rename " << tmpPath;
+  SyncDirectory (dir);
+
+  VLOG (1) << "Written state snapshot at seq " << seq;
+}
+
+void
+StateStore::Compact (const proto::State& full)
+{
+  CHECK (!compacting);
+  WriteSnapshot (nextSeq - 1, full);
+
+  /* Only once the snapshot is durable can we drop the log.  Should we
+     crash before the truncation is persisted, the records in the log
+     are skipped based on their sequence number.  */
+  const int rc = ::unlink (GetOldWalPath ().c_str ());
+  PCHECK (rc == 0 || errno == ENOENT) << "Failed to remove previous log";
+  PCHECK (::ftruncate (walFd, 0) == 0) << "Failed to truncate state log";
+  walBytes = 0;
+}
+
+uint64_t
+StateStore::BeginCompaction ()
+{
+  CHECK (!compacting);
+  compacting = true;
+
+  PCHECK (::rename (GetWalPath ().c_str (), GetOldWalPath ().c_str ()) == 0)
+      << "Failed to move state log aside";
+  const int fd
+      = ::open (GetWalPath ().c_str (), O_WRONLY | O_CREAT | O_APPEND, 0600);
+  PCHECK (fd >= 0) << "Failed to open state log " << GetWalPath ();
+
+  /* Records appended to the new log are reported as durable once they are
+     synced, so the rename and the new log's directory entry must be durable
+     before that (and not only when the compaction is finished).  */
+  SyncDirectory (dir);
+
+  {
+    std::lock_guard<std::mutex> lock(mutSync);
+    oldWalFd = walFd;
+    walFd = fd;
+  }
+  walBytes = 0;
+
+  return nextSeq - 1;
+}
+
+void
+StateStore::FinishCompaction (const uint64_t seq, const proto::State& full)
+{
+  CHECK (compacting);
+  WriteSnapshot (seq, full);
+
+  /* The records in the previous log are all part of the snapshot now,
+     so it does not have to be synced anymore.  */
+  int fd;
+  {
+    std::lock_guard<std::mutex> lock(mutSync);
+    fd = oldWalFd;
+    oldWalFd = -1;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutClose);
+    ::close (fd);
+  }
+  PCHECK (::unlink (GetOldWalPath ().c_str ()) == 0)
+      << "Failed to remove previous log";
+
+  compacting = false;
+}
+
+void
+StateStore::Sync ()
+{
+  std::lock_guard<std::mutex> closeLock(mutClose);
+
+  int fd, oldFd;
+  {
+    std::lock_guard<std::mutex> lock(mutSync);
+    if (!dirty)
+      return;
+    dirty = false;
+    fd = walFd;
+    oldFd = oldWalFd;
+  }
+
+  /* Records in the current log build on those in the previous one,
+     so the latter must be durable first.  */
+  if (oldFd >= 0)
+    {
+      PCHECK (::fdatasync (oldFd) == 0)
+          << "Failed to sync previous state log";
+    }
+  PCHECK (::fdatasync (fd) == 0) << "Failed to sync state log";
+}
+
+void
+StateStore::ApplyUpdate (const proto::StateUpdate& upd, proto::State& s)
+{
+  if (upd.has_own_order_set ())
+    {
+      const auto& change = upd.own_order_set ();
+      (*s.mutable_own_orders ()->mutable_orders ())[change.id ()]
+          = change.order ();
+    }
+  if (upd.has_own_order_removed ())
+    s.mutable_own_orders ()->mutable_orders ()->erase (
+        upd.own_order_removed ());
+  if (upd.has_next_free_id ())
+    s.set_next_free_id (upd.next_free_id ());
+
+  if (upd.has_trade_added ())
+    *s.add_trades () = upd.trade_added ();
+  if (upd.has_trade_updated ())
+    {
+      const int index = upd.trade_updated ().index ();
+      CHECK_LT (index, s.trades_size ());
+      *s.mutable_trades (index) = upd.trade_updated ().trade ();
+    }
+  if (upd.has_trade_archived ())
+    {
+      const int index = upd.trade_archived ().index ();
+      CHECK_LT (index, s.trades_size ());
+      s.mutable_trades ()->DeleteSubrange (index, 1);
+      *s.add_trade_archive () = upd.trade_archived ().archived ();
+    }
+
+  if (upd.archive_dropped () > 0)
+    {
+      const int dropped = upd.archive_dropped ();
+      CHECK_LE (dropped, s.trade_archive_size ());
+      s.mutable_trade_archive ()->DeleteSubrange (0, dropped);
+      s.set_trade_archive_offset (s.trade_archive_offset () + dropped);
+    }
+}
+
+} // namespace democrit
@@ -0,0 +1,448 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/statestore.hpp"
+
+#include "private/state.hpp"
+#include "testutils.hpp"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include <google/protobuf/util/message_differencer.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+namespace democrit
+{
+
+DECLARE_int64 (democrit_state_compact_bytes);
+
+namespace
+{
+
+using google::protobuf::util::MessageDifferencer;
+
+class StateStoreTests : public testing::Test
+{
+
+protected:
+
+  /** Temporary directory used for the store.  */
+  TempDir tmpDir;
+
+  /** Path of the temporary directory.  */
+  const std::string dir;
+
+  StateStoreTests ()
+    : tmpDir("democrit-state"), dir(tmpDir.GetPath ())
+  {}
+
+  /**
+   * Opens a State instance based on our temporary directory.
+   */
+  std::unique_ptr<State>
+  Open (const std::string& account = "me")
+  {
+    return std::make_unique<State> (account,
+                                    std::make_unique<StateStore> (dir));
+  }
+
+  /**
+   * Returns a copy of the full data inside a State instance.
+   */
+  static proto::State
+  GetData (const State& s)
+  {
+    proto::State res;
+    s.ReadState ([&res] (const proto::State& data)
+      {
+        res = data;
+      });
+    return res;
+  }
+
+  /**
+   * Reads the content of a file in our directory.
+   */
+  std::string
+  ReadFile (const std::string& name) const
+  {
+    std::ifstream in(dir + "/" + name, std::ios::binary);
+    std::ostringstream buf;
+    buf << in.rdbuf ();
+    return buf.str ();
+  }
+
+  /**
+   * Writes the content of a file in our directory.
+   */
+  void
+  WriteFile (const std::string& name, const std::string& data) const
+  {
+    std::ofstream out(dir + "/" + name, std::ios::binary);
+    out << data;
+  }
+
+  /**
+   * Returns the size of a file in our directory.
+   */
+  off_t
+  GetFileSize (const std::string& name) const
+  {
+    struct stat st;
+    CHECK_EQ (::stat ((dir + "/" + name).c_str (), &st), 0);
+    return st.st_size;
+  }
+
+};
+
+TEST_F (StateStoreTests, EmptyStart)
+{
+  auto s = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s),
+                                           ParseTextProto<proto::State> (R"(
+    account: "me"
+  )")));
+}
+
+TEST_F (StateStoreTests, Restore)
+{
+  proto::State expected;
+  {
+    auto s = Open ();
+    s->AccessState ([] (proto::State& data, StateChanges& changes)
+      {
+        data.set_next_free_id (10);
+        changes.NextFreeId (10);
+
+        auto& o = (*data.mutable_own_orders ()->mutable_orders ())[5];
+        o.set_asset ("gold");
+        o.set_price_sat (42);
+        changes.OwnOrderSet (5, o);
+      });
+    s->AccessState ([] (proto::State& data, StateChanges& changes)
+      {
+        for (const std::string cp : {"other", "third", "fourth"})
+          {
+            auto* t = data.add_trades ();
+            t->set_counterparty (cp);
+            t->set_their_psbt ("psbt");
+            changes.TradeAdded (*t);
+          }
+      });
+    s->AccessState ([] (proto::State& data, StateChanges& changes)
+      {
+        auto* t = data.mutable_trades (2);
+        t->set_their_psbt ("new psbt");
+        changes.TradeUpdated (2, *t);
+      });
+    s->AccessState ([] (proto::State& data, StateChanges& changes)
+      {
+        /* Archive the first and second trade, in which case the second
+           is at index zero as well when its change is recorded.  */
+        for (const std::string a : {"gold", "silver"})
+          {
+            auto* archived = data.add_trade_archive ();
+            archived->set_asset (a);
+            changes.TradeArchived (0, *archived);
+            data.mutable_trades ()->DeleteSubrange (0, 1);
+          }
+      });
+    s->AccessState ([] (proto::State& data, StateChanges& changes)
+      {
+        data.mutable_trade_archive ()->DeleteSubrange (0, 1);
+        data.set_trade_archive_offset (1);
+        changes.ArchiveDropped (1);
+
+        data.mutable_own_orders ()->mutable_orders ()->erase (5);
+        changes.OwnOrderRemoved (5);
+      });
+    expected = GetData (*s);
+    EXPECT_GT (GetFileSize ("state.log"), 0);
+  }
+
+  EXPECT_TRUE (MessageDifferencer::Equals (expected,
+                                           ParseTextProto<proto::State> (R"(
+    account: "me"
+    own_orders: {}
+    next_free_id: 10
+    trades: { counterparty: "fourth" their_psbt: "new psbt" }
+    trade_archive: { asset: "silver" }
+    trade_archive_offset: 1
+  )"))) << expected.DebugString ();
+
+  auto s = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s), expected))
+      << GetData (*s).DebugString ();
+}
+
+TEST_F (StateStoreTests, UnpersistedChanges)
+{
+  /* Without a store, changes are not recorded at all.  */
+  State s("me");
+  s.AccessState ([] (proto::State& data, StateChanges& changes)
+    {
+      data.set_next_free_id (5);
+      changes.NextFreeId (5);
+    });
+  EXPECT_EQ (GetData (s).next_free_id (), 5);
+}
+
+TEST_F (StateStoreTests, NoRecordForUnchangedState)
+{
+  auto s = Open ();
+  const auto before = GetFileSize ("state.log");
+  s->AccessState ([] (proto::State& data, StateChanges& changes) {});
+  EXPECT_EQ (GetFileSize ("state.log"), before);
+}
+
+TEST_F (StateStoreTests, Compaction)
+{
+  FLAGS_democrit_state_compact_bytes = 100;
+
+  proto::State expected;
+  {
+    auto s = Open ();
+    for (unsigned i = 0; i < 50; ++i)
+      s->AccessState ([i] (proto::State& data, StateChanges& changes)
+        {
+          data.set_next_free_id (i);
+          changes.NextFreeId (i);
+
+          auto* t = data.add_trades ();
+          t->set_units (i);
+          changes.TradeAdded (*t);
+        });
+    expected = GetData (*s);
+    EXPECT_LT (GetFileSize ("state.log"), 200);
+    EXPECT_EQ (::access ((dir + "/state.log.old").c_str (), F_OK), -1);
+  }
+
+  auto s = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s), expected));
+  EXPECT_EQ (GetData (*s).trades_size (), 50);
+
+  FLAGS_democrit_state_compact_bytes = 1 << 22;
+}
+
+TEST_F (StateStoreTests, LogAlreadyInSnapshot)
+{
+  /* Simulate a crash after writing a snapshot but before the log has been
+     cleared:  Keep a copy of the log before compaction (by opening the
+     state again), and restore it afterwards.  */
+
+  {
+    auto s = Open ();
+    s->AccessState ([] (proto::State& data, StateChanges& changes)
+      {
+        auto* t = data.add_trades ();
+        t->set_counterparty ("other");
+        changes.TradeAdded (*t);
+      });
+  }
+
+  const std::string log = ReadFile ("state.log");
+  ASSERT_FALSE (log.empty ());
+
+  Open ();
+  WriteFile ("state.log", log);
+
+  auto s = Open ();
+  EXPECT_EQ (GetData (*s).trades_size (), 1);
+}
+
+TEST_F (StateStoreTests, AppendDuringCompaction)
+{
+  std::string snapshot, oldLog, newLog;
+  {
+    StateStore store(dir);
+    proto::State data;
+    store.Load (data);
+    data.set_account ("me");
+    store.Compact (data);
+
+    const uint64_t seq = store.BeginCompaction ();
+    for (const std::string cp : {"first", "second"})
+      {
+        proto::StateUpdate upd;
+        upd.mutable_trade_added ()->set_counterparty (cp);
+        store.Append (upd);
+        store.Sync ();
+      }
+
+    /* Save the files as they are after the records have been synced,
+       so that we can simulate a crash before the compaction finishes.  */
+    snapshot = ReadFile ("state.snapshot");
+    oldLog = ReadFile ("state.log.old");
+    newLog = ReadFile ("state.log");
+
+    store.FinishCompaction (seq, data);
+  }
+
+  const auto expected = ParseTextProto<proto::State> (R"(
+    account: "me"
+    trades: { counterparty: "first" }
+    trades: { counterparty: "second" }
+  )");
+
+  {
+    auto s = Open ();
+    EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s), expected))
+        << GetData (*s).DebugString ();
+  }
+
+  WriteFile ("state.snapshot", snapshot);
+  WriteFile ("state.log.old", oldLog);
+  WriteFile ("state.log", newLog);
+
+  auto s = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s), expected))
+      << GetData (*s).DebugString ();
+}
+
+/**
+ * Tests for crashes during a compaction.  The store is used directly
+ * (but initialised like State does it), and a compaction is started with
+ * some updates before and after it.  The files as they are before the
+ * compaction is finished are saved, so that different crash scenarios
+ * can be restored from them.
+ */
+class StateStoreInterruptedCompactionTests : public StateStoreTests
+{
+
+protected:
+
+  /** The snapshot from before the compaction.  */
+  std::string oldSnapshot;
+
+  /** The state log moved aside by the compaction.  */
+  std::string oldLog;
+
+  /** The new state log started by the compaction.  */
+  std::string newLog;
+
+  StateStoreInterruptedCompactionTests ()
+  {
+    StateStore store(dir);
+    proto::State data;
+    store.Load (data);
+    data.set_account ("me");
+    store.Compact (data);
+    oldSnapshot = ReadFile ("state.snapshot");
+
+    proto::StateUpdate upd;
+    upd.set_next_free_id (5);
+    store.Append (upd);
+    StateStore::ApplyUpdate (upd, data);
+
+    const uint64_t seq = store.BeginCompaction ();
+    EXPECT_TRUE (store.IsCompacting ());
+
+    upd = ParseTextProto<proto::StateUpdate> (R"(
+      trade_added: { counterparty: "other" }
+    )");
+    store.Append (upd);
+
+    oldLog = ReadFile ("state.log.old");
+    newLog = ReadFile ("state.log");
+    EXPECT_FALSE (oldLog.empty ());
+    EXPECT_FALSE (newLog.empty ());
+
+    store.FinishCompaction (seq, data);
+    EXPECT_FALSE (store.IsCompacting ());
+  }
+
+};
+
+TEST_F (StateStoreInterruptedCompactionTests, BeforeSnapshot)
+{
+  WriteFile ("state.snapshot", oldSnapshot);
+  WriteFile ("state.log.old", oldLog);
+  WriteFile ("state.log", newLog);
+
+  auto s = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s),
+                                           ParseTextProto<proto::State> (R"(
+    account: "me"
+    next_free_id: 5
+    trades: { counterparty: "other" }
+  )"))) << GetData (*s).DebugString ();
+}
+
+TEST_F (StateStoreInterruptedCompactionTests, AfterSnapshot)
+{
+  WriteFile ("state.log.old", oldLog);
+
+  auto s = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s),
+                                           ParseTextProto<proto::State> (R"(
+    account: "me"
+    next_free_id: 5
+    trades: { counterparty: "other" }
+  )"))) << GetData (*s).DebugString ();
+}
+
+TEST_F (StateStoreInterruptedCompactionTests, PreviousLogLost)
+{
+  /* If the previous log has not been synced, the records in the new one
+     must not be applied on top of the snapshot.  */
+  WriteFile ("state.snapshot", oldSnapshot);
+  WriteFile ("state.log", newLog);
+
+  auto s = Open ();
+  EXPECT_TRUE (MessageDifferencer::Equals (GetData (*s),
+                                           ParseTextProto<proto::State> (R"(
+    account: "me"
+  )"))) << GetData (*s).DebugString ();
+}
+
+TEST_F (StateStoreTests, IncompleteRecord)
+{
+  {
+    auto s = Open ();
+    s->AccessState ([] (proto::State& data, StateChanges& changes)
+      {
+        data.set_next_free_id (5);
+        changes.NextFreeId (5);
+      });
+  }
+
+  {
+    std::ofstream out(dir + "/state.log",
+                      std::ios::binary | std::ios::app);
+    out << "garbage";
+  }
+
+  auto s = Open ();
+  EXPECT_EQ (GetData (*s).next_free_id (), 5);
+}
+
+TEST_F (StateStoreTests, WrongAccount)
+{
+  Open ("me");
+  EXPECT_DEATH (Open ("other"), "different account");
+}
+
+} // anonymous namespace
+} // namespace democrit
@@ -21,6 +21,7 @@
 #include <experimental/filesystem>
 
 #include <chrono>
+#include <cstdlib>
 #include <sstream>
 #include <thread>
 
@@ -98,6 +99,19 @@ SleepSome ()
   std::this_thread::sleep_for (std::chrono::milliseconds (10));
 }
 
+TempDir::TempDir (const std::string& prefix)
+{
+  std::string tmpl = "/tmp/" + prefix + "-XXXXXX";
+  CHECK (::mkdtemp (&tmpl[0]) != nullptr)
+      << "Failed to create temporary directory";
+  path = tmpl;
+}
+
+TempDir::~TempDir ()
+{
+  fs::remove_all (path);
+}
+
 Json::Value
 ParseJson (const std::string& str)
 {
@@ -109,6 +109,41 @@ gloox::JID GetRoom (const std::string& nm);
  */
 void SleepSome ();
 
+/**
+ * Temporary directory (e.g. for a StateStore) that is created in the
+ * constructor and removed again, including all its contents, when the
+ * instance is destructed.
+ */
+class TempDir
+{
+
+private:
+
+  /** The path of the directory.  */
+  std::string path;
+
+public:
+
+  /**
+   * Creates a fresh directory in /tmp, whose name starts with
+   * the given prefix.
+   */
+  explicit TempDir (const std::string& prefix);
+
+  ~TempDir ();
+
+  TempDir () = delete;
+  TempDir (const TempDir&) = delete;
+  void operator= (const TempDir&) = delete;
+
+  const std::string&
+  GetPath () const
+  {
+    return path;
+  }
+
+};
+
 /**
  * Parses a string to JSON.
  */
@@ -136,9 +171,12 @@ template <typename Proto>
     return false; \
   }
 
+DEFINE_PROTO_MATCHER (EqualsOrder, Order)
 DEFINE_PROTO_MATCHER (EqualsOrdersForAsset, OrderbookForAsset)
 DEFINE_PROTO_MATCHER (EqualsOrdersByAsset, OrderbookByAsset)
 DEFINE_PROTO_MATCHER (EqualsOrdersOfAccount, OrdersOfAccount)
+DEFINE_PROTO_MATCHER (EqualsDepthForAsset, DepthForAsset)
+DEFINE_PROTO_MATCHER (EqualsBookChange, BookChange)
 DEFINE_PROTO_MATCHER (EqualsTradeState, TradeState)
 DEFINE_PROTO_MATCHER (EqualsTrade, Trade)
 
@@ -0,0 +1,99 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/tipnotifier.hpp"
+
+#include <jsonrpccpp/common/exception.h>
+
+#include <glog/logging.h>
+
+namespace democrit
+{
+
+void
+TipNotifier::UpdateTip (const std::string& hash)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (hash == tip)
+    return;
+
+  VLOG (1) << "New best block: " << hash;
+  tip = hash;
+
+  for (const auto& entry : listeners)
+    entry.second (tip);
+}
+
+unsigned
+TipNotifier::AddListener (const Listener& cb)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  const unsigned id = nextId++;
+  listeners.emplace (id, cb);
+  return id;
+}
+
+void
+TipNotifier::RemoveListener (const unsigned id)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK_EQ (listeners.erase (id), 1) << "Unknown listener ID: " << id;
+}
+
+std::string
+TipNotifier::GetTip () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return tip;
+}
+
+RpcTipNotifier::RpcTipNotifier (RpcClient<XayaRpcClient>& r,
+                                const std::chrono::milliseconds intv)
+  : rpc(r)
+{
+  poller = std::make_unique<IntervalJob> (intv, [this] ()
+    {
+      Poll ();
+    });
+}
+
+RpcTipNotifier::~RpcTipNotifier ()
+{
+  /* Make sure the poller is stopped before the instance (e.g. the tip
+     and listeners in the base class) is destructed.  */
+  poller.reset ();
+}
+
+void
+RpcTipNotifier::Poll ()
+{
+  std::string hash;
+  try
+    {
+      hash = rpc->getbestblockhash ();
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      LOG (WARNING) << "Failed to get best block hash: " << exc.what ();
+      return;
+    }
+
+  UpdateTip (hash);
+}
+
+} // namespace democrit
@@ -0,0 +1,118 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/tipnotifier.hpp"
+
+#include "mockxaya.hpp"
+#include "testutils.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace democrit
+{
+namespace
+{
+
+using testing::ElementsAre;
+
+/**
+ * TipNotifier that allows tests to set the tip directly.
+ */
+class TestTipNotifier : public TipNotifier
+{
+
+public:
+
+  using TipNotifier::UpdateTip;
+
+};
+
+class TipNotifierTests : public testing::Test
+{
+
+protected:
+
+  TestTipNotifier notifier;
+
+  /** Tips seen by our listener.  */
+  std::vector<std::string> seen;
+
+};
+
+TEST_F (TipNotifierTests, NotifiesOnChange)
+{
+  const unsigned id = notifier.AddListener ([this] (const std::string& h)
+    {
+      seen.push_back (h);
+    });
+
+  EXPECT_EQ (notifier.GetTip (), "");
+  notifier.UpdateTip ("a");
+  notifier.UpdateTip ("a");
+  notifier.UpdateTip ("b");
+  EXPECT_EQ (notifier.GetTip (), "b");
+
+  notifier.RemoveListener (id);
+  notifier.UpdateTip ("c");
+
+  EXPECT_THAT (seen, ElementsAre ("a", "b"));
+}
+
+TEST_F (TipNotifierTests, MultipleListeners)
+{
+  unsigned calls = 0;
+  notifier.AddListener ([&calls] (const std::string& h)
+    {
+      ++calls;
+    });
+  notifier.AddListener ([this] (const std::string& h)
+    {
+      seen.push_back (h);
+    });
+
+  notifier.UpdateTip ("a");
+  EXPECT_EQ (calls, 1);
+  EXPECT_THAT (seen, ElementsAre ("a"));
+}
+
+TEST (RpcTipNotifierTests, PollsBestBlock)
+{
+  constexpr auto INTV = std::chrono::milliseconds (10);
+
+  TestEnvironment<MockXayaRpcServer> env;
+  env.GetXayaServer ().SetBestBlock (MockXayaRpcServer::GetBlockHash (10));
+
+  RpcTipNotifier notifier(env.GetXayaRpc (), INTV);
+  std::this_thread::sleep_for (5 * INTV);
+  EXPECT_EQ (notifier.GetTip (),
+             MockXayaRpcServer::GetBlockHash (10).ToHex ());
+
+  env.GetXayaServer ().SetBestBlock (MockXayaRpcServer::GetBlockHash (11));
+  std::this_thread::sleep_for (5 * INTV);
+  EXPECT_EQ (notifier.GetTip (),
+             MockXayaRpcServer::GetBlockHash (11).ToHex ());
+}
+
+} // anonymous namespace
+} // namespace democrit
@@ -22,7 +22,12 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <google/protobuf/util/message_differencer.h>
 
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <queue>
 #include <sstream>
 
 namespace democrit
@@ -36,6 +41,13 @@ DEFINE_int32 (democrit_feerate_wo_names, 1'000,
 DEFINE_int32 (democrit_trade_timeout_ms, 30'000,
               "Milliseconds until an initiated trade will be abandoned if not"
               " finalised with the counterparty");
+DEFINE_int32 (democrit_trade_update_threads, 8,
+              "Number of threads used to run periodic updates of trades");
+DEFINE_int32 (democrit_max_archived_trades, 10'000,
+              "Maximum number of finalised trades to keep in the archive"
+              " (zero for no limit)");
+
+using google::protobuf::util::MessageDifferencer;
 
 namespace
 {
@@ -77,7 +89,7 @@ LockUnspent (RpcClient<XayaRpcClient>& rpc, const bool lock,
 void
 UnlockPsbtInputs (RpcClient<XayaRpcClient>& rpc, const std::string& psbt)
 {
-  const auto decoded = rpc->decodepsbt (psbt);
+  const auto decoded = DecodePsbt (rpc, psbt);
   CHECK (decoded.isObject ());
   const auto& tx = decoded["tx"];
   CHECK (tx.isObject ());
@@ -113,23 +125,38 @@ Trade::BuildTradeChecker () const
     }
 
   return std::make_unique<TradeChecker> (
-      tm.spec, tm.xayaRpc,
+      tm.spec, tm.xayaRpc, tm.headers,
       buyer, seller,
       pb.order ().asset (), pb.order ().price_sat (), pb.units ());
 }
 
+const TradeChecker&
+Trade::GetChecker () const
+{
+  if (checker == nullptr)
+    checker = BuildTradeChecker ();
+
+  return *checker;
+}
+
 std::string
-Trade::GetIdentifier () const
+Trade::GetIdentifier (const proto::TradeState& data)
 {
   /* New lines are not valid inside Xaya names, so they can act as
      separator between maker name and order ID.  */
 
   std::ostringstream res;
-  res << pb.order ().account () << '\n' << pb.order ().id ();
+  res << data.order ().account () << '\n' << data.order ().id ();
 
   return res.str ();
 }
 
+std::string
+Trade::GetIdentifier () const
+{
+  return GetIdentifier (pb);
+}
+
 proto::Order::Type
 Trade::GetOrderType () const
 {
@@ -468,7 +495,8 @@ Trade::HasReply (proto::ProcessingMessage& reply)
     {
       CHECK (pb.has_their_psbt ());
 
-      if (!checker->CheckForSellerOutputs (pb.their_psbt (), pb.seller_data ()))
+      if (!GetChecker ().CheckForSellerOutputs (pb.their_psbt (),
+                                                pb.seller_data ()))
         {
           LOG (WARNING) << "Buyer provided invalid PSBT for the trade";
           return false;
@@ -477,8 +505,8 @@ Trade::HasReply (proto::ProcessingMessage& reply)
       bool complete;
       const auto psbt = SignPsbt (tm.xayaRpc, pb.their_psbt (), complete);
 
-      if (!checker->CheckForSellerSignature (pb.their_psbt (), psbt,
-                                             pb.seller_data ()))
+      if (!GetChecker ().CheckForSellerSignature (pb.their_psbt (), psbt,
+                                                  pb.seller_data ()))
         {
           LOG (WARNING) << "Signing PSBT as seller provided invalid signatures";
           return false;
@@ -517,18 +545,18 @@ Trade::HasReply (proto::ProcessingMessage& reply)
   if (GetOrderType () == proto::Order::BID && !pb.has_our_psbt ())
     {
       proto::OutPoint nameIn;
-      if (!checker->CheckForBuyerTrade (nameIn))
+      if (!GetChecker ().CheckForBuyerTrade (nameIn))
         {
           LOG (WARNING) << "Seller cannot fulfill the trade";
           return false;
         }
 
-      const auto unsignedPsbt = ConstructTransaction (*checker, nameIn);
+      const auto unsignedPsbt = ConstructTransaction (GetChecker (), nameIn);
 
       bool complete;
       const auto signedPsbt = SignPsbt (tm.xayaRpc, unsignedPsbt, complete);
 
-      if (!checker->CheckForBuyerSignature (unsignedPsbt, signedPsbt))
+      if (!GetChecker ().CheckForBuyerSignature (unsignedPsbt, signedPsbt))
         {
           LOG (WARNING) << "Signing PSBT as buyer provided invalid signatures";
           /* ConstructTransaction locked the inputs in our wallet, but we
@@ -569,6 +597,7 @@ Trade::HasReply (proto::ProcessingMessage& reply)
           << "Sharing our PSBT with the counterparty as taker:\n"
           << reply.DebugString ();
       pb.set_state (proto::Trade::PENDING);
+      CacheTransactionData ();
       return true;
     }
 
@@ -621,9 +650,31 @@ Trade::HasReply (proto::ProcessingMessage& reply)
   LOG (INFO) << "Broadcasted trade transaction: " << txid;
 
   pb.set_state (proto::Trade::PENDING);
+  CacheTransactionData ();
   return false;
 }
 
+void
+Trade::CacheTransactionData ()
+{
+  VLOG (1) << "Decoding transaction data of trade " << GetIdentifier ();
+
+  const auto decoded = DecodePsbt (tm.xayaRpc, pb.our_psbt ());
+  CHECK (decoded.isObject ());
+  const auto& tx = decoded["tx"];
+  CHECK (tx.isObject ());
+
+  const auto& btxidVal = tx["btxid"];
+  CHECK (btxidVal.isString ());
+  pb.set_btxid (btxidVal.asString ());
+
+  const auto& vin = tx["vin"];
+  CHECK (vin.isArray ());
+  pb.clear_inputs ();
+  for (const auto& in : vin)
+    *pb.add_inputs () = OutPointFromJson (in);
+}
+
 void
 Trade::Update ()
 {
@@ -652,17 +703,16 @@ Trade::Update ()
   if (pb.state () != proto::Trade::PENDING)
     return;
 
+  /* The transaction data is cached when the trade becomes pending.  Only
+     trades loaded from older state files may still lack it.  */
+  CHECK (pb.has_our_psbt ());
+  if (!pb.has_btxid ())
+    CacheTransactionData ();
+
   /* First, check the state of this trade's btxid in the g/dem GSP.  If it is
      confirmed with a sufficiently low height (compared to the current block
      height), then we mark the trade as succeeded.  */
-  CHECK (pb.has_our_psbt ());
-  const auto decoded = tm.xayaRpc->decodepsbt (pb.our_psbt ());
-  CHECK (decoded.isObject ());
-  const auto& tx = decoded["tx"];
-  CHECK (tx.isObject ());
-  const auto& btxidVal = tx["btxid"];
-  CHECK (btxidVal.isString ());
-  const std::string btxid = btxidVal.asString ();
+  const std::string& btxid = pb.btxid ();
 
   const auto check = tm.demGsp->checktrade (btxid);
   CHECK (check.isObject ());
@@ -703,34 +753,42 @@ Trade::Update ()
   /* If one of the trade's inputs is not available, the trade is conflicted.
      The first time this happens, we remember the block height.  If we then
      advance beyond the required confirmations, we mark it as failed.  */
-  const auto& vin = tx["vin"];
-  CHECK (vin.isArray ());
   bool conflicted = false;
-  for (const auto& in : vin)
+  std::vector<proto::OutPoint> unwatched;
+  for (const auto& in : pb.inputs ())
     {
-      CHECK (in.isObject ());
-      const auto& hashVal = in["txid"];
-      CHECK (hashVal.isString ());
-      const auto& nVal = in["vout"];
-      CHECK (nVal.isUInt ());
-
-      /* gettxout can return JSON objects and JSON null, which does not work
-         well with the libjson-rpc-cpp generated code.  */
-      Json::Value params(Json::arrayValue);
-      params.append (hashVal.asString ());
-      params.append (nVal.asUInt ());
-      const auto utxoData = tm.xayaRpc->CallMethod ("gettxout", params);
-
-      if (utxoData.isNull ())
+      bool spent;
+      if (!tm.spends.GetSpent (in, spent))
+        unwatched.push_back (in);
+      else if (spent)
         {
           VLOG (1)
               << "For trade with btxid " << btxid
-              << ", the input " << hashVal << ":" << nVal
+              << ", the input " << in.hash () << ":" << in.n ()
               << " has been double spent";
           conflicted = true;
           break;
         }
     }
+
+  /* Inputs that are not (yet) known to the spend watcher, e.g. because
+     the trade just became pending, are looked up directly in a single
+     batched request.  */
+  if (!conflicted && !unwatched.empty ())
+    {
+      const auto utxos = GetTxOuts (tm.xayaRpc, unwatched);
+      CHECK_EQ (utxos.size (), unwatched.size ());
+      for (size_t i = 0; i < unwatched.size (); ++i)
+        if (utxos[i].isNull ())
+          {
+            VLOG (1)
+                << "For trade with btxid " << btxid
+                << ", the input " << unwatched[i].hash ()
+                << ":" << unwatched[i].n () << " has been double spent";
+            conflicted = true;
+            break;
+          }
+    }
   if (!conflicted)
     {
       pb.clear_conflict_height ();
@@ -798,7 +856,13 @@ Trade::HandleFailure () const
   if (GetOrderType () == proto::Order::BID && pb.has_our_psbt ())
     {
       VLOG (1) << "Unlocking inputs for failed sale:\n" << pb.our_psbt ();
-      UnlockPsbtInputs (tm.xayaRpc, pb.our_psbt ());
+      if (pb.has_btxid ())
+        {
+          for (const auto& in : pb.inputs ())
+            LockUnspent (tm.xayaRpc, false, in);
+        }
+      else
+        UnlockPsbtInputs (tm.xayaRpc, pb.our_psbt ());
     }
 }
 
@@ -809,65 +873,360 @@ TradeManager::TradeManager (State& s, MyOrders& mo, const AssetSpec& as,
                             RpcClient<DemGspRpcClient>& d,
                             const bool startUpdates)
   : state(s), myOrders(mo), spec(as),
-    xayaRpc(x), demGsp(d)
+    xayaRpc(x), demGsp(d), headers(x), spends(x),
+    numIndexedTrades(0), archiveIndex(),
+    newTip(false), tipNotifier(nullptr), tipListener(0)
 {
+  state.ReadState ([this] (const proto::State& s)
+    {
+      RebuildTradeIndex (s);
+    });
+
+  updatePool = std::make_unique<WorkerPool> (
+      std::max (FLAGS_democrit_trade_update_threads, 1));
+
   if (startUpdates)
-    SetupUpdater (GetTradeTimeout ());
+    {
+      SetupUpdater (GetTradeTimeout ());
+      wakeups = std::make_unique<WakeupJob> ([this] ()
+        {
+          RunWakeupUpdates ();
+        });
+    }
+}
+
+TradeManager::~TradeManager ()
+{
+  /* Make sure no jobs are running anymore (and no new ones can be triggered)
+     before the members they use are destroyed.  */
+  if (tipNotifier != nullptr)
+    tipNotifier->RemoveListener (tipListener);
+  wakeups.reset ();
+  updater.reset ();
+}
+
+void
+TradeManager::EnableTipUpdates (TipNotifier& n)
+{
+  CHECK (tipNotifier == nullptr) << "Tip updates are already enabled";
+  if (wakeups == nullptr)
+    return;
+
+  tipNotifier = &n;
+  tipListener = n.AddListener ([this] (const std::string& hash)
+    {
+      VLOG (1) << "New tip " << hash << ", scheduling trade updates";
+      newTip = true;
+      wakeups->Trigger ();
+    });
+}
+
+void
+TradeManager::RunWakeupUpdates ()
+{
+  const bool updatePending = newTip.exchange (false);
+
+  /* Fetch the headers of new blocks right away, so that they are available
+     to ancestry checks done by trades later on.  */
+  xaya::uint256 tip;
+  if (updatePending && tip.FromHex (tipNotifier->GetTip ()))
+    {
+      try
+        {
+          headers.Warm (tip);
+        }
+      catch (const jsonrpc::JsonRpcException& exc)
+        {
+          LOG (WARNING)
+              << "JSON-RPC exception: " << exc.what ()
+              << "\nWhile fetching block headers for " << tip.ToHex ();
+        }
+    }
+
+  UpdateAndArchiveTrades ([updatePending] (const proto::TradeState& t)
+    {
+      switch (t.state ())
+        {
+        case proto::Trade::INITIATED:
+          return true;
+        case proto::Trade::PENDING:
+          return updatePending;
+        default:
+          return false;
+        }
+    });
+}
+
+void
+TradeManager::ScheduleTimeout ()
+{
+  /* Trade start times have only a resolution of seconds, so we add some
+     slack to make sure the trade is actually timed out when we check.  */
+  if (wakeups != nullptr)
+    wakeups->TriggerAfter (GetTradeTimeout () + std::chrono::seconds (1));
+}
+
+void
+TradeManager::UpdateInParallel (
+    const std::string& account, std::vector<proto::TradeState>& trades,
+    const std::function<void (const proto::TradeState&,
+                              proto::TradeState&)>& done) const
+{
+  std::vector<std::function<void ()>> jobs;
+  for (auto& t : trades)
+    jobs.push_back ([this, &account, &t, &done] ()
+      {
+        const proto::TradeState original = t;
+        try
+          {
+            Trade obj(*this, account, t);
+            obj.Update ();
+          }
+        catch (const jsonrpc::JsonRpcException& exc)
+          {
+            LOG (WARNING)
+                << "JSON-RPC exception: " << exc.what ()
+                << "\nWhile updating trade:\n" << original.DebugString ();
+            t = original;
+          }
+        done (original, t);
+      });
+
+  updatePool->RunAll (std::move (jobs));
+}
+
+void
+TradeManager::WatchPendingInputs (const std::vector<proto::TradeState>& trades)
+{
+  /* If there are no pending trades to update, we keep the watcher as it is.
+     This is the case e.g. for wakeups that just check for timeouts, and
+     we do not want those to discard the spent states of the current tip.  */
+  bool hasPending = false;
+  std::vector<proto::OutPoint> outs;
+  for (const auto& t : trades)
+    if (t.state () == proto::Trade::PENDING)
+      {
+        hasPending = true;
+        outs.insert (outs.end (), t.inputs ().begin (), t.inputs ().end ());
+      }
+  if (!hasPending)
+    return;
+
+  try
+    {
+      std::string tip;
+      if (tipNotifier != nullptr)
+        tip = tipNotifier->GetTip ();
+      if (tip.empty () && !outs.empty ())
+        tip = xayaRpc->getbestblockhash ();
+
+      spends.Update (outs, tip);
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      LOG (WARNING)
+          << "JSON-RPC exception: " << exc.what ()
+          << "\nWhile checking inputs of pending trades";
+      spends.Clear ();
+    }
+}
+
+void
+TradeManager::ClaimTrade (const std::string& id)
+{
+  std::unique_lock<std::mutex> lock(mutOwned);
+  cvOwned.wait (lock, [this, &id] ()
+    {
+      return ownedTrades.count (id) == 0;
+    });
+  ownedTrades.insert (id);
+}
+
+bool
+TradeManager::TryClaimTrade (const std::string& id)
+{
+  std::lock_guard<std::mutex> lock(mutOwned);
+  return ownedTrades.insert (id).second;
+}
+
+bool
+TradeManager::IsTradeOwned (const std::string& id)
+{
+  std::lock_guard<std::mutex> lock(mutOwned);
+  return ownedTrades.count (id) > 0;
+}
+
+void
+TradeManager::ReleaseTrade (const std::string& id)
+{
+  std::lock_guard<std::mutex> lock(mutOwned);
+  CHECK_EQ (ownedTrades.erase (id), 1) << "Trade was not owned: " << id;
+  cvOwned.notify_all ();
 }
 
 void
 TradeManager::UpdateAndArchiveTrades ()
 {
-  VLOG (1) << "Running periodic update of trades...";
+  UpdateAndArchiveTrades ([] (const proto::TradeState& t)
+    {
+      return true;
+    });
+}
 
+void
+TradeManager::UpdateAndArchiveTrades (
+    const std::function<bool (const proto::TradeState&)>& filter)
+{
+  VLOG (1) << "Running update of trades...";
+  std::lock_guard<std::mutex> lock(mutUpdates);
+
+  /* Trades that are finalised already (e.g. by a message handler) need no
+     update and are archived right away.  Of the others, we take ownership
+     of all we update, so that they cannot be changed by message handlers
+     concurrently.  Trades that are owned by a message handler right now are
+     left alone (and also not archived) until the next update.  */
   std::string account;
+  std::vector<proto::TradeState> toUpdate;
   std::vector<proto::TradeState> finalised;
-  state.AccessState ([&] (proto::State& s)
+  state.AccessState ([&] (proto::State& s, StateChanges& changes)
     {
       account = s.account ();
 
+      /* The position of the current trade as seen by the recorded changes,
+         i.e. in the list with all previously archived trades removed.  */
+      int pos = 0;
+
       google::protobuf::RepeatedPtrField<proto::TradeState> stillActive;
       for (proto::TradeState& t : *s.mutable_trades ())
         {
           Trade obj(*this, account, t);
-          obj.Update ();
-          if (obj.IsFinalised ())
+          const auto id = obj.GetIdentifier ();
+
+          if (obj.IsFinalised () && !IsTradeOwned (id))
             {
-              *s.mutable_trade_archive ()->Add () = obj.GetPublicInfo ();
+              auto& archived = *s.mutable_trade_archive ()->Add ();
+              archived = obj.GetPublicInfo ();
+              changes.TradeArchived (pos, archived);
               finalised.emplace_back (std::move (t));
+              continue;
             }
-          else
-            *stillActive.Add () = std::move (t);
+
+          if (filter (t))
+            {
+              if (TryClaimTrade (id))
+                toUpdate.push_back (t);
+              else
+                VLOG (1) << "Skipping update of busy trade " << id;
+            }
+
+          *stillActive.Add () = std::move (t);
+          ++pos;
         }
 
-      s.mutable_trades ()->Swap (&stillActive);
+      if (!finalised.empty ())
+        {
+          s.mutable_trades ()->Swap (&stillActive);
+          RebuildTradeIndex (s);
+          DropExcessArchive (s, changes);
+        }
     });
 
-  /* If trades got finalised, we need to do some further processing on them,
-     e.g. to release locked inputs or to restore the order if we are the maker
-     and the trade failed.  */
   for (const auto& t : finalised)
-    {
-      const Trade obj(*this, account, t);
-      switch (t.state ())
+    FinishArchivedTrade (account, t);
+  size_t numArchived = finalised.size ();
+
+  WatchPendingInputs (toUpdate);
+
+  /* Each trade is written back and released as soon as its own update is
+     done, so that e.g. initiated trades (whose update needs no RPC calls)
+     are not blocked for message handlers while pending trades are still
+     checked against the blockchain.  */
+  std::mutex mutArchived;
+  UpdateInParallel (account, toUpdate,
+      [&] (const proto::TradeState& before, proto::TradeState& updated)
         {
-        case proto::Trade::ABANDONED:
-        case proto::Trade::FAILED:
-          obj.HandleFailure ();
-          break;
-        case proto::Trade::SUCCESS:
-          obj.HandleSuccess ();
-          break;
-        default:
-          /* Any other state should not have been finalised!  */
-          LOG (FATAL)
-              << "Trade with state " << static_cast<int> (t.state ())
-              << " has been archived";
-        }
+          const auto id = Trade::GetIdentifier (before);
+          const Trade obj(*this, account, updated);
+
+          bool archived = false;
+          state.AccessState ([&] (proto::State& s, StateChanges& changes)
+            {
+              CHECK_EQ (s.account (), account);
+
+              const int pos = FindTradePos (s, id,
+                  [&before] (const proto::TradeState& t)
+                    {
+                      return MessageDifferencer::Equals (t, before);
+                    });
+              CHECK_GE (pos, 0) << "Owned trade disappeared: " << id;
+
+              if (obj.IsFinalised ())
+                {
+                  auto& entry = *s.mutable_trade_archive ()->Add ();
+                  entry = obj.GetPublicInfo ();
+                  changes.TradeArchived (pos, entry);
+                  s.mutable_trades ()->DeleteSubrange (pos, 1);
+                  RebuildTradeIndex (s);
+                  DropExcessArchive (s, changes);
+                  archived = true;
+                }
+              else if (!MessageDifferencer::Equals (updated, s.trades (pos)))
+                {
+                  *s.mutable_trades (pos) = updated;
+                  changes.TradeUpdated (pos, updated);
+                }
+            });
+          ReleaseTrade (id);
+
+          if (archived)
+            {
+              FinishArchivedTrade (account, updated);
+              std::lock_guard<std::mutex> lockArchived(mutArchived);
+              ++numArchived;
+            }
+        });
+
+  LOG_IF (INFO, numArchived > 0)
+      << "Archived " << numArchived << " finalised trades";
+}
+
+void
+TradeManager::DropExcessArchive (proto::State& s, StateChanges& changes)
+{
+  const int excess = s.trade_archive_size ()
+                        - FLAGS_democrit_max_archived_trades;
+  if (FLAGS_democrit_max_archived_trades > 0 && excess > 0)
+    {
+      s.mutable_trade_archive ()->DeleteSubrange (0, excess);
+      s.set_trade_archive_offset (s.trade_archive_offset () + excess);
+      changes.ArchiveDropped (excess);
+      VLOG (1) << "Dropped " << excess << " trades from the archive";
     }
+}
 
-  LOG_IF (INFO, !finalised.empty ())
-      << "Archived " << finalised.size () << " finalised trades";
+void
+TradeManager::FinishArchivedTrade (const std::string& account,
+                                   const proto::TradeState& t) const
+{
+  /* Finalised trades need some further processing, e.g. to release locked
+     inputs or to restore the order if we are the maker and the trade
+     failed.  */
+  const Trade obj(*this, account, t);
+  switch (t.state ())
+    {
+    case proto::Trade::ABANDONED:
+    case proto::Trade::FAILED:
+      obj.HandleFailure ();
+      break;
+    case proto::Trade::SUCCESS:
+      obj.HandleSuccess ();
+      break;
+    default:
+      /* Any other state should not have been finalised!  */
+      LOG (FATAL)
+          << "Trade with state " << static_cast<int> (t.state ())
+          << " has been archived";
+    }
 }
 
 std::vector<proto::Trade>
@@ -885,6 +1244,232 @@ TradeManager::GetTrades () const
   return res;
 }
 
+namespace
+{
+
+/** Number of archived trades returned if the query does not set a limit.  */
+constexpr unsigned DEFAULT_QUERY_LIMIT = 100;
+
+/**
+ * Returns true if the given trade matches all filters of a query.
+ */
+bool
+MatchesQuery (const proto::TradeQuery& q, const proto::Trade& t)
+{
+  if (q.has_since () && t.start_time () < q.since ())
+    return false;
+  if (q.has_asset () && t.asset () != q.asset ())
+    return false;
+  if (q.has_counterparty () && t.counterparty () != q.counterparty ())
+    return false;
+  if (q.has_state () && t.state () != q.state ())
+    return false;
+
+  return true;
+}
+
+/**
+ * Removes all positions before the given offset from the front of
+ * the lists in an index map, and erases lists that become empty.
+ */
+template <typename Map>
+  void
+  PruneIndexLists (Map& m, const uint64_t offset)
+{
+  for (auto it = m.begin (); it != m.end (); )
+    {
+      auto& lst = it->second;
+      while (!lst.empty () && lst.front () < offset)
+        lst.pop_front ();
+
+      if (lst.empty ())
+        it = m.erase (it);
+      else
+        ++it;
+    }
+}
+
+} // anonymous namespace
+
+void
+TradeManager::SyncArchiveIndex (const proto::State& s) const
+{
+  auto& idx = archiveIndex;
+
+  const uint64_t offset = s.trade_archive_offset ();
+  const uint64_t end = offset + s.trade_archive_size ();
+
+  /* If the archive has been changed in some other way than by dropping
+     and appending trades, rebuild the index from scratch.  */
+  if (end < idx.end || offset < idx.offset)
+    {
+      VLOG (1) << "Rebuilding the trade archive index";
+      idx = ArchiveIndex ();
+      idx.end = offset;
+      idx.offset = offset;
+    }
+
+  if (offset > idx.offset)
+    {
+      PruneIndexLists (idx.byCounterparty, offset);
+      PruneIndexLists (idx.byAsset, offset);
+      PruneIndexLists (idx.byState, offset);
+
+      /* Pruning the start-time index requires a full pass, so we only
+         do that once it contains mostly stale entries.  */
+      auto& times = idx.byStartTime;
+      if (times.size () > 2 * static_cast<size_t> (s.trade_archive_size ()))
+        {
+          for (auto it = times.begin (); it != times.end (); )
+            {
+              if (it->second < offset)
+                it = times.erase (it);
+              else
+                ++it;
+            }
+        }
+
+      idx.offset = offset;
+    }
+
+  for (uint64_t pos = std::max (idx.end, offset); pos < end; ++pos)
+    {
+      const auto& t = s.trade_archive (pos - offset);
+      idx.byCounterparty[t.counterparty ()].push_back (pos);
+      idx.byAsset[t.asset ()].push_back (pos);
+      idx.byState[t.state ()].push_back (pos);
+      idx.byStartTime.emplace (t.start_time (), pos);
+    }
+  idx.end = end;
+}
+
+proto::TradeQueryResult
+TradeManager::QueryTrades (const proto::TradeQuery& q) const
+{
+  /* A zero limit would return an empty page with an unchanged cursor,
+     so that a client following cursors never terminates.  Treat it
+     like an unset limit instead.  */
+  const unsigned limit
+      = q.has_limit () && q.limit () > 0 ? q.limit () : DEFAULT_QUERY_LIMIT;
+
+  proto::TradeQueryResult res;
+  state.ReadState ([&] (const proto::State& s)
+    {
+      if (!q.has_cursor ())
+        for (const auto& t : s.trades ())
+          {
+            auto pub = Trade (*this, s.account (), t).GetPublicInfo ();
+            if (MatchesQuery (q, pub))
+              *res.add_trades () = std::move (pub);
+          }
+
+      SyncArchiveIndex (s);
+      const auto& idx = archiveIndex;
+
+      const uint64_t offset = s.trade_archive_offset ();
+      uint64_t upper = offset + s.trade_archive_size ();
+      if (q.has_cursor ())
+        upper = std::min (upper, q.cursor ());
+
+      /* Processes the archived trade at the given position, adding it
+         to the result if it matches.  Returns false when the page is
+         complete and iteration should stop.  */
+      unsigned found = 0;
+      uint64_t lastPos = upper;
+      const auto process = [&] (const uint64_t pos)
+        {
+          const auto& t = s.trade_archive (pos - offset);
+          if (!MatchesQuery (q, t))
+            return true;
+
+          if (found == limit)
+            {
+              res.set_cursor (lastPos);
+              return false;
+            }
+
+          *res.add_trades () = t;
+          lastPos = pos;
+          ++found;
+          return true;
+        };
+
+      /* Goes through a sorted list of candidate positions backwards,
+         starting before the upper bound.  */
+      const auto walk = [&] (const auto& positions)
+        {
+          auto it = std::lower_bound (positions.begin (), positions.end (),
+                                      upper);
+          while (it != positions.begin ())
+            {
+              --it;
+              if (*it < offset || !process (*it))
+                break;
+            }
+        };
+
+      /* Use the most selective index list for the filters we have.  */
+      const std::deque<uint64_t>* lst = nullptr;
+      bool noMatches = false;
+      const auto useList = [&] (const auto& m, const auto& key)
+        {
+          const auto mit = m.find (key);
+          if (mit == m.end ())
+            noMatches = true;
+          else if (lst == nullptr || mit->second.size () < lst->size ())
+            lst = &mit->second;
+        };
+      if (q.has_counterparty ())
+        useList (idx.byCounterparty, q.counterparty ());
+      if (q.has_asset ())
+        useList (idx.byAsset, q.asset ());
+      if (q.has_state ())
+        useList (idx.byState, static_cast<int> (q.state ()));
+
+      if (noMatches)
+        return;
+
+      if (lst != nullptr)
+        walk (*lst);
+      else if (q.has_since ())
+        {
+          /* Start times are not ordered by archive position, so we go
+             through the start-time index directly and just keep the
+             limit + 1 highest positions below the upper bound (enough to
+             fill the page and set the cursor) in a min-heap.  */
+          std::priority_queue<uint64_t, std::vector<uint64_t>,
+                              std::greater<uint64_t>> highest;
+          for (auto it = idx.byStartTime.lower_bound (q.since ());
+               it != idx.byStartTime.end (); ++it)
+            {
+              const uint64_t pos = it->second;
+              if (pos < offset || pos >= upper)
+                continue;
+
+              if (highest.size () <= limit)
+                highest.push (pos);
+              else if (pos > highest.top ())
+                {
+                  highest.pop ();
+                  highest.push (pos);
+                }
+            }
+
+          std::vector<uint64_t> candidates;
+          candidates.reserve (highest.size ());
+          for (; !highest.empty (); highest.pop ())
+            candidates.push_back (highest.top ());
+          walk (candidates);
+        }
+      else
+        for (uint64_t pos = upper; pos > offset; --pos)
+          if (!process (pos - 1))
+            break;
+    });
+
+  return res;
+}
+
 void
 TradeManager::SetupUpdater (const Trade::Clock::duration intv)
 {
@@ -940,6 +1525,101 @@ CheckOrder (const proto::Order& o, const Amount units)
 
 } // anonymous namespace
 
+void
+TradeManager::RebuildTradeIndex (const proto::State& s)
+{
+  tradeIndex.clear ();
+  for (int i = 0; i < s.trades_size (); ++i)
+    tradeIndex.emplace (Trade::GetIdentifier (s.trades (i)), i);
+  numIndexedTrades = s.trades_size ();
+}
+
+void
+TradeManager::IndexNewTrade (const proto::State& s)
+{
+  const int pos = s.trades_size () - 1;
+  CHECK_GE (pos, 0);
+
+  if (numIndexedTrades != pos)
+    {
+      RebuildTradeIndex (s);
+      return;
+    }
+
+  tradeIndex.emplace (Trade::GetIdentifier (s.trades (pos)), pos);
+  numIndexedTrades = s.trades_size ();
+}
+
+int
+TradeManager::FindTradePos (
+    const proto::State& s, const std::string& id,
+    const std::function<bool (const proto::TradeState&)>& pred)
+{
+  if (numIndexedTrades != s.trades_size ())
+    RebuildTradeIndex (s);
+
+  /* Looks up the matching trade in the index.  Returns false if the
+     index turns out to be inconsistent with the state.  If there are
+     multiple matches, the first one in the state is returned (as a linear
+     scan would do).  */
+  const auto lookup = [&] (int& res)
+    {
+      res = -1;
+      int bestPos = s.trades_size ();
+
+      const auto range = tradeIndex.equal_range (id);
+      for (auto it = range.first; it != range.second; ++it)
+        {
+          const int pos = it->second;
+          if (pos >= s.trades_size ())
+            return false;
+
+          const auto& t = s.trades (pos);
+          if (Trade::GetIdentifier (t) != it->first)
+            return false;
+
+          if (pos < bestPos && pred (t))
+            {
+              res = pos;
+              bestPos = pos;
+            }
+        }
+
+      return true;
+    };
+
+  int res;
+  if (lookup (res))
+    return res;
+
+  LOG (WARNING) << "Trade index is out of sync, rebuilding";
+  RebuildTradeIndex (s);
+  CHECK (lookup (res));
+
+  return res;
+}
+
+int
+TradeManager::FindTradePosForMessage (const proto::State& s,
+                                      const proto::ProcessingMessage& msg)
+{
+  return FindTradePos (s, msg.identifier (),
+      [&msg] (const proto::TradeState& t)
+        {
+          return t.counterparty () == msg.counterparty ();
+        });
+}
+
+const proto::TradeState*
+TradeManager::FindTradeForMessage (const proto::State& s,
+                                   const proto::ProcessingMessage& msg)
+{
+  const int pos = FindTradePosForMessage (s, msg);
+  if (pos < 0)
+    return nullptr;
+  return &s.trades (pos);
+}
+
 bool
 TradeManager::TakeOrder (const proto::Order& o, const Amount units,
                          proto::ProcessingMessage& msg)
@@ -954,45 +1634,57 @@ TradeManager::TakeOrder (const proto::Order& o, const Amount units,
   data.set_counterparty (o.account ());
   data.set_state (proto::Trade::INITIATED);
 
-  bool ok;
-  state.AccessState ([&] (proto::State& s)
+  std::string account;
+  state.ReadState ([&account] (const proto::State& s)
     {
-      if (data.counterparty () == s.account ())
-        {
-          LOG (WARNING)
-              << "Can't take own order:\n" << data.order ().DebugString ();
-          ok = false;
-          return;
-        }
+      account = s.account ();
+    });
 
-      Trade t(*this, s.account (), data);
+  if (data.counterparty () == account)
+    {
+      LOG (WARNING)
+          << "Can't take own order:\n" << data.order ().DebugString ();
+      return false;
+    }
 
-      try
-        {
-          if (t.HasReply (msg))
-            {
-              /* This means we were the seller and it filled in the seller
-                 data as well.  We still add the "taking_order" field below.  */
-            }
-          else
-            t.InitProcessingMessage (msg);
-        }
-      catch (const jsonrpc::JsonRpcException& exc)
-        {
-          LOG (WARNING)
-              << "JSON-RPC exception: " << exc.what ()
-              << "\nWhile taking order:\n" << data.order ().DebugString ();
-          ok = false;
-          return;
-        }
+  /* The trade is not yet part of the state, so we can do the initial
+     processing (which may involve RPC calls, e.g. to get the seller
+     addresses) without holding the state lock.  This allows taking
+     multiple orders in parallel.  */
+  {
+    Trade t(*this, account, data);
 
-      t.SetTakingOrder (msg);
+    try
+      {
+        if (t.HasReply (msg))
+          {
+            /* This means we were the seller and it filled in the seller
+               data as well.  We still add the "taking_order" field below.  */
+          }
+        else
+          t.InitProcessingMessage (msg);
+      }
+    catch (const jsonrpc::JsonRpcException& exc)
+      {
+        LOG (WARNING)
+            << "JSON-RPC exception: " << exc.what ()
+            << "\nWhile taking order:\n" << data.order ().DebugString ();
+        return false;
+      }
+
+    t.SetTakingOrder (msg);
+  }
 
+  state.AccessState ([&] (proto::State& s, StateChanges& changes)
+    {
+      CHECK_EQ (s.account (), account);
       *s.mutable_trades ()->Add () = std::move (data);
-      ok = true;
+      changes.TradeAdded (s.trades (s.trades_size () - 1));
+      IndexNewTrade (s);
     });
 
-  return ok;
+  ScheduleTimeout ();
+  return true;
 }
 
 bool
@@ -1010,7 +1702,8 @@ TradeManager::OrderTaken (const proto::Order& o, const Amount units,
   data.set_state (proto::Trade::INITIATED);
 
   bool ok;
-  state.AccessState ([&data, &ok] (proto::State& s)
+  state.AccessState ([this, &data, &ok] (proto::State& s,
+                                         StateChanges& changes)
     {
       CHECK_EQ (data.order ().account (), s.account ());
 
@@ -1023,10 +1716,15 @@ TradeManager::OrderTaken (const proto::Order& o, const Amount units,
       else
         {
           *s.mutable_trades ()->Add () = std::move (data);
+          changes.TradeAdded (s.trades (s.trades_size () - 1));
+          IndexNewTrade (s);
           ok = true;
         }
     });
 
+  if (ok)
+    ScheduleTimeout ();
+
   return ok;
 }
 
@@ -1061,37 +1759,90 @@ TradeManager::ProcessMessage (const proto::ProcessingMessage& msg,
          processing below.  */
     }
 
-  bool ok = false;
-  state.AccessState ([&] (proto::State& s)
+  /* Handling the message may involve RPC calls (e.g. to construct or sign
+     transactions, which also locks coins or broadcasts), so we do it on
+     a copy of the trade without holding the state lock.  This allows
+     messages for different trades to be processed in parallel.  To make
+     sure the message is handled exactly once and the result is not
+     overwritten, we take exclusive ownership of the trade for that time.  */
+  std::string account;
+  const auto lookup = [&] (proto::TradeState& out)
     {
-      for (auto& tPb : *s.mutable_trades ())
+      bool found = false;
+      state.ReadState ([&] (const proto::State& s)
         {
-          Trade t(*this, s.account (), tPb);
-          if (!t.Matches (msg))
-            continue;
-          CHECK (!ok);
-
-          try
-            {
-              t.HandleMessage (msg);
-              if (t.HasReply (reply))
-                ok = true;
-            }
-          catch (const jsonrpc::JsonRpcException& exc)
+          account = s.account ();
+          const proto::TradeState* tPb = FindTradeForMessage (s, msg);
+          if (tPb != nullptr)
             {
-              LOG (WARNING)
-                  << "JSON-RPC exception: " << exc.what ()
-                  << "\nWhile processing message:\n" << msg.DebugString ();
-              CHECK (!ok);
+              out = *tPb;
+              found = true;
             }
+        });
+      return found;
+    };
 
-          break;
+  proto::TradeState data;
+  if (!lookup (data))
+    return false;
+  const std::string id = Trade::GetIdentifier (data);
+
+  ClaimTrade (id);
+
+  /* The trade may have been changed or archived while we were waiting
+     to claim it, so look it up again.  */
+  if (!lookup (data))
+    {
+      ReleaseTrade (id);
+      return false;
+    }
+
+  const bool ok = HandleMessageForTrade (account, data, msg, reply);
+
+  state.AccessState ([&] (proto::State& s, StateChanges& changes)
+    {
+      CHECK_EQ (s.account (), account);
+
+      const int pos = FindTradePosForMessage (s, msg);
+      CHECK_GE (pos, 0) << "Owned trade disappeared: " << id;
+
+      /* Only record an update if handling the message actually changed
+         something, e.g. not for messages that are just ignored.  */
+      proto::TradeState& t = *s.mutable_trades (pos);
+      if (!MessageDifferencer::Equals (t, data))
+        {
+          t = std::move (data);
+          changes.TradeUpdated (pos, t);
         }
     });
+  ReleaseTrade (id);
 
   return ok;
 }
 
+bool
+TradeManager::HandleMessageForTrade (const std::string& account,
+                                     proto::TradeState& data,
+                                     const proto::ProcessingMessage& msg,
+                                     proto::ProcessingMessage& reply)
+{
+  Trade t(*this, account, data);
+  CHECK (t.Matches (msg));
+
+  try
+    {
+      t.HandleMessage (msg);
+      return t.HasReply (reply);
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      LOG (WARNING)
+          << "JSON-RPC exception: " << exc.what ()
+          << "\nWhile processing message:\n" << msg.DebugString ();
+      return false;
+    }
+}
+
 /* ************************************************************************** */
 
 } // namespace democrit
@@ -21,21 +21,32 @@
 #include "mockxaya.hpp"
 #include "private/myorders.hpp"
 #include "private/state.hpp"
+#include "private/statestore.hpp"
 #include "testutils.hpp"
 
 #include <gflags/gflags.h>
 #include <gmock/gmock.h>
+#include <google/protobuf/util/message_differencer.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 namespace democrit
 {
 
 DECLARE_int32 (democrit_confirmations);
+DECLARE_int32 (democrit_max_archived_trades);
 DECLARE_int32 (democrit_trade_timeout_ms);
 
 namespace
 {
 
+using google::protobuf::util::MessageDifferencer;
 using testing::ElementsAre;
 using testing::Return;
 
@@ -82,6 +93,22 @@ public:
       mockTime(0), account(a)
   {}
 
+  /**
+   * Constructs the instance with its state persisted in the given store.
+   */
+  template <typename XayaRpc>
+    explicit TestTradeManager (const std::string& a,
+                               TestEnvironment<XayaRpc>& env,
+                               std::unique_ptr<StateStore> store)
+    : State(a, std::move (store)),
+      MyOrders(static_cast<State&> (*this), NO_EXPIRY),
+      TradeManager(static_cast<State&> (*this),
+                   static_cast<MyOrders&> (*this),
+                   env.GetAssetSpec (), env.GetXayaRpc (), env.GetGspRpc (),
+                   false),
+      mockTime(0), account(a)
+  {}
+
   void
   SetMockTime (const int64_t t)
   {
@@ -98,11 +125,12 @@ public:
   {
     auto pb = ParseTextProto<proto::TradeState> (data);
     proto::TradeState* ref;
-    AccessState ([&pb, &ref] (proto::State& s)
+    AccessState ([this, &pb, &ref] (proto::State& s, StateChanges&)
       {
         s.clear_trades ();
         ref = s.mutable_trades ()->Add ();
         *ref = std::move (pb);
+        RebuildTradeIndex (s);
       });
 
     return std::unique_ptr<Trade> (new Trade (*this, account, *ref));
@@ -114,9 +142,11 @@ public:
   void
   AddTrade (const proto::TradeState& pb)
   {
-    AccessState ([&pb] (proto::State& s)
+    AccessState ([this, &pb] (proto::State& s, StateChanges& changes)
       {
         *s.mutable_trades ()->Add () = std::move (pb);
+        IndexNewTrade (s);
+        changes.TradeAdded (s.trades (s.trades_size () - 1));
       });
   }
 
@@ -163,9 +193,10 @@ public:
   void
   AddOrder (const uint64_t id, const proto::Order& o)
   {
-    AccessState ([id] (proto::State& s)
+    AccessState ([id] (proto::State& s, StateChanges& changes)
       {
         s.set_next_free_id (id);
+        changes.NextFreeId (id);
       });
 
     auto copy = o;
@@ -551,10 +582,16 @@ TEST_F (TradeUpdateTests, NoTimeOutWhenPending)
     state: PENDING
     start_time: 10
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"), EqualsTradeState (R"(
     state: PENDING
     start_time: 10
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"));
 }
 
@@ -564,9 +601,15 @@ TEST_F (TradeUpdateTests, MarkedSuccess)
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"), EqualsTradeState (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"));
 
   env.GetGspServer ().SetCurrentHeight (109);
@@ -574,18 +617,30 @@ TEST_F (TradeUpdateTests, MarkedSuccess)
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"), EqualsTradeState (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"));
 
   env.GetGspServer ().SetCurrentHeight (110);
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"), EqualsTradeState (R"(
     state: SUCCESS
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"));
 }
 
@@ -596,10 +651,16 @@ TEST_F (TradeUpdateTests, NotDoubleSpent)
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
     conflict_height: 10
   )"), EqualsTradeState (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"));
 }
 
@@ -609,10 +670,16 @@ TEST_F (TradeUpdateTests, NotConflictedIfPending)
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
     conflict_height: 10
   )"), EqualsTradeState (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"));
 }
 
@@ -625,9 +692,15 @@ TEST_F (TradeUpdateTests, MarkedFailed)
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
   )"), EqualsTradeState (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
     conflict_height: 101
   )"));
 
@@ -635,10 +708,16 @@ TEST_F (TradeUpdateTests, MarkedFailed)
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
     conflict_height: 101
   )"), EqualsTradeState (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
     conflict_height: 101
   )"));
 
@@ -646,16 +725,56 @@ TEST_F (TradeUpdateTests, MarkedFailed)
   EXPECT_THAT (UpdateTrade (R"(
     state: PENDING
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
     conflict_height: 101
   )"), EqualsTradeState (R"(
     state: FAILED
     our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
     conflict_height: 101
   )"));
 }
 
 /* ************************************************************************** */
 
+TEST_F (TradeUpdateTests, CachesTransactionData)
+{
+  env.GetGspServer ().SetPending ("id");
+  EXPECT_THAT (UpdateTrade (R"(
+    state: PENDING
+    our_psbt: "psbt"
+  )"), EqualsTradeState (R"(
+    state: PENDING
+    our_psbt: "psbt"
+    btxid: "id"
+    inputs: { hash: "name in" n: 12 }
+    inputs: { hash: "coin in" n: 1 }
+  )"));
+}
+
+TEST_F (TradeUpdateTests, UsesCachedTransactionData)
+{
+  /* The PSBT is unknown to the mock server, so decoding it would fail.  */
+  env.GetGspServer ().SetPending ("cached id");
+  EXPECT_THAT (UpdateTrade (R"(
+    state: PENDING
+    our_psbt: "unknown psbt"
+    btxid: "cached id"
+    inputs: { hash: "name in" n: 12 }
+  )"), EqualsTradeState (R"(
+    state: PENDING
+    our_psbt: "unknown psbt"
+    btxid: "cached id"
+    inputs: { hash: "name in" n: 12 }
+  )"));
+}
+
+/* ************************************************************************** */
+
 using TradeSellerDataTests = TradeStateTests;
 
 TEST_F (TradeSellerDataTests, BuyerSentData)
@@ -1081,6 +1200,10 @@ TEST_F (TradeBuyerTransactionTests, BuyerIsTaker)
             counterparty: "other"
             seller_data: { name_address: "addr 1" chi_address: "addr 2" }
             our_psbt: "partial"
+            btxid: "unsigned btxid"
+            inputs: { hash: "buyer txid" n: 1 }
+            inputs: { hash: "buyer txid" n: 2 }
+            inputs: { hash: "other txid" n: 12 }
       )"),
       EqualsProcessingMessage (R"(
         counterparty: "other"
@@ -1271,6 +1394,10 @@ TEST_F (TradeSellerTransactionTests, SellerIsMaker)
           }
         their_psbt: "partial"
         our_psbt: "full"
+        btxid: "unsigned btxid"
+        inputs: { hash: "buyer txid" n: 1 }
+        inputs: { hash: "buyer txid" n: 2 }
+        inputs: { hash: "me txid" n: 12 }
     )"));
 }
 
@@ -1319,6 +1446,10 @@ TEST_F (TradeSellerTransactionTests, SellerIsTaker)
           }
         their_psbt: "unsigned"
         our_psbt: "partial"
+        btxid: "unsigned btxid"
+        inputs: { hash: "buyer txid" n: 1 }
+        inputs: { hash: "buyer txid" n: 2 }
+        inputs: { hash: "me txid" n: 12 }
       )"),
       EqualsProcessingMessage (R"(
         counterparty: "other"
@@ -1372,6 +1503,10 @@ TEST_F (TradeMakerBuyerFinalisationTests, Success)
         seller_data: { name_address: "addr 1" chi_address: "addr 2" }
         our_psbt: "my partial"
         their_psbt: "other partial"
+        btxid: "unsigned btxid"
+        inputs: { hash: "buyer txid" n: 1 }
+        inputs: { hash: "buyer txid" n: 2 }
+        inputs: { hash: "other txid" n: 12 }
     )"));
 }
 
@@ -1811,7 +1946,8 @@ TEST_F (TradeManagerTests, Archive)
   env.GetXayaServer ().SetPsbt ("signed", ParseJson (R"({
     "tx":
       {
-        "btxid": "id"
+        "btxid": "id",
+        "vin": []
       }
   })"));
   env.GetGspServer ().SetPending ("id");
@@ -1948,6 +2084,341 @@ TEST_F (TradeManagerTests, Archive)
   EXPECT_EQ (tm.LookupTrade ("other", 20), nullptr);
 }
 
+TEST_F (TradeManagerTests, UpdatesManyTrades)
+{
+  constexpr unsigned num = 20;
+
+  FLAGS_democrit_trade_timeout_ms = 10'000;
+  tm.SetMockTime (100);
+
+  for (unsigned i = 0; i < num; ++i)
+    {
+      auto pb = ParseTextProto<proto::TradeState> (R"(
+        state: INITIATED
+        order:
+          {
+            account: "other"
+            asset: "gold"
+            price_sat: 100
+            type: ASK
+          }
+        units: 1
+        counterparty: "other"
+      )");
+      pb.mutable_order ()->set_id (i);
+      pb.set_start_time (95 + (i % 2) * 10);
+      tm.AddTrade (pb);
+    }
+
+  /* Half of the trades should time out, the others not yet.  */
+  tm.SetMockTime (110);
+  tm.UpdateAndArchiveTrades ();
+
+  unsigned abandoned = 0;
+  for (const auto& t : tm.GetTrades ())
+    if (t.state () == proto::Trade::ABANDONED)
+      ++abandoned;
+  EXPECT_EQ (abandoned, num / 2);
+
+  for (unsigned i = 0; i < num; ++i)
+    if (i % 2 == 0)
+      EXPECT_EQ (tm.LookupTrade ("other", i), nullptr);
+    else
+      EXPECT_NE (tm.LookupTrade ("other", i), nullptr);
+}
+
+TEST_F (TradeManagerTests, FilteredUpdate)
+{
+  FLAGS_democrit_trade_timeout_ms = 10'000;
+
+  for (unsigned i = 1; i <= 2; ++i)
+    {
+      auto pb = ParseTextProto<proto::TradeState> (R"(
+        state: INITIATED
+        start_time: 100
+        order:
+          {
+            account: "other"
+            asset: "gold"
+            price_sat: 100
+            type: ASK
+          }
+        units: 1
+        counterparty: "other"
+      )");
+      pb.mutable_order ()->set_id (i);
+      tm.AddTrade (pb);
+    }
+
+  /* Both trades are timed out, but only the one selected by the filter
+     should be updated and archived.  */
+  tm.SetMockTime (200);
+  tm.UpdateAndArchiveTrades ([] (const proto::TradeState& t)
+    {
+      return t.order ().id () == 1;
+    });
+  EXPECT_EQ (tm.LookupTrade ("other", 1), nullptr);
+  EXPECT_NE (tm.LookupTrade ("other", 2), nullptr);
+
+  tm.UpdateAndArchiveTrades ();
+  EXPECT_EQ (tm.LookupTrade ("other", 2), nullptr);
+}
+
+TEST_F (TradeManagerTests, MessageAfterArchive)
+{
+  FLAGS_democrit_trade_timeout_ms = 100'000;
+
+  tm.AddTrade (R"(
+    state: FAILED
+    start_time: 100
+    order:
+      {
+        account: "invalid"
+        id: 1
+        asset: "gold"
+        price_sat: 10
+        type: ASK
+      }
+    units: 1
+    counterparty: "invalid"
+  )");
+  tm.AddTrade (R"(
+    state: INITIATED
+    start_time: 100
+    order:
+      {
+        account: "invalid"
+        id: 2
+        asset: "gold"
+        price_sat: 10
+        type: ASK
+      }
+    units: 1
+    counterparty: "invalid"
+  )");
+
+  /* Archiving the first trade shifts the position of the second one
+     in the state, which the trade index needs to handle.  */
+  tm.UpdateAndArchiveTrades ();
+  EXPECT_EQ (tm.LookupTrade ("invalid", 1), nullptr);
+
+  /* A message with the right identifier but from someone else
+     should be ignored.  The "invalid" name makes sure that the further
+     processing (as buyer) stops after merging in the seller data.  */
+  tm.ProcessWithoutReply (R"(
+    counterparty: "third"
+    identifier: "invalid\n2"
+    seller_data: { name_address: "wrong name" chi_address: "wrong chi" }
+  )");
+  tm.ProcessWithoutReply (R"(
+    counterparty: "invalid"
+    identifier: "invalid\n2"
+    seller_data: { name_address: "name addr" chi_address: "chi addr" }
+  )");
+
+  auto t = tm.LookupTrade ("invalid", 2);
+  ASSERT_NE (t, nullptr);
+  EXPECT_EQ (tm.GetInternalState (*t).seller_data ().name_address (),
+             "name addr");
+}
+
+TEST_F (TradeManagerTests, BoundedArchive)
+{
+  FLAGS_democrit_trade_timeout_ms = 100'000;
+  FLAGS_democrit_max_archived_trades = 2;
+
+  for (unsigned i = 1; i <= 3; ++i)
+    {
+      auto pb = ParseTextProto<proto::TradeState> (R"(
+        state: ABANDONED
+        order:
+          {
+            account: "other"
+            asset: "gold"
+            price_sat: 20
+            type: ASK
+          }
+        units: 1
+        counterparty: "other"
+      )");
+      pb.mutable_order ()->set_id (i);
+      pb.set_start_time (i);
+      tm.AddTrade (pb);
+    }
+  tm.UpdateAndArchiveTrades ();
+
+  tm.ReadState ([] (const proto::State& s)
+    {
+      EXPECT_EQ (s.trades_size (), 0);
+      ASSERT_EQ (s.trade_archive_size (), 2);
+      EXPECT_EQ (s.trade_archive (0).start_time (), 2);
+      EXPECT_EQ (s.trade_archive (1).start_time (), 3);
+      EXPECT_EQ (s.trade_archive_offset (), 1);
+    });
+
+  FLAGS_democrit_max_archived_trades = 10'000;
+}
+
+/**
+ * Tests for querying trades with filters and pagination.
+ */
+class TradeQueryTests : public TradeManagerTests
+{
+
+protected:
+
+  TradeQueryTests ()
+  {
+    tm.AddTrade (R"(
+      state: INITIATED
+      start_time: 60
+      order:
+        {
+          account: "other"
+          id: 1
+          asset: "gold"
+          price_sat: 10
+          type: ASK
+        }
+      units: 1
+      counterparty: "other"
+    )");
+
+    AddArchived (proto::Trade::SUCCESS, 10, "a", "gold");
+    AddArchived (proto::Trade::FAILED, 20, "b", "gold");
+    AddArchived (proto::Trade::SUCCESS, 30, "a", "silver");
+    AddArchived (proto::Trade::ABANDONED, 40, "a", "gold");
+    AddArchived (proto::Trade::SUCCESS, 50, "b", "silver");
+  }
+
+  /**
+   * Adds a trade with the given data directly to the archive.
+   */
+  void
+  AddArchived (const proto::Trade::State state, const int64_t startTime,
+               const std::string& counterparty, const std::string& asset)
+  {
+    tm.AccessState ([&] (proto::State& s, StateChanges&)
+      {
+        auto& t = *s.add_trade_archive ();
+        t.set_state (state);
+        t.set_start_time (startTime);
+        t.set_counterparty (counterparty);
+        t.set_asset (asset);
+      });
+  }
+
+  /**
+   * Runs a query (given as text proto) and returns the start times of the
+   * returned trades (which identify them uniquely in our tests).  The cursor
+   * is returned as well, or -1 if there is none.
+   */
+  std::vector<int64_t>
+  Query (const std::string& query, int64_t& cursor)
+  {
+    const auto res
+        = tm.QueryTrades (ParseTextProto<proto::TradeQuery> (query));
+
+    std::vector<int64_t> times;
+    for (const auto& t : res.trades ())
+      times.push_back (t.start_time ());
+
+    cursor = res.has_cursor () ? res.cursor () : -1;
+    return times;
+  }
+
+  /**
+   * Runs a query and expects that it has no further pages.
+   */
+  std::vector<int64_t>
+  Query (const std::string& query)
+  {
+    int64_t cursor;
+    const auto res = Query (query, cursor);
+    EXPECT_EQ (cursor, -1);
+    return res;
+  }
+
+};
+
+TEST_F (TradeQueryTests, NoFilters)
+{
+  EXPECT_THAT (Query (""), ElementsAre (60, 50, 40, 30, 20, 10));
+}
+
+TEST_F (TradeQueryTests, Filters)
+{
+  EXPECT_THAT (Query (R"(counterparty: "a")"), ElementsAre (40, 30, 10));
+  EXPECT_THAT (Query (R"(counterparty: "other")"), ElementsAre (60));
+  EXPECT_THAT (Query (R"(counterparty: "c")"), ElementsAre ());
+  EXPECT_THAT (Query (R"(asset: "silver" state: SUCCESS)"),
+               ElementsAre (50, 30));
+  EXPECT_THAT (Query (R"(asset: "gold" state: PENDING)"), ElementsAre ());
+  EXPECT_THAT (Query ("since: 25"), ElementsAre (60, 50, 40, 30));
+  EXPECT_THAT (Query (R"(since: 25 counterparty: "b")"), ElementsAre (50));
+}
+
+TEST_F (TradeQueryTests, Pagination)
+{
+  int64_t cursor;
+  EXPECT_THAT (Query ("limit: 2", cursor), ElementsAre (60, 50, 40));
+  EXPECT_EQ (cursor, 3);
+  EXPECT_THAT (Query ("limit: 2 cursor: 3", cursor), ElementsAre (30, 20));
+  EXPECT_EQ (cursor, 1);
+  EXPECT_THAT (Query ("limit: 2 cursor: 1"), ElementsAre (10));
+
+  EXPECT_THAT (Query ("since: 25 limit: 1", cursor), ElementsAre (60, 50));
+  EXPECT_EQ (cursor, 4);
+  EXPECT_THAT (Query ("since: 25 limit: 1 cursor: 4", cursor),
+               ElementsAre (40));
+  EXPECT_EQ (cursor, 3);
+
+  EXPECT_THAT (Query (R"(asset: "gold" limit: 1 cursor: 3)", cursor),
+               ElementsAre (20));
+  EXPECT_EQ (cursor, 1);
+}
+
+TEST_F (TradeQueryTests, SinceOutOfOrder)
+{
+  /* Start times need not be increasing with the archive position.  */
+  AddArchived (proto::Trade::SUCCESS, 5, "a", "gold");
+  AddArchived (proto::Trade::FAILED, 35, "b", "gold");
+
+  int64_t cursor;
+  EXPECT_THAT (Query ("since: 25 limit: 2", cursor), ElementsAre (60, 35, 50));
+  EXPECT_EQ (cursor, 4);
+  EXPECT_THAT (Query ("since: 25 limit: 2 cursor: 4"), ElementsAre (40, 30));
+  EXPECT_THAT (Query ("since: 0 limit: 1 cursor: 6", cursor),
+               ElementsAre (5));
+  EXPECT_EQ (cursor, 5);
+}
+
+TEST_F (TradeQueryTests, ZeroLimit)
+{
+  EXPECT_THAT (Query ("limit: 0"), ElementsAre (60, 50, 40, 30, 20, 10));
+  EXPECT_THAT (Query ("limit: 0 cursor: 3"), ElementsAre (30, 20, 10));
+}
+
+TEST_F (TradeQueryTests, DroppedTrades)
+{
+  /* Query once, so that the index is built.  */
+  EXPECT_THAT (Query (R"(counterparty: "a")"), ElementsAre (40, 30, 10));
+
+  tm.AccessState ([] (proto::State& s, StateChanges&)
+    {
+      s.mutable_trade_archive ()->DeleteSubrange (0, 2);
+      s.set_trade_archive_offset (2);
+    });
+  AddArchived (proto::Trade::SUCCESS, 70, "a", "gold");
+
+  EXPECT_THAT (Query (R"(counterparty: "a")"), ElementsAre (70, 40, 30));
+  EXPECT_THAT (Query (R"(since: 0)"), ElementsAre (60, 70, 50, 40, 30));
+
+  EXPECT_THAT (Query (R"(asset: "gold" limit: 1 cursor: 5)"),
+               ElementsAre (40));
+  EXPECT_THAT (Query (R"(asset: "gold" cursor: 2)"), ElementsAre ());
+}
+
 TEST_F (TradeManagerTests, RunsUpdates)
 {
   constexpr auto INTV = std::chrono::milliseconds (50);
@@ -2178,6 +2649,210 @@ TEST_F (TradeManagerTests, UnlocksChiInputsOnFailure)
 
 /* ************************************************************************** */
 
+/**
+ * Mock Xaya RPC server whose name_show calls can be held at a gate.  This
+ * lets tests keep message handlers busy inside an RPC call, and observe
+ * how many of them are there concurrently.
+ */
+class GatedXayaRpcServer : public MockXayaRpcServer
+{
+
+private:
+
+  std::mutex mut;
+  std::condition_variable cv;
+
+  /** Whether or not calls are let through.  */
+  bool open = true;
+
+  /** Number of calls currently at the gate.  */
+  unsigned active = 0;
+
+  /** Maximum number of calls seen at the gate at the same time.  */
+  unsigned maxActive = 0;
+
+public:
+
+  using MockXayaRpcServer::MockXayaRpcServer;
+
+  void
+  SetOpen (const bool o)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    open = o;
+    cv.notify_all ();
+  }
+
+  /**
+   * Waits (with a timeout) until the given number of calls are at
+   * the gate.  Returns false if that did not happen.
+   */
+  bool
+  WaitForActive (const unsigned n)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    return cv.wait_for (lock, std::chrono::seconds (5),
+                        [this, n] () { return active >= n; });
+  }
+
+  unsigned
+  GetMaxActive ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    return maxActive;
+  }
+
+  Json::Value
+  name_show (const std::string& name) override
+  {
+    {
+      std::unique_lock<std::mutex> lock(mut);
+      ++active;
+      maxActive = std::max (maxActive, active);
+      cv.notify_all ();
+      cv.wait (lock, [this] () { return open; });
+      --active;
+    }
+
+    return MockXayaRpcServer::name_show (name);
+  }
+
+};
+
+/**
+ * Tests for how TradeManager handles messages concurrently with each other
+ * and with trade updates.
+ */
+class TradeOwnershipTests : public testing::Test
+{
+
+protected:
+
+  TestEnvironment<GatedXayaRpcServer> env;
+  TestTradeManager tm;
+
+  TradeOwnershipTests ()
+    : tm("me", env)
+  {
+    tm.SetMockTime (123);
+  }
+
+};
+
+TEST_F (TradeOwnershipTests, ParallelMessagesForDifferentTrades)
+{
+  FLAGS_democrit_trade_timeout_ms = 100'000;
+
+  /* Processing seller data as buyer runs the checks for the trade, which
+     call name_show on the seller's name (and then fail, since the
+     name "p/invalid" does not exist).  */
+  env.GetAssetSpec ().InitialiseAccount ("me");
+  for (const std::string id : {"1", "2"})
+    tm.AddTrade (R"(
+      state: INITIATED
+      start_time: 100
+      order:
+        {
+          account: "invalid"
+          id: )" + id + R"(
+          asset: "gold"
+          price_sat: 10
+          type: ASK
+        }
+      units: 1
+      counterparty: "invalid"
+    )");
+
+  env.GetXayaServer ().SetOpen (false);
+  std::vector<std::thread> threads;
+  for (const std::string id : {"1", "2"})
+    threads.emplace_back ([this, id] ()
+      {
+        tm.ProcessWithoutReply (R"(
+          counterparty: "invalid"
+          identifier: "invalid\n)" + id + R"("
+          seller_data:
+            {
+              name_address: "name )" + id + R"("
+              chi_address: "chi"
+            }
+        )");
+      });
+
+  EXPECT_TRUE (env.GetXayaServer ().WaitForActive (2));
+  env.GetXayaServer ().SetOpen (true);
+  for (auto& t : threads)
+    t.join ();
+
+  EXPECT_EQ (env.GetXayaServer ().GetMaxActive (), 2);
+  for (const int id : {1, 2})
+    {
+      auto t = tm.LookupTrade ("invalid", id);
+      ASSERT_NE (t, nullptr);
+      EXPECT_EQ (tm.GetInternalState (*t).seller_data ().name_address (),
+                 "name " + std::to_string (id));
+    }
+}
+
+TEST_F (TradeOwnershipTests, MessageRacingUpdate)
+{
+  /* The trade is timed out, so an update would abandon it.  */
+  FLAGS_democrit_trade_timeout_ms = 1'000;
+  tm.AddTrade (R"(
+    state: INITIATED
+    start_time: 0
+    order:
+      {
+        account: "other"
+        id: 42
+        asset: "gold"
+        price_sat: 10
+        type: BID
+      }
+    units: 1
+    counterparty: "other"
+  )");
+
+  /* Handling a message makes us create the seller data, which locks our
+     name output.  We hold that in name_show while updating trades.  */
+  env.GetXayaServer ().SetOpen (false);
+  proto::ProcessingMessage reply;
+  std::thread handler([this, &reply] ()
+    {
+      reply = tm.ProcessWithReply (R"(
+        counterparty: "other"
+        identifier: "other\n42"
+      )");
+    });
+
+  EXPECT_TRUE (env.GetXayaServer ().WaitForActive (1));
+  tm.UpdateAndArchiveTrades ();
+  EXPECT_NE (tm.LookupTrade ("other", 42), nullptr);
+
+  env.GetXayaServer ().SetOpen (true);
+  handler.join ();
+
+  /* The message has been handled exactly once, and the trade with its
+     seller data is still active.  */
+  EXPECT_THAT (reply, EqualsProcessingMessage (R"(
+    counterparty: "other"
+    identifier: "other\n42"
+    seller_data: { name_address: "addr 1" chi_address: "addr 2" }
+  )"));
+  auto t = tm.LookupTrade ("other", 42);
+  ASSERT_NE (t, nullptr);
+  EXPECT_EQ (tm.GetInternalState (*t).state (), proto::Trade::INITIATED);
+  EXPECT_TRUE (tm.GetInternalState (*t).has_seller_data ());
+  EXPECT_TRUE (tm.IsLocked ("me txid", 12));
+
+  /* The next update abandons the trade and releases the name again.  */
+  tm.UpdateAndArchiveTrades ();
+  EXPECT_EQ (tm.LookupTrade ("other", 42), nullptr);
+  EXPECT_FALSE (tm.IsLocked ("me txid", 12));
+}
+
+/* ************************************************************************** */
+
 /**
  * These tests use *two* TradeManager's that actually exchange messages
  * with each other to simulate the entire trade flow.
@@ -2362,6 +3037,10 @@ TEST_F (TradeFlowTests, TakingBuyOrder)
     seller_data: { name_address: "addr 1" chi_address: "addr 2" }
     our_psbt: "buyer signed"
     their_psbt: "seller signed"
+    btxid: "unsigned btxid"
+    inputs: { hash: "buyer txid" n: 1 }
+    inputs: { hash: "buyer txid" n: 2 }
+    inputs: { hash: "seller txid" n: 12 }
   )"));
 
   EXPECT_THAT (seller.GetOrders (), EqualsOrdersOfAccount (R"(
@@ -2402,6 +3081,10 @@ TEST_F (TradeFlowTests, TakingBuyOrder)
       }
     their_psbt: "unsigned"
     our_psbt: "seller signed"
+    btxid: "unsigned btxid"
+    inputs: { hash: "buyer txid" n: 1 }
+    inputs: { hash: "buyer txid" n: 2 }
+    inputs: { hash: "seller txid" n: 12 }
   )"));
 }
 
@@ -2466,6 +3149,10 @@ TEST_F (TradeFlowTests, TakingSellOrder)
     units: 1
     seller_data: { name_address: "addr 1" chi_address: "addr 2" }
     our_psbt: "partial"
+    btxid: "unsigned btxid"
+    inputs: { hash: "buyer txid" n: 1 }
+    inputs: { hash: "buyer txid" n: 2 }
+    inputs: { hash: "seller txid" n: 12 }
   )"));
 
   EXPECT_THAT (seller.GetOrders (), EqualsOrdersOfAccount (R"(
@@ -2518,10 +3205,177 @@ TEST_F (TradeFlowTests, TakingSellOrder)
       }
     their_psbt: "partial"
     our_psbt: "signed"
+    btxid: "unsigned btxid"
+    inputs: { hash: "buyer txid" n: 1 }
+    inputs: { hash: "buyer txid" n: 2 }
+    inputs: { hash: "seller txid" n: 12 }
   )"));
 }
 
 /* ************************************************************************** */
 
+/**
+ * Tests that the changes TradeManager makes to a persisted state are
+ * recorded correctly, i.e. that reopening the state from disk yields
+ * the same data.
+ */
+class TradePersistenceTests : public testing::Test
+{
+
+protected:
+
+  /** Temporary directory used for the state store.  */
+  TempDir tmpDir;
+
+  /** Path of the temporary directory.  */
+  const std::string dir;
+
+  TestEnvironment<MockXayaRpcServer> env;
+  std::unique_ptr<TestTradeManager> tm;
+
+  TradePersistenceTests ()
+    : tmpDir("democrit-trades"), dir(tmpDir.GetPath ())
+  {
+    Reopen ();
+  }
+
+  ~TradePersistenceTests ()
+  {
+    tm.reset ();
+  }
+
+  /**
+   * Closes the current TradeManager instance (if any) and opens a new
+   * one from the state on disk.
+   */
+  void
+  Reopen ()
+  {
+    tm.reset ();
+    tm = std::make_unique<TestTradeManager> (
+        "me", env, std::make_unique<StateStore> (dir));
+    tm->SetMockTime (123);
+  }
+
+  /**
+   * Returns a copy of the full state data.
+   */
+  proto::State
+  GetData () const
+  {
+    proto::State res;
+    tm->ReadState ([&res] (const proto::State& data)
+      {
+        res = data;
+      });
+    return res;
+  }
+
+  /**
+   * Reopens the state from disk and expects its data to be the same
+   * as before.
+   */
+  void
+  ExpectRestored ()
+  {
+    const auto expected = GetData ();
+    Reopen ();
+    EXPECT_TRUE (MessageDifferencer::Equals (GetData (), expected));
+  }
+
+};
+
+TEST_F (TradePersistenceTests, TradeFlows)
+{
+  FLAGS_democrit_trade_timeout_ms = 10'000;
+  FLAGS_democrit_max_archived_trades = 1;
+
+  /* This trade is timed out and will be archived by the update, which
+     shifts the positions of all later trades.  */
+  tm->AddTrade (R"(
+    state: INITIATED
+    start_time: 1
+    order:
+      {
+        account: "other"
+        id: 1
+        asset: "gold"
+        price_sat: 10
+        type: ASK
+      }
+    units: 1
+    counterparty: "other"
+  )");
+  tm->AddTrade (R"(
+    state: ABANDONED
+    start_time: 2
+    order:
+      {
+        account: "other"
+        id: 2
+        asset: "gold"
+        price_sat: 10
+        type: ASK
+      }
+    units: 1
+    counterparty: "other"
+  )");
+
+  /* A counterparty takes our order, which creates a trade and also
+     updates it with our seller data.  */
+  tm->AddOrder (42, R"(
+    asset: "gold"
+    max_units: 10
+    price_sat: 5
+    type: ASK
+  )");
+  tm->ProcessWithReply (R"(
+    counterparty: "other"
+    identifier: "me\n42"
+    taking_order: { id: 42 units: 10 }
+  )");
+  ExpectRestored ();
+
+  proto::ProcessingMessage msg;
+  ASSERT_TRUE (tm->TakeOrder (ParseTextProto<proto::Order> (R"(
+    account: "invalid"
+    id: 3
+    asset: "gold"
+    max_units: 100
+    price_sat: 64
+    type: ASK
+  )"), 10, msg));
+  ExpectRestored ();
+
+  /* This archives both the abandoned and the timed-out trade (dropping
+     one of them again from the bounded archive), and keeps the others.  */
+  tm->UpdateAndArchiveTrades ();
+  tm->ReadState ([] (const proto::State& s)
+    {
+      EXPECT_EQ (s.trades_size (), 2);
+      EXPECT_EQ (s.trade_archive_size (), 1);
+      EXPECT_EQ (s.trade_archive_offset (), 1);
+    });
+  ExpectRestored ();
+
+  /* Processing a message for a trade at a shifted position.  The "invalid"
+     name makes sure that the processing (as buyer) stops after merging in
+     the seller data.  */
+  tm->ProcessWithoutReply (R"(
+    counterparty: "invalid"
+    identifier: "invalid\n3"
+    seller_data: { name_address: "name addr" chi_address: "chi addr" }
+  )");
+  auto t = tm->LookupTrade ("invalid", 3);
+  ASSERT_NE (t, nullptr);
+  EXPECT_EQ (tm->GetInternalState (*t).seller_data ().name_address (),
+             "name addr");
+  ExpectRestored ();
+
+  FLAGS_democrit_max_archived_trades = 10'000;
+}
+
+/* ************************************************************************** */
+
 } // anonymous namespace
 } // namespace democrit
@@ -0,0 +1,87 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/wakeupjob.hpp"
+
+namespace democrit
+{
+
+WakeupJob::WakeupJob (const std::function<void ()>& j)
+  : job(j), stop(false), triggered(false)
+{
+  worker = std::thread ([this] ()
+    {
+      std::unique_lock<std::mutex> lock(mut);
+      while (true)
+        {
+          if (stop)
+            break;
+
+          const auto now = Clock::now ();
+          bool run = triggered;
+          while (!scheduled.empty () && scheduled.top () <= now)
+            {
+              scheduled.pop ();
+              run = true;
+            }
+
+          if (run)
+            {
+              triggered = false;
+              lock.unlock ();
+              job ();
+              lock.lock ();
+              continue;
+            }
+
+          if (scheduled.empty ())
+            cv.wait (lock);
+          else
+            cv.wait_until (lock, scheduled.top ());
+        }
+    });
+}
+
+WakeupJob::~WakeupJob ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stop = true;
+    cv.notify_all ();
+  }
+
+  worker.join ();
+}
+
+void
+WakeupJob::Trigger ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  triggered = true;
+  cv.notify_all ();
+}
+
+void
+WakeupJob::TriggerAt (const Clock::time_point t)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  scheduled.push (t);
+  cv.notify_all ();
+}
+
+} // namespace democrit
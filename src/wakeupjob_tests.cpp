@@ -0,0 +1,115 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/wakeupjob.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+namespace democrit
+{
+namespace
+{
+
+class WakeupJobTests : public testing::Test
+{
+
+protected:
+
+  /** Counter that is incremented for each job execution.  */
+  std::atomic<unsigned> counter;
+
+  /** Time unit we use in the tests.  */
+  static constexpr auto INTV = std::chrono::milliseconds (20);
+
+  /** The job under test.  */
+  std::unique_ptr<WakeupJob> job;
+
+  WakeupJobTests ()
+  {
+    counter = 0;
+    job = std::make_unique<WakeupJob> ([this] ()
+      {
+        std::this_thread::sleep_for (INTV);
+        ++counter;
+      });
+  }
+
+};
+
+constexpr std::chrono::milliseconds WakeupJobTests::INTV;
+
+TEST_F (WakeupJobTests, NotRunWithoutTrigger)
+{
+  std::this_thread::sleep_for (3 * INTV);
+  EXPECT_EQ (counter, 0);
+}
+
+TEST_F (WakeupJobTests, Trigger)
+{
+  job->Trigger ();
+  std::this_thread::sleep_for (3 * INTV);
+  EXPECT_EQ (counter, 1);
+
+  job->Trigger ();
+  std::this_thread::sleep_for (3 * INTV);
+  EXPECT_EQ (counter, 2);
+}
+
+TEST_F (WakeupJobTests, TriggersCoalesced)
+{
+  for (unsigned i = 0; i < 10; ++i)
+    job->Trigger ();
+  std::this_thread::sleep_for (5 * INTV);
+  EXPECT_LE (counter, 2);
+  EXPECT_GE (counter, 1);
+}
+
+TEST_F (WakeupJobTests, Scheduled)
+{
+  job->TriggerAfter (5 * INTV);
+  job->TriggerAfter (2 * INTV);
+
+  std::this_thread::sleep_for (INTV);
+  EXPECT_EQ (counter, 0);
+  std::this_thread::sleep_for (3 * INTV);
+  EXPECT_EQ (counter, 1);
+  std::this_thread::sleep_for (4 * INTV);
+  EXPECT_EQ (counter, 2);
+}
+
+TEST_F (WakeupJobTests, QuickShutdown)
+{
+  using Clock = std::chrono::steady_clock;
+
+  job->TriggerAfter (100 * INTV);
+
+  const auto before = Clock::now ();
+  job.reset ();
+  const auto after = Clock::now ();
+
+  EXPECT_EQ (counter, 0);
+  EXPECT_LT (after - before, INTV);
+}
+
+} // anonymous namespace
+} // namespace democrit
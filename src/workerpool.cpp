@@ -0,0 +1,116 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/workerpool.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace democrit
+{
+
+WorkerPool::WorkerPool (const unsigned numThreads)
+  : stop(false)
+{
+  const unsigned n = std::max (numThreads, 1u);
+  for (unsigned i = 0; i < n; ++i)
+    workers.emplace_back ([this] ()
+      {
+        RunWorker ();
+      });
+}
+
+WorkerPool::~WorkerPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stop = true;
+    cv.notify_all ();
+  }
+
+  for (auto& w : workers)
+    w.join ();
+}
+
+void
+WorkerPool::RunWorker ()
+{
+  while (true)
+    {
+      std::function<void ()> job;
+
+      {
+        std::unique_lock<std::mutex> lock(mut);
+        cv.wait (lock, [this] ()
+          {
+            return stop || !jobs.empty ();
+          });
+
+        if (jobs.empty ())
+          {
+            CHECK (stop);
+            return;
+          }
+
+        job = std::move (jobs.front ());
+        jobs.pop ();
+      }
+
+      job ();
+    }
+}
+
+void
+WorkerPool::Submit (std::function<void ()> job)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (!stop) << "Submitting job to stopped worker pool";
+  jobs.push (std::move (job));
+  cv.notify_one ();
+}
+
+void
+WorkerPool::RunAll (std::vector<std::function<void ()>> batch)
+{
+  if (batch.empty ())
+    return;
+
+  std::mutex mutDone;
+  std::condition_variable cvDone;
+  size_t remaining = batch.size ();
+
+  for (auto& job : batch)
+    Submit ([&, job = std::move (job)] ()
+      {
+        job ();
+
+        std::lock_guard<std::mutex> lock(mutDone);
+        --remaining;
+        if (remaining == 0)
+          cvDone.notify_all ();
+      });
+
+  std::unique_lock<std::mutex> lock(mutDone);
+  cvDone.wait (lock, [&remaining] ()
+    {
+      return remaining == 0;
+    });
+}
+
+} // namespace democrit
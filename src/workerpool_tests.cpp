@@ -0,0 +1,96 @@
+/*
+    Democrit - atomic trades for XAYA games
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/workerpool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace democrit
+{
+namespace
+{
+
+using WorkerPoolTests = testing::Test;
+
+TEST_F (WorkerPoolTests, AtLeastOneThread)
+{
+  WorkerPool pool(0);
+  EXPECT_EQ (pool.GetNumThreads (), 1);
+}
+
+TEST_F (WorkerPoolTests, SubmittedJobsFinishedOnDestruction)
+{
+  std::atomic<unsigned> counter(0);
+
+  {
+    WorkerPool pool(2);
+    for (unsigned i = 0; i < 10; ++i)
+      pool.Submit ([&counter] ()
+        {
+          std::this_thread::sleep_for (std::chrono::milliseconds (1));
+          ++counter;
+        });
+  }
+
+  EXPECT_EQ (counter, 10);
+}
+
+TEST_F (WorkerPoolTests, RunAll)
+{
+  WorkerPool pool(4);
+
+  std::vector<unsigned> results(100, 0);
+  std::vector<std::function<void ()>> jobs;
+  for (unsigned i = 0; i < results.size (); ++i)
+    jobs.push_back ([&results, i] ()
+      {
+        results[i] = i * i;
+      });
+  pool.RunAll (std::move (jobs));
+
+  for (unsigned i = 0; i < results.size (); ++i)
+    EXPECT_EQ (results[i], i * i);
+
+  pool.RunAll ({});
+}
+
+TEST_F (WorkerPoolTests, RunsInParallel)
+{
+  constexpr auto DELAY = std::chrono::milliseconds (50);
+  WorkerPool pool(4);
+
+  std::vector<std::function<void ()>> jobs;
+  for (unsigned i = 0; i < 4; ++i)
+    jobs.push_back ([DELAY] ()
+      {
+        std::this_thread::sleep_for (DELAY);
+      });
+
+  const auto start = std::chrono::steady_clock::now ();
+  pool.RunAll (std::move (jobs));
+  EXPECT_LT (std::chrono::steady_clock::now () - start, 3 * DELAY);
+}
+
+} // anonymous namespace
+} // namespace democrit
@@ -29,7 +29,18 @@ class GetStatusTest (NonFungibleTest):
     with self.runDemocrit () as d1, \
          self.runDemocrit () as d2:
       for d in [d1, d2]:
-        self.assertEqual (d.rpc.getstatus (), {
+        status = d.rpc.getstatus ()
+        self.assertEqual (status["orderbook"], {
+          "accounts": 0,
+          "orders": 0,
+          "bytes": 0,
+          "assets": 0,
+        })
+        del status["orderbook"]
+        self.assertEqual (set (status["assetcache"].keys ()),
+                          set (["hits", "misses"]))
+        del status["assetcache"]
+        self.assertEqual (status, {
           "account": d.account,
           "connected": True,
           "gameid": "nf",